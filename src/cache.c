@@ -43,16 +43,26 @@
 #include "db.h"
 #include "cache.h"
 #include "commands.h"
+#include "misc.h"
 
 
 #define CACHE_VERSION 2
 
+// Max number of queries kept in the cache db (replies that don't fit in memory)
+#define CACHE_DAAP_QUERIES_MAX 100
+
+// Number of hash buckets for the DMAP item cache, must be a power of two
+#define CACHE_DMAP_ITEM_BUCKETS 16384
+
 
 struct cache_arg
 {
   char *query; // daap query
   char *ua;    // user agent
   int msec;
+  int deps;    // what changed (CACHE_DAAP_DEP_*)
+  int id;      // playlist id for CACHE_DAAP_DEP_PLAYLIST
+  int fileid;  // file id for CACHE_DAAP_DEP_FILES, if only one file changed
 
   char *path;  // artwork path
   int type;    // individual or group artwork
@@ -95,10 +105,100 @@ struct stash
 static struct timeval g_wait = { 60, 0 };
 static int g_suspended;
 
+// Invalidations from a thread between cache_daap_hold() and cache_daap_release()
+// are merged and sent as one. A plid or fileid of -1 means none yet.
+static __thread int g_hold;
+static __thread int g_hold_deps;
+static __thread int g_hold_plid;
+static __thread int g_hold_fileid;
+
 // The user may configure a threshold (in msec), and queries slower than
 // that will have their reply cached
 static int g_cfg_threshold;
 
+// Gzipped DAAP replies held in memory, most recently used first. The cache db
+// has all the replies (also those evicted from memory), so it is both a spill
+// and used for a warm start. Only accessed from the cache thread.
+struct daap_reply
+{
+  char *query;
+  char *ua;
+  uint32_t hash;
+  int msec;
+
+  // What the reply depends on (CACHE_DAAP_DEP_*), see cache_daap_deps()
+  int deps;
+  int plid;
+
+  // Gzipped reply, NULL if outdated or not built yet
+  uint8_t *data;
+  size_t len;
+
+  struct daap_reply *prev;
+  struct daap_reply *next;
+};
+
+struct daap_reply_cache
+{
+  struct daap_reply *head;
+  struct daap_reply *tail;
+
+  size_t size;
+  size_t max_size;
+
+  // Invalidations not yet applied to the cache db
+  int pending_deps;
+
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t invalidations;
+} g_replies;
+
+// In-memory cache of DMAP encoded songs (mlit blocks). Items are hashed by
+// file id, so all variants of a file (different meta sets) are in the same
+// bucket. Eviction is least recently used first. Since it is accessed directly
+// from the httpd and cache threads it is protected by its own mutex.
+struct dmap_item
+{
+  uint32_t id;
+  uint64_t key;
+  uint32_t stamp;
+
+  // One for the cache while the item is in it, plus one per pin (see
+  // cache_dmap_item_pin), protected by the mutex
+  int refs;
+
+  struct dmap_item *next;     // Next in hash bucket
+  struct dmap_item *lru_prev; // Least recently used first
+  struct dmap_item *lru_next;
+
+  size_t len;
+  uint8_t data[];
+};
+
+struct dmap_item_cache
+{
+  pthread_mutex_t lck;
+
+  struct dmap_item **buckets;
+  struct dmap_item *oldest;
+  struct dmap_item *newest;
+
+  // Invalidation generations: gens[bucket] is the seq of the last invalidation
+  // of an id in the bucket, cleared the seq of the last full invalidation
+  uint64_t *gens;
+  uint64_t seq;
+  uint64_t cleared;
+
+  size_t size;
+  size_t max_size;
+
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+} g_items = { .lck = PTHREAD_MUTEX_INITIALIZER };
+
 /* --------------------------------- HELPERS ------------------------------- */
 
 /* The purpose of this function is to remove transient tags from a request 
@@ -557,18 +657,215 @@ cache_close(void)
   DPRINTF(E_DBG, L_CACHE, "Cache closed\n");
 }
 
-/* Adds the reply (stored in evbuf) to the cache */
+/* Returns what the reply to a query depends on, see CACHE_DAAP_DEP_* */
+static int
+cache_daap_deps(const char *query, int *plid)
+{
+  *plid = 0;
+
+  // /databases/1/containers/<id>/items
+  if (strncmp(query, "/databases/1/containers/", strlen("/databases/1/containers/")) == 0)
+    {
+      *plid = atoi(query + strlen("/databases/1/containers/"));
+      return CACHE_DAAP_DEP_FILES | CACHE_DAAP_DEP_PLAYLIST;
+    }
+
+  // The list of playlists, which depends on all of them (plid 0)
+  if (strncmp(query, "/databases/1/containers", strlen("/databases/1/containers")) == 0)
+    return CACHE_DAAP_DEP_FILES | CACHE_DAAP_DEP_PLAYLIST;
+
+  if (strncmp(query, "/databases/1/groups?", strlen("/databases/1/groups?")) == 0)
+    return CACHE_DAAP_DEP_FILES | CACHE_DAAP_DEP_GROUPS;
+
+  return CACHE_DAAP_DEP_FILES;
+}
+
+static int
+cache_daap_deps_match(int deps, int plid, int inval_deps, int inval_plid)
+{
+  if (deps & inval_deps & ~CACHE_DAAP_DEP_PLAYLIST)
+    return 1;
+
+  // A plid of 0 means any playlist (used for pending invalidations and for the
+  // list of playlists)
+  if ((deps & inval_deps & CACHE_DAAP_DEP_PLAYLIST) && ((inval_plid == 0) || (plid == 0) || (plid == inval_plid)))
+    return 1;
+
+  return 0;
+}
+
+static struct daap_reply *
+cache_daap_reply_find(const char *query)
+{
+  struct daap_reply *r;
+  uint32_t hash;
+
+  hash = djb_hash(query, strlen(query));
+
+  for (r = g_replies.head; r; r = r->next)
+    {
+      if ((r->hash == hash) && (strcmp(r->query, query) == 0))
+	return r;
+    }
+
+  return NULL;
+}
+
+static void
+cache_daap_reply_unlink(struct daap_reply *r)
+{
+  if (r->prev)
+    r->prev->next = r->next;
+  else
+    g_replies.head = r->next;
+
+  if (r->next)
+    r->next->prev = r->prev;
+  else
+    g_replies.tail = r->prev;
+
+  r->prev = NULL;
+  r->next = NULL;
+}
+
+static void
+cache_daap_reply_link_head(struct daap_reply *r)
+{
+  r->prev = NULL;
+  r->next = g_replies.head;
+
+  if (g_replies.head)
+    g_replies.head->prev = r;
+  else
+    g_replies.tail = r;
+
+  g_replies.head = r;
+}
+
+static void
+cache_daap_reply_clear(struct daap_reply *r)
+{
+  if (!r->data)
+    return;
+
+  g_replies.size -= r->len;
+
+  free(r->data);
+  r->data = NULL;
+  r->len = 0;
+}
+
+static void
+cache_daap_reply_free(struct daap_reply *r)
+{
+  cache_daap_reply_unlink(r);
+  cache_daap_reply_clear(r);
+
+  free(r->query);
+  free(r->ua);
+  free(r);
+}
+
+static struct daap_reply *
+cache_daap_reply_new(const char *query, const char *ua, int msec)
+{
+  struct daap_reply *r;
+
+  r = calloc(1, sizeof(struct daap_reply));
+  if (!r)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Out of memory for DAAP reply cache entry\n");
+      return NULL;
+    }
+
+  r->query = strdup(query);
+  r->ua = strdup(ua);
+  r->hash = djb_hash(query, strlen(query));
+  r->msec = msec;
+  r->deps = cache_daap_deps(query, &r->plid);
+
+  cache_daap_reply_link_head(r);
+
+  return r;
+}
+
+/* Makes room for len bytes by evicting the least recently used replies from
+ * memory. They stay in the cache db, so they can be loaded again if requested.
+ * Returns -1 if the reply would not fit even in an empty cache.
+ */
+static int
+cache_daap_reply_make_room(struct daap_reply *keep, size_t len)
+{
+  struct daap_reply *r;
+  struct daap_reply *prev;
+
+  if (len > g_replies.max_size)
+    return -1;
+
+  for (r = g_replies.tail; r && (g_replies.size + len > g_replies.max_size); r = prev)
+    {
+      prev = r->prev;
+
+      if ((r == keep) || !r->data)
+	continue;
+
+      DPRINTF(E_DBG, L_CACHE, "Evicting DAAP reply from memory (%zu bytes): %s\n", r->len, r->query);
+
+      cache_daap_reply_free(r);
+      g_replies.evictions++;
+    }
+
+  return 0;
+}
+
+static int
+cache_daap_reply_set(struct daap_reply *r, const void *data, size_t len)
+{
+  cache_daap_reply_clear(r);
+
+  if (cache_daap_reply_make_room(r, len) < 0)
+    return -1;
+
+  r->data = malloc(len);
+  if (!r->data)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Out of memory for DAAP reply\n");
+      return -1;
+    }
+
+  memcpy(r->data, data, len);
+  r->len = len;
+
+  g_replies.size += len;
+
+  return 0;
+}
+
+/* Adds the (gzipped) reply to the cache db */
 static int
-cache_daap_reply_add(const char *query, struct evbuffer *evbuf)
+cache_daap_reply_add(const char *query, const uint8_t *data, size_t datalen)
 {
+#define Q_DEL "DELETE FROM replies WHERE query = ?;"
 #define Q_TMPL "INSERT INTO replies (query, reply) VALUES (?, ?);"
   sqlite3_stmt *stmt;
-  unsigned char *data;
-  size_t datalen;
   int ret;
 
-  datalen = evbuffer_get_length(evbuf);
-  data = evbuffer_pullup(evbuf, -1);
+  ret = sqlite3_prepare_v2(g_db_hdl, Q_DEL, -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error preparing query for cache update: %s\n", sqlite3_errmsg(g_db_hdl));
+      return -1;
+    }
+
+  sqlite3_bind_text(stmt, 1, query, -1, SQLITE_STATIC);
+
+  ret = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  if (ret != SQLITE_DONE)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error deleting old reply for cache update: %s\n", sqlite3_errmsg(g_db_hdl));
+      return -1;
+    }
 
   ret = sqlite3_prepare_v2(g_db_hdl, Q_TMPL, -1, &stmt, 0);
   if (ret != SQLITE_OK)
@@ -599,6 +896,183 @@ cache_daap_reply_add(const char *query, struct evbuffer *evbuf)
 
   return 0;
 #undef Q_TMPL
+#undef Q_DEL
+}
+
+/* Removes the query and its reply from the cache db */
+static int
+cache_daap_query_delete(const char *query)
+{
+#define Q_TMPL_QUERY "DELETE FROM queries WHERE query = '%q';"
+#define Q_TMPL_REPLY "DELETE FROM replies WHERE query = '%q';"
+  char *q;
+  char *errmsg;
+  int ret;
+
+  q = sqlite3_mprintf(Q_TMPL_QUERY " " Q_TMPL_REPLY, query, query);
+  if (!q)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Out of memory making query string.\n");
+      return -1;
+    }
+
+  ret = sqlite3_exec(g_db_hdl, q, NULL, NULL, &errmsg);
+  sqlite3_free(q);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error deleting query from cache: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      return -1;
+    }
+
+  return 0;
+#undef Q_TMPL_REPLY
+#undef Q_TMPL_QUERY
+}
+
+/* Invalidations are applied to the in-memory replies right away, but the cache
+ * db is only brought up to date when the cache is updated (or at shutdown), so
+ * that a library scan doesn't cause a storm of cache db writes. Until then the
+ * pending dependencies make sure that no outdated reply is loaded from the db.
+ */
+static void
+cache_daap_purge_pending(void)
+{
+#define Q_TMPL "INSERT OR REPLACE INTO queries (user_agent, query, msec, timestamp) VALUES ('%q', '%q', %d, %" PRIi64 ");"
+  struct daap_reply *r;
+  const char *where;
+  char *query;
+  char *errmsg;
+  int purge_all;
+  int ret;
+
+  if (!g_replies.pending_deps)
+    return;
+
+  purge_all = (g_replies.pending_deps & CACHE_DAAP_DEP_FILES);
+
+  // All cacheable replies depend on the files, see cache_daap_deps()
+  if (g_replies.pending_deps & CACHE_DAAP_DEP_FILES)
+    where = "1 = 1";
+  else if ((g_replies.pending_deps & CACHE_DAAP_DEP_GROUPS) && (g_replies.pending_deps & CACHE_DAAP_DEP_PLAYLIST))
+    where = "query LIKE '/databases/1/groups?%' OR query LIKE '/databases/1/containers%'";
+  else if (g_replies.pending_deps & CACHE_DAAP_DEP_GROUPS)
+    where = "query LIKE '/databases/1/groups?%'";
+  else
+    where = "query LIKE '/databases/1/containers%'";
+
+  g_replies.pending_deps = 0;
+
+  query = sqlite3_mprintf("BEGIN TRANSACTION; DELETE FROM replies WHERE %s; DELETE FROM queries WHERE %s;", where, where);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Out of memory making query string.\n");
+      return;
+    }
+
+  ret = sqlite3_exec(g_db_hdl, query, NULL, NULL, &errmsg);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error purging outdated replies from cache: %s\n", errmsg);
+      sqlite3_free(errmsg);
+      goto out;
+    }
+
+  /* Outdated replies that are in memory will be rebuilt, so keep their queries.
+   * A change to a single file may have left some replies in memory valid (see
+   * cache_daap_reply_unaffected()), but they were purged too, so add them back.
+   */
+  for (r = g_replies.head; r; r = r->next)
+    {
+      if (r->data && !purge_all)
+	continue;
+
+      if (r->data)
+	cache_daap_reply_add(r->query, r->data, r->len);
+
+      query = sqlite3_mprintf(Q_TMPL, r->ua, r->query, r->msec, (int64_t)time(NULL));
+      if (!query)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Out of memory making query string.\n");
+	  break;
+	}
+
+      ret = sqlite3_exec(g_db_hdl, query, NULL, NULL, &errmsg);
+      sqlite3_free(query);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Error re-adding query to query list: %s\n", errmsg);
+	  sqlite3_free(errmsg);
+	}
+    }
+
+ out:
+  sqlite3_exec(g_db_hdl, "END TRANSACTION;", NULL, NULL, NULL);
+#undef Q_TMPL
+}
+
+/* Loads the most recent replies from the cache db until the memory budget is
+ * used, so we don't start out cold
+ */
+static void
+cache_daap_load(void)
+{
+#define Q_TMPL "SELECT q.query, q.user_agent, q.msec, r.reply FROM queries q LEFT JOIN replies r ON r.query = q.query ORDER BY q.timestamp DESC;"
+  sqlite3_stmt *stmt;
+  struct daap_reply *r;
+  const char *query;
+  const char *ua;
+  int nstale;
+  int n;
+  int ret;
+
+  ret = sqlite3_prepare_v2(g_db_hdl, Q_TMPL, -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error preparing query for loading DAAP cache: %s\n", sqlite3_errmsg(g_db_hdl));
+      return;
+    }
+
+  n = 0;
+  nstale = 0;
+  while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+      query = (const char *)sqlite3_column_text(stmt, 0);
+      ua = (const char *)sqlite3_column_text(stmt, 1);
+      if (!query || !ua || cache_daap_reply_find(query))
+	continue;
+
+      if (g_replies.size + sqlite3_column_bytes(stmt, 3) > g_replies.max_size)
+	break;
+
+      // The least recent are loaded last, so they must go to the tail
+      r = cache_daap_reply_new(query, ua, sqlite3_column_int(stmt, 2));
+      if (!r)
+	break;
+
+      cache_daap_reply_unlink(r);
+      r->prev = g_replies.tail;
+      if (g_replies.tail)
+	g_replies.tail->next = r;
+      else
+	g_replies.head = r;
+      g_replies.tail = r;
+
+      if ((sqlite3_column_type(stmt, 3) != SQLITE_BLOB) || (cache_daap_reply_set(r, sqlite3_column_blob(stmt, 3), sqlite3_column_bytes(stmt, 3)) < 0))
+	nstale++;
+
+      n++;
+    }
+
+  sqlite3_finalize(stmt);
+
+  DPRINTF(E_INFO, L_CACHE, "Loaded %d DAAP replies into memory (%zu bytes, %d to be rebuilt)\n", n, g_replies.size, nstale);
+
+  if (nstale > 0)
+    evtimer_add(g_cacheev, &g_wait);
+#undef Q_TMPL
 }
 
 /* Adds the query to the list of queries for which we will build and cache a reply */
@@ -606,7 +1080,8 @@ static enum command_state
 cache_daap_query_add(void *arg, int *retval)
 {
 #define Q_TMPL "INSERT OR REPLACE INTO queries (user_agent, query, msec, timestamp) VALUES ('%q', '%q', %d, %" PRIi64 ");"
-#define Q_CLEANUP "DELETE FROM queries WHERE id NOT IN (SELECT id FROM queries ORDER BY timestamp DESC LIMIT 20);"
+#define Q_CLEANUP "DELETE FROM queries WHERE id NOT IN (SELECT id FROM queries ORDER BY timestamp DESC LIMIT %d); " \
+                  "DELETE FROM replies WHERE query NOT IN (SELECT query FROM queries);"
   struct cache_arg *cmdarg;
   char *query;
   char *errmsg;
@@ -650,11 +1125,17 @@ cache_daap_query_add(void *arg, int *retval)
 
   DPRINTF(E_INFO, L_CACHE, "Slow query (%d ms) added to cache: '%s' (user-agent: '%s')\n", cmdarg->msec, cmdarg->query, cmdarg->ua);
 
+  // The reply will be built when the cache is updated
+  if (!cache_daap_reply_find(cmdarg->query))
+    cache_daap_reply_new(cmdarg->query, cmdarg->ua, cmdarg->msec);
+
   free(cmdarg->ua);
   free(cmdarg->query);
 
-  // Limits the size of the cache to only contain replies for 20 most recent queries
-  ret = sqlite3_exec(g_db_hdl, Q_CLEANUP, NULL, NULL, &errmsg);
+  // Limits the size of the cache db, which holds the replies that don't fit in memory
+  query = sqlite3_mprintf(Q_CLEANUP, CACHE_DAAP_QUERIES_MAX);
+  ret = sqlite3_exec(g_db_hdl, query, NULL, NULL, &errmsg);
+  sqlite3_free(query);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_CACHE, "Error cleaning up query list before update: %s\n", errmsg);
@@ -663,7 +1144,7 @@ cache_daap_query_add(void *arg, int *retval)
       return COMMAND_END;
     }
 
-  cache_daap_trigger();
+  evtimer_add(g_cacheev, &g_wait);
 
   *retval = 0;
   return COMMAND_END;
@@ -681,63 +1162,106 @@ cache_daap_query_add(void *arg, int *retval)
 #undef Q_TMPL
 }
 
-// Gets a reply from the cache.
-// cmdarg->evbuf will be filled with the reply (gzipped)
-static enum command_state
-cache_daap_query_get(void *arg, int *retval)
+/* Loads a reply that didn't fit in memory from the cache db */
+static int
+cache_daap_reply_load(const char *query, struct evbuffer *evbuf)
 {
-#define Q_TMPL "SELECT reply FROM replies WHERE query = ?;"
-  struct cache_arg *cmdarg;
+#define Q_TMPL "SELECT r.reply, q.user_agent, q.msec FROM replies r JOIN queries q ON q.query = r.query WHERE r.query = ?;"
   sqlite3_stmt *stmt;
-  char *query;
-  int datalen;
+  struct daap_reply *r;
+  const char *ua;
+  int deps;
+  int plid;
   int ret;
 
-  cmdarg = arg;
-  query = cmdarg->query;
-  remove_tag(query, "session-id");
-  remove_tag(query, "revision-number");
+  // Might be outdated, see cache_daap_purge_pending()
+  deps = cache_daap_deps(query, &plid);
+  if (cache_daap_deps_match(deps, plid, g_replies.pending_deps, 0))
+    return -1;
 
-  // Look in the DB
   ret = sqlite3_prepare_v2(g_db_hdl, Q_TMPL, -1, &stmt, 0);
   if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_CACHE, "Error preparing query for cache update: %s\n", sqlite3_errmsg(g_db_hdl));
-      free(query);
-      *retval = -1;
-      return COMMAND_END;
+      DPRINTF(E_LOG, L_CACHE, "Error preparing query for cache lookup: %s\n", sqlite3_errmsg(g_db_hdl));
+      return -1;
     }
 
   sqlite3_bind_text(stmt, 1, query, -1, SQLITE_STATIC);
 
   ret = sqlite3_step(stmt);
-  if (ret != SQLITE_ROW)  
+  if (ret != SQLITE_ROW)
     {
       if (ret != SQLITE_DONE)
-	DPRINTF(E_LOG, L_CACHE, "Error stepping query for cache update: %s\n", sqlite3_errmsg(g_db_hdl));
-      goto error_get;
-    }
-
-  datalen = sqlite3_column_bytes(stmt, 0);
-
-  if (!cmdarg->evbuf)
-    {
-      DPRINTF(E_LOG, L_CACHE, "Error: DAAP reply evbuffer is NULL\n");
-      goto error_get;
+	DPRINTF(E_LOG, L_CACHE, "Error stepping query for cache lookup: %s\n", sqlite3_errmsg(g_db_hdl));
+      goto error;
     }
 
-  ret = evbuffer_add(cmdarg->evbuf, sqlite3_column_blob(stmt, 0), datalen);
+  ret = evbuffer_add(evbuf, sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0));
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_CACHE, "Out of memory for DAAP reply evbuffer\n");
-      goto error_get;
+      goto error;
     }
 
-  ret = sqlite3_finalize(stmt);
-  if (ret != SQLITE_OK)
-    DPRINTF(E_LOG, L_CACHE, "Error finalizing query for getting cache: %s\n", sqlite3_errmsg(g_db_hdl));
+  // Bring it back into memory, since it is apparently in use
+  ua = (const char *)sqlite3_column_text(stmt, 1);
+  r = cache_daap_reply_new(query, ua ? ua : "", sqlite3_column_int(stmt, 2));
+  if (r && (cache_daap_reply_set(r, sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0)) < 0))
+    cache_daap_reply_free(r);
 
-  DPRINTF(E_INFO, L_CACHE, "Cache hit: %s\n", query);
+  sqlite3_finalize(stmt);
+
+  return 0;
+
+ error:
+  sqlite3_finalize(stmt);
+  return -1;
+#undef Q_TMPL
+}
+
+// Gets a reply from the cache.
+// cmdarg->evbuf will be filled with the reply (gzipped)
+static enum command_state
+cache_daap_query_get(void *arg, int *retval)
+{
+  struct cache_arg *cmdarg;
+  struct daap_reply *r;
+  char *query;
+  int ret;
+
+  cmdarg = arg;
+  query = cmdarg->query;
+  remove_tag(query, "session-id");
+  remove_tag(query, "revision-number");
+
+  if (!cmdarg->evbuf)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error: DAAP reply evbuffer is NULL\n");
+      goto error_get;
+    }
+
+  r = cache_daap_reply_find(query);
+  if (r && r->data)
+    {
+      ret = evbuffer_add(cmdarg->evbuf, r->data, r->len);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Out of memory for DAAP reply evbuffer\n");
+	  goto error_get;
+	}
+
+      cache_daap_reply_unlink(r);
+      cache_daap_reply_link_head(r);
+    }
+  else if (r || (cache_daap_reply_load(query, cmdarg->evbuf) < 0))
+    {
+      g_replies.misses++;
+      goto error_get;
+    }
+
+  g_replies.hits++;
+
+  DPRINTF(E_INFO, L_CACHE, "Cache hit: %s\n", query);
 
   free(query);
 
@@ -745,78 +1269,108 @@ cache_daap_query_get(void *arg, int *retval)
   return COMMAND_END;
 
  error_get:
-  sqlite3_finalize(stmt);
   free(query);
   *retval = -1;
   return COMMAND_END;
-#undef Q_TMPL
 }
 
-/* Removes the query from the cache */
+/* When only one file changed, the items of a plain playlist that doesn't have
+ * the file are still valid. Any other reply may list the file, or count or
+ * group it, so for those we can't tell.
+ */
 static int
-cache_daap_query_delete(const int id)
+cache_daap_reply_unaffected(struct daap_reply *r, struct cache_arg *cmdarg)
 {
-#define Q_TMPL "DELETE FROM queries WHERE id = %d;"
-  char *query;
-  char *errmsg;
-  int ret;
+  if ((cmdarg->deps != CACHE_DAAP_DEP_FILES) || (cmdarg->fileid <= 0) || (r->plid <= 0))
+    return 0;
 
-  query = sqlite3_mprintf(Q_TMPL, id);
+  return (db_pl_has_file(r->plid, cmdarg->fileid) == 0);
+}
 
-  ret = sqlite3_exec(g_db_hdl, query, NULL, NULL, &errmsg);
-  sqlite3_free(query);
-  if (ret != SQLITE_OK)
+/* Marks replies that depend on what changed as outdated, they will be rebuilt
+ * when the cache is updated
+ */
+static enum command_state
+cache_daap_invalidate_impl(void *arg, int *retval)
+{
+  struct cache_arg *cmdarg;
+  struct daap_reply *r;
+  int n;
+
+  cmdarg = arg;
+
+  n = 0;
+  for (r = g_replies.head; r; r = r->next)
     {
-      DPRINTF(E_LOG, L_CACHE, "Error deleting query from cache: %s\n", errmsg);
+      if (!r->data || !cache_daap_deps_match(r->deps, r->plid, cmdarg->deps, cmdarg->id))
+	continue;
 
-      sqlite3_free(errmsg);
-      return -1;
+      if (cache_daap_reply_unaffected(r, cmdarg))
+	continue;
+
+      cache_daap_reply_clear(r);
+      n++;
     }
 
-  return 0;
-#undef Q_TMPL
+  // The db is purged of outdated replies when the cache is updated
+  g_replies.pending_deps |= cmdarg->deps;
+
+  g_replies.invalidations += n;
+
+  if (n > 0)
+    DPRINTF(E_DBG, L_CACHE, "Invalidated %d DAAP replies (deps %d, id %d, file id %d)\n", n, cmdarg->deps, cmdarg->id, cmdarg->fileid);
+
+  if (!g_cacheev)
+    {
+      *retval = -1;
+      return COMMAND_END;
+    }
+
+  evtimer_add(g_cacheev, &g_wait);
+
+  *retval = 0;
+  return COMMAND_END;
+}
+
+static struct daap_reply *
+cache_daap_next_outdated(void)
+{
+  struct daap_reply *r;
+
+  for (r = g_replies.head; r; r = r->next)
+    {
+      if (!r->data)
+	return r;
+    }
+
+  return NULL;
 }
 
 /* Here we actually update the cache by asking httpd_daap for responses
- * to the queries set for caching
+ * to the queries set for caching. Only outdated replies are rebuilt.
  */
 static void
 cache_daap_update_cb(int fd, short what, void *arg)
 {
-  sqlite3_stmt *stmt;
+  struct daap_reply *r;
   struct evbuffer *evbuf;
   struct evbuffer *gzbuf;
-  char *errmsg;
-  char *query;
+  int n;
   int ret;
 
   DPRINTF(E_INFO, L_CACHE, "Timeout reached, time to update DAAP cache\n");
 
-  ret = sqlite3_exec(g_db_hdl, "DELETE FROM replies;", NULL, NULL, &errmsg);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_CACHE, "Error clearing reply cache before update: %s\n", errmsg);
-      sqlite3_free(errmsg);
-      return;
-    }
+  cache_daap_purge_pending();
 
-  ret = sqlite3_prepare_v2(g_db_hdl, "SELECT id, user_agent, query FROM queries;", -1, &stmt, 0);
-  if (ret != SQLITE_OK)
+  n = 0;
+  while ((r = cache_daap_next_outdated()))
     {
-      DPRINTF(E_LOG, L_CACHE, "Error preparing for cache update: %s\n", sqlite3_errmsg(g_db_hdl));
-      return;
-    }
-
-  while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
-    {
-      query = strdup((char *)sqlite3_column_text(stmt, 2));
-
-      evbuf = daap_reply_build(query, (char *)sqlite3_column_text(stmt, 1));
+      evbuf = daap_reply_build(r->query, r->ua);
       if (!evbuf)
 	{
-	  DPRINTF(E_LOG, L_CACHE, "Error building DAAP reply for query: %s\n", query);
-	  cache_daap_query_delete(sqlite3_column_int(stmt, 0));
-	  free(query);
+	  DPRINTF(E_LOG, L_CACHE, "Error building DAAP reply for query: %s\n", r->query);
+	  cache_daap_query_delete(r->query);
+	  cache_daap_reply_free(r);
 
 	  continue;
 	}
@@ -824,9 +1378,9 @@ cache_daap_update_cb(int fd, short what, void *arg)
       gzbuf = httpd_gzip_deflate(evbuf);
       if (!gzbuf)
 	{
-	  DPRINTF(E_LOG, L_CACHE, "Error gzipping DAAP reply for query: %s\n", query);
-	  cache_daap_query_delete(sqlite3_column_int(stmt, 0));
-	  free(query);
+	  DPRINTF(E_LOG, L_CACHE, "Error gzipping DAAP reply for query: %s\n", r->query);
+	  cache_daap_query_delete(r->query);
+	  cache_daap_reply_free(r);
 	  evbuffer_free(evbuf);
 
 	  continue;
@@ -834,38 +1388,20 @@ cache_daap_update_cb(int fd, short what, void *arg)
 
       evbuffer_free(evbuf);
 
-      cache_daap_reply_add(query, gzbuf);
+      cache_daap_reply_add(r->query, evbuffer_pullup(gzbuf, -1), evbuffer_get_length(gzbuf));
 
-      free(query);
-      evbuffer_free(gzbuf);
-    }
-
-  if (ret != SQLITE_DONE)
-    DPRINTF(E_LOG, L_CACHE, "Could not step: %s\n", sqlite3_errmsg(g_db_hdl));
-
-  sqlite3_finalize(stmt);
-
-  DPRINTF(E_INFO, L_CACHE, "DAAP cache updated\n");
-}
+      // If it doesn't fit in memory it will only be in the db
+      ret = cache_daap_reply_set(r, evbuffer_pullup(gzbuf, -1), evbuffer_get_length(gzbuf));
+      if (ret < 0)
+	cache_daap_reply_free(r);
 
-/* This function will just set a timer, which when it times out will trigger
- * the actual cache update. The purpose is to avoid avoid cache updates when
- * the database is busy, eg during a library scan.
- */
-static enum command_state
-cache_daap_update_timer(void *arg, int *ret)
-{
-  if (!g_cacheev)
-    {
-      *ret = -1;
-      return COMMAND_END;
+      evbuffer_free(gzbuf);
+      n++;
     }
 
-  evtimer_add(g_cacheev, &g_wait);
-
-  *ret = 0;
-
-  return COMMAND_END;
+  DPRINTF(E_INFO, L_CACHE, "DAAP cache updated, %d replies rebuilt (in memory: %zu bytes; hits %" PRIu64 ", misses %" PRIu64
+	  ", evictions %" PRIu64 ", invalidations %" PRIu64 ")\n",
+	  n, g_replies.size, g_replies.hits, g_replies.misses, g_replies.evictions, g_replies.invalidations);
 }
 
 static enum command_state
@@ -969,6 +1505,45 @@ cache_artwork_ping_impl(void *arg, int *retval)
 #undef Q_TMPL_DEL
 }
 
+/* Pings the artwork of the files directly in the directory cmdarg->path, for
+ * directories the scanner skips because they are unchanged. The path is not
+ * used as a LIKE pattern, since it may contain '%' and '_'.
+ */
+static enum command_state
+cache_artwork_ping_bydirectory_impl(void *arg, int *retval)
+{
+#define Q_TMPL "UPDATE artwork SET db_timestamp = %" PRIi64 " WHERE substr(filepath, 1, %d) = '%q/' AND substr(filepath, %d) NOT LIKE '%%/%%';"
+
+  struct cache_arg *cmdarg;
+  char *query;
+  char *errmsg;
+  int len;
+  int ret;
+
+  cmdarg = arg;
+  len = strlen(cmdarg->path) + 1;
+  query = sqlite3_mprintf(Q_TMPL, (int64_t)time(NULL), len, cmdarg->path, len + 1);
+
+  DPRINTF(E_DBG, L_CACHE, "Running query '%s'\n", query);
+
+  ret = sqlite3_exec(g_db_hdl, query, NULL, NULL, &errmsg);
+  sqlite3_free(query);
+  free(cmdarg->path);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Query error: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      *retval = -1;
+      return COMMAND_END;
+    }
+
+  *retval = 0;
+  return COMMAND_END;
+
+#undef Q_TMPL
+}
+
 /*
  * Removes all cache entries for the given path
  *
@@ -1277,6 +1852,24 @@ cache_artwork_read_impl(void *arg, int *retval)
   return COMMAND_END;
 }
 
+// Adds the stats of the DAAP reply cache to cmdarg->evbuf as JSON
+static enum command_state
+cache_stats_impl(void *arg, int *retval)
+{
+  struct cache_arg *cmdarg;
+  int ret;
+
+  cmdarg = arg;
+
+  ret = evbuffer_add_printf(cmdarg->evbuf, "{\"bytes\":%zu,\"max_bytes\":%zu,\"hits\":%" PRIu64 ",\"misses\":%" PRIu64 ","
+			    "\"evictions\":%" PRIu64 ",\"invalidations\":%" PRIu64 "}",
+			    g_replies.size, g_replies.max_size, g_replies.hits, g_replies.misses,
+			    g_replies.evictions, g_replies.invalidations);
+
+  *retval = (ret < 0) ? -1 : 0;
+  return COMMAND_END;
+}
+
 static void *
 cache(void *arg)
 {
@@ -1301,6 +1894,8 @@ cache(void *arg)
       pthread_exit(NULL);
     }
 
+  cache_daap_load();
+
   g_initialized = 1;
 
   event_base_dispatch(evbase_cache);
@@ -1311,6 +1906,14 @@ cache(void *arg)
       g_initialized = 0;
     }
 
+  cache_daap_purge_pending();
+
+  DPRINTF(E_INFO, L_CACHE, "DAAP cache stats: hits %" PRIu64 ", misses %" PRIu64 ", evictions %" PRIu64 ", invalidations %" PRIu64 "\n",
+	  g_replies.hits, g_replies.misses, g_replies.evictions, g_replies.invalidations);
+
+  while (g_replies.head)
+    cache_daap_reply_free(g_replies.head);
+
   db_perthread_deinit();
 
   cache_close();
@@ -1330,31 +1933,142 @@ cache(void *arg)
 
 void
 cache_daap_trigger(void)
+{
+  cache_daap_invalidate(CACHE_DAAP_DEP_FILES, 0);
+}
+
+static void
+cache_daap_invalidate_send(int deps, int id, int fileid)
+{
+  struct cache_arg *cmdarg;
+
+  cmdarg = (struct cache_arg *)malloc(sizeof(struct cache_arg));
+  if (!cmdarg)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not allocate cache_arg\n");
+      return;
+    }
+
+  memset(cmdarg, 0, sizeof(struct cache_arg));
+
+  cmdarg->deps = deps;
+  cmdarg->id = id;
+  cmdarg->fileid = fileid;
+
+  commands_exec_async(cmdbase, cache_daap_invalidate_impl, cmdarg);
+}
+
+/*
+ * Marks cached replies that depend on what changed as outdated, and schedules
+ * rebuilding them
+ *
+ * @param deps what changed, CACHE_DAAP_DEP_*
+ * @param id the playlist id if CACHE_DAAP_DEP_PLAYLIST
+ */
+void
+cache_daap_invalidate(int deps, int id)
 {
   if (!g_initialized)
     return;
 
-  commands_exec_async(cmdbase, cache_daap_update_timer, NULL);
+  if (g_hold > 0)
+    {
+      g_hold_deps |= deps;
+
+      if (deps & CACHE_DAAP_DEP_PLAYLIST)
+	g_hold_plid = (g_hold_plid < 0 || g_hold_plid == id) ? id : 0;
+      if (deps & CACHE_DAAP_DEP_FILES)
+	g_hold_fileid = 0;
+
+      return;
+    }
+
+  cache_daap_invalidate_send(deps, id, 0);
 }
 
+/*
+ * Like cache_daap_invalidate(CACHE_DAAP_DEP_FILES, 0), but for a change to the
+ * metadata of a single existing file, which leaves the replies for playlists
+ * that don't have the file valid
+ *
+ * @param id the file id
+ */
 void
-cache_daap_suspend(void)
+cache_daap_invalidate_file(int id)
 {
   if (!g_initialized)
     return;
 
+  if (g_hold > 0)
+    {
+      g_hold_deps |= CACHE_DAAP_DEP_FILES;
+      g_hold_fileid = (g_hold_fileid < 0 || g_hold_fileid == id) ? id : 0;
+
+      return;
+    }
+
+  cache_daap_invalidate_send(CACHE_DAAP_DEP_FILES, 0, id);
+}
+
+void
+cache_daap_suspend(void)
+{
+  if (!g_initialized || (g_hold > 0))
+    return;
+
   commands_exec_async(cmdbase, cache_daap_suspend_timer, NULL);
 }
 
 void
 cache_daap_resume(void)
 {
-  if (!g_initialized)
+  if (!g_initialized || (g_hold > 0))
     return;
 
   commands_exec_async(cmdbase, cache_daap_resume_timer, NULL);
 }
 
+/*
+ * Holds back the invalidations made by the calling thread, e.g. while it
+ * processes a batch of library changes, and suspends cache updates. Calls may
+ * be nested.
+ */
+void
+cache_daap_hold(void)
+{
+  if (g_hold > 0)
+    {
+      g_hold++;
+      return;
+    }
+
+  cache_daap_suspend();
+
+  g_hold = 1;
+  g_hold_deps = 0;
+  g_hold_plid = -1;
+  g_hold_fileid = -1;
+}
+
+/*
+ * Sends the invalidations held back since cache_daap_hold() as one
+ */
+void
+cache_daap_release(void)
+{
+  if (g_hold == 0)
+    return;
+
+  g_hold--;
+  if (g_hold > 0)
+    return;
+
+  if (g_hold_deps && g_initialized)
+    cache_daap_invalidate_send(g_hold_deps, (g_hold_plid < 0) ? 0 : g_hold_plid, (g_hold_fileid < 0) ? 0 : g_hold_fileid);
+  else
+    cache_daap_resume();
+}
+
 int
 cache_daap_get(const char *query, struct evbuffer *evbuf)
 {
@@ -1399,6 +2113,515 @@ cache_daap_threshold(void)
   return g_cfg_threshold;
 }
 
+/*
+ * Adds the stats of the DAAP reply cache and the DMAP item cache to evbuf as
+ * JSON, a cache that isn't running is null
+ *
+ * @param evbuf event buffer the stats will be added to
+ * @return 0 if successful, -1 on error
+ */
+int
+cache_stats_get(struct evbuffer *evbuf)
+{
+  struct cache_arg cmdarg;
+  int ret;
+
+  ret = evbuffer_add_printf(evbuf, "{\"daap_replies\":");
+
+  if (ret >= 0)
+    {
+      if (g_initialized)
+	{
+	  cmdarg.evbuf = evbuf;
+	  ret = commands_exec_sync(cmdbase, cache_stats_impl, NULL, &cmdarg);
+	}
+      else
+	ret = evbuffer_add_printf(evbuf, "null");
+    }
+
+  if (ret >= 0)
+    ret = evbuffer_add_printf(evbuf, ",\"dmap_items\":");
+
+  if (ret >= 0)
+    {
+      pthread_mutex_lock(&g_items.lck);
+
+      if (g_items.buckets)
+	ret = evbuffer_add_printf(evbuf, "{\"bytes\":%zu,\"max_bytes\":%zu,\"hits\":%" PRIu64 ",\"misses\":%" PRIu64 ",\"evictions\":%" PRIu64 "}",
+				  g_items.size, g_items.max_size, g_items.hits, g_items.misses, g_items.evictions);
+      else
+	ret = evbuffer_add_printf(evbuf, "null");
+
+      pthread_mutex_unlock(&g_items.lck);
+    }
+
+  if (ret >= 0)
+    ret = evbuffer_add_printf(evbuf, "}\n");
+
+  return (ret < 0) ? -1 : 0;
+}
+
+
+/* ------------------------- DMAP item cache API  ------------------------- */
+
+/* The DMAP item cache holds encoded song blocks (mlit) for song list replies,
+ * so that for unchanged items a reply is just a concatenation of cached blocks.
+ * The key identifies the requested meta set and encoding options, the stamp
+ * is the file's time_modified, so an entry is never used for a newer version of
+ * the file. It is not the db_timestamp, since that is bumped by every rescan.
+ * Updates that don't change the stamp (e.g. the play count) invalidate the
+ * file's blocks, and a block that was encoded from a row read before an
+ * invalidation of its id is refused by cache_dmap_item_add() (see
+ * cache_dmap_item_gen()).
+ */
+
+static void
+dmap_item_lru_unlink(struct dmap_item *item)
+{
+  if (item->lru_prev)
+    item->lru_prev->lru_next = item->lru_next;
+  else
+    g_items.oldest = item->lru_next;
+
+  if (item->lru_next)
+    item->lru_next->lru_prev = item->lru_prev;
+  else
+    g_items.newest = item->lru_prev;
+}
+
+static void
+dmap_item_lru_link_newest(struct dmap_item *item)
+{
+  item->lru_prev = g_items.newest;
+  item->lru_next = NULL;
+  if (g_items.newest)
+    g_items.newest->lru_next = item;
+  else
+    g_items.oldest = item;
+  g_items.newest = item;
+}
+
+static void
+dmap_item_unref(struct dmap_item *item)
+{
+  item->refs--;
+  if (item->refs == 0)
+    free(item);
+}
+
+static void
+dmap_item_unlink(struct dmap_item **prev_next, struct dmap_item *item)
+{
+  *prev_next = item->next;
+
+  dmap_item_lru_unlink(item);
+
+  g_items.size -= sizeof(struct dmap_item) + item->len;
+
+  dmap_item_unref(item);
+}
+
+static void
+dmap_item_evict_oldest(void)
+{
+  struct dmap_item **prev_next;
+  struct dmap_item *item;
+
+  item = g_items.oldest;
+
+  prev_next = &g_items.buckets[item->id & (CACHE_DMAP_ITEM_BUCKETS - 1)];
+  while (*prev_next != item)
+    prev_next = &(*prev_next)->next;
+
+  dmap_item_unlink(prev_next, item);
+
+  g_items.evictions++;
+}
+
+static void
+dmap_item_clear(void)
+{
+  struct dmap_item *item;
+
+  while ((item = g_items.oldest))
+    {
+      g_items.oldest = item->lru_next;
+      dmap_item_unref(item);
+    }
+
+  g_items.newest = NULL;
+  g_items.size = 0;
+
+  memset(g_items.buckets, 0, CACHE_DMAP_ITEM_BUCKETS * sizeof(struct dmap_item *));
+}
+
+/*
+ * Adds the cached DMAP block for the given item to the evbuffer
+ *
+ * @param id file id
+ * @param key identifies the meta set and encoding options
+ * @param stamp time_modified of the file
+ * @param evbuf event buffer the block will be added to
+ * @return 0 if a block was added, -1 if not in cache (or on error)
+ */
+int
+cache_dmap_item_get(uint32_t id, uint64_t key, uint32_t stamp, struct evbuffer *evbuf)
+{
+  struct dmap_item *item;
+  int ret;
+
+  if (!g_items.buckets)
+    return -1;
+
+  ret = -1;
+
+  pthread_mutex_lock(&g_items.lck);
+
+  for (item = g_items.buckets[id & (CACHE_DMAP_ITEM_BUCKETS - 1)]; item; item = item->next)
+    {
+      if ((item->id == id) && (item->key == key) && (item->stamp == stamp))
+	{
+	  ret = evbuffer_add(evbuf, item->data, item->len);
+
+	  // Keep items in use, e.g. by a library sync larger than the cache
+	  if ((ret == 0) && (item != g_items.newest))
+	    {
+	      dmap_item_lru_unlink(item);
+	      dmap_item_lru_link_newest(item);
+	    }
+	  break;
+	}
+    }
+
+  if (ret == 0)
+    g_items.hits++;
+  else
+    g_items.misses++;
+
+  pthread_mutex_unlock(&g_items.lck);
+
+  return ret;
+}
+
+/*
+ * Returns the current invalidation generation, to be taken before the rows
+ * that blocks are encoded from are read
+ *
+ * @return generation to pass to cache_dmap_item_add()
+ */
+uint64_t
+cache_dmap_item_gen(void)
+{
+  uint64_t gen;
+
+  pthread_mutex_lock(&g_items.lck);
+  gen = g_items.seq;
+  pthread_mutex_unlock(&g_items.lck);
+
+  return gen;
+}
+
+static struct dmap_item *
+dmap_item_new(uint32_t id, uint64_t key, uint32_t stamp, struct evbuffer *evbuf)
+{
+  struct dmap_item *item;
+  size_t len;
+
+  len = evbuffer_get_length(evbuf);
+
+  item = malloc(sizeof(struct dmap_item) + len);
+  if (!item)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Out of memory for DMAP item cache\n");
+      return NULL;
+    }
+
+  item->id = id;
+  item->key = key;
+  item->stamp = stamp;
+  item->refs = 0;
+  item->len = len;
+
+  evbuffer_copyout(evbuf, item->data, len);
+
+  return item;
+}
+
+/* Adds the item to the cache unless it is too large, or may have been
+ * invalidated after its row was read. Must be called with the lock held.
+ */
+static void
+dmap_item_insert(struct dmap_item *item, uint64_t gen)
+{
+  struct dmap_item **prev_next;
+
+  if (sizeof(struct dmap_item) + item->len > g_items.max_size / 16)
+    return;
+
+  if ((g_items.gens[item->id & (CACHE_DMAP_ITEM_BUCKETS - 1)] > gen) || (g_items.cleared > gen))
+    return;
+
+  prev_next = &g_items.buckets[item->id & (CACHE_DMAP_ITEM_BUCKETS - 1)];
+  while (*prev_next)
+    {
+      if (((*prev_next)->id == item->id) && ((*prev_next)->key == item->key))
+	dmap_item_unlink(prev_next, *prev_next);
+      else
+	prev_next = &(*prev_next)->next;
+    }
+
+  while (g_items.oldest && (g_items.size + sizeof(struct dmap_item) + item->len > g_items.max_size))
+    dmap_item_evict_oldest();
+
+  prev_next = &g_items.buckets[item->id & (CACHE_DMAP_ITEM_BUCKETS - 1)];
+  item->next = *prev_next;
+  *prev_next = item;
+
+  dmap_item_lru_link_newest(item);
+
+  item->refs++;
+
+  g_items.size += sizeof(struct dmap_item) + item->len;
+}
+
+/*
+ * Adds the DMAP block for the given item to the cache, replacing any block
+ * with the same id and key. The block is not added if the item may have been
+ * invalidated after its row was read.
+ *
+ * @param id file id
+ * @param key identifies the meta set and encoding options
+ * @param stamp time_modified of the file
+ * @param gen generation from cache_dmap_item_gen() before the row was read
+ * @param evbuf event buffer with the DMAP block (will not be drained)
+ */
+void
+cache_dmap_item_add(uint32_t id, uint64_t key, uint32_t stamp, uint64_t gen, struct evbuffer *evbuf)
+{
+  struct dmap_item *item;
+
+  if (!g_items.buckets)
+    return;
+
+  if (sizeof(struct dmap_item) + evbuffer_get_length(evbuf) > g_items.max_size / 16)
+    return;
+
+  item = dmap_item_new(id, key, stamp, evbuf);
+  if (!item)
+    return;
+
+  pthread_mutex_lock(&g_items.lck);
+
+  dmap_item_insert(item, gen);
+  if (item->refs == 0)
+    free(item);
+
+  pthread_mutex_unlock(&g_items.lck);
+}
+
+/*
+ * Pins the cached DMAP block for the given item. A pinned block stays valid
+ * until it is unpinned, also if the cache drops it in the meantime, so a
+ * streamed song list can hold on to the blocks its header was made from.
+ *
+ * @param id file id
+ * @param key identifies the meta set and encoding options
+ * @param stamp time_modified of the file
+ * @param len set to the length of the block
+ * @return the pinned block, NULL if not in cache
+ */
+struct dmap_item *
+cache_dmap_item_pin(uint32_t id, uint64_t key, uint32_t stamp, size_t *len)
+{
+  struct dmap_item *item;
+
+  if (!g_items.buckets)
+    return NULL;
+
+  pthread_mutex_lock(&g_items.lck);
+
+  for (item = g_items.buckets[id & (CACHE_DMAP_ITEM_BUCKETS - 1)]; item; item = item->next)
+    {
+      if ((item->id == id) && (item->key == key) && (item->stamp == stamp))
+	break;
+    }
+
+  if (item)
+    {
+      if (item != g_items.newest)
+	{
+	  dmap_item_lru_unlink(item);
+	  dmap_item_lru_link_newest(item);
+	}
+
+      item->refs++;
+      *len = item->len;
+
+      g_items.hits++;
+    }
+  else
+    g_items.misses++;
+
+  pthread_mutex_unlock(&g_items.lck);
+
+  return item;
+}
+
+/*
+ * Like cache_dmap_item_add(), but also returns the block pinned, which it also
+ * does if the block couldn't be cached (e.g. the cache is disabled)
+ *
+ * @param id file id
+ * @param key identifies the meta set and encoding options
+ * @param stamp time_modified of the file
+ * @param gen generation from cache_dmap_item_gen() before the row was read
+ * @param evbuf event buffer with the DMAP block (will not be drained)
+ * @return the pinned block, NULL if out of memory
+ */
+struct dmap_item *
+cache_dmap_item_pin_add(uint32_t id, uint64_t key, uint32_t stamp, uint64_t gen, struct evbuffer *evbuf)
+{
+  struct dmap_item *item;
+
+  item = dmap_item_new(id, key, stamp, evbuf);
+  if (!item)
+    return NULL;
+
+  pthread_mutex_lock(&g_items.lck);
+
+  item->refs = 1;
+  if (g_items.buckets)
+    dmap_item_insert(item, gen);
+
+  pthread_mutex_unlock(&g_items.lck);
+
+  return item;
+}
+
+/*
+ * Adds a pinned DMAP block to the evbuffer
+ *
+ * @param item the pinned block
+ * @param evbuf event buffer the block will be added to
+ * @return 0 on success, -1 on error
+ */
+int
+cache_dmap_item_pinned_get(struct dmap_item *item, struct evbuffer *evbuf)
+{
+  // The content of an item never changes, so no need to lock
+  return evbuffer_add(evbuf, item->data, item->len);
+}
+
+/*
+ * Releases a block pinned by cache_dmap_item_pin() or cache_dmap_item_pin_add()
+ *
+ * @param item the pinned block
+ */
+void
+cache_dmap_item_unpin(struct dmap_item *item)
+{
+  pthread_mutex_lock(&g_items.lck);
+  dmap_item_unref(item);
+  pthread_mutex_unlock(&g_items.lck);
+}
+
+/*
+ * Removes all cached DMAP blocks for the given file id, must be called after
+ * the update of the file
+ *
+ * @param id file id
+ */
+void
+cache_dmap_item_invalidate(uint32_t id)
+{
+  struct dmap_item **prev_next;
+
+  if (!g_items.buckets)
+    return;
+
+  pthread_mutex_lock(&g_items.lck);
+
+  prev_next = &g_items.buckets[id & (CACHE_DMAP_ITEM_BUCKETS - 1)];
+  while (*prev_next)
+    {
+      if ((*prev_next)->id == id)
+	dmap_item_unlink(prev_next, *prev_next);
+      else
+	prev_next = &(*prev_next)->next;
+    }
+
+  g_items.gens[id & (CACHE_DMAP_ITEM_BUCKETS - 1)] = ++g_items.seq;
+
+  pthread_mutex_unlock(&g_items.lck);
+}
+
+/*
+ * Removes all cached DMAP blocks, used after updates that affect many files
+ */
+void
+cache_dmap_item_invalidate_all(void)
+{
+  if (!g_items.buckets)
+    return;
+
+  pthread_mutex_lock(&g_items.lck);
+
+  DPRINTF(E_DBG, L_CACHE, "Clearing DMAP item cache (%zu bytes, hits %" PRIu64 ", misses %" PRIu64 ", evictions %" PRIu64 ")\n",
+	  g_items.size, g_items.hits, g_items.misses, g_items.evictions);
+
+  dmap_item_clear();
+
+  g_items.cleared = ++g_items.seq;
+
+  pthread_mutex_unlock(&g_items.lck);
+}
+
+static void
+dmap_item_cache_init(void)
+{
+  int size;
+
+  size = cfg_getint(cfg_getsec(cfg, "general"), "cache_daap_items_size");
+  if (size <= 0)
+    {
+      DPRINTF(E_INFO, L_CACHE, "DMAP item cache disabled\n");
+      return;
+    }
+
+  g_items.buckets = calloc(CACHE_DMAP_ITEM_BUCKETS, sizeof(struct dmap_item *));
+  g_items.gens = calloc(CACHE_DMAP_ITEM_BUCKETS, sizeof(uint64_t));
+  if (!g_items.buckets || !g_items.gens)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Out of memory for DMAP item cache, disabling\n");
+
+      free(g_items.buckets);
+      free(g_items.gens);
+      g_items.buckets = NULL;
+      g_items.gens = NULL;
+      return;
+    }
+
+  g_items.max_size = (size_t)size * 1024 * 1024;
+}
+
+static void
+dmap_item_cache_deinit(void)
+{
+  if (!g_items.buckets)
+    return;
+
+  DPRINTF(E_INFO, L_CACHE, "DMAP item cache stats: hits %" PRIu64 ", misses %" PRIu64 ", evictions %" PRIu64 "\n",
+	  g_items.hits, g_items.misses, g_items.evictions);
+
+  pthread_mutex_lock(&g_items.lck);
+  dmap_item_clear();
+  free(g_items.buckets);
+  free(g_items.gens);
+  g_items.buckets = NULL;
+  g_items.gens = NULL;
+  pthread_mutex_unlock(&g_items.lck);
+}
+
 
 /* --------------------------- Artwork cache API -------------------------- */
 
@@ -1438,6 +2661,33 @@ cache_artwork_ping(char *path, time_t mtime, int del)
   commands_exec_async(cmdbase, cache_artwork_ping_impl, cmdarg);
 }
 
+/*
+ * Updates cached timestamps to current time for the artwork of the files directly in the given directory
+ *
+ * @param path the full path to the directory
+ */
+void
+cache_artwork_ping_bydirectory(char *path)
+{
+  struct cache_arg *cmdarg;
+
+  if (!g_initialized)
+    return;
+
+  cmdarg = (struct cache_arg *)malloc(sizeof(struct cache_arg));
+  if (!cmdarg)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not allocate cache_arg\n");
+      return;
+    }
+
+  memset(cmdarg, 0, sizeof(struct cache_arg));
+
+  cmdarg->path = strdup(path);
+
+  commands_exec_async(cmdbase, cache_artwork_ping_bydirectory_impl, cmdarg);
+}
+
 /*
  * Removes all cache entries for the given path
  *
@@ -1608,6 +2858,9 @@ cache_init(void)
 
   g_initialized = 0;
 
+  // Doesn't need the cache thread, so is set up even if that is disabled
+  dmap_item_cache_init();
+
   g_db_path = cfg_getstr(cfg_getsec(cfg, "general"), "cache_path");
   if (!g_db_path || (strlen(g_db_path) == 0))
     {
@@ -1622,6 +2875,9 @@ cache_init(void)
       return 0;
     }
 
+  memset(&g_replies, 0, sizeof(struct daap_reply_cache));
+  g_replies.max_size = (size_t)cfg_getint(cfg_getsec(cfg, "general"), "cache_daap_replies_size") * 1024 * 1024;
+
   evbase_cache = event_base_new();
   if (!evbase_cache)
     {
@@ -1671,6 +2927,8 @@ cache_deinit(void)
 {
   int ret;
 
+  dmap_item_cache_deinit();
+
   if (!g_initialized)
     return;
 
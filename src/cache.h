@@ -2,19 +2,37 @@
 #ifndef __CACHE_H__
 #define __CACHE_H__
 
+#include <stdint.h>
 #include <event2/buffer.h>
 
 /* ---------------------------- DAAP cache API  --------------------------- */
 
+/* What a cached DAAP reply depends on, used for invalidation */
+#define CACHE_DAAP_DEP_FILES    (1 << 0)
+#define CACHE_DAAP_DEP_PLAYLIST (1 << 1)
+#define CACHE_DAAP_DEP_GROUPS   (1 << 2)
+
 void
 cache_daap_trigger(void);
 
+void
+cache_daap_invalidate(int deps, int id);
+
+void
+cache_daap_invalidate_file(int id);
+
 void
 cache_daap_suspend(void);
 
 void
 cache_daap_resume(void);
 
+void
+cache_daap_hold(void);
+
+void
+cache_daap_release(void);
+
 int
 cache_daap_get(const char *query, struct evbuffer *evbuf);
 
@@ -24,6 +42,41 @@ cache_daap_add(const char *query, const char *ua, int msec);
 int
 cache_daap_threshold(void);
 
+int
+cache_stats_get(struct evbuffer *evbuf);
+
+
+/* ------------------------- DMAP item cache API  ------------------------- */
+
+int
+cache_dmap_item_get(uint32_t id, uint64_t key, uint32_t stamp, struct evbuffer *evbuf);
+
+uint64_t
+cache_dmap_item_gen(void);
+
+void
+cache_dmap_item_add(uint32_t id, uint64_t key, uint32_t stamp, uint64_t gen, struct evbuffer *evbuf);
+
+struct dmap_item;
+
+struct dmap_item *
+cache_dmap_item_pin(uint32_t id, uint64_t key, uint32_t stamp, size_t *len);
+
+struct dmap_item *
+cache_dmap_item_pin_add(uint32_t id, uint64_t key, uint32_t stamp, uint64_t gen, struct evbuffer *evbuf);
+
+int
+cache_dmap_item_pinned_get(struct dmap_item *item, struct evbuffer *evbuf);
+
+void
+cache_dmap_item_unpin(struct dmap_item *item);
+
+void
+cache_dmap_item_invalidate(uint32_t id);
+
+void
+cache_dmap_item_invalidate_all(void);
+
 
 /* ---------------------------- Artwork cache API  --------------------------- */
 
@@ -33,6 +86,9 @@ cache_daap_threshold(void);
 void
 cache_artwork_ping(char *path, time_t mtime, int del);
 
+void
+cache_artwork_ping_bydirectory(char *path);
+
 int
 cache_artwork_delete_by_path(char *path);
 
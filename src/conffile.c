@@ -55,7 +55,14 @@ static cfg_opt_t sec_general[] =
     CFG_BOOL("ipv6", cfg_true, CFGF_NONE),
     CFG_STR("cache_path", STATEDIR "/cache/" PACKAGE "/cache.db", CFGF_NONE),
     CFG_INT("cache_daap_threshold", 1000, CFGF_NONE),
+    CFG_INT("cache_daap_replies_size", 32, CFGF_NONE),
+    CFG_INT("cache_daap_items_size", 32, CFGF_NONE),
     CFG_BOOL("speaker_autoselect", cfg_true, CFGF_NONE),
+    CFG_INT("prefetch_secs", 5, CFGF_NONE),
+    CFG_INT("httpd_threads", 1, CFGF_NONE),
+    CFG_INT("httpd_workers", 2, CFGF_NONE),
+    CFG_INT("transcode_cache_size", 0, CFGF_NONE),
+    CFG_STR("transcode_cache_dir", STATEDIR "/cache/" PACKAGE "/transcode", CFGF_NONE),
     CFG_STR("allow_origin", "*", CFGF_NONE),
     CFG_END()
   };
@@ -85,6 +92,12 @@ static cfg_opt_t sec_library[] =
     CFG_STR_LIST("filetypes_ignore", "{.db,.ini,.db-journal,.pdf}", CFGF_NONE),
     CFG_STR_LIST("filepath_ignore", NULL, CFGF_NONE),
     CFG_BOOL("filescan_disable", cfg_false, CFGF_NONE),
+    CFG_INT("filescan_workers", 0, CFGF_NONE),
+    CFG_INT("filescan_batch_files", 1000, CFGF_NONE),
+    CFG_INT("filescan_batch_msec", 2000, CFGF_NONE),
+    CFG_BOOL("filescan_skip_unchanged_dirs", cfg_false, CFGF_NONE),
+    CFG_INT("filescan_stat_parallel", 16, CFGF_NONE),
+    CFG_INT("inotify_quiet_msec", 500, CFGF_NONE),
     CFG_BOOL("itunes_overrides", cfg_false, CFGF_NONE),
     CFG_BOOL("itunes_smartpl", cfg_false, CFGF_NONE),
     CFG_STR_LIST("no_decode", NULL, CFGF_NONE),
@@ -109,6 +122,14 @@ static cfg_opt_t sec_airplay[] =
   {
     CFG_INT("max_volume", 11, CFGF_NONE),
     CFG_STR("password", NULL, CFGF_NONE),
+    CFG_BOOL("alac_compression", cfg_false, CFGF_NONE),
+    CFG_END()
+  };
+
+/* AirPlay shared section structure */
+static cfg_opt_t sec_airplay_shared[] =
+  {
+    CFG_INT("retransmit_buffer_size", 1024, CFGF_NONE),
     CFG_END()
   };
 
@@ -158,6 +179,7 @@ static cfg_opt_t toplvl_cfg[] =
     CFG_SEC("general", sec_general, CFGF_NONE),
     CFG_SEC("library", sec_library, CFGF_NONE),
     CFG_SEC("audio", sec_audio, CFGF_NONE),
+    CFG_SEC("airplay_shared", sec_airplay_shared, CFGF_NONE),
     CFG_SEC("airplay", sec_airplay, CFGF_MULTI | CFGF_TITLE),
     CFG_SEC("fifo", sec_fifo, CFGF_NONE),
     CFG_SEC("spotify", sec_spotify, CFGF_NONE),
@@ -309,6 +309,37 @@ struct rng_ctx shuffle_rng;
 static char *db_path;
 static __thread sqlite3 *hdl;
 
+/* Per-thread cache of prepared statements, see db_statement_prepare_cached() */
+#define DB_STMT_CACHE_SIZE 32
+
+struct db_stmt_cache_entry
+{
+  char *query;
+  uint32_t hash;
+  sqlite3_stmt *stmt;
+  int in_use;
+  unsigned int last_used;
+};
+
+struct db_stmt_cache
+{
+  struct db_stmt_cache_entry entries[DB_STMT_CACHE_SIZE];
+  unsigned int clock;
+
+  unsigned int prepares;
+  unsigned int prepares_saved;
+};
+
+static __thread struct db_stmt_cache *stmt_cache;
+
+/* Files updated in a transaction have their DMAP blocks invalidated again when
+ * it is committed, since until then readers see the old rows, and may cache
+ * them. The cache entries are stamped with time_modified, which not all
+ * updates change.
+ */
+static __thread int db_in_transaction;
+static __thread int db_items_changed;
+
 
 /* Forward */
 static int
@@ -326,6 +357,9 @@ db_group_type_bypersistentid(int64_t persistentid);
 static int
 db_query_run(char *query, int free, int cache_update);
 
+static int
+db_get_one_int(char *query);
+
 
 char *
 db_escape_string(const char *str)
@@ -603,6 +637,125 @@ db_blocking_prepare_v2(const char *query, int len, sqlite3_stmt **stmt, const ch
   return ret;
 }
 
+/* Prepares a statement, or takes it from the thread's statement cache if the
+ * same query was prepared before. Statements are found by their SQL, so this
+ * is only for hot queries with a fixed text that use parameters (sqlite3_bind_*)
+ * for their values. One-off queries, e.g. with a filter or literal values, would
+ * just evict those, so they use db_statement_prepare(). The statement must be
+ * released with db_statement_finalize().
+ */
+static int
+db_statement_prepare_cached(const char *query, sqlite3_stmt **stmt)
+{
+  struct db_stmt_cache_entry *e;
+  struct db_stmt_cache_entry *slot;
+  uint32_t hash;
+  int i;
+  int ret;
+
+  if (!stmt_cache)
+    return db_blocking_prepare_v2(query, -1, stmt, NULL);
+
+  hash = djb_hash(query, strlen(query));
+
+  slot = NULL;
+  for (i = 0; i < DB_STMT_CACHE_SIZE; i++)
+    {
+      e = &stmt_cache->entries[i];
+
+      if (e->in_use)
+	continue;
+
+      if (e->stmt && (e->hash == hash) && (strcmp(e->query, query) == 0))
+	{
+	  e->in_use = 1;
+	  e->last_used = ++stmt_cache->clock;
+	  stmt_cache->prepares_saved++;
+
+	  *stmt = e->stmt;
+	  return SQLITE_OK;
+	}
+
+      // Use an empty slot, otherwise the least recently used
+      if (!slot || (slot->stmt && (!e->stmt || (e->last_used < slot->last_used))))
+	slot = e;
+    }
+
+  ret = db_blocking_prepare_v2(query, -1, stmt, NULL);
+  if (ret != SQLITE_OK)
+    return ret;
+
+  stmt_cache->prepares++;
+
+  // All statements in the cache are in use, so don't cache this one
+  if (!slot)
+    return SQLITE_OK;
+
+  if (slot->stmt)
+    {
+      sqlite3_finalize(slot->stmt);
+      free(slot->query);
+    }
+
+  slot->query = strdup(query);
+  if (!slot->query)
+    {
+      slot->stmt = NULL;
+      return SQLITE_OK;
+    }
+
+  slot->hash = hash;
+  slot->stmt = *stmt;
+  slot->in_use = 1;
+  slot->last_used = ++stmt_cache->clock;
+
+  return SQLITE_OK;
+}
+
+/* Prepares a statement that is not cached, for queries that are built for the
+ * occasion. The statement must be released with db_statement_finalize().
+ */
+static int
+db_statement_prepare(const char *query, sqlite3_stmt **stmt)
+{
+  int ret;
+
+  ret = db_blocking_prepare_v2(query, -1, stmt, NULL);
+  if ((ret == SQLITE_OK) && stmt_cache)
+    stmt_cache->prepares++;
+
+  return ret;
+}
+
+/* Releases a statement from db_statement_prepare() or
+ * db_statement_prepare_cached(). Cached statements are just reset, which also
+ * releases any locks they hold.
+ */
+static void
+db_statement_finalize(sqlite3_stmt *stmt)
+{
+  int i;
+
+  if (!stmt)
+    return;
+
+  if (stmt_cache)
+    {
+      for (i = 0; i < DB_STMT_CACHE_SIZE; i++)
+	{
+	  if (stmt_cache->entries[i].stmt != stmt)
+	    continue;
+
+	  sqlite3_reset(stmt);
+	  sqlite3_clear_bindings(stmt);
+	  stmt_cache->entries[i].in_use = 0;
+	  return;
+	}
+    }
+
+  sqlite3_finalize(stmt);
+}
+
 
 /* Modelled after sqlite3_exec() */
 static int
@@ -710,11 +863,91 @@ db_set_cfg_names(void)
 #undef Q_TMPL
 }
 
+/* Normally the update_groups triggers add the group rows one file at a time.
+ * During bulk scans they are dropped, and this adds the rows for all files in
+ * one pass before the triggers are recreated.
+ */
+static int
+db_groups_rebuild(void)
+{
+  char *queries[2] =
+    {
+      "INSERT OR IGNORE INTO groups (type, name, persistentid) SELECT 1, album, songalbumid FROM files;",
+      "INSERT OR IGNORE INTO groups (type, name, persistentid) SELECT 2, album_artist, songartistid FROM files;",
+    };
+  char *errmsg;
+  int i;
+  int ret;
+
+  db_transaction_begin();
+
+  for (i = 0; i < (sizeof(queries) / sizeof(queries[0])); i++)
+    {
+      DPRINTF(E_DBG, L_DB, "Running query '%s'\n", queries[i]);
+
+      ret = db_exec(queries[i], &errmsg);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_DB, "Error rebuilding groups: %s\n", errmsg);
+
+	  sqlite3_free(errmsg);
+	  db_transaction_rollback();
+	  return -1;
+	}
+    }
+
+  ret = db_init_triggers(hdl);
+  if (ret < 0)
+    {
+      db_transaction_rollback();
+      return -1;
+    }
+
+  db_transaction_end();
+
+  return 0;
+}
+
+/* If a bulk scan was interrupted the group triggers are still missing */
+static void
+db_groups_check(void)
+{
+  int ret;
+
+  ret = db_get_one_int("SELECT COUNT(*) FROM sqlite_master WHERE type = 'trigger' AND name IN ('update_groups_new_file', 'update_groups_update_file');");
+  if (ret == 2)
+    return;
+
+  DPRINTF(E_LOG, L_DB, "Group triggers missing (interrupted library scan?), rebuilding groups\n");
+
+  db_groups_rebuild();
+}
+
+void
+db_hook_pre_scan(void)
+{
+  int ret;
+
+  DPRINTF(E_DBG, L_DB, "Deferring group updates until end of scan\n");
+
+  ret = db_drop_triggers(hdl);
+  if (ret < 0)
+    DPRINTF(E_LOG, L_DB, "Could not drop group triggers, groups will be updated per file\n");
+}
+
 void
 db_hook_post_scan(void)
 {
+  int ret;
+
   DPRINTF(E_DBG, L_DB, "Running post-scan DB maintenance tasks...\n");
 
+  ret = db_groups_rebuild();
+  if (ret < 0)
+    DPRINTF(E_LOG, L_DB, "Could not rebuild groups after scan, will retry on next startup\n");
+  else
+    cache_daap_invalidate(CACHE_DAAP_DEP_GROUPS, 0);
+
   db_analyze();
 
   DPRINTF(E_DBG, L_DB, "Done with post-scan DB maintenance\n");
@@ -797,6 +1030,8 @@ db_purge_all(void)
 	DPRINTF(E_DBG, L_DB, "Purged %d rows\n", sqlite3_changes(hdl));
     }
 
+  cache_dmap_item_invalidate_all();
+
   query = sqlite3_mprintf(Q_TMPL, PL_SPECIAL);
   if (!query)
     {
@@ -828,7 +1063,7 @@ db_get_one_int(char *query)
 
   DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  ret = db_statement_prepare(query, &stmt);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
@@ -840,7 +1075,7 @@ db_get_one_int(char *query)
     {
       DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));	
 
-      sqlite3_finalize(stmt);
+      db_statement_finalize(stmt);
       return -1;
     }
 
@@ -851,12 +1086,21 @@ db_get_one_int(char *query)
     ; /* EMPTY */
 #endif
 
-  sqlite3_finalize(stmt);
+  db_statement_finalize(stmt);
 
   return ret;
 }
 
 
+static void
+db_dmap_item_invalidate(uint32_t id)
+{
+  cache_dmap_item_invalidate(id);
+
+  if (db_in_transaction)
+    db_items_changed = 1;
+}
+
 /* Transactions */
 void
 db_transaction_begin(void)
@@ -873,7 +1117,10 @@ db_transaction_begin(void)
       DPRINTF(E_LOG, L_DB, "SQL error running '%s': %s\n", query, errmsg);
 
       sqlite3_free(errmsg);
+      return;
     }
+
+  db_in_transaction = 1;
 }
 
 void
@@ -892,6 +1139,12 @@ db_transaction_end(void)
 
       sqlite3_free(errmsg);
     }
+
+  if (db_items_changed)
+    cache_dmap_item_invalidate_all();
+
+  db_in_transaction = 0;
+  db_items_changed = 0;
 }
 
 void
@@ -910,6 +1163,9 @@ db_transaction_rollback(void)
 
       sqlite3_free(errmsg);
     }
+
+  db_in_transaction = 0;
+  db_items_changed = 0;
 }
 
 
@@ -1605,7 +1861,7 @@ db_query_start(struct query_params *qp)
 
   DPRINTF(E_DBG, L_DB, "Starting query '%s'\n", query);
 
-  ret = db_blocking_prepare_v2(query, -1, &qp->stmt, NULL);
+  ret = db_statement_prepare(query, &qp->stmt);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
@@ -1627,7 +1883,7 @@ db_query_end(struct query_params *qp)
 
   qp->results = -1;
 
-  sqlite3_finalize(qp->stmt);
+  db_statement_finalize(qp->stmt);
   qp->stmt = NULL;
 }
 
@@ -1719,6 +1975,82 @@ db_query_fetch_file(struct query_params *qp, struct db_media_file_info *dbmfi)
   return 0;
 }
 
+int
+db_query_fetch_file_typed(struct query_params *qp, struct db_media_file_row *dbmfr)
+{
+  struct db_media_file_value *val;
+  int ncols;
+  int i;
+  int ret;
+
+  if (!qp->stmt)
+    {
+      DPRINTF(E_LOG, L_DB, "Query not started!\n");
+      return -1;
+    }
+
+  if ((qp->type != Q_ITEMS) && (qp->type != Q_PLITEMS) && (qp->type != Q_GROUP_ITEMS))
+    {
+      DPRINTF(E_LOG, L_DB, "Not an items, playlist or group items query!\n");
+      return -1;
+    }
+
+  ret = db_blocking_step(qp->stmt);
+  if (ret == SQLITE_DONE)
+    {
+      DPRINTF(E_DBG, L_DB, "End of query results\n");
+      memset(dbmfr_val(dbmfr, id), 0, sizeof(struct db_media_file_value));
+      return 0;
+    }
+  else if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  ncols = sqlite3_column_count(qp->stmt);
+
+  if (sizeof(dbmfi_cols_map) / sizeof(dbmfi_cols_map[0]) != ncols)
+    {
+      DPRINTF(E_LOG, L_DB, "BUG: dbmfi column map out of sync with schema\n");
+      return -1;
+    }
+
+  // Every column is written, so no need to clear dbmfr beforehand. Note that
+  // the column type must be checked before fetching, since fetching as text
+  // would make sqlite convert the value.
+  for (i = 0; i < ncols; i++)
+    {
+      val = &dbmfr->val[dbmfr_idx(dbmfi_cols_map[i])];
+
+      switch (sqlite3_column_type(qp->stmt, i))
+	{
+	  case SQLITE_INTEGER:
+	    val->intval = sqlite3_column_int64(qp->stmt, i);
+	    val->str = NULL;
+	    val->len = 0;
+	    val->isint = 1;
+	    break;
+
+	  case SQLITE_NULL:
+	    val->intval = 0;
+	    val->str = NULL;
+	    val->len = 0;
+	    val->isint = 0;
+	    break;
+
+	  default:
+	    val->intval = 0;
+	    val->str = (const char *)sqlite3_column_text(qp->stmt, i);
+	    val->len = sqlite3_column_bytes(qp->stmt, i);
+	    val->isint = 0;
+	    break;
+	}
+    }
+
+  return 0;
+}
+
 int
 db_query_fetch_pl(struct query_params *qp, struct db_playlist_info *dbpli, int with_itemcount)
 {
@@ -2028,12 +2360,16 @@ void
 db_files_update_songartistid(void)
 {
   db_query_run("UPDATE files SET songartistid = daap_songalbumid(LOWER(album_artist), '');", 0, 1);
+
+  cache_dmap_item_invalidate_all();
 }
 
 void
 db_files_update_songalbumid(void)
 {
   db_query_run("UPDATE files SET songalbumid = daap_songalbumid(LOWER(album_artist), LOWER(album));", 0, 1);
+
+  cache_dmap_item_invalidate_all();
 }
 
 void
@@ -2051,18 +2387,31 @@ db_file_inc_playcount(int id)
     }
 
   db_query_run(query, 1, 0);
+
+  db_dmap_item_invalidate(id);
 #undef Q_TMPL
 }
 
 void
 db_file_ping(int id)
 {
-#define Q_TMPL "UPDATE files SET db_timestamp = %" PRIi64 ", disabled = 0 WHERE id = %d;"
+#define Q_TMPL "UPDATE files SET db_timestamp = %" PRIi64 " WHERE id = %d AND disabled = 0;"
+#define Q_TMPL_ENABLE "UPDATE files SET db_timestamp = %" PRIi64 ", disabled = 0 WHERE id = %d;"
   char *query;
+  int ret;
 
+  // Only the timestamp changes, which is not in any DAAP reply
   query = sqlite3_mprintf(Q_TMPL, (int64_t)time(NULL), id);
 
+  ret = db_query_run(query, 1, 0);
+  if ((ret < 0) || (sqlite3_changes(hdl) > 0))
+    return;
+
+  // The file was disabled, so enabling it changes the library
+  query = sqlite3_mprintf(Q_TMPL_ENABLE, (int64_t)time(NULL), id);
+
   db_query_run(query, 1, 1);
+#undef Q_TMPL_ENABLE
 #undef Q_TMPL
 }
 
@@ -2078,39 +2427,43 @@ db_file_ping_bymatch(char *path, int isdir)
   else
     query = sqlite3_mprintf(Q_TMPL_NODIR, (int64_t)time(NULL), path);
 
-  db_query_run(query, 1, 1);
+  db_query_run(query, 1, 0);
 #undef Q_TMPL_DIR
 #undef Q_TMPL_NODIR
 }
 
+void
+db_file_ping_bydirectory(int dir_id)
+{
+#define Q_TMPL "UPDATE files SET db_timestamp = %" PRIi64 " WHERE directory_id = %d;"
+  char *query;
+
+  query = sqlite3_mprintf(Q_TMPL, (int64_t)time(NULL), dir_id);
+
+  db_query_run(query, 1, 0);
+#undef Q_TMPL
+}
+
 char *
 db_file_path_byid(int id)
 {
-#define Q_TMPL "SELECT f.path FROM files f WHERE f.id = %d;"
-  char *query;
+#define Q_TMPL "SELECT f.path FROM files f WHERE f.id = ?;"
   sqlite3_stmt *stmt;
   char *res;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, id);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (id %d)\n", Q_TMPL, id);
 
-      return NULL;
-    }
-
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
-  ret = db_blocking_prepare_v2(query, strlen(query) + 1, &stmt, NULL);
+  ret = db_statement_prepare_cached(Q_TMPL, &stmt);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
 
-      sqlite3_free(query);
       return NULL;
     }
 
+  sqlite3_bind_int(stmt, 1, id);
+
   ret = db_blocking_step(stmt);
   if (ret != SQLITE_ROW)
     {
@@ -2119,8 +2472,7 @@ db_file_path_byid(int id)
       else
 	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
 
-      sqlite3_finalize(stmt);
-      sqlite3_free(query);
+      db_statement_finalize(stmt);
       return NULL;
     }
 
@@ -2133,33 +2485,19 @@ db_file_path_byid(int id)
     ; /* EMPTY */
 #endif
 
-  sqlite3_finalize(stmt);
-  sqlite3_free(query);
+  db_statement_finalize(stmt);
 
   return res;
 
 #undef Q_TMPL
 }
 
+/* Steps a query for a file id, which must be the first column */
 static int
-db_file_id_byquery(char *query)
+db_file_id_step(sqlite3_stmt *stmt)
 {
-  sqlite3_stmt *stmt;
   int ret;
 
-  if (!query)
-    return 0;
-
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
-  ret = db_blocking_prepare_v2(query, strlen(query) + 1, &stmt, NULL);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
-
-      return 0;
-    }
-
   ret = db_blocking_step(stmt);
   if (ret != SQLITE_ROW)
     {
@@ -2168,7 +2506,6 @@ db_file_id_byquery(char *query)
       else
 	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
 
-      sqlite3_finalize(stmt);
       return 0;
     }
 
@@ -2179,67 +2516,77 @@ db_file_id_byquery(char *query)
     ; /* EMPTY */
 #endif
 
-  sqlite3_finalize(stmt);
-
   return ret;
 }
 
-int
-db_file_id_bypath(char *path)
+/* Returns the file id for a query with a single text parameter */
+static int
+db_file_id_bytext(const char *query, const char *value)
 {
-#define Q_TMPL "SELECT f.id FROM files f WHERE f.path = '%q';"
-  char *query;
+  sqlite3_stmt *stmt;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, path);
-  if (!query)
+  DPRINTF(E_DBG, L_DB, "Running query '%s' ('%s')\n", query, value);
+
+  ret = db_statement_prepare_cached(query, &stmt);
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
 
       return 0;
     }
 
-  ret = db_file_id_byquery(query);
+  sqlite3_bind_text(stmt, 1, value, -1, SQLITE_STATIC);
 
-  sqlite3_free(query);
+  ret = db_file_id_step(stmt);
 
-  return ret;
+  db_statement_finalize(stmt);
 
-#undef Q_TMPL
+  return ret;
 }
 
-int
-db_file_id_bymatch(char *path)
+static int
+db_file_id_byquery(char *query)
 {
-#define Q_TMPL "SELECT f.id FROM files f WHERE f.path LIKE '%%%q';"
-  char *query;
+  sqlite3_stmt *stmt;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, path);
   if (!query)
+    return 0;
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, strlen(query) + 1, &stmt, NULL);
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
 
       return 0;
     }
 
-  ret = db_file_id_byquery(query);
+  ret = db_file_id_step(stmt);
 
-  sqlite3_free(query);
+  sqlite3_finalize(stmt);
 
   return ret;
+}
 
+int
+db_file_id_bypath(char *path)
+{
+#define Q_TMPL "SELECT f.id FROM files f WHERE f.path = ?;"
+  return db_file_id_bytext(Q_TMPL, path);
 #undef Q_TMPL
 }
 
 int
-db_file_id_byfile(char *filename)
+db_file_id_bymatch(char *path)
 {
-#define Q_TMPL "SELECT f.id FROM files f WHERE f.fname = '%q';"
+#define Q_TMPL "SELECT f.id FROM files f WHERE f.path LIKE '%%%q';"
   char *query;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, filename);
+  query = sqlite3_mprintf(Q_TMPL, path);
   if (!query)
     {
       DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
@@ -2257,26 +2604,18 @@ db_file_id_byfile(char *filename)
 }
 
 int
-db_file_id_byurl(char *url)
+db_file_id_byfile(char *filename)
 {
-#define Q_TMPL "SELECT f.id FROM files f WHERE f.url = '%q';"
-  char *query;
-  int ret;
-
-  query = sqlite3_mprintf(Q_TMPL, url);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return 0;
-    }
-
-  ret = db_file_id_byquery(query);
-
-  sqlite3_free(query);
-
-  return ret;
+#define Q_TMPL "SELECT f.id FROM files f WHERE f.fname = ?;"
+  return db_file_id_bytext(Q_TMPL, filename);
+#undef Q_TMPL
+}
 
+int
+db_file_id_byurl(char *url)
+{
+#define Q_TMPL "SELECT f.id FROM files f WHERE f.url = ?;"
+  return db_file_id_bytext(Q_TMPL, url);
 #undef Q_TMPL
 }
 
@@ -2307,32 +2646,24 @@ db_file_id_by_virtualpath_match(char *path)
 void
 db_file_stamp_bypath(char *path, time_t *stamp, int *id)
 {
-#define Q_TMPL "SELECT f.id, f.db_timestamp FROM files f WHERE f.path = '%q';"
-  char *query;
+#define Q_TMPL "SELECT f.id, f.db_timestamp FROM files f WHERE f.path = ?;"
   sqlite3_stmt *stmt;
   int ret;
 
   *stamp = 0;
 
-  query = sqlite3_mprintf(Q_TMPL, path);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  DPRINTF(E_DBG, L_DB, "Running query '%s' ('%s')\n", Q_TMPL, path);
 
-      return;
-    }
-
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
-  ret = db_blocking_prepare_v2(query, strlen(query) + 1, &stmt, NULL);
+  ret = db_statement_prepare_cached(Q_TMPL, &stmt);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
 
-      sqlite3_free(query);
       return;
     }
 
+  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+
   ret = db_blocking_step(stmt);
   if (ret != SQLITE_ROW)
     {
@@ -2341,8 +2672,7 @@ db_file_stamp_bypath(char *path, time_t *stamp, int *id)
       else
 	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
 
-      sqlite3_finalize(stmt);
-      sqlite3_free(query);
+      db_statement_finalize(stmt);
       return;
     }
 
@@ -2354,8 +2684,7 @@ db_file_stamp_bypath(char *path, time_t *stamp, int *id)
     ; /* EMPTY */
 #endif
 
-  sqlite3_finalize(stmt);
-  sqlite3_free(query);
+  db_statement_finalize(stmt);
 
 #undef Q_TMPL
 }
@@ -2600,6 +2929,9 @@ db_file_add(struct media_file_info *mfi)
 
   sqlite3_free(query);
 
+  // File ids may be reused, so make sure there are no blocks for a former file
+  cache_dmap_item_invalidate((uint32_t)sqlite3_last_insert_rowid(hdl));
+
   cache_daap_trigger();
 
   return 0;
@@ -2679,7 +3011,9 @@ db_file_update(struct media_file_info *mfi)
 
   sqlite3_free(query);
 
-  cache_daap_trigger();
+  db_dmap_item_invalidate(mfi->id);
+
+  cache_daap_invalidate_file(mfi->id);
 
   return 0;
 
@@ -2704,6 +3038,8 @@ db_file_save_seek(int id, uint32_t seek)
     }
 
   db_query_run(query, 1, 0);
+
+  db_dmap_item_invalidate(id);
 #undef Q_TMPL
 }
 
@@ -2738,6 +3074,8 @@ db_file_disable_bypath(char *path, char *strip, uint32_t cookie)
   query = sqlite3_mprintf(Q_TMPL, striplen, striplenvpath, disabled, path);
 
   db_query_run(query, 1, 1);
+
+  cache_dmap_item_invalidate_all();
 #undef Q_TMPL
 }
 
@@ -2760,6 +3098,8 @@ db_file_disable_bymatch(char *path, char *strip, uint32_t cookie)
   query = sqlite3_mprintf(Q_TMPL, striplen, striplenvpath, disabled, path);
 
   db_query_run(query, 1, 1);
+
+  cache_dmap_item_invalidate_all();
 #undef Q_TMPL
 }
 
@@ -2773,8 +3113,14 @@ db_file_enable_bycookie(uint32_t cookie, char *path)
   query = sqlite3_mprintf(Q_TMPL, path, path, (int64_t)cookie);
 
   ret = db_query_run(query, 1, 1);
+  if (ret < 0)
+    return -1;
 
-  return ((ret < 0) ? -1 : sqlite3_changes(hdl));
+  ret = sqlite3_changes(hdl);
+
+  cache_dmap_item_invalidate_all();
+
+  return ret;
 #undef Q_TMPL
 }
 
@@ -2832,6 +3178,33 @@ db_pl_count_items(int id, int streams_only)
 #undef Q_TMPL
 }
 
+/* Returns 0 if the file is not an item of the playlist, which can only be said
+ * for plain playlists, 1 if it is or might be and -1 on error
+ */
+int
+db_pl_has_file(int plid, int fileid)
+{
+#define Q_TMPL "SELECT COUNT(*) FROM playlists p WHERE p.id = %d AND (p.type <> %d OR EXISTS" \
+               " (SELECT 1 FROM playlistitems pi JOIN files f ON pi.filepath = f.path WHERE pi.playlistid = p.id AND f.id = %d));"
+  char *query;
+  int ret;
+
+  query = sqlite3_mprintf(Q_TMPL, plid, PL_PLAIN, fileid);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
+    }
+
+  ret = db_get_one_int(query);
+
+  sqlite3_free(query);
+
+  return ret;
+
+#undef Q_TMPL
+}
+
 static int
 db_smartpl_count_items(const char *smartpl_query)
 {
@@ -2868,6 +3241,29 @@ db_pl_ping(int id)
 #undef Q_TMPL
 }
 
+/* Pings the playlists of a directory that is not rescanned, including iTunes
+ * XML playlists (which have no directory id) and the http streams they list
+ */
+void
+db_pl_ping_bydirectory(int dir_id, char *path)
+{
+#define Q_TMPL_PL "UPDATE playlists SET db_timestamp = %" PRIi64 " WHERE directory_id = %d OR (directory_id = 0 AND path LIKE '%q/%%');"
+#define Q_TMPL_HTTP "UPDATE files SET db_timestamp = %" PRIi64 " WHERE directory_id = %d AND path IN" \
+                    " (SELECT pi.filepath FROM playlistitems pi JOIN playlists p ON pi.playlistid = p.id WHERE p.directory_id = %d);"
+  char *query;
+  int64_t now;
+
+  now = (int64_t)time(NULL);
+
+  query = sqlite3_mprintf(Q_TMPL_PL, now, dir_id, path);
+  db_query_run(query, 1, 0);
+
+  query = sqlite3_mprintf(Q_TMPL_HTTP, now, DIR_HTTP, dir_id);
+  db_query_run(query, 1, 0);
+#undef Q_TMPL_PL
+#undef Q_TMPL_HTTP
+}
+
 void
 db_pl_ping_bymatch(char *path, int isdir)
 {
@@ -2888,30 +3284,22 @@ db_pl_ping_bymatch(char *path, int isdir)
 static int
 db_pl_id_bypath(char *path, int *id)
 {
-#define Q_TMPL "SELECT p.id FROM playlists p WHERE p.path = '%q';"
-  char *query;
+#define Q_TMPL "SELECT p.id FROM playlists p WHERE p.path = ?;"
   sqlite3_stmt *stmt;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, path);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  DPRINTF(E_DBG, L_DB, "Running query '%s' ('%s')\n", Q_TMPL, path);
 
-      return -1;
-    }
-
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  ret = db_statement_prepare_cached(Q_TMPL, &stmt);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
 
-      sqlite3_free(query);
       return -1;
     }
 
+  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+
   ret = db_blocking_step(stmt);
   if (ret != SQLITE_ROW)
     {
@@ -2920,8 +3308,7 @@ db_pl_id_bypath(char *path, int *id)
       else
 	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));	
 
-      sqlite3_finalize(stmt);
-      sqlite3_free(query);
+      db_statement_finalize(stmt);
       return -1;
     }
 
@@ -2932,8 +3319,7 @@ db_pl_id_bypath(char *path, int *id)
     ; /* EMPTY */
 #endif
 
-  sqlite3_finalize(stmt);
-  sqlite3_free(query);
+  db_statement_finalize(stmt);
 
   return 0;
 
@@ -3235,10 +3621,15 @@ db_pl_add_item_bypath(int plid, char *path)
 {
 #define Q_TMPL "INSERT INTO playlistitems (playlistid, filepath) VALUES (%d, '%q');"
   char *query;
+  int ret;
 
   query = sqlite3_mprintf(Q_TMPL, plid, path);
 
-  return db_query_run(query, 1, 0);
+  ret = db_query_run(query, 1, 0);
+  if (ret == 0)
+    cache_daap_invalidate(CACHE_DAAP_DEP_PLAYLIST, plid);
+
+  return ret;
 #undef Q_TMPL
 }
 
@@ -3247,10 +3638,15 @@ db_pl_add_item_byid(int plid, int fileid)
 {
 #define Q_TMPL "INSERT INTO playlistitems (playlistid, filepath) VALUES (%d, (SELECT f.path FROM files f WHERE f.id = %d));"
   char *query;
+  int ret;
 
   query = sqlite3_mprintf(Q_TMPL, plid, fileid);
 
-  return db_query_run(query, 1, 0);
+  ret = db_query_run(query, 1, 0);
+  if (ret == 0)
+    cache_daap_invalidate(CACHE_DAAP_DEP_PLAYLIST, plid);
+
+  return ret;
 #undef Q_TMPL
 }
 
@@ -3268,6 +3664,8 @@ db_pl_update(struct playlist_info *pli)
 			  pli->index, pli->special_id, pli->parent_id, pli->virtual_path, pli->directory_id, pli->id);
 
   ret = db_query_run(query, 1, 0);
+  if (ret == 0)
+    cache_daap_invalidate(CACHE_DAAP_DEP_PLAYLIST, pli->id);
 
   return ret;
 #undef Q_TMPL
@@ -3278,10 +3676,13 @@ db_pl_clear_items(int id)
 {
 #define Q_TMPL "DELETE FROM playlistitems WHERE playlistid = %d;"
   char *query;
+  int ret;
 
   query = sqlite3_mprintf(Q_TMPL, id);
 
-  db_query_run(query, 1, 0);
+  ret = db_query_run(query, 1, 0);
+  if (ret == 0)
+    cache_daap_invalidate(CACHE_DAAP_DEP_PLAYLIST, id);
 #undef Q_TMPL
 }
 
@@ -3382,7 +3783,13 @@ db_pl_enable_bycookie(uint32_t cookie, char *path)
 int
 db_groups_clear(void)
 {
-  return db_query_run("DELETE FROM groups;", 0, 1);
+  int ret;
+
+  ret = db_query_run("DELETE FROM groups;", 0, 0);
+  if (ret == 0)
+    cache_daap_invalidate(CACHE_DAAP_DEP_GROUPS, 0);
+
+  return ret;
 }
 
 static enum group_type
@@ -3589,6 +3996,7 @@ db_directory_enum_fetch(struct directory_enum *de, struct directory_info *di)
   disabled = sqlite3_column_int64(de->stmt, 3);
   di->disabled = (disabled != 0);
   di->parent_id = sqlite3_column_int(de->stmt, 4);
+  di->mtime = sqlite3_column_int(de->stmt, 5);
 
   return 0;
 }
@@ -3717,6 +4125,51 @@ db_directory_addorupdate(char *virtual_path, int disabled, int parent_id)
   return id;
 }
 
+time_t
+db_directory_mtime_get(int id)
+{
+#define Q_TMPL "SELECT d.mtime FROM directories d WHERE d.id = ?;"
+  sqlite3_stmt *stmt;
+  time_t mtime;
+  int ret;
+
+  ret = db_statement_prepare_cached(Q_TMPL, &stmt);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+
+      return 0;
+    }
+
+  sqlite3_bind_int(stmt, 1, id);
+
+  mtime = 0;
+
+  ret = db_blocking_step(stmt);
+  if (ret == SQLITE_ROW)
+    mtime = (time_t)sqlite3_column_int64(stmt, 0);
+  else if (ret != SQLITE_DONE)
+    DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+
+  db_statement_finalize(stmt);
+
+  return mtime;
+
+#undef Q_TMPL
+}
+
+void
+db_directory_mtime_set(int id, time_t mtime)
+{
+#define Q_TMPL "UPDATE directories SET mtime = %" PRIi64 " WHERE id = %d;"
+  char *query;
+
+  query = sqlite3_mprintf(Q_TMPL, (int64_t)mtime, id);
+
+  db_query_run(query, 1, 0);
+#undef Q_TMPL
+}
+
 void
 db_directory_ping_bymatch(char *path)
 {
@@ -3725,7 +4178,7 @@ db_directory_ping_bymatch(char *path)
 
   query = sqlite3_mprintf(Q_TMPL_DIR, (int64_t)time(NULL), path, path);
 
-  db_query_run(query, 1, 1);
+  db_query_run(query, 1, 0);
 #undef Q_TMPL_DIR
 }
 
@@ -4517,7 +4970,7 @@ queue_enum_start(struct query_params *query_params)
 
   DPRINTF(E_DBG, L_DB, "Starting enum '%s'\n", query);
 
-  ret = db_blocking_prepare_v2(query, -1, &query_params->stmt, NULL);
+  ret = db_statement_prepare(query, &query_params->stmt);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
@@ -4679,18 +5132,16 @@ queue_fetch_byitemid(uint32_t item_id, struct db_queue_item *queue_item, int wit
   int ret;
 
   memset(&query_params, 0, sizeof(struct query_params));
-  query_params.filter = sqlite3_mprintf("id = %d", item_id);
+  query_params.filter = "id = ?";
 
   ret = queue_enum_start(&query_params);
   if (ret < 0)
-    {
-      sqlite3_free(query_params.filter);
-      return -1;
-    }
+    return -1;
+
+  sqlite3_bind_int(query_params.stmt, 1, item_id);
 
   ret = queue_enum_fetch(&query_params, queue_item, with_metadata);
   db_query_end(&query_params);
-  sqlite3_free(query_params.filter);
   return ret;
 }
 
@@ -4744,21 +5195,21 @@ db_queue_fetch_byfileid(uint32_t file_id)
 
   db_transaction_begin();
 
-  query_params.filter = sqlite3_mprintf("file_id = %d", file_id);
+  query_params.filter = "file_id = ?";
 
   ret = queue_enum_start(&query_params);
   if (ret < 0)
     {
-      sqlite3_free(query_params.filter);
       db_transaction_end();
       free_queue_item(queue_item, 0);
       DPRINTF(E_LOG, L_DB, "Error fetching queue item by file id\n");
       return NULL;
     }
 
+  sqlite3_bind_int(query_params.stmt, 1, file_id);
+
   ret = queue_enum_fetch(&query_params, queue_item, 1);
   db_query_end(&query_params);
-  sqlite3_free(query_params.filter);
   db_transaction_end();
 
   if (ret < 0)
@@ -4785,20 +5236,18 @@ queue_fetch_bypos(uint32_t pos, char shuffle, struct db_queue_item *queue_item,
 
   memset(&query_params, 0, sizeof(struct query_params));
   if (shuffle)
-    query_params.filter = sqlite3_mprintf("shuffle_pos = %d", pos);
+    query_params.filter = "shuffle_pos = ?";
   else
-    query_params.filter = sqlite3_mprintf("pos = %d", pos);
+    query_params.filter = "pos = ?";
 
   ret = queue_enum_start(&query_params);
   if (ret < 0)
-    {
-      sqlite3_free(query_params.filter);
-      return -1;
-    }
+    return -1;
+
+  sqlite3_bind_int(query_params.stmt, 1, pos);
 
   ret = queue_enum_fetch(&query_params, queue_item, with_metadata);
   db_query_end(&query_params);
-  sqlite3_free(query_params.filter);
   return ret;
 }
 
@@ -6190,6 +6639,10 @@ db_perthread_init(void)
   sqlite3_profile(hdl, db_xprofile, NULL);
 #endif
 
+  stmt_cache = calloc(1, sizeof(struct db_stmt_cache));
+  if (!stmt_cache)
+    DPRINTF(E_LOG, L_DB, "Out of memory for statement cache, will run without\n");
+
   cache_size = cfg_getint(cfg_getsec(cfg, "sqlite"), "pragma_cache_size_library");
   if (cache_size > -1)
     {
@@ -6220,14 +6673,26 @@ void
 db_perthread_deinit(void)
 {
   sqlite3_stmt *stmt;
+  int i;
 
   if (!hdl)
     return;
 
-  /* Tear down anything that's in flight */
+  /* Tear down anything that's in flight (and the statement cache) */
   while ((stmt = sqlite3_next_stmt(hdl, 0)))
     sqlite3_finalize(stmt);
 
+  if (stmt_cache)
+    {
+      DPRINTF(E_DBG, L_DB, "Statement cache: %u prepares, %u saved\n", stmt_cache->prepares, stmt_cache->prepares_saved);
+
+      for (i = 0; i < DB_STMT_CACHE_SIZE; i++)
+	free(stmt_cache->entries[i].query);
+
+      free(stmt_cache);
+      stmt_cache = NULL;
+    }
+
   sqlite3_close(hdl);
 }
 
@@ -6414,6 +6879,8 @@ db_init(void)
 	}
     }
 
+  db_groups_check();
+
   db_analyze();
 
   db_set_cfg_names();
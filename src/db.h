@@ -331,6 +331,28 @@ struct db_media_file_info {
 
 #define dbmfi_offsetof(field) offsetof(struct db_media_file_info, field)
 
+/* Typed column value, filled in by db_query_fetch_file_typed(). Integer
+ * columns are fetched as integers so they don't have to be converted to text
+ * by sqlite and back again by the caller. Strings point into the sqlite row
+ * and are only valid until the next fetch, they must not be freed.
+ */
+struct db_media_file_value {
+  int64_t intval;   /* integer value, 0 if not an integer column */
+  const char *str;  /* string value, NULL if not a string column */
+  int len;          /* length of str, excluding the terminating zero */
+  char isint;
+};
+
+/* One typed value per field of struct db_media_file_info, so that the
+ * dbmfi_offsetof() offsets of the DMAP field maps can be used for lookups
+ */
+struct db_media_file_row {
+  struct db_media_file_value val[sizeof(struct db_media_file_info) / sizeof(char *)];
+};
+
+#define dbmfr_idx(offset) ((offset) / sizeof(char *))
+#define dbmfr_val(dbmfr, field) (&(dbmfr)->val[dbmfr_idx(dbmfi_offsetof(field))])
+
 struct watch_info {
   int wd;
   char *path;
@@ -367,6 +389,7 @@ struct directory_info {
   uint32_t db_timestamp;
   uint32_t disabled;
   uint32_t parent_id;
+  uint32_t mtime;
 };
 
 struct directory_enum {
@@ -441,6 +464,9 @@ void
 free_queue_item(struct db_queue_item *queue_item, int content_only);
 
 /* Maintenance and DB hygiene */
+void
+db_hook_pre_scan(void);
+
 void
 db_hook_post_scan(void);
 
@@ -470,6 +496,9 @@ db_query_end(struct query_params *qp);
 int
 db_query_fetch_file(struct query_params *qp, struct db_media_file_info *dbmfi);
 
+int
+db_query_fetch_file_typed(struct query_params *qp, struct db_media_file_row *dbmfr);
+
 int
 db_query_fetch_pl(struct query_params *qp, struct db_playlist_info *dbpli, int with_itemcount);
 
@@ -513,6 +542,9 @@ db_file_ping(int id);
 void
 db_file_ping_bymatch(char *path, int isdir);
 
+void
+db_file_ping_bydirectory(int dir_id);
+
 char *
 db_file_path_byid(int id);
 
@@ -568,12 +600,18 @@ db_file_update_directoryid(char *path, int dir_id);
 int
 db_pl_get_count(void);
 
+int
+db_pl_has_file(int plid, int fileid);
+
 void
 db_pl_ping(int id);
 
 void
 db_pl_ping_bymatch(char *path, int isdir);
 
+void
+db_pl_ping_bydirectory(int dir_id, char *path);
+
 struct playlist_info *
 db_pl_fetch_bypath(char *path);
 
@@ -640,6 +678,12 @@ db_directory_addorupdate(char *virtual_path, int disabled, int parent_id);
 void
 db_directory_ping_bymatch(char *path);
 
+time_t
+db_directory_mtime_get(int id);
+
+void
+db_directory_mtime_set(int id, time_t mtime);
+
 void
 db_directory_disable_bymatch(char *path, char *strip, uint32_t cookie);
 
@@ -155,7 +155,8 @@
   "   virtual_path        VARCHAR(4096) NOT NULL,"		\
   "   db_timestamp        INTEGER DEFAULT 0,"			\
   "   disabled            INTEGER DEFAULT 0,"			\
-  "   parent_id           INTEGER DEFAULT 0"			\
+  "   parent_id           INTEGER DEFAULT 0,"			\
+  "   mtime               INTEGER DEFAULT 0"			\
   ");"
 
 #define T_QUEUE								\
@@ -185,14 +186,14 @@
   ");"
 
 #define TRG_GROUPS_INSERT_FILES						\
-  "CREATE TRIGGER update_groups_new_file AFTER INSERT ON files FOR EACH ROW" \
+  "CREATE TRIGGER IF NOT EXISTS update_groups_new_file AFTER INSERT ON files FOR EACH ROW" \
   " BEGIN"								\
   "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (1, NEW.album, NEW.songalbumid);" \
   "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (2, NEW.album_artist, NEW.songartistid);" \
   " END;"
 
 #define TRG_GROUPS_UPDATE_FILES						\
-  "CREATE TRIGGER update_groups_update_file AFTER UPDATE OF songalbumid ON files FOR EACH ROW" \
+  "CREATE TRIGGER IF NOT EXISTS update_groups_update_file AFTER UPDATE OF songalbumid ON files FOR EACH ROW" \
   " BEGIN"								\
   "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (1, NEW.album, NEW.songalbumid);" \
   "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (2, NEW.album_artist, NEW.songartistid);" \
@@ -268,9 +269,6 @@ static const struct db_init_query db_init_table_queries[] =
     { T_DIRECTORIES, "create table directories" },
     { T_QUEUE,     "create table queue" },
 
-    { TRG_GROUPS_INSERT_FILES,    "create trigger update_groups_new_file" },
-    { TRG_GROUPS_UPDATE_FILES,    "create trigger update_groups_update_file" },
-
     { Q_PL1,       "create default playlist" },
     { Q_PL2,       "create default smart playlist 'Music'" },
     { Q_PL3,       "create default smart playlist 'Movies'" },
@@ -285,6 +283,20 @@ static const struct db_init_query db_init_table_queries[] =
   };
 
 
+/* The group triggers are dropped during bulk scans, see db_hook_pre_scan() */
+static const struct db_init_query db_init_trigger_queries[] =
+  {
+    { TRG_GROUPS_INSERT_FILES,    "create trigger update_groups_new_file" },
+    { TRG_GROUPS_UPDATE_FILES,    "create trigger update_groups_update_file" },
+  };
+
+static const struct db_init_query db_drop_trigger_queries[] =
+  {
+    { "DROP TRIGGER IF EXISTS update_groups_new_file;",    "drop trigger update_groups_new_file" },
+    { "DROP TRIGGER IF EXISTS update_groups_update_file;", "drop trigger update_groups_update_file" },
+  };
+
+
 /* Indices must be prefixed with idx_ for db_drop_indices() to id them */
 
 #define I_RESCAN				\
@@ -423,6 +435,42 @@ db_init_indices(sqlite3 *hdl)
   return 0;
 }
 
+static int
+db_init_run(sqlite3 *hdl, const struct db_init_query *queries, int nqueries)
+{
+  char *errmsg;
+  int i;
+  int ret;
+
+  for (i = 0; i < nqueries; i++)
+    {
+      DPRINTF(E_DBG, L_DB, "DB init query: %s\n", queries[i].desc);
+
+      ret = sqlite3_exec(hdl, queries[i].query, NULL, NULL, &errmsg);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_DB, "DB init error: %s\n", errmsg);
+
+	  sqlite3_free(errmsg);
+	  return -1;
+	}
+    }
+
+  return 0;
+}
+
+int
+db_init_triggers(sqlite3 *hdl)
+{
+  return db_init_run(hdl, db_init_trigger_queries, sizeof(db_init_trigger_queries) / sizeof(db_init_trigger_queries[0]));
+}
+
+int
+db_drop_triggers(sqlite3 *hdl)
+{
+  return db_init_run(hdl, db_drop_trigger_queries, sizeof(db_drop_trigger_queries) / sizeof(db_drop_trigger_queries[0]));
+}
+
 int
 db_init_tables(sqlite3 *hdl)
 {
@@ -469,6 +517,10 @@ db_init_tables(sqlite3 *hdl)
       return -1;
     }
 
+  ret = db_init_triggers(hdl);
+  if (ret < 0)
+    return -1;
+
   ret = db_init_indices(hdl);
 
   return ret;
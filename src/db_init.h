@@ -26,11 +26,17 @@
  * is a major upgrade. In other words minor version upgrades permit downgrading
  * forked-daapd after the database was upgraded. */
 #define SCHEMA_VERSION_MAJOR 19
-#define SCHEMA_VERSION_MINOR 02
+#define SCHEMA_VERSION_MINOR 03
 
 int
 db_init_indices(sqlite3 *hdl);
 
+int
+db_init_triggers(sqlite3 *hdl);
+
+int
+db_drop_triggers(sqlite3 *hdl);
+
 int
 db_init_tables(sqlite3 *hdl);
 
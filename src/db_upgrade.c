@@ -1529,6 +1529,28 @@ static const struct db_upgrade_query db_upgrade_v1902_queries[] =
     { U_V1902_SCVER_MINOR,    "set schema_version_minor to 02" },
   };
 
+
+/* Upgrade from schema v19.02 to v19.03 */
+/* Add mtime column to directories table, used to skip unchanged directories
+ * when rescanning on startup
+ */
+
+#define U_V1903_ALTER_DIR_ADD_MTIME \
+  "ALTER TABLE directories ADD COLUMN mtime INTEGER DEFAULT 0;"
+
+#define U_V1903_SCVER_MAJOR			\
+  "UPDATE admin SET value = '19' WHERE key = 'schema_version_major';"
+#define U_V1903_SCVER_MINOR			\
+  "UPDATE admin SET value = '03' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_v1903_queries[] =
+  {
+    { U_V1903_ALTER_DIR_ADD_MTIME,    "alter table directories add column mtime" },
+
+    { U_V1903_SCVER_MAJOR,    "set schema_version_major to 19" },
+    { U_V1903_SCVER_MINOR,    "set schema_version_minor to 03" },
+  };
+
 int
 db_upgrade(sqlite3 *hdl, int db_ver)
 {
@@ -1651,6 +1673,13 @@ db_upgrade(sqlite3 *hdl, int db_ver)
       if (ret < 0)
 	return -1;
 
+      /* FALLTHROUGH */
+
+    case 1902:
+      ret = db_generic_upgrade(hdl, db_upgrade_v1903_queries, sizeof(db_upgrade_v1903_queries) / sizeof(db_upgrade_v1903_queries[0]));
+      if (ret < 0)
+	return -1;
+
       break;
 
     default:
@@ -147,7 +147,7 @@ dmap_add_char(struct evbuffer *evbuf, const char *tag, char val)
 }
 
 void
-dmap_add_literal(struct evbuffer *evbuf, const char *tag, char *str, int len)
+dmap_add_literal(struct evbuffer *evbuf, const char *tag, const char *str, int len)
 {
   char buf[4];
 
@@ -383,14 +383,159 @@ dmap_send_error(struct evhttp_request *req, const char *container, const char *e
 }
 
 
+static void
+dmap_add_file_field(struct evbuffer *evbuf, const struct dmap_field *df, const struct db_media_file_value *val)
+{
+  union {
+    int32_t v_i32;
+    uint32_t v_u32;
+    int64_t v_i64;
+    uint64_t v_u64;
+  } num;
+  int64_t intval;
+  int ret;
+
+  if (df->type == DMAP_TYPE_STRING)
+    {
+      if (val->str && (val->len > 0))
+	dmap_add_literal(evbuf, df->tag, val->str, val->len);
+      return;
+    }
+
+  /* Columns sqlite has as text go through the same parsers as dmap_add_field();
+   * integer columns get the same range checks, so values that don't fit the
+   * DMAP type are dropped instead of wrapped */
+  num.v_u64 = 0;
+
+  switch (df->type)
+    {
+      case DMAP_TYPE_DATE:
+      case DMAP_TYPE_UBYTE:
+      case DMAP_TYPE_USHORT:
+      case DMAP_TYPE_UINT:
+	if (val->isint)
+	  {
+	    intval = val->intval;
+	    if ((intval >= 0) && (intval <= UINT32_MAX))
+	      num.v_u32 = intval;
+	  }
+	else if (val->str)
+	  {
+	    ret = safe_atou32(val->str, &num.v_u32);
+	    if (ret < 0)
+	      num.v_u32 = 0;
+	  }
+	break;
+
+      case DMAP_TYPE_BYTE:
+      case DMAP_TYPE_SHORT:
+      case DMAP_TYPE_INT:
+	if (val->isint)
+	  {
+	    intval = val->intval;
+	    if ((intval >= INT32_MIN) && (intval <= INT32_MAX))
+	      num.v_i32 = intval;
+	  }
+	else if (val->str)
+	  {
+	    ret = safe_atoi32(val->str, &num.v_i32);
+	    if (ret < 0)
+	      num.v_i32 = 0;
+	  }
+	break;
+
+      case DMAP_TYPE_ULONG:
+	if (val->isint)
+	  num.v_u64 = val->intval;
+	else if (val->str)
+	  {
+	    ret = safe_atou64(val->str, &num.v_u64);
+	    if (ret < 0)
+	      num.v_u64 = 0;
+	  }
+	break;
+
+      case DMAP_TYPE_LONG:
+	if (val->isint)
+	  num.v_i64 = val->intval;
+	else if (val->str)
+	  {
+	    ret = safe_atoi64(val->str, &num.v_i64);
+	    if (ret < 0)
+	      num.v_i64 = 0;
+	  }
+	break;
+
+      /* DMAP_TYPE_VERSION & DMAP_TYPE_LIST not handled here */
+      default:
+	DPRINTF(E_LOG, L_DAAP, "Unsupported DMAP type %d for DMAP field %s\n", df->type, df->desc);
+	return;
+    }
+
+  switch (df->type)
+    {
+      case DMAP_TYPE_UBYTE:
+	if (num.v_u32)
+	  dmap_add_char(evbuf, df->tag, num.v_u32);
+	break;
+
+      case DMAP_TYPE_BYTE:
+	if (num.v_i32)
+	  dmap_add_char(evbuf, df->tag, num.v_i32);
+	break;
+
+      case DMAP_TYPE_USHORT:
+	if (num.v_u32)
+	  dmap_add_short(evbuf, df->tag, num.v_u32);
+	break;
+
+      case DMAP_TYPE_SHORT:
+	if (num.v_i32)
+	  dmap_add_short(evbuf, df->tag, num.v_i32);
+	break;
+
+      case DMAP_TYPE_DATE:
+      case DMAP_TYPE_UINT:
+	if (num.v_u32)
+	  dmap_add_int(evbuf, df->tag, num.v_u32);
+	break;
+
+      case DMAP_TYPE_INT:
+	if (num.v_i32)
+	  dmap_add_int(evbuf, df->tag, num.v_i32);
+	break;
+
+      case DMAP_TYPE_ULONG:
+	if (num.v_u64)
+	  dmap_add_long(evbuf, df->tag, num.v_u64);
+	break;
+
+      case DMAP_TYPE_LONG:
+	if (num.v_i64)
+	  dmap_add_long(evbuf, df->tag, num.v_i64);
+	break;
+
+      default:
+	return;
+    }
+}
+
+static void
+dmap_add_sort_tag(struct evbuffer *evbuf, const char *tag, const struct db_media_file_value *val)
+{
+  dmap_add_literal(evbuf, tag, val->str, val->str ? val->len : 0);
+}
+
 int
-dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_info *dbmfi, const struct dmap_field **meta, int nmeta, int sort_tags, int force_wav)
+dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_row *dbmfr, const struct dmap_field **meta, int nmeta, int sort_tags, int force_wav)
 {
   const struct dmap_field_map *dfm;
   const struct dmap_field *df;
-  char **strval;
-  char *ptr;
-  int32_t val;
+  const struct db_media_file_value *val;
+  struct db_media_file_value wav;
+  char codectype[4];
+  int64_t samplerate;
+  int32_t kind;
   int want_mikd;
   int want_asdk;
   int want_ased;
@@ -456,44 +601,45 @@ dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, stru
 
       DPRINTF(E_SPAM, L_DAAP, "Investigating %s\n", df->desc);
 
-      strval = (char **) ((char *)dbmfi + dfm->mfi_offset);
+      val = &dbmfr->val[dbmfr_idx(dfm->mfi_offset)];
 
-      if (!(*strval) || (**strval == '\0'))
+      if (!val->isint && (!val->str || (val->len == 0)))
 	continue;
 
       /* Here's one exception ... codectype (ascd) is actually an integer */
       if (dfm == &dfm_dmap_ascd)
 	{
-	  dmap_add_literal(song, df->tag, *strval, 4);
+	  memset(codectype, 0, sizeof(codectype));
+	  if (val->str)
+	    memcpy(codectype, val->str, (val->len < sizeof(codectype)) ? val->len : sizeof(codectype));
+
+	  dmap_add_literal(song, df->tag, codectype, sizeof(codectype));
 	  continue;
 	}
 
-      val = 0;
-
       if (force_wav)
 	{
+	  memset(&wav, 0, sizeof(struct db_media_file_value));
+
 	  switch (dfm->mfi_offset)
 	    {
 	      case dbmfi_offsetof(type):
-		ptr = "wav";
-		strval = &ptr;
+		wav.str = "wav";
+		wav.len = strlen(wav.str);
+		val = &wav;
 		break;
 
 	      case dbmfi_offsetof(bitrate):
-		val = 0;
-		ret = safe_atoi32(dbmfi->samplerate, &val);
-		if ((ret < 0) || (val == 0))
-		  val = 1411;
-		else
-		  val = (val * 8) / 250;
-
-		ptr = NULL;
-		strval = &ptr;
+		samplerate = dbmfr_val(dbmfr, samplerate)->intval;
+		wav.intval = (samplerate == 0) ? 1411 : (samplerate * 8) / 250;
+		wav.isint = 1;
+		val = &wav;
 		break;
 
 	      case dbmfi_offsetof(description):
-		ptr = "wav audio file";
-		strval = &ptr;
+		wav.str = "wav audio file";
+		wav.len = strlen(wav.str);
+		val = &wav;
 		break;
 
 	      default:
@@ -501,9 +647,9 @@ dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, stru
 	    }
 	}
 
-      dmap_add_field(song, df, *strval, val);
+      dmap_add_file_field(song, df, val);
 
-      DPRINTF(E_SPAM, L_DAAP, "Done with meta tag %s (%s)\n", df->desc, *strval);
+      DPRINTF(E_SPAM, L_DAAP, "Done with meta tag %s\n", df->desc);
     }
 
   /* Required for artwork in iTunes, set songartworkcount (asac) = 1 */
@@ -515,38 +661,36 @@ dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, stru
 
   if (sort_tags)
     {
-      dmap_add_string(song, "assn", dbmfi->title_sort);
-      dmap_add_string(song, "assa", dbmfi->artist_sort);
-      dmap_add_string(song, "assu", dbmfi->album_sort);
-      dmap_add_string(song, "assl", dbmfi->album_artist_sort);
+      dmap_add_sort_tag(song, "assn", dbmfr_val(dbmfr, title_sort));
+      dmap_add_sort_tag(song, "assa", dbmfr_val(dbmfr, artist_sort));
+      dmap_add_sort_tag(song, "assu", dbmfr_val(dbmfr, album_sort));
+      dmap_add_sort_tag(song, "assl", dbmfr_val(dbmfr, album_artist_sort));
 
-      if (dbmfi->composer_sort)
-	dmap_add_string(song, "assc", dbmfi->composer_sort);
+      if (dbmfr_val(dbmfr, composer_sort)->str)
+	dmap_add_sort_tag(song, "assc", dbmfr_val(dbmfr, composer_sort));
     }
 
-  val = 0;
+  kind = 0;
   if (want_mikd)
-    val += 9;
+    kind += 9;
   if (want_asdk)
-    val += 9;
+    kind += 9;
 
-  dmap_add_container(songlist, "mlit", evbuffer_get_length(song) + val);
+  dmap_add_container(songlist, "mlit", evbuffer_get_length(song) + kind);
 
   /* Prepend mikd & asdk if needed */
   if (want_mikd)
     {
       /* dmap.itemkind must come first */
-      ret = safe_atoi32(dbmfi->item_kind, &val);
-      if (ret < 0)
-	val = 2; /* music by default */
-      dmap_add_char(songlist, "mikd", val);
+      val = dbmfr_val(dbmfr, item_kind);
+      kind = val->isint ? val->intval : 2; /* music by default */
+      dmap_add_char(songlist, "mikd", kind);
     }
   if (want_asdk)
     {
-      ret = safe_atoi32(dbmfi->data_kind, &val);
-      if (ret < 0)
-	val = 0;
-      dmap_add_char(songlist, "asdk", val);
+      val = dbmfr_val(dbmfr, data_kind);
+      kind = val->isint ? val->intval : 0;
+      dmap_add_char(songlist, "asdk", kind);
     }
 
   ret = evbuffer_add_buffer(songlist, song);
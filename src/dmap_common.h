@@ -65,7 +65,7 @@ void
 dmap_add_char(struct evbuffer *evbuf, const char *tag, char val);
 
 void
-dmap_add_literal(struct evbuffer *evbuf, const char *tag, char *str, int len);
+dmap_add_literal(struct evbuffer *evbuf, const char *tag, const char *str, int len);
 
 void
 dmap_add_raw_uint32(struct evbuffer *evbuf, uint32_t val);
@@ -82,7 +82,7 @@ dmap_send_error(struct evhttp_request *req, const char *container, const char *e
 
 
 int
-dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_info *dbmfi, const struct dmap_field **meta, int nmeta, int sort_tags, int force_wav);
+dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_row *dbmfr, const struct dmap_field **meta, int nmeta, int sort_tags, int force_wav);
 
 int
 dmap_encode_queue_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_queue_item *queue_item);
@@ -62,6 +62,7 @@
 #include "cache.h"
 #include "artwork.h"
 #include "commands.h"
+#include "listener.h"
 
 #ifdef LASTFM
 # include "lastfm.h"
@@ -75,6 +76,7 @@
 #define F_SCAN_RESCAN  (1 << 1)
 #define F_SCAN_FAST    (1 << 2)
 #define F_SCAN_MOVED   (1 << 3)
+#define F_SCAN_MTIME   (1 << 4) // Skip directories with unchanged mtime
 
 enum file_type {
   FILE_UNKNOWN = 0,
@@ -113,6 +115,39 @@ static struct deferred_pl *playlists;
 static struct stacked_dir *dirstack;
 static struct commands_base *cmdbase;
 
+/* Metadata extraction during bulk scans, see scan_pool_start() */
+#define SCAN_WORKERS_MAX 16
+#define SCAN_JOBS_MAX    64
+
+struct scan_job {
+  char *path;
+  time_t mtime;
+  off_t size;
+  int type;
+  int dir_id;
+  int id;
+
+  struct media_file_info *mfi; // Result, NULL if no metadata
+  struct scan_job *next;
+};
+
+struct scan_pool {
+  pthread_t *tids;
+  int nworkers;
+  int exit;
+
+  pthread_mutex_t lck;
+  pthread_cond_t job_cond;
+  pthread_cond_t done_cond;
+
+  struct scan_job *jobs;      // Queued, oldest first
+  struct scan_job *jobs_tail;
+  struct scan_job *done;      // Finished, not written yet
+  int pending;                // Queued, in progress or not written yet
+};
+
+static struct scan_pool scan_pool;
+
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
 struct deferred_file
 {
@@ -129,6 +164,20 @@ static struct event *deferred_inoev;
 
 /* Count of files scanned during a bulk scan */
 static int counter;
+static int dirs_skipped;
+
+/* The directory being read by process_directory(), and whether any of its files
+ * could not be added to the db. If so we don't record its mtime, so the next
+ * scan reads it again instead of skipping it.
+ */
+static int scan_dir_id;
+static int scan_dir_failed;
+
+/* Bulk scans commit the transaction in batches, see batch_check() */
+static int batch_files;
+static int batch_msec;
+static int batch_counter;
+static struct timespec batch_start;
 
 /* Flag for scan in progress */
 static int scanning;
@@ -140,6 +189,46 @@ static int scanning;
  * when we get the IN_CREATE and then ignore the IN_ATTRIB for these files.
  */
 #define INCOMINGFILES_BUFFER_SIZE 50
+
+/* Inotify events are collected until there has been a quiet period of
+ * inotify_quiet_msec (or at most INOTIFY_DELAY_MAX_MSEC), so that the many
+ * events we get when e.g. an album is copied or retagged are merged per path
+ * and processed as one batch.
+ */
+#define INOTIFY_HASH_SIZE        1024
+#define INOTIFY_DELAY_MAX_MSEC   5000
+#define INOTIFY_PENDING_MAX      10000
+
+struct inotify_pending {
+  struct watch_info wi;
+  struct inotify_event ie; // Without name, mask is merged from all events
+  char *path;
+  int is_dir;
+  uint32_t hash;
+  int gen;
+
+  struct inotify_pending *next;
+  struct inotify_pending *hash_next;
+};
+
+struct inotify_batch {
+  struct inotify_pending *head;
+  struct inotify_pending *tail;
+  struct inotify_pending *hash[INOTIFY_HASH_SIZE];
+  int count;
+  int merged;
+
+  // Events may only be merged into pending events of the same generation. A
+  // new generation starts after each directory or move event, since their
+  // order matters.
+  int gen;
+
+  struct timespec first;
+};
+
+static struct inotify_batch inobatch;
+static struct event *inobatchev;
+static struct timeval inotify_quiet;
 static int incomingfiles_idx;
 static uint32_t incomingfiles_buffer[INCOMINGFILES_BUFFER_SIZE];
 
@@ -587,13 +676,15 @@ fixup_tags(struct media_file_info *mfi)
 }
 
 
-void
-filescanner_process_media(char *path, time_t mtime, off_t size, int type, struct media_file_info *external_mfi, int dir_id)
+/* Fills in the metadata of a media file, doesn't touch the database, so this
+ * may run in a scan worker thread.
+ *
+ * @return 0 on success, -1 if no metadata could be extracted
+ */
+static int
+process_media_metadata(struct media_file_info *mfi, char *path, time_t mtime, off_t size, int type, int dir_id)
 {
-  struct media_file_info *mfi;
   char *filename;
-  time_t stamp;
-  int id;
   char virtual_path[PATH_MAX];
   int ret;
 
@@ -603,43 +694,18 @@ filescanner_process_media(char *path, time_t mtime, off_t size, int type, struct
   else
     filename++;
 
-  db_file_stamp_bypath(path, &stamp, &id);
-
-  if (stamp && (stamp >= mtime))
-    {
-      db_file_ping(id);
-      return;
-    }
-
-  if (!external_mfi)
-    {
-      mfi = (struct media_file_info*)malloc(sizeof(struct media_file_info));
-      if (!mfi)
-	{
-	  DPRINTF(E_LOG, L_SCAN, "Out of memory for mfi\n");
-	  return;
-	}
-
-      memset(mfi, 0, sizeof(struct media_file_info));
-    }
-  else
-    mfi = external_mfi;
-
-  if (stamp)
-    mfi->id = db_file_id_bypath(path);
-
   mfi->fname = strdup(filename);
   if (!mfi->fname)
     {
       DPRINTF(E_LOG, L_SCAN, "Out of memory for fname\n");
-      goto out;
+      return -1;
     }
 
   mfi->path = strdup(path);
   if (!mfi->path)
     {
       DPRINTF(E_LOG, L_SCAN, "Out of memory for path\n");
-      goto out;
+      return -1;
     }
 
   mfi->time_modified = mtime;
@@ -692,7 +758,7 @@ filescanner_process_media(char *path, time_t mtime, off_t size, int type, struct
   if (ret < 0)
     {
       DPRINTF(E_INFO, L_SCAN, "Could not extract metadata for '%s'\n", path);
-      goto out;
+      return -1;
     }
 
   if (!mfi->item_kind)
@@ -722,14 +788,403 @@ filescanner_process_media(char *path, time_t mtime, off_t size, int type, struct
 
   mfi->directory_id = dir_id;
 
+  return 0;
+}
+
+int
+filescanner_process_media(char *path, time_t mtime, off_t size, int type, struct media_file_info *external_mfi, int dir_id)
+{
+  struct media_file_info *mfi;
+  time_t stamp;
+  int id;
+  int ret;
+
+  db_file_stamp_bypath(path, &stamp, &id);
+
+  if (stamp && (stamp >= mtime))
+    {
+      db_file_ping(id);
+      return 0;
+    }
+
+  if (!external_mfi)
+    {
+      mfi = (struct media_file_info*)malloc(sizeof(struct media_file_info));
+      if (!mfi)
+	{
+	  DPRINTF(E_LOG, L_SCAN, "Out of memory for mfi\n");
+	  return -1;
+	}
+
+      memset(mfi, 0, sizeof(struct media_file_info));
+    }
+  else
+    mfi = external_mfi;
+
+  if (stamp)
+    mfi->id = db_file_id_bypath(path);
+
+  ret = process_media_metadata(mfi, path, mtime, size, type, dir_id);
+  if (ret < 0)
+    goto out;
+
   if (mfi->id == 0)
-    db_file_add(mfi);
+    ret = db_file_add(mfi);
   else
-    db_file_update(mfi);
+    ret = db_file_update(mfi);
 
  out:
   if (!external_mfi)
     free_mfi(mfi, 0);
+
+  return ret;
+}
+
+/* Thread: scan
+ * Called when a file of the directory could not be added to the db
+ */
+static void
+scan_dir_file_failed(int dir_id)
+{
+  if (dir_id == scan_dir_id)
+    scan_dir_failed = 1;
+  else if (dir_id > 0)
+    db_directory_mtime_set(dir_id, 0);
+}
+
+
+/* ---------------------------- Scan worker pool ---------------------------- */
+
+/* During bulk scans the metadata of media files is extracted by a pool of
+ * worker threads, while the scan thread walks the directories and writes the
+ * results to the database, so there is still only one database writer.
+ */
+
+/* Thread: scan worker */
+static void *
+scan_worker(void *arg)
+{
+  struct scan_job *job;
+  int ret;
+#if defined(__linux__)
+  struct sched_param param;
+
+  // Same priority as the scan thread, see filescanner()
+  memset(&param, 0, sizeof(struct sched_param));
+  pthread_setschedparam(pthread_self(), SCHED_BATCH, &param);
+#endif
+
+  for (;;)
+    {
+      pthread_mutex_lock(&scan_pool.lck);
+
+      while (!scan_pool.jobs && !scan_pool.exit)
+	pthread_cond_wait(&scan_pool.job_cond, &scan_pool.lck);
+
+      job = scan_pool.jobs;
+      if (!job)
+	{
+	  pthread_mutex_unlock(&scan_pool.lck);
+	  break;
+	}
+
+      scan_pool.jobs = job->next;
+      if (!scan_pool.jobs)
+	scan_pool.jobs_tail = NULL;
+
+      pthread_mutex_unlock(&scan_pool.lck);
+
+      job->mfi = (struct media_file_info *)malloc(sizeof(struct media_file_info));
+      if (job->mfi)
+	{
+	  memset(job->mfi, 0, sizeof(struct media_file_info));
+	  job->mfi->id = job->id;
+
+	  ret = process_media_metadata(job->mfi, job->path, job->mtime, job->size, job->type, job->dir_id);
+	  if (ret < 0)
+	    {
+	      free_mfi(job->mfi, 0);
+	      job->mfi = NULL;
+	    }
+	}
+      else
+	DPRINTF(E_LOG, L_SCAN, "Out of memory for mfi\n");
+
+      pthread_mutex_lock(&scan_pool.lck);
+
+      job->next = scan_pool.done;
+      scan_pool.done = job;
+
+      pthread_cond_signal(&scan_pool.done_cond);
+      pthread_mutex_unlock(&scan_pool.lck);
+    }
+
+  pthread_exit(NULL);
+}
+
+/* Thread: scan */
+static void
+scan_pool_start(void)
+{
+  long nworkers;
+  int ret;
+  int i;
+
+  memset(&scan_pool, 0, sizeof(struct scan_pool));
+
+  nworkers = cfg_getint(cfg_getsec(cfg, "library"), "filescan_workers");
+  if (nworkers == 0)
+    nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nworkers > SCAN_WORKERS_MAX)
+    nworkers = SCAN_WORKERS_MAX;
+
+  // With just one worker we might as well do the work in the scan thread
+  if (nworkers <= 1)
+    return;
+
+  scan_pool.tids = calloc(nworkers, sizeof(pthread_t));
+  if (!scan_pool.tids)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Out of memory for scan workers, scanning without\n");
+      return;
+    }
+
+  pthread_mutex_init(&scan_pool.lck, NULL);
+  pthread_cond_init(&scan_pool.job_cond, NULL);
+  pthread_cond_init(&scan_pool.done_cond, NULL);
+
+  for (i = 0; i < nworkers; i++)
+    {
+      ret = pthread_create(&scan_pool.tids[i], NULL, scan_worker, NULL);
+      if (ret != 0)
+	{
+	  DPRINTF(E_LOG, L_SCAN, "Could not spawn scan worker: %s\n", strerror(ret));
+	  break;
+	}
+
+#if defined(HAVE_PTHREAD_SETNAME_NP)
+      pthread_setname_np(scan_pool.tids[i], "scan_worker");
+#elif defined(HAVE_PTHREAD_SET_NAME_NP)
+      pthread_set_name_np(scan_pool.tids[i], "scan_worker");
+#endif
+    }
+
+  // Without workers the jobs would never be run, so scan in the scan thread
+  if (i == 0)
+    {
+      DPRINTF(E_LOG, L_SCAN, "No scan workers, scanning without\n");
+
+      pthread_cond_destroy(&scan_pool.done_cond);
+      pthread_cond_destroy(&scan_pool.job_cond);
+      pthread_mutex_destroy(&scan_pool.lck);
+
+      free(scan_pool.tids);
+      scan_pool.tids = NULL;
+      return;
+    }
+
+  scan_pool.nworkers = i;
+
+  DPRINTF(E_INFO, L_SCAN, "Scanning with %d metadata workers\n", scan_pool.nworkers);
+}
+
+/* Thread: scan */
+static void
+scan_pool_stop(void)
+{
+  struct scan_job *job;
+  int i;
+
+  if (!scan_pool.tids)
+    return;
+
+  pthread_mutex_lock(&scan_pool.lck);
+  scan_pool.exit = 1;
+  pthread_cond_broadcast(&scan_pool.job_cond);
+  pthread_mutex_unlock(&scan_pool.lck);
+
+  for (i = 0; i < scan_pool.nworkers; i++)
+    pthread_join(scan_pool.tids[i], NULL);
+
+  // Normally written already by scan_pool_write(1)
+  for (job = scan_pool.done; job; job = scan_pool.done)
+    {
+      scan_pool.done = job->next;
+
+      if (job->mfi)
+	free_mfi(job->mfi, 0);
+      free(job->path);
+      free(job);
+    }
+
+  pthread_cond_destroy(&scan_pool.done_cond);
+  pthread_cond_destroy(&scan_pool.job_cond);
+  pthread_mutex_destroy(&scan_pool.lck);
+
+  free(scan_pool.tids);
+
+  memset(&scan_pool, 0, sizeof(struct scan_pool));
+}
+
+/* Thread: scan
+ * Writes the results of the finished jobs to the database. If all is set it
+ * waits for all queued jobs to finish, otherwise only while the queue is full.
+ */
+static void
+scan_pool_write(int all)
+{
+  struct scan_job *done;
+  struct scan_job *job;
+  int n;
+  int ret;
+
+  if (!scan_pool.tids)
+    return;
+
+  for (;;)
+    {
+      pthread_mutex_lock(&scan_pool.lck);
+
+      while (!scan_pool.done && ((all && (scan_pool.pending > 0)) || (scan_pool.pending >= SCAN_JOBS_MAX)))
+	pthread_cond_wait(&scan_pool.done_cond, &scan_pool.lck);
+
+      done = scan_pool.done;
+      scan_pool.done = NULL;
+
+      pthread_mutex_unlock(&scan_pool.lck);
+
+      if (!done)
+	return;
+
+      for (n = 0; (job = done); n++)
+	{
+	  done = job->next;
+
+	  ret = -1;
+	  if (job->mfi)
+	    {
+	      if (job->mfi->id == 0)
+		ret = db_file_add(job->mfi);
+	      else
+		ret = db_file_update(job->mfi);
+
+	      free_mfi(job->mfi, 0);
+	    }
+
+	  // The directory may have been read already, see scan_dir_file_failed()
+	  if (ret < 0)
+	    scan_dir_file_failed(job->dir_id);
+
+	  free(job->path);
+	  free(job);
+	}
+
+      pthread_mutex_lock(&scan_pool.lck);
+      scan_pool.pending -= n;
+      pthread_mutex_unlock(&scan_pool.lck);
+    }
+}
+
+/* Thread: scan
+ * Like filescanner_process_media(), but hands the metadata extraction to the
+ * worker pool. Falls back to doing it all in the scan thread if there is no pool.
+ */
+static int
+scan_pool_process_media(char *path, time_t mtime, off_t size, int type, int dir_id)
+{
+  struct scan_job *job;
+  time_t stamp;
+  int id;
+
+  if (!scan_pool.tids)
+    return filescanner_process_media(path, mtime, size, type, NULL, dir_id);
+
+  id = 0;
+  db_file_stamp_bypath(path, &stamp, &id);
+
+  if (stamp && (stamp >= mtime))
+    {
+      db_file_ping(id);
+      return 0;
+    }
+
+  job = (struct scan_job *)malloc(sizeof(struct scan_job));
+  if (!job)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Out of memory for scan job\n");
+      return -1;
+    }
+
+  memset(job, 0, sizeof(struct scan_job));
+
+  job->path = strdup(path);
+  if (!job->path)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Out of memory for scan job\n");
+      free(job);
+      return -1;
+    }
+
+  job->mtime = mtime;
+  job->size = size;
+  job->type = type;
+  job->dir_id = dir_id;
+  job->id = stamp ? id : 0;
+
+  pthread_mutex_lock(&scan_pool.lck);
+
+  if (scan_pool.jobs_tail)
+    scan_pool.jobs_tail->next = job;
+  else
+    scan_pool.jobs = job;
+  scan_pool.jobs_tail = job;
+
+  scan_pool.pending++;
+
+  pthread_cond_signal(&scan_pool.job_cond);
+  pthread_mutex_unlock(&scan_pool.lck);
+
+  // Write what the workers have finished, and wait if they are falling behind
+  scan_pool_write(0);
+
+  return 0;
+}
+
+
+/* Thread: scan */
+static void
+batch_begin(void)
+{
+  db_transaction_begin();
+
+  batch_counter = counter;
+  clock_gettime(CLOCK_MONOTONIC, &batch_start);
+}
+
+/* Thread: scan
+ * Commits the bulk scan transaction once it holds batch_files files or has been
+ * open for batch_msec, whichever comes first
+ */
+static void
+batch_check(void)
+{
+  struct timespec now;
+  int64_t msec;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  msec = (now.tv_sec - batch_start.tv_sec) * 1000LL + (now.tv_nsec - batch_start.tv_nsec) / 1000000;
+
+  if ((counter - batch_counter < batch_files) && (msec < batch_msec))
+    return;
+
+  DPRINTF(E_LOG, L_SCAN, "Scanned %d files...\n", counter);
+
+  // Directory mtimes are committed with the batch, so the files must be too
+  scan_pool_write(1);
+
+  db_transaction_end();
+  batch_begin();
 }
 
 static void
@@ -811,20 +1266,22 @@ process_file(char *file, time_t mtime, off_t size, int type, int flags, int dir_
   switch (file_type_get(file))
     {
       case FILE_REGULAR:
-	filescanner_process_media(file, mtime, size, type, NULL, dir_id);
+	if (is_bulkscan)
+	  ret = scan_pool_process_media(file, mtime, size, type, dir_id);
+	else
+	  ret = filescanner_process_media(file, mtime, size, type, NULL, dir_id);
+
+	if (ret < 0)
+	  scan_dir_file_failed(dir_id);
 
 	cache_artwork_ping(file, mtime, !is_bulkscan);
 	// TODO [artworkcache] If entry in artwork cache exists for no artwork available, delete the entry if media file has embedded artwork
 
 	counter++;
 
-	/* When in bulk mode, split transaction in pieces of 200 */
-	if ((flags & F_SCAN_BULK) && (counter % 200 == 0))
-	  {
-	    DPRINTF(E_LOG, L_SCAN, "Scanned %d files...\n", counter);
-	    db_transaction_end();
-	    db_transaction_begin();
-	  }
+	/* When in bulk mode, split transaction in batches */
+	if (flags & F_SCAN_BULK)
+	  batch_check();
 	break;
 
       case FILE_PLAYLIST:
@@ -925,6 +1382,47 @@ create_virtual_path(char *path, char *virtual_path, int virtual_path_len)
   return 0;
 }
 
+/* Thread: scan
+ * Instead of reading a directory that has not changed since the last scan, we
+ * ping its content in the db and stack the subdirectories we already know of.
+ * Note that a directory mtime does not change when a file is modified in place,
+ * such changes are only picked up by inotify or a full rescan.
+ */
+static int
+process_directory_unchanged(char *path, int dir_id)
+{
+  struct directory_enum de;
+  struct directory_info di;
+  int ret;
+
+  db_file_ping_bydirectory(dir_id);
+  db_pl_ping_bydirectory(dir_id, path);
+
+  // Or cache_artwork_purge_cruft() would delete the artwork of its files
+  cache_artwork_ping_bydirectory(path);
+
+  memset(&de, 0, sizeof(struct directory_enum));
+  de.parent_id = dir_id;
+
+  ret = db_directory_enum_start(&de);
+  if (ret < 0)
+    return -1;
+
+  while (((ret = db_directory_enum_fetch(&de, &di)) == 0) && (di.id > 0))
+    {
+      if (strncmp(di.virtual_path, "/file:", strlen("/file:")) != 0)
+	continue;
+
+      ret = push_dir(&dirstack, di.virtual_path + strlen("/file:"), dir_id);
+      if (ret < 0)
+	break;
+    }
+
+  db_directory_enum_end(&de);
+
+  return ret;
+}
+
 static void
 process_directory(char *path, int parent_id, int flags)
 {
@@ -936,7 +1434,16 @@ process_directory(char *path, int parent_id, int flags)
   struct watch_info wi;
   int type;
   char virtual_path[PATH_MAX];
+  struct scan_stat_entry *entries;
+  void *ptr;
+  int nentries;
+  int nalloc;
+  time_t dir_mtime;
+  time_t db_mtime;
+  time_t now;
   int dir_id;
+  int readdir_err;
+  int i;
   int ret;
 
   DPRINTF(E_DBG, L_SCAN, "Processing directory %s (flags = 0x%x)\n", path, flags);
@@ -961,6 +1468,28 @@ process_directory(char *path, int parent_id, int flags)
       DPRINTF(E_LOG, L_SCAN, "Insert or update of directory failed '%s'\n", virtual_path);
     }
 
+  /* Check if the directory changed since the last scan, unless file scan is disabled */
+  dir_mtime = 0;
+  db_mtime = 0;
+  if ((dir_id > 0) && !(flags & F_SCAN_FAST) && (stat(path, &sb) == 0))
+    {
+      dir_mtime = sb.st_mtime;
+      db_mtime = db_directory_mtime_get(dir_id);
+    }
+
+  if ((flags & F_SCAN_MTIME) && dir_mtime && (dir_mtime == db_mtime))
+    {
+      ret = process_directory_unchanged(path, dir_id);
+      if (ret == 0)
+	{
+	  DPRINTF(E_DBG, L_SCAN, "Directory %s is unchanged, skipping\n", path);
+
+	  closedir(dirp);
+	  dirs_skipped++;
+	  goto watch;
+	}
+    }
+
   /* Check if compilation and/or podcast directory */
   type = 0;
   if (check_speciallib(path, "compilations"))
@@ -970,6 +1499,17 @@ process_directory(char *path, int parent_id, int flags)
   if (check_speciallib(path, "audiobooks"))
     type |= F_SCAN_TYPE_AUDIOBOOK;
 
+  now = time(NULL);
+  readdir_err = 0;
+
+  scan_dir_id = dir_id;
+  scan_dir_failed = 0;
+
+  /* Read the whole directory first, so we can stat the entries in a batch */
+  entries = NULL;
+  nentries = 0;
+  nalloc = 0;
+
   for (;;)
     {
       if (scan_exit)
@@ -981,6 +1521,7 @@ process_directory(char *path, int parent_id, int flags)
 	{
 	  DPRINTF(E_LOG, L_SCAN, "readdir error in %s: %s\n", path, strerror(errno));
 
+	  readdir_err = 1;
 	  break;
 	}
 
@@ -995,17 +1536,54 @@ process_directory(char *path, int parent_id, int flags)
 	{
 	  DPRINTF(E_LOG, L_SCAN, "Skipping %s/%s, PATH_MAX exceeded\n", path, de->d_name);
 
+	  scan_dir_failed = 1;
 	  continue;
 	}
 
-      ret = lstat(entry, &sb);
-      if (ret < 0)
+      if (nentries == nalloc)
+	{
+	  nalloc = nalloc ? 2 * nalloc : 64;
+	  ptr = realloc(entries, nalloc * sizeof(struct scan_stat_entry));
+	  if (!ptr)
+	    {
+	      DPRINTF(E_LOG, L_SCAN, "Out of memory for entries of %s\n", path);
+
+	      readdir_err = 1;
+	      break;
+	    }
+
+	  entries = ptr;
+	}
+
+      entries[nentries].path = strdup(entry);
+      if (!entries[nentries].path)
 	{
-	  DPRINTF(E_LOG, L_SCAN, "Skipping %s, lstat() failed: %s\n", entry, strerror(errno));
+	  DPRINTF(E_LOG, L_SCAN, "Out of memory for entries of %s\n", path);
+
+	  readdir_err = 1;
+	  break;
+	}
 
+      nentries++;
+    }
+
+  if (!scan_exit)
+    scan_stat_batch(entries, nentries);
+
+  for (i = 0; (i < nentries) && !scan_exit; i++)
+    {
+      snprintf(entry, sizeof(entry), "%s", entries[i].path);
+
+      if (entries[i].ret < 0)
+	{
+	  DPRINTF(E_LOG, L_SCAN, "Skipping %s, lstat() failed: %s\n", entry, strerror(-entries[i].ret));
+
+	  scan_dir_failed = 1;
 	  continue;
 	}
 
+      sb = entries[i].sb;
+
       if (S_ISLNK(sb.st_mode))
 	{
 	  deref = m_realpath(entry);
@@ -1013,6 +1591,7 @@ process_directory(char *path, int parent_id, int flags)
 	    {
 	      DPRINTF(E_LOG, L_SCAN, "Skipping %s, could not dereference symlink: %s\n", entry, strerror(errno));
 
+	      scan_dir_failed = 1;
 	      continue;
 	    }
 
@@ -1021,6 +1600,7 @@ process_directory(char *path, int parent_id, int flags)
 	    {
 	      DPRINTF(E_LOG, L_SCAN, "Skipping %s, stat() failed: %s\n", deref, strerror(errno));
 
+	      scan_dir_failed = 1;
 	      free(deref);
 	      continue;
 	    }
@@ -1030,6 +1610,7 @@ process_directory(char *path, int parent_id, int flags)
 	    {
 	      DPRINTF(E_LOG, L_SCAN, "Skipping %s, PATH_MAX exceeded\n", entry);
 
+	      scan_dir_failed = 1;
 	      free(deref);
 	      continue;
 	    }
@@ -1053,8 +1634,28 @@ process_directory(char *path, int parent_id, int flags)
 	DPRINTF(E_LOG, L_SCAN, "Skipping %s, not a directory, symlink, pipe nor regular file\n", entry);
     }
 
+  for (i = 0; i < nentries; i++)
+    free(entries[i].path);
+  free(entries);
+
   closedir(dirp);
 
+  scan_dir_id = 0;
+
+  /* Remember the mtime of the directory we have now read completely. If it was
+   * modified in the same second as we read it we can't trust it, so then it is
+   * left for the next scan to check. Same if some of its files didn't make it
+   * to the db, the metadata workers may still report more of those.
+   */
+  if (scan_dir_failed || readdir_err)
+    {
+      if (db_mtime)
+	db_directory_mtime_set(dir_id, 0);
+    }
+  else if (dir_mtime && (dir_mtime != db_mtime) && (dir_mtime < now) && !scan_exit)
+    db_directory_mtime_set(dir_id, dir_mtime);
+
+ watch:
   memset(&wi, 0, sizeof(struct watch_info));
 
   // Add inotify watch (for FreeBSD we limit the flags so only dirs will be
@@ -1155,6 +1756,10 @@ bulk_scan(int flags)
   char *deref;
   time_t start;
   time_t end;
+  struct timespec ts_start;
+  struct timespec ts_end;
+  double secs;
+  int nfiles;
   int parent_id;
   int i;
 
@@ -1162,12 +1767,28 @@ bulk_scan(int flags)
   scanning = 1;
 
   start = time(NULL);
+  clock_gettime(CLOCK_MONOTONIC, &ts_start);
 
   playlists = NULL;
   dirstack = NULL;
+  nfiles = 0;
+  dirs_skipped = 0;
 
   lib = cfg_getsec(cfg, "library");
 
+  batch_files = cfg_getint(lib, "filescan_batch_files");
+  batch_msec = cfg_getint(lib, "filescan_batch_msec");
+
+  scan_stat_init(cfg_getint(lib, "filescan_stat_parallel"));
+
+  if (!(flags & F_SCAN_FAST))
+    {
+      // Group rows are rebuilt in one pass by db_hook_post_scan()
+      db_hook_pre_scan();
+
+      scan_pool_start();
+    }
+
   ndirs = cfg_size(lib, "directories");
   for (i = 0; i < ndirs; i++)
     {
@@ -1193,17 +1814,27 @@ bulk_scan(int flags)
 	}
 
       counter = 0;
-      db_transaction_begin();
+      batch_begin();
 
       process_directories(deref, parent_id, flags);
+      scan_pool_write(1);
       db_transaction_end();
 
+      nfiles += counter;
+
       free(deref);
 
       if (scan_exit)
-	return;
+	{
+	  scan_pool_stop();
+	  scan_stat_deinit();
+	  return;
+	}
     }
 
+  scan_pool_stop();
+  scan_stat_deinit();
+
   if (!(flags & F_SCAN_FAST) && playlists)
     process_deferred_playlists();
 
@@ -1214,6 +1845,13 @@ bulk_scan(int flags)
     DPRINTF(E_LOG, L_SCAN, "WARNING: unhandled leftover directories\n");
 
   end = time(NULL);
+  clock_gettime(CLOCK_MONOTONIC, &ts_end);
+
+  secs = (ts_end.tv_sec - ts_start.tv_sec) + (ts_end.tv_nsec - ts_start.tv_nsec) / 1000000000.0;
+
+  DPRINTF(E_LOG, L_SCAN, "Scanned %d files in %.1f sec (%.f files/sec)\n", nfiles, secs, (secs > 0) ? nfiles / secs : 0);
+  if (dirs_skipped > 0)
+    DPRINTF(E_LOG, L_SCAN, "Skipped %d unchanged directories\n", dirs_skipped);
 
   if (flags & F_SCAN_FAST)
     {
@@ -1234,6 +1872,8 @@ bulk_scan(int flags)
 
       DPRINTF(E_DBG, L_SCAN, "Running post library scan jobs\n");
       db_hook_post_scan();
+
+      listener_notify(LISTENER_DATABASE);
     }
 
   // Set scan in progress flag to FALSE
@@ -1308,6 +1948,8 @@ filescanner(void *arg)
 
   if (cfg_getbool(cfg_getsec(cfg, "library"), "filescan_disable"))
     bulk_scan(F_SCAN_BULK | F_SCAN_FAST);
+  else if (cfg_getbool(cfg_getsec(cfg, "library"), "filescan_skip_unchanged_dirs"))
+    bulk_scan(F_SCAN_BULK | F_SCAN_MTIME);
   else
     bulk_scan(F_SCAN_BULK);
 
@@ -1564,17 +2206,20 @@ process_inotify_file(struct watch_info *wi, char *path, struct inotify_event *ie
     {
       DPRINTF(E_DBG, L_SCAN, "File attributes changed: %s\n", path);
 
-      // Ignore the IN_ATTRIB if we just got an IN_CREATE
+      // Ignore the IN_ATTRIB if we just got an IN_CREATE. Only the IN_ATTRIB,
+      // since the batch may have merged it with other events for the file.
       for (i = 0; i < INCOMINGFILES_BUFFER_SIZE; i++)
 	{
 	  if (incomingfiles_buffer[i] == path_hash)
-	    return;
+	    break;
 	}
 
+      if (i < INCOMINGFILES_BUFFER_SIZE)
+	DPRINTF(E_SPAM, L_SCAN, "Ignoring attribute change of incoming file: %s\n", path);
 #ifdef HAVE_EUIDACCESS
-      if (euidaccess(path, R_OK) < 0)
+      else if (euidaccess(path, R_OK) < 0)
 #else
-      if (access(path, R_OK) < 0)
+      else if (access(path, R_OK) < 0)
 #endif
 	{
 	  DPRINTF(E_LOG, L_SCAN, "File access to '%s' failed: %s\n", path, strerror(errno));
@@ -1778,15 +2423,170 @@ process_inotify_file_defer(struct watch_info *wi, char *path, struct inotify_eve
 #endif
 
 
+/* Thread: scan */
+static void
+inotify_pending_free(struct inotify_pending *p)
+{
+  free(p->wi.path);
+  free(p->path);
+  free(p);
+}
+
+/* Thread: scan */
+static void
+inotify_batch_clear(void)
+{
+  struct inotify_pending *p;
+
+  while ((p = inobatch.head))
+    {
+      inobatch.head = p->next;
+      inotify_pending_free(p);
+    }
+
+  memset(&inobatch, 0, sizeof(struct inotify_batch));
+}
+
+/* Thread: scan
+ * Processes the collected events in the order they came in, in one transaction
+ * and with one cache update and one notification for the whole batch
+ */
+static void
+inotify_batch_process(void)
+{
+  struct inotify_pending *p;
+  struct inotify_batch batch;
+
+  if (!inobatch.head)
+    return;
+
+  batch = inobatch;
+  memset(&inobatch, 0, sizeof(struct inotify_batch));
+
+  DPRINTF(E_DBG, L_SCAN, "Processing %d inotify events (%d merged)\n", batch.count, batch.merged);
+
+  db_transaction_begin();
+  cache_daap_hold();
+
+  while ((p = batch.head))
+    {
+      batch.head = p->next;
+
+      if (p->is_dir)
+	process_inotify_dir(&p->wi, p->path, &p->ie);
+      else
+#if defined(__linux__)
+	process_inotify_file(&p->wi, p->path, &p->ie);
+#elif defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
+	process_inotify_file_defer(&p->wi, p->path, &p->ie);
+#endif
+
+      inotify_pending_free(p);
+    }
+
+  cache_daap_release();
+  db_transaction_end();
+
+  listener_notify(LISTENER_DATABASE);
+}
+
+/* Thread: scan */
+static void
+inotify_batch_cb(int fd, short what, void *arg)
+{
+  inotify_batch_process();
+}
+
+/* Thread: scan
+ * Adds an event to the batch, or merges it with a pending event for the same
+ * path. Takes ownership of wi->path.
+ */
+static void
+inotify_batch_add(struct watch_info *wi, char *path, struct inotify_event *ie)
+{
+  struct inotify_pending *p;
+  uint32_t hash;
+  int is_dir;
+  int is_move;
+
+  /* ie->len == 0 catches events on the subject of the watch itself.
+   * As we only watch directories, this catches directories.
+   * General watch events like IN_UNMOUNT and IN_IGNORED do not come
+   * with the IN_ISDIR flag set.
+   */
+  is_dir = (ie->mask & IN_ISDIR) || (ie->len == 0);
+  is_move = (ie->mask & (IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF));
+
+  hash = djb_hash(path, strlen(path));
+
+  if (!is_dir && !is_move)
+    {
+      for (p = inobatch.hash[hash % INOTIFY_HASH_SIZE]; p; p = p->hash_next)
+	{
+	  if ((p->gen == inobatch.gen) && (p->hash == hash) && (strcmp(p->path, path) == 0))
+	    {
+	      // The file is scanned anyway when it is created or closed
+	      if (p->ie.mask & (IN_CREATE | IN_CLOSE_WRITE))
+		p->ie.mask |= (ie->mask & ~IN_ATTRIB);
+	      else
+		p->ie.mask |= ie->mask;
+	      inobatch.merged++;
+
+	      free(wi->path);
+	      return;
+	    }
+	}
+    }
+
+  p = calloc(1, sizeof(struct inotify_pending));
+  if (p)
+    p->path = strdup(path);
+  if (!p || !p->path)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Out of memory for inotify event, dropping event for %s\n", path);
+
+      free(p);
+      free(wi->path);
+      return;
+    }
+
+  p->wi = *wi;
+  p->ie = *ie;
+  p->ie.len = 0;
+  p->is_dir = is_dir;
+  p->hash = hash;
+  p->gen = inobatch.gen;
+
+  if (inobatch.tail)
+    inobatch.tail->next = p;
+  else
+    {
+      inobatch.head = p;
+      clock_gettime(CLOCK_MONOTONIC, &inobatch.first);
+    }
+  inobatch.tail = p;
+  inobatch.count++;
+
+  if (is_dir || is_move)
+    inobatch.gen++;
+  else
+    {
+      p->hash_next = inobatch.hash[hash % INOTIFY_HASH_SIZE];
+      inobatch.hash[hash % INOTIFY_HASH_SIZE] = p;
+    }
+}
+
 /* Thread: scan */
 static void
 inotify_cb(int fd, short event, void *arg)
 {
   struct inotify_event *ie;
   struct watch_info wi;
+  struct timespec now;
   uint8_t *buf;
   uint8_t *ptr;
   char path[PATH_MAX];
+  int64_t msec;
   int size;
   int namelen;
   int ret;
@@ -1870,24 +2670,25 @@ inotify_cb(int fd, short event, void *arg)
 	    }
 	}
 
-      /* ie->len == 0 catches events on the subject of the watch itself.
-       * As we only watch directories, this catches directories.
-       * General watch events like IN_UNMOUNT and IN_IGNORED do not come
-       * with the IN_ISDIR flag set.
-       */
-      if ((ie->mask & IN_ISDIR) || (ie->len == 0))
-	process_inotify_dir(&wi, path, ie);
-      else
-#if defined(__linux__)
-	process_inotify_file(&wi, path, ie);
-#elif defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
-	process_inotify_file_defer(&wi, path, ie);
-#endif
-      free(wi.path);
+      inotify_batch_add(&wi, path, ie);
     }
 
   free(buf);
 
+  /* Process the batch when things have been quiet for a while, but don't let
+   * a steady stream of events hold it back forever
+   */
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  msec = (now.tv_sec - inobatch.first.tv_sec) * 1000LL + (now.tv_nsec - inobatch.first.tv_nsec) / 1000000;
+
+  if (inobatch.head && ((msec >= INOTIFY_DELAY_MAX_MSEC) || (inobatch.count >= INOTIFY_PENDING_MAX)))
+    {
+      evtimer_del(inobatchev);
+      inotify_batch_process();
+    }
+  else if (inobatch.head)
+    evtimer_add(inobatchev, &inotify_quiet);
+
   event_add(inoev, NULL);
 }
 
@@ -1905,6 +2706,16 @@ inofd_event_set(void)
 
   inoev = event_new(evbase_scan, inofd, EV_READ, inotify_cb, NULL);
 
+  inobatchev = evtimer_new(evbase_scan, inotify_batch_cb, NULL);
+  if (!inobatchev)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Could not create inotify batch event\n");
+
+      return -1;
+    }
+
+  memset(&inobatch, 0, sizeof(struct inotify_batch));
+
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
   deferred_inoev = evtimer_new(evbase_scan, inotify_deferred_cb, NULL);
   if (!deferred_inoev)
@@ -1925,6 +2736,10 @@ inofd_event_unset(void)
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
   event_free(deferred_inoev);
 #endif
+  // Pending events refer to watches that are now gone
+  inotify_batch_clear();
+  event_free(inobatchev);
+
   event_free(inoev);
   close(inofd);
 }
@@ -2001,11 +2816,16 @@ filescanner_scanning(void)
 int
 filescanner_init(void)
 {
+  int msec;
   int ret;
 
   scan_exit = 0;
   scanning = 0;
 
+  msec = cfg_getint(cfg_getsec(cfg, "library"), "inotify_quiet_msec");
+  inotify_quiet.tv_sec = msec / 1000;
+  inotify_quiet.tv_usec = (msec % 1000) * 1000;
+
   evbase_scan = event_base_new();
   if (!evbase_scan)
     {
@@ -2,6 +2,8 @@
 #ifndef __FILESCANNER_H__
 #define __FILESCANNER_H__
 
+#include <sys/stat.h>
+
 #include "db.h"
 
 #define F_SCAN_TYPE_FILE         (1 << 0)
@@ -18,9 +20,25 @@ filescanner_init(void);
 void
 filescanner_deinit(void);
 
-void
+int
 filescanner_process_media(char *path, time_t mtime, off_t size, int type, struct media_file_info *external_mfi, int dir_id);
 
+/* Batched stat of directory entries, see filescanner_stat.c */
+struct scan_stat_entry {
+  char *path;
+  struct stat sb;
+  int ret;          // 0 or -errno from lstat()
+};
+
+void
+scan_stat_batch(struct scan_stat_entry *entries, int n);
+
+void
+scan_stat_init(int parallel);
+
+void
+scan_stat_deinit(void);
+
 /* Actual scanners */
 int
 scan_metadata_ffmpeg(char *file, struct media_file_info *mfi);
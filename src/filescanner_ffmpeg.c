@@ -48,7 +48,7 @@ struct metadata_map {
 };
 
 // Used for passing errors to DPRINTF (can't count on av_err2str being present)
-static char errbuf[64];
+static __thread char errbuf[64];
 
 static inline char *
 err2str(int errnum)
@@ -0,0 +1,466 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Batched stat of directory entries for the file scanner. On network mounted
+ * libraries each stat is a round trip to the server, so instead of stat'ing
+ * the entries of a directory one by one we keep a number of requests in flight.
+ * With io_uring (--with-liburing) the requests are submitted as statx ops on
+ * the ring, otherwise they are spread over a small pool of threads.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_LIBURING
+# include <liburing.h>
+#endif
+
+#include "logger.h"
+#include "filescanner.h"
+
+// Below this many entries we just stat them in the calling thread
+#define STAT_BATCH_MIN 4
+#define STAT_THREADS_MAX 64
+
+struct stat_pool {
+  pthread_t *tids;
+  int nthreads;
+  int exit;
+
+  pthread_mutex_t lck;
+  pthread_cond_t job_cond;
+  pthread_cond_t done_cond;
+
+  // Current batch
+  struct scan_stat_entry *entries;
+  int nentries;
+  int next;
+  int done;
+};
+
+static struct stat_pool stat_pool;
+
+#ifdef HAVE_LIBURING
+static struct io_uring ring;
+static int ring_depth;
+#endif
+
+// Stats, logged by scan_stat_deinit()
+static uint64_t stat_count;
+static uint64_t stat_usec;
+
+
+static void
+stat_entry(struct scan_stat_entry *entry)
+{
+  entry->ret = lstat(entry->path, &entry->sb);
+  if (entry->ret < 0)
+    entry->ret = -errno;
+}
+
+
+/* --------------------------- Thread pool stat ---------------------------- */
+
+/* Thread: scan and stat workers */
+static void
+stat_pool_run(void)
+{
+  struct scan_stat_entry *entry;
+
+  pthread_mutex_lock(&stat_pool.lck);
+
+  while (stat_pool.entries && (stat_pool.next < stat_pool.nentries))
+    {
+      entry = &stat_pool.entries[stat_pool.next];
+      stat_pool.next++;
+
+      pthread_mutex_unlock(&stat_pool.lck);
+
+      stat_entry(entry);
+
+      pthread_mutex_lock(&stat_pool.lck);
+
+      stat_pool.done++;
+      if (stat_pool.done == stat_pool.nentries)
+	pthread_cond_signal(&stat_pool.done_cond);
+    }
+
+  pthread_mutex_unlock(&stat_pool.lck);
+}
+
+/* Thread: stat worker */
+static void *
+stat_worker(void *arg)
+{
+  for (;;)
+    {
+      pthread_mutex_lock(&stat_pool.lck);
+
+      while (!stat_pool.exit && !(stat_pool.entries && (stat_pool.next < stat_pool.nentries)))
+	pthread_cond_wait(&stat_pool.job_cond, &stat_pool.lck);
+
+      if (stat_pool.exit)
+	{
+	  pthread_mutex_unlock(&stat_pool.lck);
+	  break;
+	}
+
+      pthread_mutex_unlock(&stat_pool.lck);
+
+      stat_pool_run();
+    }
+
+  pthread_exit(NULL);
+}
+
+static void
+stat_batch_pool(struct scan_stat_entry *entries, int n)
+{
+  pthread_mutex_lock(&stat_pool.lck);
+
+  stat_pool.entries = entries;
+  stat_pool.nentries = n;
+  stat_pool.next = 0;
+  stat_pool.done = 0;
+
+  pthread_cond_broadcast(&stat_pool.job_cond);
+  pthread_mutex_unlock(&stat_pool.lck);
+
+  // Lend a hand while waiting
+  stat_pool_run();
+
+  pthread_mutex_lock(&stat_pool.lck);
+
+  while (stat_pool.done < stat_pool.nentries)
+    pthread_cond_wait(&stat_pool.done_cond, &stat_pool.lck);
+
+  stat_pool.entries = NULL;
+  stat_pool.nentries = 0;
+
+  pthread_mutex_unlock(&stat_pool.lck);
+}
+
+static int
+stat_pool_init(int nthreads)
+{
+  int ret;
+  int i;
+
+  memset(&stat_pool, 0, sizeof(struct stat_pool));
+
+  if (nthreads > STAT_THREADS_MAX)
+    nthreads = STAT_THREADS_MAX;
+
+  stat_pool.tids = calloc(nthreads, sizeof(pthread_t));
+  if (!stat_pool.tids)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Out of memory for stat threads\n");
+      return -1;
+    }
+
+  pthread_mutex_init(&stat_pool.lck, NULL);
+  pthread_cond_init(&stat_pool.job_cond, NULL);
+  pthread_cond_init(&stat_pool.done_cond, NULL);
+
+  for (i = 0; i < nthreads; i++)
+    {
+      ret = pthread_create(&stat_pool.tids[i], NULL, stat_worker, NULL);
+      if (ret != 0)
+	{
+	  DPRINTF(E_LOG, L_SCAN, "Could not spawn stat thread: %s\n", strerror(ret));
+	  break;
+	}
+
+#if defined(HAVE_PTHREAD_SETNAME_NP)
+      pthread_setname_np(stat_pool.tids[i], "scan_stat");
+#elif defined(HAVE_PTHREAD_SET_NAME_NP)
+      pthread_set_name_np(stat_pool.tids[i], "scan_stat");
+#endif
+    }
+
+  stat_pool.nthreads = i;
+
+  return 0;
+}
+
+static void
+stat_pool_deinit(void)
+{
+  int i;
+
+  if (!stat_pool.tids)
+    return;
+
+  pthread_mutex_lock(&stat_pool.lck);
+  stat_pool.exit = 1;
+  pthread_cond_broadcast(&stat_pool.job_cond);
+  pthread_mutex_unlock(&stat_pool.lck);
+
+  for (i = 0; i < stat_pool.nthreads; i++)
+    pthread_join(stat_pool.tids[i], NULL);
+
+  pthread_cond_destroy(&stat_pool.done_cond);
+  pthread_cond_destroy(&stat_pool.job_cond);
+  pthread_mutex_destroy(&stat_pool.lck);
+
+  free(stat_pool.tids);
+
+  memset(&stat_pool, 0, sizeof(struct stat_pool));
+}
+
+
+/* ------------------------------ io_uring stat ----------------------------- */
+
+#ifdef HAVE_LIBURING
+static int
+stat_ring_init(int depth)
+{
+  struct io_uring_probe *probe;
+  int supported;
+  int ret;
+
+  ret = io_uring_queue_init(depth, &ring, 0);
+  if (ret < 0)
+    {
+      DPRINTF(E_INFO, L_SCAN, "Could not create io_uring: %s\n", strerror(-ret));
+      return -1;
+    }
+
+  // IORING_OP_STATX requires Linux 5.6
+  probe = io_uring_get_probe_ring(&ring);
+  supported = probe && io_uring_opcode_supported(probe, IORING_OP_STATX);
+  if (probe)
+    free(probe);
+
+  if (!supported)
+    {
+      DPRINTF(E_INFO, L_SCAN, "Kernel does not support statx with io_uring\n");
+      io_uring_queue_exit(&ring);
+      return -1;
+    }
+
+  ring_depth = depth;
+
+  return 0;
+}
+
+static void
+stat_ring_deinit(void)
+{
+  if (!ring_depth)
+    return;
+
+  io_uring_queue_exit(&ring);
+  ring_depth = 0;
+}
+
+static void
+statx_to_stat(struct statx *stx, struct stat *sb)
+{
+  memset(sb, 0, sizeof(struct stat));
+
+  sb->st_mode = stx->stx_mode;
+  sb->st_size = stx->stx_size;
+  sb->st_mtime = stx->stx_mtime.tv_sec;
+  sb->st_ino = stx->stx_ino;
+  sb->st_nlink = stx->stx_nlink;
+}
+
+static int
+stat_batch_ring(struct scan_stat_entry *entries, int n)
+{
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  struct statx *stx;
+  int submitted;
+  int completed;
+  int inflight;
+  int i;
+  int ret;
+
+  stx = calloc(n, sizeof(struct statx));
+  if (!stx)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Out of memory for statx buffers\n");
+      return -1;
+    }
+
+  submitted = 0;
+  completed = 0;
+  inflight = 0;
+  while (completed < n)
+    {
+      while ((submitted < n) && (inflight < ring_depth))
+	{
+	  sqe = io_uring_get_sqe(&ring);
+	  if (!sqe)
+	    break;
+
+	  io_uring_prep_statx(sqe, AT_FDCWD, entries[submitted].path, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &stx[submitted]);
+	  io_uring_sqe_set_data(sqe, (void *)(intptr_t)submitted);
+
+	  submitted++;
+	  inflight++;
+	}
+
+      ret = io_uring_submit_and_wait(&ring, 1);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_SCAN, "io_uring submit failed: %s\n", strerror(-ret));
+	  goto error;
+	}
+
+      while (io_uring_peek_cqe(&ring, &cqe) == 0)
+	{
+	  i = (intptr_t)io_uring_cqe_get_data(cqe);
+
+	  entries[i].ret = cqe->res;
+	  if (cqe->res == 0)
+	    statx_to_stat(&stx[i], &entries[i].sb);
+
+	  io_uring_cqe_seen(&ring, cqe);
+
+	  inflight--;
+	  completed++;
+	}
+    }
+
+  free(stx);
+  return 0;
+
+ error:
+  // Reap what is in flight, the kernel may still write to the buffers
+  while (inflight > 0)
+    {
+      ret = io_uring_wait_cqe(&ring, &cqe);
+      if (ret < 0)
+	break;
+
+      io_uring_cqe_seen(&ring, cqe);
+      inflight--;
+    }
+
+  // Requests we couldn't reap are cancelled with the ring, which is then not
+  // used again
+  if (inflight > 0)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Could not reap io_uring stat requests, not using io_uring anymore\n");
+
+      stat_ring_deinit();
+    }
+
+  free(stx);
+
+  return -1;
+}
+#endif /* HAVE_LIBURING */
+
+
+/* ---------------------------------- API ----------------------------------- */
+
+/* Thread: scan */
+void
+scan_stat_batch(struct scan_stat_entry *entries, int n)
+{
+  struct timespec start;
+  struct timespec end;
+  int i;
+  int ret;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  ret = -1;
+  if (n >= STAT_BATCH_MIN)
+    {
+#ifdef HAVE_LIBURING
+      if (ring_depth)
+	ret = stat_batch_ring(entries, n);
+#endif
+      if ((ret < 0) && (stat_pool.nthreads > 0))
+	{
+	  stat_batch_pool(entries, n);
+	  ret = 0;
+	}
+    }
+
+  if (ret < 0)
+    {
+      for (i = 0; i < n; i++)
+	stat_entry(&entries[i]);
+    }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  stat_count += n;
+  stat_usec += (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_nsec - start.tv_nsec) / 1000;
+}
+
+/* Thread: scan */
+void
+scan_stat_init(int parallel)
+{
+  int ret;
+
+  stat_count = 0;
+  stat_usec = 0;
+
+  if (parallel <= 1)
+    return;
+
+#ifdef HAVE_LIBURING
+  ret = stat_ring_init(parallel);
+  if (ret == 0)
+    {
+      DPRINTF(E_DBG, L_SCAN, "Directory entries will be stat'ed with io_uring, depth %d\n", parallel);
+      return;
+    }
+#endif
+
+  ret = stat_pool_init(parallel - 1);
+  if (ret == 0)
+    DPRINTF(E_DBG, L_SCAN, "Directory entries will be stat'ed with %d threads\n", stat_pool.nthreads + 1);
+}
+
+/* Thread: scan */
+void
+scan_stat_deinit(void)
+{
+  if (stat_count > 0)
+    DPRINTF(E_LOG, L_SCAN, "Stat'ed %" PRIu64 " directory entries in %.1f sec (%.f entries/sec)\n",
+	    stat_count, stat_usec / 1000000.0, (stat_usec > 0) ? stat_count * 1000000.0 / stat_usec : 0);
+
+#ifdef HAVE_LIBURING
+  stat_ring_deinit();
+#endif
+  stat_pool_deinit();
+
+  stat_count = 0;
+  stat_usec = 0;
+}
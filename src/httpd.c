@@ -56,12 +56,16 @@
 #include "conffile.h"
 #include "misc.h"
 #include "worker.h"
+#include "player.h"
 #include "httpd.h"
 #include "httpd_rsp.h"
 #include "httpd_daap.h"
 #include "httpd_dacp.h"
 #include "httpd_streaming.h"
 #include "transcode.h"
+#include "transcode_cache.h"
+#include "outputs.h"
+#include "cache.h"
 #ifdef LASTFM
 # include "lastfm.h"
 #endif
@@ -89,6 +93,16 @@
 
 
 #define STREAM_CHUNK_SIZE (64 * 1024)
+// File data that is sent with sendfile() isn't copied, so we can queue more
+#define STREAM_FILE_CHUNK_SIZE (1024 * 1024)
+
+/* Raw files are added to the reply as file segments, which libevent sends with
+ * sendfile(). Without sendfile, libevent would map or read the whole file, so
+ * then we read() it in chunks ourselves.
+ */
+#if defined(HAVE_SENDFILE) && !defined(HAVE_LIBEVENT2_OLD)
+# define STREAM_SENDFILE 1
+#endif
 #define WEBFACE_ROOT   DATADIR "/webface/"
 #define ERR_PAGE "<html>\n<head>\n" \
   "<title>%d %s</title>\n" \
@@ -101,6 +115,13 @@ struct content_type_map {
   char *ctype;
 };
 
+struct httpd_chunked_reply {
+  struct evhttp_request *req;
+  struct evbuffer *out;
+  z_stream strm;
+  int gzip;
+};
+
 struct stream_ctx {
   struct evhttp_request *req;
   uint8_t *buf;
@@ -115,6 +136,24 @@ struct stream_ctx {
   off_t end_offset;
   int marked;
   struct transcode_ctx *xcode;
+  // Copy of the transcoded output going to the transcode cache
+  struct transcode_cache_fill *fill;
+#ifdef STREAM_SENDFILE
+  // The file, when streaming it raw with sendfile()
+  struct evbuffer_file_segment *seg;
+#endif
+
+  struct timespec start;
+  uint64_t bytes;
+};
+
+// File streaming totals, updated atomically
+struct stream_stats {
+  int active;
+  uint64_t streams;
+  uint64_t bytes;
+  uint64_t bytes_sendfile;
+  uint64_t cached;
 };
 
 
@@ -131,6 +170,58 @@ static const struct content_type_map ext2ctype[] =
     { NULL, NULL }
   };
 
+// Max number of event loops (threads) serving requests
+#define HTTPD_LOOPS_MAX 16
+
+/* An event loop serving requests in a thread of its own. The first loop also
+ * runs the events of the protocol modules (e.g. DACP status updates and the mp3
+ * encoder). The other loops accept connections on the same listening socket,
+ * and a connection is served by the loop that accepted it.
+ */
+struct httpd_loop
+{
+  int id;
+  pthread_t tid;
+  struct event_base *evbase;
+  struct evhttp *evhttp;
+
+  // Protected by httpd_stats_lck
+  uint64_t requests;
+  uint64_t usec_total;
+  uint64_t usec_max;
+};
+
+// A request that is being handled by the worker pool, see httpd_defer()
+struct httpd_job
+{
+  struct evhttp_request *req;
+  // Completion event in the loop serving the request
+  struct event *ev;
+
+  httpd_job_cb cb;
+  void *arg;
+  void (*arg_free)(void *);
+
+  // Protected by httpd_job_lck. The loop serving the request and the worker
+  // each hold a reference, so neither has to wait for the other.
+  int refcount;
+  int cancelled;
+  // Set if the connection failed and left the request to us
+  int owned;
+
+  // The reply the handler made, sent by the loop when the job is done
+  int replied;
+  int error;
+  int code;
+  char *reason;
+  struct evbuffer *reply;
+
+  // Or, set with httpd_defer_finish(), the loop makes the reply with this
+  void (*finish_cb)(struct evhttp_request *req, void *arg);
+  void *finish_arg;
+  void (*finish_arg_free)(void *);
+};
+
 struct event_base *evbase_httpd;
 
 #ifdef USE_EVENTFD
@@ -140,8 +231,20 @@ static int exit_pipe[2];
 #endif
 static int httpd_exit;
 static struct event *exitev;
-static struct evhttp *evhttpd;
-static pthread_t tid_httpd;
+
+static struct httpd_loop httpd_loops[HTTPD_LOOPS_MAX];
+static int httpd_nloops;
+static pthread_mutex_t httpd_stats_lck = PTHREAD_MUTEX_INITIALIZER;
+static struct stream_stats stream_stats;
+
+static pthread_mutex_t httpd_job_lck = PTHREAD_MUTEX_INITIALIZER;
+// Protected by httpd_job_lck. Jobs the worker pool has a reference to, so that
+// httpd_deinit() can wait for them before freeing the loops.
+static pthread_cond_t httpd_job_cond = PTHREAD_COND_INITIALIZER;
+static int httpd_jobs;
+static int httpd_jobs_stop;
+// Set while a worker pool thread runs the handler of a deferred request
+static __thread struct httpd_job *httpd_job_current;
 
 static char *allow_origin;
 static int httpd_port;
@@ -155,6 +258,8 @@ static void
 stream_end(struct stream_ctx *st, int failed)
 {
   struct evhttp_connection *evcon;
+  struct timespec end;
+  double secs;
 
   evcon = evhttp_request_get_connection(st->req);
 
@@ -164,11 +269,27 @@ stream_end(struct stream_ctx *st, int failed)
   if (!failed)
     evhttp_send_reply_end(st->req);
 
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  secs = (end.tv_sec - st->start.tv_sec) + (end.tv_nsec - st->start.tv_nsec) / 1000000000.0;
+
+  DPRINTF(E_DBG, L_HTTPD, "Streamed %" PRIu64 " bytes of file id %d in %.1f sec (%.1f MB/s%s)\n",
+	  st->bytes, st->id, secs, (secs > 0) ? st->bytes / secs / 1000000.0 : 0, (st->xcode || st->buf) ? "" : ", sendfile");
+
+  __atomic_sub_fetch(&stream_stats.active, 1, __ATOMIC_RELAXED);
+
+  if (st->fill)
+    transcode_cache_fill_end(st->fill, 0);
+
   evbuffer_free(st->evbuf);
   event_free(st->ev);
 
   if (st->xcode)
     transcode_cleanup(st->xcode);
+#ifdef STREAM_SENDFILE
+  // The segment owns the fd, and is only freed when libevent is done with it
+  else if (st->seg)
+    evbuffer_file_segment_free(st->seg);
+#endif
   else
     {
       free(st->buf);
@@ -260,6 +381,88 @@ oauth_interface(struct evhttp_request *req, const char *uri)
   evbuffer_free(evbuf);
 }
 
+static int
+httpd_stats_get(struct evbuffer *evbuf)
+{
+  struct httpd_loop *loop;
+  int ret;
+  int i;
+
+  pthread_mutex_lock(&httpd_stats_lck);
+
+  ret = evbuffer_add_printf(evbuf, "{\"loops\":[");
+
+  for (i = 0; (i < httpd_nloops) && (ret >= 0); i++)
+    {
+      loop = &httpd_loops[i];
+
+      ret = evbuffer_add_printf(evbuf, "%s{\"id\":%d,\"requests\":%" PRIu64 ",\"usec_avg\":%" PRIu64 ",\"usec_max\":%" PRIu64 "}",
+				(i == 0) ? "" : ",", loop->id, loop->requests,
+				(loop->requests > 0) ? loop->usec_total / loop->requests : 0, loop->usec_max);
+    }
+
+  if (ret >= 0)
+    ret = evbuffer_add_printf(evbuf, "],\"file_streams\":{\"active\":%d,\"total\":%" PRIu64 ",\"bytes\":%" PRIu64 ",\"bytes_sendfile\":%" PRIu64 ",\"transcode_cache_hits\":%" PRIu64 "}}\n",
+			      __atomic_load_n(&stream_stats.active, __ATOMIC_RELAXED),
+			      __atomic_load_n(&stream_stats.streams, __ATOMIC_RELAXED),
+			      __atomic_load_n(&stream_stats.bytes, __ATOMIC_RELAXED),
+			      __atomic_load_n(&stream_stats.bytes_sendfile, __ATOMIC_RELAXED),
+			      __atomic_load_n(&stream_stats.cached, __ATOMIC_RELAXED));
+
+  pthread_mutex_unlock(&httpd_stats_lck);
+
+  return (ret < 0) ? -1 : 0;
+}
+
+static void
+stats_interface(struct evhttp_request *req, const char *uri)
+{
+  struct evbuffer *evbuf;
+  int ret;
+
+  evbuf = evbuffer_new();
+  if (!evbuf)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not alloc evbuf for stats\n");
+
+      httpd_send_error(req, HTTP_SERVUNAVAIL, "Internal Server Error");
+      return;
+    }
+
+  if (strcmp(uri, "/stats/clock") == 0)
+    ret = outputs_clock_stats(evbuf);
+  else if (strcmp(uri, "/stats/streaming") == 0)
+    ret = streaming_stats_get(evbuf);
+  else if (strcmp(uri, "/stats/httpd") == 0)
+    ret = httpd_stats_get(evbuf);
+  else if (strcmp(uri, "/stats/player") == 0)
+    ret = player_stats_get(evbuf);
+  else if (strcmp(uri, "/stats/cache") == 0)
+    ret = cache_stats_get(evbuf);
+  else
+    {
+      httpd_send_error(req, HTTP_NOTFOUND, "Not Found");
+      evbuffer_free(evbuf);
+      return;
+    }
+
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not get stats for %s\n", uri);
+
+      httpd_send_error(req, HTTP_SERVUNAVAIL, "Internal Server Error");
+      evbuffer_free(evbuf);
+      return;
+    }
+
+  evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type", "application/json");
+  evhttp_add_header(evhttp_request_get_output_headers(req), "Cache-Control", "no-cache");
+
+  httpd_send_reply(req, HTTP_OK, "OK", evbuf, 0);
+
+  evbuffer_free(evbuf);
+}
+
 static void
 stream_end_register(struct stream_ctx *st)
 {
@@ -318,7 +521,13 @@ stream_chunk_xcode_cb(int fd, short event, void *arg)
   if (xcoded <= 0)
     {
       if (xcoded == 0)
-	DPRINTF(E_LOG, L_HTTPD, "Done streaming transcoded file id %d\n", st->id);
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Done streaming transcoded file id %d\n", st->id);
+
+	  if (st->fill)
+	    transcode_cache_fill_end(st->fill, 1);
+	  st->fill = NULL;
+	}
       else
 	DPRINTF(E_LOG, L_HTTPD, "Transcoding error, file id %d\n", st->id);
 
@@ -326,6 +535,12 @@ stream_chunk_xcode_cb(int fd, short event, void *arg)
       return;
     }
 
+  /* Also write everything to the cache, including what we skip to get to
+   * start_offset, since the cache needs the complete file
+   */
+  if (st->fill && (transcode_cache_fill_write(st->fill, st->evbuf) < 0))
+    st->fill = NULL;
+
   DPRINTF(E_DBG, L_HTTPD, "Got %d bytes from transcode; streaming file id %d\n", xcoded, st->id);
 
   /* Consume transcoded data until we meet start_offset */
@@ -351,6 +566,9 @@ stream_chunk_xcode_cb(int fd, short event, void *arg)
   else
     ret = xcoded;
 
+  st->bytes += ret;
+  __atomic_add_fetch(&stream_stats.bytes, ret, __ATOMIC_RELAXED);
+
 #ifdef HAVE_LIBEVENT2_OLD
   evhttp_send_reply_chunk(st->req, st->evbuf);
 
@@ -381,11 +599,50 @@ stream_chunk_xcode_cb(int fd, short event, void *arg)
     }
 }
 
+/* Adds up to len bytes of the file to st->evbuf. If we have the file as a
+ * segment, the data is added as a reference to the file. Since st->evbuf is
+ * flagged as draining to the socket, the reference is kept when evhttp moves it
+ * to the connection, and libevent sends it with sendfile() instead of us
+ * copying it through st->buf. Returns the number of bytes added, 0 at the end
+ * of the file or -1 on error.
+ */
+static int
+stream_file_read(struct stream_ctx *st, size_t len)
+{
+  int ret;
+
+#ifdef STREAM_SENDFILE
+  if (st->seg)
+    {
+      if (st->offset >= st->size)
+	return 0;
+
+      if (len > st->size - st->offset)
+	len = st->size - st->offset;
+
+      ret = evbuffer_add_file_segment(st->evbuf, st->seg, st->offset, len);
+      if (ret < 0)
+	return -1;
+
+      __atomic_add_fetch(&stream_stats.bytes_sendfile, len, __ATOMIC_RELAXED);
+
+      return len;
+    }
+#endif
+
+  ret = read(st->fd, st->buf, len);
+  if (ret > 0)
+    evbuffer_add(st->evbuf, st->buf, ret);
+
+  return ret;
+}
+
 static void
 stream_chunk_raw_cb(int fd, short event, void *arg)
 {
   struct stream_ctx *st;
   size_t chunk_size;
+  size_t chunk_max;
   int ret;
 
   st = (struct stream_ctx *)arg;
@@ -396,12 +653,14 @@ stream_chunk_raw_cb(int fd, short event, void *arg)
       return;
     }
 
-  if (st->end_offset && ((st->offset + STREAM_CHUNK_SIZE) > (st->end_offset + 1)))
+  chunk_max = st->buf ? STREAM_CHUNK_SIZE : STREAM_FILE_CHUNK_SIZE;
+
+  if (st->end_offset && ((st->offset + chunk_max) > (st->end_offset + 1)))
     chunk_size = st->end_offset + 1 - st->offset;
   else
-    chunk_size = STREAM_CHUNK_SIZE;  
+    chunk_size = chunk_max;
 
-  ret = read(st->fd, st->buf, chunk_size);
+  ret = stream_file_read(st, chunk_size);
   if (ret <= 0)
     {
       if (ret == 0)
@@ -415,7 +674,8 @@ stream_chunk_raw_cb(int fd, short event, void *arg)
 
   DPRINTF(E_DBG, L_HTTPD, "Read %d bytes; streaming file id %d\n", ret, st->id);
 
-  evbuffer_add(st->evbuf, st->buf, ret);
+  st->bytes += ret;
+  __atomic_add_fetch(&stream_stats.bytes, ret, __ATOMIC_RELAXED);
 
 #ifdef HAVE_LIBEVENT2_OLD
   evhttp_send_reply_chunk(st->req, st->evbuf);
@@ -471,6 +731,7 @@ httpd_stream_file(struct evhttp_request *req, int id)
   int64_t end_offset;
   off_t pos;
   int transcode;
+  int cached;
   int ret;
 
   offset = 0;
@@ -547,6 +808,20 @@ httpd_stream_file(struct evhttp_request *req, int id)
 
   output_headers = evhttp_request_get_output_headers(req);
 
+  /* If we have the transcoding in the cache we stream it like a raw file, which
+   * also means we can give the client a Content-Length
+   */
+  cached = 0;
+  if (transcode)
+    {
+      st->fd = transcode_cache_open(mfi, XCODE_PCM16_HEADER, &st->size);
+      if (st->fd >= 0)
+	{
+	  transcode = 0;
+	  cached = 1;
+	}
+    }
+
   if (transcode)
     {
       DPRINTF(E_INFO, L_HTTPD, "Preparing to transcode %s\n", mfi->path);
@@ -563,27 +838,20 @@ httpd_stream_file(struct evhttp_request *req, int id)
 	  goto out_free_st;
 	}
 
+      st->fill = transcode_cache_fill_start(mfi, XCODE_PCM16_HEADER, st->size);
+
       if (!evhttp_find_header(output_headers, "Content-Type"))
 	evhttp_add_header(output_headers, "Content-Type", "audio/wav");
     }
   else
     {
-      /* Stream the raw file */
-      DPRINTF(E_INFO, L_HTTPD, "Preparing to stream %s\n", mfi->path);
-
-      st->buf = (uint8_t *)malloc(STREAM_CHUNK_SIZE);
-      if (!st->buf)
-	{
-	  DPRINTF(E_LOG, L_HTTPD, "Out of memory for raw streaming buffer\n");
-
-	  evhttp_send_error(req, HTTP_SERVUNAVAIL, "Internal Server Error");
-
-	  goto out_free_st;
-	}
+      /* Stream the raw file, or the cached transcoding of it */
+      DPRINTF(E_INFO, L_HTTPD, "Preparing to stream %s%s\n", mfi->path, (cached) ? " from the transcode cache" : "");
 
       stream_cb = stream_chunk_raw_cb;
 
-      st->fd = open(mfi->path, O_RDONLY);
+      if (!cached)
+	st->fd = open(mfi->path, O_RDONLY);
       if (st->fd < 0)
 	{
 	  DPRINTF(E_LOG, L_HTTPD, "Could not open %s: %s\n", mfi->path, strerror(errno));
@@ -593,7 +861,7 @@ httpd_stream_file(struct evhttp_request *req, int id)
 	  goto out_cleanup;
 	}
 
-      ret = stat(mfi->path, &sb);
+      ret = fstat(st->fd, &sb);
       if (ret < 0)
 	{
 	  DPRINTF(E_LOG, L_HTTPD, "Could not stat() %s: %s\n", mfi->path, strerror(errno));
@@ -604,6 +872,27 @@ httpd_stream_file(struct evhttp_request *req, int id)
 	}
       st->size = sb.st_size;
 
+#ifdef STREAM_SENDFILE
+      // Never let libevent map the file, a mapping of a file that is truncated
+      // while we stream it would give us SIGBUS
+      st->seg = evbuffer_file_segment_new(st->fd, 0, st->size, EVBUF_FS_CLOSE_ON_FREE | EVBUF_FS_DISABLE_MMAP);
+      if (!st->seg)
+	DPRINTF(E_WARN, L_HTTPD, "Could not create file segment for %s, will copy it instead\n", mfi->path);
+
+      if (!st->seg)
+#endif
+	{
+	  st->buf = (uint8_t *)malloc(STREAM_CHUNK_SIZE);
+	  if (!st->buf)
+	    {
+	      DPRINTF(E_LOG, L_HTTPD, "Out of memory for raw streaming buffer\n");
+
+	      evhttp_send_error(req, HTTP_SERVUNAVAIL, "Internal Server Error");
+
+	      goto out_cleanup;
+	    }
+	}
+
       pos = lseek(st->fd, offset, SEEK_SET);
       if (pos == (off_t) -1)
 	{
@@ -620,7 +909,12 @@ httpd_stream_file(struct evhttp_request *req, int id)
        * and overrides whatever may have been set previously, like
        * application/x-dmap-tagged when we're speaking DAAP.
        */
-      if (mfi->has_video)
+      if (cached)
+	{
+	  if (!evhttp_find_header(output_headers, "Content-Type"))
+	    evhttp_add_header(output_headers, "Content-Type", "audio/wav");
+	}
+      else if (mfi->has_video)
 	{
 	  /* Front Row and others expect video/<type> */
 	  ret = snprintf(buf, sizeof(buf), "video/%s", mfi->type);
@@ -668,7 +962,16 @@ httpd_stream_file(struct evhttp_request *req, int id)
       goto out_cleanup;
     }
 
-  st->ev = event_new(evbase_httpd, -1, EV_TIMEOUT, stream_cb, st);
+#ifdef STREAM_SENDFILE
+  /* Without this flag libevent copies file segments into memory when they are
+   * added to st->evbuf. We only ever move its content to the connection with
+   * evhttp_send_reply_chunk(), which keeps the segment as it is.
+   */
+  if (st->seg)
+    evbuffer_set_flags(st->evbuf, EVBUFFER_FLAG_DRAINS_TO_FD);
+#endif
+
+  st->ev = event_new(httpd_request_evbase(req), -1, EV_TIMEOUT, stream_cb, st);
   evutil_timerclear(&tv);
   if (!st->ev || (event_add(st->ev, &tv) < 0))
     {
@@ -741,6 +1044,13 @@ httpd_stream_file(struct evhttp_request *req, int id)
 
   evhttp_connection_set_closecb(evcon, stream_fail_cb, st);
 
+  clock_gettime(CLOCK_MONOTONIC, &st->start);
+
+  __atomic_add_fetch(&stream_stats.active, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&stream_stats.streams, 1, __ATOMIC_RELAXED);
+  if (cached)
+    __atomic_add_fetch(&stream_stats.cached, 1, __ATOMIC_RELAXED);
+
   DPRINTF(E_INFO, L_HTTPD, "Kicking off streaming for %s\n", mfi->path);
 
   free_mfi(mfi, 0);
@@ -750,10 +1060,17 @@ httpd_stream_file(struct evhttp_request *req, int id)
  out_cleanup:
   if (st->evbuf)
     evbuffer_free(st->evbuf);
+  if (st->fill)
+    transcode_cache_fill_end(st->fill, 0);
   if (st->xcode)
     transcode_cleanup(st->xcode);
   if (st->buf)
     free(st->buf);
+#ifdef STREAM_SENDFILE
+  if (st->seg)
+    evbuffer_file_segment_free(st->seg);
+  else
+#endif
   if (st->fd > 0)
     close(st->fd);
  out_free_st:
@@ -825,6 +1142,40 @@ httpd_gzip_deflate(struct evbuffer *in)
   return NULL;
 }
 
+/* Sends the reply, or if we are a worker building the reply to a deferred
+ * request, saves it so the loop serving the request can send it. If error is
+ * set the reply is made with evhttp_send_error() and evbuf is ignored.
+ */
+static void
+httpd_reply_send(struct evhttp_request *req, int code, const char *reason, struct evbuffer *evbuf, int error)
+{
+  struct httpd_job *job;
+
+  job = httpd_job_current;
+  if (!job || (job->req != req))
+    {
+      if (error)
+	evhttp_send_error(req, code, reason);
+      else
+	evhttp_send_reply(req, code, reason, evbuf);
+      return;
+    }
+
+  if (job->replied)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Bug! Deferred request was replied to more than once\n");
+      return;
+    }
+
+  job->replied = 1;
+  job->error = error;
+  job->code = code;
+  job->reason = strdup(reason ? reason : "");
+
+  if (!error && evbuf)
+    evbuffer_add_buffer(job->reply, evbuf);
+}
+
 void
 httpd_send_reply(struct evhttp_request *req, int code, const char *reason, struct evbuffer *evbuf, enum httpd_send_flags flags)
 {
@@ -854,7 +1205,7 @@ httpd_send_reply(struct evhttp_request *req, int code, const char *reason, struc
       DPRINTF(E_DBG, L_HTTPD, "Gzipping response\n");
 
       evhttp_add_header(output_headers, "Content-Encoding", "gzip");
-      evhttp_send_reply(req, code, reason, gzbuf);
+      httpd_reply_send(req, code, reason, gzbuf, 0);
       evbuffer_free(gzbuf);
 
       // Drain original buffer, as would be after evhttp_send_reply()
@@ -862,9 +1213,173 @@ httpd_send_reply(struct evhttp_request *req, int code, const char *reason, struc
     }
   else
     {
-      evhttp_send_reply(req, code, reason, evbuf);
+      httpd_reply_send(req, code, reason, evbuf, 0);
+    }
+}
+
+#ifndef HAVE_LIBEVENT2_OLD
+struct httpd_chunked_reply *
+httpd_send_reply_start(struct evhttp_request *req, int code, const char *reason, enum httpd_send_flags flags)
+{
+  struct httpd_chunked_reply *cr;
+  struct evkeyvalq *input_headers;
+  struct evkeyvalq *output_headers;
+  const char *param;
+  int ret;
+
+  cr = calloc(1, sizeof(struct httpd_chunked_reply));
+  if (!cr)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Out of memory for chunked reply\n");
+      return NULL;
+    }
+
+  cr->out = evbuffer_new();
+  if (!cr->out)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not allocate evbuffer for chunked reply\n");
+      free(cr);
+      return NULL;
+    }
+
+  input_headers = evhttp_request_get_input_headers(req);
+  output_headers = evhttp_request_get_output_headers(req);
+
+  cr->gzip = ( (!(flags & HTTPD_SEND_NO_GZIP)) &&
+               (param = evhttp_find_header(input_headers, "Accept-Encoding")) &&
+               (strstr(param, "gzip") || strstr(param, "*"))
+             );
+
+  if (cr->gzip)
+    {
+      cr->strm.zalloc = Z_NULL;
+      cr->strm.zfree = Z_NULL;
+      cr->strm.opaque = Z_NULL;
+
+      ret = deflateInit2(&cr->strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+      if (ret != Z_OK)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "zlib setup failed, sending chunked reply uncompressed: %s\n", zError(ret));
+	  cr->gzip = 0;
+	}
+    }
+
+  if (allow_origin)
+    evhttp_add_header(output_headers, "Access-Control-Allow-Origin", allow_origin);
+
+  if (cr->gzip)
+    evhttp_add_header(output_headers, "Content-Encoding", "gzip");
+
+  cr->req = req;
+
+  evhttp_send_reply_start(req, code, reason);
+
+  return cr;
+}
+
+static int
+chunked_reply_deflate(struct httpd_chunked_reply *cr, struct evbuffer *evbuf, int flush)
+{
+  struct evbuffer_iovec in[8];
+  struct evbuffer_iovec out[1];
+  int nin;
+  int i;
+  int ret;
+
+  nin = evbuf ? evbuffer_peek(evbuf, -1, NULL, in, sizeof(in) / sizeof(in[0])) : 0;
+  if (nin > sizeof(in) / sizeof(in[0]))
+    {
+      // Too fragmented, rare enough that we don't mind the memcpy
+      evbuffer_pullup(evbuf, -1);
+      nin = evbuffer_peek(evbuf, -1, NULL, in, 1);
+    }
+
+  for (i = 0; i <= nin; i++)
+    {
+      if (i < nin)
+	{
+	  cr->strm.next_in = in[i].iov_base;
+	  cr->strm.avail_in = in[i].iov_len;
+	}
+      else
+	{
+	  cr->strm.next_in = NULL;
+	  cr->strm.avail_in = 0;
+	}
+
+      // Input of the last iteration is empty, but we use it to flush
+      do
+	{
+	  ret = evbuffer_reserve_space(cr->out, STREAM_CHUNK_SIZE, out, 1);
+	  if (ret < 0)
+	    {
+	      DPRINTF(E_LOG, L_HTTPD, "Could not reserve memory for gzipped chunk\n");
+	      return -1;
+	    }
+
+	  cr->strm.next_out = out[0].iov_base;
+	  cr->strm.avail_out = out[0].iov_len;
+
+	  ret = deflate(&cr->strm, (i < nin) ? Z_NO_FLUSH : flush);
+	  if (ret == Z_STREAM_ERROR)
+	    {
+	      DPRINTF(E_LOG, L_HTTPD, "Error gzipping chunk\n");
+	      return -1;
+	    }
+
+	  out[0].iov_len -= cr->strm.avail_out;
+	  evbuffer_commit_space(cr->out, out, 1);
+	}
+      while (cr->strm.avail_out == 0);
+    }
+
+  if (evbuf)
+    evbuffer_drain(evbuf, evbuffer_get_length(evbuf));
+
+  return 0;
+}
+
+int
+httpd_send_reply_chunk(struct httpd_chunked_reply *cr, struct evbuffer *evbuf, void (*cb)(struct evhttp_connection *, void *), void *arg)
+{
+  int ret;
+
+  if (!cr->gzip)
+    {
+      evhttp_send_reply_chunk_with_cb(cr->req, evbuf, cb, arg);
+      return 0;
+    }
+
+  // Sync flush so that every chunk produces output, otherwise cb might never
+  // be called. The loss of compression is negligible with large chunks.
+  ret = chunked_reply_deflate(cr, evbuf, Z_SYNC_FLUSH);
+  if (ret < 0)
+    return -1;
+
+  evhttp_send_reply_chunk_with_cb(cr->req, cr->out, cb, arg);
+
+  return 0;
+}
+
+void
+httpd_send_reply_end(struct httpd_chunked_reply *cr, int failed)
+{
+  if (!failed && cr->gzip)
+    {
+      if (chunked_reply_deflate(cr, NULL, Z_FINISH) == 0)
+	evhttp_send_reply_chunk(cr->req, cr->out);
     }
+
+  if (!failed)
+    evhttp_send_reply_end(cr->req);
+
+  if (cr->gzip)
+    deflateEnd(&cr->strm);
+
+  evbuffer_free(cr->out);
+  free(cr);
 }
+#endif /* !HAVE_LIBEVENT2_OLD */
 
 // This is a modified version of evhttp_send_error (credit libevent)
 void
@@ -875,7 +1390,7 @@ httpd_send_error(struct evhttp_request* req, int error, const char* reason)
 
   if (!allow_origin)
     {
-      evhttp_send_error(req, error, reason);
+      httpd_reply_send(req, error, reason, NULL, 1);
       return;
     }
 
@@ -893,7 +1408,7 @@ httpd_send_error(struct evhttp_request* req, int error, const char* reason)
   else
     evbuffer_add_printf(evbuf, ERR_PAGE, error, reason, reason);
 
-  evhttp_send_reply(req, error, reason, evbuf);
+  httpd_reply_send(req, error, reason, evbuf, 0);
 
   if (evbuf)
     evbuffer_free(evbuf);
@@ -980,6 +1495,12 @@ serve_file(struct evhttp_request *req, char *uri)
       return;
     }
 
+  if (strncmp(uri, "/stats/", strlen("/stats/")) == 0)
+    {
+      stats_interface(req, uri);
+      return;
+    }
+
   ret = snprintf(path, sizeof(path), "%s%s", WEBFACE_ROOT, uri + 1); /* skip starting '/' */
   if ((ret < 0) || (ret >= sizeof(path)))
     {
@@ -1111,7 +1632,7 @@ serve_file(struct evhttp_request *req, char *uri)
 
 /* Thread: httpd */
 static void
-httpd_gen_cb(struct evhttp_request *req, void *arg)
+httpd_dispatch(struct evhttp_request *req)
 {
   struct evkeyvalq *input_headers;
   struct evkeyvalq *output_headers;
@@ -1195,12 +1716,43 @@ httpd_gen_cb(struct evhttp_request *req, void *arg)
   free(uri);
 }
 
-/* Thread: httpd */
+/* Thread: httpd (any of the loops) */
+static void
+httpd_gen_cb(struct evhttp_request *req, void *arg)
+{
+  struct httpd_loop *loop;
+  struct timespec start;
+  struct timespec end;
+  uint64_t usec;
+
+  loop = (struct httpd_loop *)arg;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  httpd_dispatch(req);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  // Only the time spent in the loop, not the time until an async reply is sent
+  usec = (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_nsec - start.tv_nsec) / 1000;
+
+  pthread_mutex_lock(&httpd_stats_lck);
+  loop->requests++;
+  loop->usec_total += usec;
+  if (usec > loop->usec_max)
+    loop->usec_max = usec;
+  pthread_mutex_unlock(&httpd_stats_lck);
+}
+
+/* Thread: httpd (any of the loops) */
 static void *
 httpd(void *arg)
 {
+  struct httpd_loop *loop;
   int ret;
 
+  loop = (struct httpd_loop *)arg;
+
   ret = db_perthread_init();
   if (ret < 0)
     {
@@ -1209,10 +1761,10 @@ httpd(void *arg)
       pthread_exit(NULL);
     }
 
-  event_base_dispatch(evbase_httpd);
+  event_base_dispatch(loop->evbase);
 
   if (!httpd_exit)
-    DPRINTF(E_FATAL, L_HTTPD, "HTTPd event loop terminated ahead of time!\n");
+    DPRINTF(E_FATAL, L_HTTPD, "HTTPd event loop %d terminated ahead of time!\n", loop->id);
 
   db_perthread_deinit();
 
@@ -1223,11 +1775,307 @@ httpd(void *arg)
 static void
 exit_cb(int fd, short event, void *arg)
 {
-  event_base_loopbreak(evbase_httpd);
+  int i;
+
+  for (i = 0; i < httpd_nloops; i++)
+    event_base_loopbreak(httpd_loops[i].evbase);
 
   httpd_exit = 1;
 }
 
+/* Thread: main */
+static int
+loop_start(struct httpd_loop *loop)
+{
+  char name[16];
+  int ret;
+
+  ret = pthread_create(&loop->tid, NULL, httpd, loop);
+  if (ret != 0)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not spawn HTTPd thread %d: %s\n", loop->id, strerror(ret));
+      return -1;
+    }
+
+  if (loop->id == 0)
+    snprintf(name, sizeof(name), "httpd");
+  else
+    snprintf(name, sizeof(name), "httpd_%d", loop->id);
+
+#if defined(HAVE_PTHREAD_SETNAME_NP)
+  pthread_setname_np(loop->tid, name);
+#elif defined(HAVE_PTHREAD_SET_NAME_NP)
+  pthread_set_name_np(loop->tid, name);
+#endif
+
+  return 0;
+}
+
+/* Thread: main */
+static void
+loops_free(void)
+{
+  int i;
+
+  for (i = 0; i < httpd_nloops; i++)
+    {
+      if (httpd_loops[i].evhttp)
+	evhttp_free(httpd_loops[i].evhttp);
+      event_base_free(httpd_loops[i].evbase);
+    }
+
+  memset(httpd_loops, 0, sizeof(httpd_loops));
+  httpd_nloops = 0;
+}
+
+/* Thread: any httpd loop */
+struct event_base *
+httpd_request_evbase(struct evhttp_request *req)
+{
+  struct evhttp_connection *evcon;
+
+  evcon = evhttp_request_get_connection(req);
+  if (!evcon)
+    return evbase_httpd;
+
+  return evhttp_connection_get_base(evcon);
+}
+
+static void
+httpd_job_free(struct httpd_job *job)
+{
+  if (job->ev)
+    event_free(job->ev);
+
+  if (job->finish_arg_free)
+    job->finish_arg_free(job->finish_arg);
+
+  // When the connection fails before we replied, the request may be ours to
+  // free, see httpd_job_fail_cb()
+  if (job->owned)
+    evhttp_request_free(job->req);
+
+  if (job->arg_free)
+    job->arg_free(job->arg);
+
+  if (job->reply)
+    evbuffer_free(job->reply);
+
+  free(job->reason);
+  free(job);
+}
+
+/* Thread: worker pool or httpd (the loop serving the request) */
+static void
+httpd_job_unref(struct httpd_job *job)
+{
+  int refcount;
+
+  pthread_mutex_lock(&httpd_job_lck);
+  refcount = --job->refcount;
+  pthread_mutex_unlock(&httpd_job_lck);
+
+  if (refcount == 0)
+    httpd_job_free(job);
+}
+
+/* Thread: worker pool */
+static void
+httpd_job_done(void)
+{
+  pthread_mutex_lock(&httpd_job_lck);
+  httpd_jobs--;
+  if (httpd_jobs == 0)
+    pthread_cond_signal(&httpd_job_cond);
+  pthread_mutex_unlock(&httpd_job_lck);
+}
+
+/* Thread: worker pool */
+static void
+httpd_job_run(void *arg)
+{
+  struct httpd_job *job;
+  int cancelled;
+
+  job = (struct httpd_job *)arg;
+
+  pthread_mutex_lock(&httpd_job_lck);
+  cancelled = job->cancelled || httpd_jobs_stop;
+  pthread_mutex_unlock(&httpd_job_lck);
+
+  // The client went away while the job was queued, or we are shutting down
+  if (cancelled)
+    {
+      httpd_job_unref(job);
+      httpd_job_done();
+      return;
+    }
+
+  httpd_job_current = job;
+  job->cb(job->req, job->arg);
+  httpd_job_current = NULL;
+
+  // If the client went away in the meantime the reply is just dropped
+  pthread_mutex_lock(&httpd_job_lck);
+  if (!job->cancelled)
+    event_active(job->ev, 0, 0);
+  pthread_mutex_unlock(&httpd_job_lck);
+
+  httpd_job_unref(job);
+  httpd_job_done();
+}
+
+/* Thread: httpd (the loop serving the request) */
+static void
+httpd_job_done_cb(int fd, short what, void *arg)
+{
+  struct httpd_job *job;
+  struct evhttp_connection *evcon;
+
+  job = (struct httpd_job *)arg;
+
+  evcon = evhttp_request_get_connection(job->req);
+  if (evcon)
+    evhttp_connection_set_closecb(evcon, NULL, NULL);
+
+  if (!job->replied)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Bug! Deferred request was not replied to\n");
+      httpd_send_error(job->req, 500, "Internal Server Error");
+    }
+  else if (job->finish_cb)
+    {
+      // The callback takes over the argument
+      job->finish_arg_free = NULL;
+      job->finish_cb(job->req, job->finish_arg);
+    }
+  else if (job->error)
+    evhttp_send_error(job->req, job->code, job->reason);
+  else
+    evhttp_send_reply(job->req, job->code, job->reason, job->reply);
+
+  httpd_job_unref(job);
+}
+
+/* Thread: httpd (the loop serving the request) */
+static void
+httpd_job_fail_cb(struct evhttp_connection *evcon, void *arg)
+{
+  struct httpd_job *job;
+
+  job = (struct httpd_job *)arg;
+
+  DPRINTF(E_DBG, L_HTTPD, "Connection failed while the reply was being made\n");
+
+  evhttp_connection_set_closecb(evcon, NULL, NULL);
+
+  // When the client goes away, libevent detaches the request from the failed
+  // connection, and we own it so it stays valid for the worker. The request is
+  // only still attached when evhttp_free() frees the connection at shutdown,
+  // after the workers are done with their jobs (see httpd_deinit()). Then
+  // libevent frees it with the connection once this callback returns.
+  if (!evhttp_request_get_connection(job->req))
+    {
+      evhttp_request_own(job->req);
+      job->owned = 1;
+    }
+
+  pthread_mutex_lock(&httpd_job_lck);
+  job->cancelled = 1;
+  pthread_mutex_unlock(&httpd_job_lck);
+
+  // The worker may have finished already, then the completion event is pending
+  event_del(job->ev);
+
+  httpd_job_unref(job);
+}
+
+int
+httpd_defer(struct evhttp_request *req, httpd_job_cb cb, void *arg, void (*arg_free)(void *))
+{
+  struct httpd_job *job;
+  struct evhttp_connection *evcon;
+  int ret;
+
+  evcon = evhttp_request_get_connection(req);
+  if (!evcon)
+    return -1;
+
+  job = calloc(1, sizeof(struct httpd_job));
+  if (!job)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Out of memory for deferred request\n");
+      return -1;
+    }
+
+  job->req = req;
+  job->cb = cb;
+  job->arg = arg;
+  job->refcount = 2;
+
+  job->reply = evbuffer_new();
+  job->ev = event_new(httpd_request_evbase(req), -1, 0, httpd_job_done_cb, job);
+  if (!job->reply || !job->ev)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Out of memory for deferred request\n");
+      goto error;
+    }
+
+  // The job owns the argument once it is queued
+  job->arg_free = arg_free;
+
+  evhttp_connection_set_closecb(evcon, httpd_job_fail_cb, job);
+
+  pthread_mutex_lock(&httpd_job_lck);
+  httpd_jobs++;
+  pthread_mutex_unlock(&httpd_job_lck);
+
+  ret = worker_pool_execute(httpd_job_run, job);
+  if (ret < 0)
+    {
+      pthread_mutex_lock(&httpd_job_lck);
+      httpd_jobs--;
+      pthread_mutex_unlock(&httpd_job_lck);
+
+      evhttp_connection_set_closecb(evcon, NULL, NULL);
+      job->arg_free = NULL;
+      goto error;
+    }
+
+  return 0;
+
+ error:
+  httpd_job_free(job);
+  return -1;
+}
+
+void
+httpd_defer_finish(struct evhttp_request *req, httpd_job_cb cb, void *arg, void (*arg_free)(void *))
+{
+  struct httpd_job *job;
+
+  job = httpd_job_current;
+  if (!job || (job->req != req))
+    {
+      cb(req, arg);
+      return;
+    }
+
+  if (job->replied)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Bug! Deferred request was replied to more than once\n");
+
+      if (arg_free)
+	arg_free(arg);
+      return;
+    }
+
+  job->replied = 1;
+  job->finish_cb = cb;
+  job->finish_arg = arg;
+  job->finish_arg_free = arg_free;
+}
+
 char *
 httpd_fixup_uri(struct evhttp_request *req)
 {
@@ -1414,19 +2262,43 @@ httpd_basic_auth(struct evhttp_request *req, char *user, char *passwd, char *rea
 int
 httpd_init(void)
 {
+  struct evhttp_bound_socket *bound;
+  evutil_socket_t fd;
   int v6enabled;
+  int nloops;
   int ret;
+  int i;
 
   httpd_exit = 0;
 
-  evbase_httpd = event_base_new();
-  if (!evbase_httpd)
+  nloops = cfg_getint(cfg_getsec(cfg, "general"), "httpd_threads");
+  if ((nloops < 1) || (nloops > HTTPD_LOOPS_MAX))
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Invalid httpd_threads (%d), must be between 1 and %d\n", nloops, HTTPD_LOOPS_MAX);
+      nloops = (nloops < 1) ? 1 : HTTPD_LOOPS_MAX;
+    }
+#ifdef HAVE_LIBEVENT2_OLD
+  if (nloops > 1)
     {
-      DPRINTF(E_FATAL, L_HTTPD, "Could not create an event base\n");
+      DPRINTF(E_LOG, L_HTTPD, "More than one httpd thread requires libevent 2.1.4 or later\n");
+      nloops = 1;
+    }
+#endif
 
-      return -1;
+  for (httpd_nloops = 0; httpd_nloops < nloops; httpd_nloops++)
+    {
+      httpd_loops[httpd_nloops].id = httpd_nloops;
+      httpd_loops[httpd_nloops].evbase = event_base_new();
+      if (!httpd_loops[httpd_nloops].evbase)
+	{
+	  DPRINTF(E_FATAL, L_HTTPD, "Could not create an event base\n");
+
+	  goto evbase_fail;
+	}
     }
 
+  evbase_httpd = httpd_loops[0].evbase;
+
   ret = rsp_init();
   if (ret < 0)
     {
@@ -1453,6 +2325,10 @@ httpd_init(void)
 
   streaming_init();
 
+  ret = transcode_cache_init();
+  if (ret < 0)
+    DPRINTF(E_LOG, L_HTTPD, "Transcode cache init failed, transcoded streams will not be cached\n");
+
 #ifdef USE_EVENTFD
   exit_efd = eventfd(0, EFD_CLOEXEC);
   if (exit_efd < 0)
@@ -1486,31 +2362,35 @@ httpd_init(void)
     }
   event_add(exitev, NULL);
 
-  evhttpd = evhttp_new(evbase_httpd);
-  if (!evhttpd)
-    {
-      DPRINTF(E_FATAL, L_HTTPD, "Could not create HTTP server\n");
-
-      goto event_fail;
-    }
-
   v6enabled = cfg_getbool(cfg_getsec(cfg, "general"), "ipv6");
   httpd_port = cfg_getint(cfg_getsec(cfg, "library"), "port");
 
   // For CORS headers
   allow_origin = cfg_getstr(cfg_getsec(cfg, "general"), "allow_origin");
-  if (allow_origin)
+  if (allow_origin && (strlen(allow_origin) == 0))
+    allow_origin = NULL;
+
+  for (i = 0; i < httpd_nloops; i++)
     {
-      if (strlen(allow_origin) != 0)
-	evhttp_set_allowed_methods(evhttpd, EVHTTP_REQ_GET | EVHTTP_REQ_POST | EVHTTP_REQ_HEAD | EVHTTP_REQ_OPTIONS);
-      else
-	allow_origin = NULL;
+      httpd_loops[i].evhttp = evhttp_new(httpd_loops[i].evbase);
+      if (!httpd_loops[i].evhttp)
+	{
+	  DPRINTF(E_FATAL, L_HTTPD, "Could not create HTTP server\n");
+
+	  goto evhttp_fail;
+	}
+
+      if (allow_origin)
+	evhttp_set_allowed_methods(httpd_loops[i].evhttp, EVHTTP_REQ_GET | EVHTTP_REQ_POST | EVHTTP_REQ_HEAD | EVHTTP_REQ_OPTIONS);
+
+      evhttp_set_gencb(httpd_loops[i].evhttp, httpd_gen_cb, &httpd_loops[i]);
     }
 
+  bound = NULL;
   if (v6enabled)
     {
-      ret = evhttp_bind_socket(evhttpd, "::", httpd_port);
-      if (ret < 0)
+      bound = evhttp_bind_socket_with_handle(httpd_loops[0].evhttp, "::", httpd_port);
+      if (!bound)
 	{
 	  DPRINTF(E_LOG, L_HTTPD, "Could not bind to port %d with IPv6, falling back to IPv4\n", httpd_port);
 	  v6enabled = 0;
@@ -1519,35 +2399,49 @@ httpd_init(void)
 
   if (!v6enabled)
     {
-      ret = evhttp_bind_socket(evhttpd, "0.0.0.0", httpd_port);
-      if (ret < 0)
+      bound = evhttp_bind_socket_with_handle(httpd_loops[0].evhttp, "0.0.0.0", httpd_port);
+      if (!bound)
 	{
 	  DPRINTF(E_FATAL, L_HTTPD, "Could not bind to port %d (forked-daapd already running?)\n", httpd_port);
-	  goto bind_fail;
+	  goto evhttp_fail;
 	}
     }
 
-  evhttp_set_gencb(evhttpd, httpd_gen_cb, NULL);
-
-  ret = pthread_create(&tid_httpd, NULL, httpd, NULL);
-  if (ret != 0)
+  // The other loops accept from the same socket. They get a dup of it, since
+  // each evhttp closes its listening sockets when freed.
+  for (i = 1; i < httpd_nloops; i++)
     {
-      DPRINTF(E_FATAL, L_HTTPD, "Could not spawn HTTPd thread: %s\n", strerror(errno));
+      fd = dup(evhttp_bound_socket_get_fd(bound));
+      if ((fd < 0) || (evhttp_accept_socket(httpd_loops[i].evhttp, fd) < 0))
+	{
+	  DPRINTF(E_FATAL, L_HTTPD, "Could not accept connections in HTTPd loop %d: %s\n", i, strerror(errno));
+	  if (fd >= 0)
+	    close(fd);
+	  goto evhttp_fail;
+	}
+    }
 
-      goto thread_fail;
+  for (i = 0; i < httpd_nloops; i++)
+    {
+      ret = loop_start(&httpd_loops[i]);
+      if (ret < 0)
+	goto thread_fail;
     }
 
-#if defined(HAVE_PTHREAD_SETNAME_NP)
-  pthread_setname_np(tid_httpd, "httpd");
-#elif defined(HAVE_PTHREAD_SET_NAME_NP)
-  pthread_set_name_np(tid_httpd, "httpd");
-#endif
+  if (httpd_nloops > 1)
+    DPRINTF(E_INFO, L_HTTPD, "Serving HTTP requests with %d threads\n", httpd_nloops);
 
   return 0;
 
  thread_fail:
- bind_fail:
-  evhttp_free(evhttpd);
+  httpd_exit = 1;
+  while (--i >= 0)
+    {
+      event_base_loopbreak(httpd_loops[i].evbase);
+      pthread_join(httpd_loops[i].tid, NULL);
+    }
+ evhttp_fail:
+  event_free(exitev);
  event_fail:
 #ifdef USE_EVENTFD
   close(exit_efd);
@@ -1556,6 +2450,7 @@ httpd_init(void)
   close(exit_pipe[1]);
 #endif
  pipe_fail:
+  transcode_cache_deinit();
   streaming_deinit();
   dacp_deinit();
  dacp_fail:
@@ -1563,7 +2458,8 @@ httpd_init(void)
  daap_fail:
   rsp_deinit();
  rsp_fail:
-  event_base_free(evbase_httpd);
+ evbase_fail:
+  loops_free();
 
   return -1;
 }
@@ -1573,6 +2469,7 @@ void
 httpd_deinit(void)
 {
   int ret;
+  int i;
 
 #ifdef USE_EVENTFD
   ret = eventfd_write(exit_efd, 1);
@@ -1594,14 +2491,27 @@ httpd_deinit(void)
     }
 #endif
 
-  ret = pthread_join(tid_httpd, NULL);
-  if (ret != 0)
+  for (i = 0; i < httpd_nloops; i++)
     {
-      DPRINTF(E_FATAL, L_HTTPD, "Could not join HTTPd thread: %s\n", strerror(errno));
+      ret = pthread_join(httpd_loops[i].tid, NULL);
+      if (ret != 0)
+	{
+	  DPRINTF(E_FATAL, L_HTTPD, "Could not join HTTPd thread %d: %s\n", i, strerror(ret));
 
-      return;
+	  return;
+	}
     }
 
+  // Jobs still in the worker pool use their request and the protocol modules,
+  // so let running ones finish and queued ones be dropped. The requests are
+  // then freed with their connections by loops_free().
+  pthread_mutex_lock(&httpd_job_lck);
+  httpd_jobs_stop = 1;
+  while (httpd_jobs > 0)
+    pthread_cond_wait(&httpd_job_cond, &httpd_job_lck);
+  pthread_mutex_unlock(&httpd_job_lck);
+
+  transcode_cache_deinit();
   streaming_deinit();
   rsp_deinit();
   dacp_deinit();
@@ -1613,6 +2523,6 @@ httpd_deinit(void)
   close(exit_pipe[0]);
   close(exit_pipe[1]);
 #endif
-  evhttp_free(evhttpd);
-  event_base_free(evbase_httpd);
+  event_free(exitev);
+  loops_free();
 }
@@ -38,6 +38,46 @@ httpd_gzip_deflate(struct evbuffer *in);
 void
 httpd_send_reply(struct evhttp_request *req, int code, const char *reason, struct evbuffer *evbuf, enum httpd_send_flags flags);
 
+#ifndef HAVE_LIBEVENT2_OLD
+struct httpd_chunked_reply;
+
+/*
+ * Starts a chunked reply, for replies that are too large to be built in memory
+ * before sending. Like httpd_send_reply() the reply will be gzipped if the
+ * client accepts it, but here it is done incrementally, chunk by chunk.
+ *
+ * @in  req      The evhttp request struct
+ * @in  code     HTTP code, e.g. 200
+ * @in  reason   A brief explanation of the error - if NULL the standard meaning
+                 of the error code will be used
+ * @in  flags    See flags above
+ * @return       Context for the below functions, NULL on error
+ */
+struct httpd_chunked_reply *
+httpd_send_reply_start(struct evhttp_request *req, int code, const char *reason, enum httpd_send_flags flags);
+
+/*
+ * Sends (and drains) evbuf as the next chunk of the reply. The callback is
+ * invoked when the chunk has been written to the connection, so the caller can
+ * use it to produce the next chunk without buffering the whole reply.
+ *
+ * @in  cr       Context from httpd_send_reply_start()
+ * @in  evbuf    Data for the chunk
+ * @in  cb       Callback when the chunk has been written
+ * @in  arg      Argument for the callback
+ * @return       0 if successful, -1 if an error occurred
+ */
+int
+httpd_send_reply_chunk(struct httpd_chunked_reply *cr, struct evbuffer *evbuf, void (*cb)(struct evhttp_connection *, void *), void *arg);
+
+/*
+ * Completes the reply and frees the context. If failed is set (e.g. because
+ * the connection was closed) the reply is not completed, only freed.
+ */
+void
+httpd_send_reply_end(struct httpd_chunked_reply *cr, int failed);
+#endif
+
 /*
  * This is a substitute for evhttp_send_error that should be used whenever an
  * error may be returned to a browser. It will set CORS headers as appropriate,
@@ -55,6 +95,53 @@ httpd_send_error(struct evhttp_request *req, int error, const char *reason);
 char *
 httpd_fixup_uri(struct evhttp_request *req);
 
+/*
+ * Requests may be served by any of the httpd event loops (see httpd_threads in
+ * the config), and events concerning a request must be added to the event base
+ * of the loop that serves it, since the connection is only safe to use from
+ * that loop.
+ *
+ * @in  req      The evhttp request struct
+ * @return       The event base of the loop serving the request
+ */
+struct event_base *
+httpd_request_evbase(struct evhttp_request *req);
+
+typedef void (*httpd_job_cb)(struct evhttp_request *req, void *arg);
+
+/*
+ * Hands the request over to the worker pool, where cb will be called with a
+ * DB connection of its own. This is for handlers that may take long to make
+ * the reply, so they don't hold up the other requests of the loop. The reply
+ * that cb makes with httpd_send_reply() or httpd_send_error() is sent by the
+ * loop serving the request once cb returns, so cb must reply in one of those
+ * ways, and must not add events. A chunked reply must be started by the loop,
+ * see httpd_defer_finish().
+ *
+ * @in  req      The evhttp request struct
+ * @in  cb       Callback that handles the request in a worker pool thread
+ * @in  arg      Argument for the callback
+ * @in  arg_free If set, called to free arg when the request is done or failed
+ * @return       0 if the request was deferred, otherwise -1 and the caller
+ *               still owns arg and must handle the request itself
+ */
+int
+httpd_defer(struct evhttp_request *req, httpd_job_cb cb, void *arg, void (*arg_free)(void *));
+
+/*
+ * Replies to a deferred request by having cb called by the loop serving the
+ * request once the worker is done, e.g. so cb can start a chunked reply. If the
+ * client goes away before that, cb isn't called and arg_free frees arg. If the
+ * request isn't deferred, cb is called right away.
+ *
+ * @in  req      The evhttp request struct
+ * @in  cb       Callback that makes the reply in the loop serving the request
+ * @in  arg      Argument for the callback, which takes it over
+ * @in  arg_free If set, called to free arg if cb is not called
+ */
+void
+httpd_defer_finish(struct evhttp_request *req, httpd_job_cb cb, void *arg, void (*arg_free)(void *));
+
 int
 httpd_basic_auth(struct evhttp_request *req, char *user, char *passwd, char *realm);
 
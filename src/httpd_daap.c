@@ -36,6 +36,7 @@
 #include <inttypes.h>
 #include <time.h>
 #include <ctype.h>
+#include <pthread.h>
 
 #include <uninorm.h>
 #include <unistd.h>
@@ -57,9 +58,6 @@
 #include <event2/http_struct.h>
 #include <event2/keyvalq_struct.h>
 
-/* httpd event base, from httpd.c */
-extern struct event_base *evbase_httpd;
-
 /* Max number of sessions and session timeout
  * Many clients (including iTunes) don't seem to respect the timeout capability
  * that we announce, and just keep using the same session. Therefore we take a
@@ -77,10 +75,30 @@ extern struct event_base *evbase_httpd;
 /* Database number for the Radio item */
 #define DAAP_DB_RADIO 2
 
+/* Song lists larger than this are not built in memory, but streamed with a
+ * chunked reply from the blocks in the DMAP item cache. The second is the size
+ * of each chunk.
+ */
+#define DAAP_SONGLIST_STREAM_THRESHOLD (1024 * 1024)
+#define DAAP_SONGLIST_CHUNK_SIZE (64 * 1024)
+
 struct uri_map {
   regex_t preg;
   char *regexp;
   int (*handler)(struct evhttp_request *req, struct evbuffer *evbuf, char **uri, struct evkeyvalq *query, const char *ua);
+  // Handler may take long, so it runs in the worker pool (see httpd_defer)
+  int deferred;
+};
+
+// A request handed over to the worker pool
+struct daap_job {
+  int handler;
+  char *full_uri;
+  char *uri;
+  char *uri_parts[7];
+  struct evkeyvalq query;
+  const char *ua;
+  struct evbuffer *evbuf;
 };
 
 struct daap_session {
@@ -108,12 +126,71 @@ struct sort_ctx {
   uint32_t misc_mshn;
 };
 
+struct songlist_encoder {
+  const struct dmap_field **meta;
+  int nmeta;
+  int sort_headers;
+
+  const char *ua;
+  const char *client_codecs;
+  int remote;
+
+  char *last_codectype;
+  int transcode;
+
+  /* For the DMAP item cache: identifies meta set and options, without and
+   * with transcoding, and a buffer for encoding a single item. The generation
+   * must be taken before the query that the items are read with is started.
+   */
+  uint64_t item_key[2];
+  uint64_t item_gen;
+  struct evbuffer *item;
+};
+
+/* An item of a large song list, its block is pinned in the DMAP item cache */
+struct songlist_item {
+  struct dmap_item *block;
+  size_t len;
+};
+
+struct songlist_stream {
+  struct evhttp_request *req;
+  struct httpd_chunked_reply *cr;
+  struct event *ev;
+
+  /* While the reply is made the encoded block of each item is pinned, so the
+   * header with the container lengths can be sent as soon as the query is done.
+   * The items are then sent as they were at that point, also if they change or
+   * the cache drops them while the client reads the reply. Each block is
+   * released once it has been sent.
+   */
+  struct songlist_item *items;
+  int nitems;
+  int nitems_max;
+  int next;
+  size_t len;
+  size_t streamed;
+
+  /* Set when the song list turned out too large for a normal reply */
+  int streaming;
+
+  struct sort_ctx *sctx;
+  struct evbuffer *chunk;
+
+  const char *tag;
+};
+
 
 /* Default meta tags if not provided in the query */
 static char *default_meta_plsongs = "dmap.itemkind,dmap.itemid,dmap.itemname,dmap.containeritemid,dmap.parentcontainerid";
 static char *default_meta_pl = "dmap.itemid,dmap.itemname,dmap.persistentid,com.apple.itunes.smart-playlist";
 static char *default_meta_group = "dmap.itemname,dmap.persistentid,daap.songalbumartist";
 
+/* Protects the sessions and the update requests, since requests may be served
+ * by more than one httpd thread
+ */
+static pthread_mutex_t daap_lck = PTHREAD_MUTEX_INITIALIZER;
+
 /* DAAP session tracking */
 static struct daap_session *daap_sessions;
 
@@ -133,6 +210,7 @@ daap_session_free(struct daap_session *s)
   free(s);
 }
 
+// Must be called with daap_lck held
 static void
 daap_session_remove(struct daap_session *s)
 {
@@ -162,6 +240,7 @@ daap_session_remove(struct daap_session *s)
   daap_session_free(s);
 }
 
+// Must be called with daap_lck held
 static struct daap_session *
 daap_session_get(int id)
 {
@@ -177,7 +256,7 @@ daap_session_get(int id)
 }
 
 /* Removes stale sessions and also drops the oldest sessions if DAAP_SESSION_MAX
- * will otherwise be exceeded
+ * will otherwise be exceeded. Must be called with daap_lck held.
  */
 static void
 daap_session_cleanup(void)
@@ -204,28 +283,34 @@ daap_session_cleanup(void)
     }
 }
 
-static struct daap_session *
+// Returns the id of the new session, or -1 on failure
+static int
 daap_session_add(const char *user_agent, int request_session_id)
 {
   struct daap_session *s;
-
-  daap_session_cleanup();
+  int id;
 
   s = (struct daap_session *)malloc(sizeof(struct daap_session));
   if (!s)
     {
       DPRINTF(E_LOG, L_DAAP, "Out of memory for DAAP session\n");
-      return NULL;
+      return -1;
     }
 
   memset(s, 0, sizeof(struct daap_session));
 
+  pthread_mutex_lock(&daap_lck);
+
+  daap_session_cleanup();
+
   if (request_session_id)
     {
       if (daap_session_get(request_session_id))
 	{
 	  DPRINTF(E_LOG, L_DAAP, "Session id requested in login (%d) is not available\n", request_session_id);
-	  return NULL;
+	  pthread_mutex_unlock(&daap_lck);
+	  free(s);
+	  return -1;
 	}
       
       s->id = request_session_id;
@@ -245,10 +330,19 @@ daap_session_add(const char *user_agent, int request_session_id)
 
   daap_sessions = s;
 
-  return s;
+  // The session may be removed by another thread once the lock is released
+  id = s->id;
+
+  pthread_mutex_unlock(&daap_lck);
+
+  return id;
 }
 
-struct daap_session *
+/* Returns the id of the request's session, or -1 and replies with an error if
+ * it has none. Only the id is returned, since the session may be removed by
+ * another thread as soon as daap_lck is released.
+ */
+int
 daap_session_find(struct evhttp_request *req, struct evkeyvalq *query, struct evbuffer *evbuf)
 {
   struct daap_session *s;
@@ -257,7 +351,7 @@ daap_session_find(struct evhttp_request *req, struct evkeyvalq *query, struct ev
   int ret;
 
   if (!req)
-    return NULL;
+    return -1;
 
   param = evhttp_find_header(query, "session-id");
   if (!param)
@@ -270,20 +364,25 @@ daap_session_find(struct evhttp_request *req, struct evkeyvalq *query, struct ev
   if (ret < 0)
     goto invalid;
 
+  pthread_mutex_lock(&daap_lck);
+
   s = daap_session_get(id);
+  if (s)
+    s->mtime = time(NULL);
+
+  pthread_mutex_unlock(&daap_lck);
+
   if (!s)
     {
       DPRINTF(E_LOG, L_DAAP, "DAAP session id %d not found\n", id);
       goto invalid;
     }
 
-  s->mtime = time(NULL);
-
-  return s;
+  return id;
 
  invalid:
   httpd_send_error(req, 403, "Forbidden");
-  return NULL;
+  return -1;
 }
 
 
@@ -302,6 +401,8 @@ update_remove(struct daap_update_request *ur)
 {
   struct daap_update_request *p;
 
+  pthread_mutex_lock(&daap_lck);
+
   if (ur == update_requests)
     update_requests = ur->next;
   else
@@ -312,12 +413,15 @@ update_remove(struct daap_update_request *ur)
       if (!p)
 	{
 	  DPRINTF(E_LOG, L_DAAP, "WARNING: struct daap_update_request not found in list; BUG!\n");
+	  pthread_mutex_unlock(&daap_lck);
 	  return;
 	}
 
       p->next = ur->next;
     }
 
+  pthread_mutex_unlock(&daap_lck);
+
   update_free(ur);
 }
 
@@ -427,7 +531,7 @@ daap_sort_context_free(struct sort_ctx *ctx)
 }
 
 static int
-daap_sort_build(struct sort_ctx *ctx, char *str)
+daap_sort_build(struct sort_ctx *ctx, const char *str)
 {
   uint8_t *ret;
   size_t len;
@@ -933,9 +1037,9 @@ static int
 daap_reply_login(struct evhttp_request *req, struct evbuffer *evbuf, char **uri, struct evkeyvalq *query, const char *ua)
 {
   struct pairing_info pi;
-  struct daap_session *s;
   const char *param;
   int request_session_id;
+  int id;
   int ret;
 
   ret = evbuffer_expand(evbuf, 32);
@@ -988,8 +1092,8 @@ daap_reply_login(struct evhttp_request *req, struct evbuffer *evbuf, char **uri,
   else
     request_session_id = 0;
 
-  s = daap_session_add(ua, request_session_id);
-  if (!s)
+  id = daap_session_add(ua, request_session_id);
+  if (id < 0)
     {
       dmap_send_error(req, "mlog", "Could not start session");
       return -1;
@@ -997,7 +1101,7 @@ daap_reply_login(struct evhttp_request *req, struct evbuffer *evbuf, char **uri,
 
   dmap_add_container(evbuf, "mlog", 24);
   dmap_add_int(evbuf, "mstt", 200);        /* 12 */
-  dmap_add_int(evbuf, "mlid", s->id); /* 12 */
+  dmap_add_int(evbuf, "mlid", id); /* 12 */
 
   httpd_send_reply(req, HTTP_OK, "OK", evbuf, 0);
 
@@ -1008,12 +1112,18 @@ static int
 daap_reply_logout(struct evhttp_request *req, struct evbuffer *evbuf, char **uri, struct evkeyvalq *query, const char *ua)
 {
   struct daap_session *s;
+  int session_id;
 
-  s = daap_session_find(req, query, evbuf);
-  if (!s)
+  session_id = daap_session_find(req, query, evbuf);
+  if (session_id < 0)
     return -1;
 
-  daap_session_remove(s);
+  // Another thread may have removed the session in the meantime
+  pthread_mutex_lock(&daap_lck);
+  s = daap_session_get(session_id);
+  if (s)
+    daap_session_remove(s);
+  pthread_mutex_unlock(&daap_lck);
 
   httpd_send_reply(req, 204, "Logout Successful", evbuf, 0);
 
@@ -1023,15 +1133,15 @@ daap_reply_logout(struct evhttp_request *req, struct evbuffer *evbuf, char **uri
 static int
 daap_reply_update(struct evhttp_request *req, struct evbuffer *evbuf, char **uri, struct evkeyvalq *query, const char *ua)
 {
-  struct daap_session *s;
+  int session_id;
   struct daap_update_request *ur;
   struct evhttp_connection *evcon;
   const char *param;
   int reqd_rev;
   int ret;
 
-  s = daap_session_find(req, query, evbuf);
-  if (!s)
+  session_id = daap_session_find(req, query, evbuf);
+  if (session_id < 0)
     return -1;
 
   param = evhttp_find_header(query, "revision-number");
@@ -1086,7 +1196,7 @@ daap_reply_update(struct evhttp_request *req, struct evbuffer *evbuf, char **uri
 
   if (DAAP_UPDATE_REFRESH > 0)
     {
-      ur->timeout = evtimer_new(evbase_httpd, update_refresh_cb, ur);
+      ur->timeout = evtimer_new(httpd_request_evbase(req), update_refresh_cb, ur);
       if (ur->timeout)
 	ret = evtimer_add(ur->timeout, &daap_update_refresh_tv);
       else
@@ -1105,8 +1215,10 @@ daap_reply_update(struct evhttp_request *req, struct evbuffer *evbuf, char **uri
   /* NOTE: we may need to keep reqd_rev in there too */
   ur->req = req;
 
+  pthread_mutex_lock(&daap_lck);
   ur->next = update_requests;
   update_requests = ur;
+  pthread_mutex_unlock(&daap_lck);
 
   /* If the connection fails before we have an update to push out
    * to the client, we need to know.
@@ -1132,15 +1244,15 @@ daap_reply_dblist(struct evhttp_request *req, struct evbuffer *evbuf, char **uri
 {
   struct evbuffer *content;
   struct evbuffer *item;
-  struct daap_session *s;
+  int session_id;
   cfg_t *lib;
   char *name;
   char *name_radio;
   size_t len;
   int count;
 
-  s = daap_session_find(req, query, evbuf);
-  if (!s)
+  session_id = daap_session_find(req, query, evbuf);
+  if (session_id < 0)
     return -1;
 
   lib = cfg_getsec(cfg, "library");
@@ -1227,31 +1339,424 @@ daap_reply_dblist(struct evhttp_request *req, struct evbuffer *evbuf, char **uri
   return 0;
 }
 
+/* Song list encoding state, shared by the reply builder and the streamer */
+static void
+songlist_encoder_init(struct songlist_encoder *enc, struct evhttp_request *req, const char *ua)
+{
+  struct evkeyvalq *headers;
+
+  memset(enc, 0, sizeof(struct songlist_encoder));
+
+  enc->ua = ua;
+  enc->remote = is_remote(ua);
+
+  if (!enc->remote && req)
+    {
+      headers = evhttp_request_get_input_headers(req);
+      enc->client_codecs = evhttp_find_header(headers, "Accept-Codecs");
+    }
+}
+
+static void
+songlist_encoder_deinit(struct songlist_encoder *enc)
+{
+  if (enc->last_codectype)
+    free(enc->last_codectype);
+
+  if (enc->item)
+    evbuffer_free(enc->item);
+
+  if (enc->nmeta > 0)
+    free(enc->meta);
+}
+
+/* Works out if the item is transcoded, and gets the key of its blocks in the
+ * DMAP item cache. Returns -1 if there is no buffer for encoding items.
+ */
+static int
+songlist_encode_prepare(struct songlist_encoder *enc, struct db_media_file_row *dbmfr, uint64_t *key)
+{
+  const char *codectype;
+
+  codectype = dbmfr_val(dbmfr, codectype)->str;
+
+  if (!codectype)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Cannot transcode '%s', codec type is unknown\n", dbmfr_val(dbmfr, fname)->str);
+
+      enc->transcode = 0;
+    }
+  else if (enc->remote)
+    {
+      enc->transcode = 1;
+    }
+  else if (!enc->last_codectype || (strcmp(enc->last_codectype, codectype) != 0))
+    {
+      enc->transcode = transcode_needed(enc->ua, enc->client_codecs, (char *)codectype);
+
+      if (enc->last_codectype)
+	free(enc->last_codectype);
+
+      enc->last_codectype = strdup(codectype);
+    }
+
+  /* The meta fields are static, so the pointers identify the meta set */
+  if (!enc->item)
+    {
+      enc->item = evbuffer_new();
+      if (!enc->item)
+	return -1;
+
+      enc->item_key[0] = murmur_hash64(enc->meta, enc->nmeta * sizeof(struct dmap_field *), (enc->sort_headers << 1) | 0);
+      enc->item_key[1] = murmur_hash64(enc->meta, enc->nmeta * sizeof(struct dmap_field *), (enc->sort_headers << 1) | 1);
+    }
+
+  *key = enc->item_key[enc->transcode ? 1 : 0];
+
+  return 0;
+}
+
+static int
+songlist_encode(struct songlist_encoder *enc, struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_row *dbmfr)
+{
+  uint64_t key;
+  uint32_t stamp;
+  uint32_t id;
+  int ret;
+
+  ret = songlist_encode_prepare(enc, dbmfr, &key);
+  if (ret < 0)
+    return dmap_encode_file_metadata(songlist, song, dbmfr, enc->meta, enc->nmeta, enc->sort_headers, enc->transcode);
+
+  id = dbmfr_val(dbmfr, id)->intval;
+  stamp = dbmfr_val(dbmfr, time_modified)->intval;
+
+  ret = cache_dmap_item_get(id, key, stamp, songlist);
+  if (ret == 0)
+    return 0;
+
+  ret = dmap_encode_file_metadata(enc->item, song, dbmfr, enc->meta, enc->nmeta, enc->sort_headers, enc->transcode);
+  if (ret < 0)
+    {
+      evbuffer_drain(enc->item, evbuffer_get_length(enc->item));
+      return -1;
+    }
+
+  cache_dmap_item_add(id, key, stamp, enc->item_gen, enc->item);
+
+  return evbuffer_add_buffer(songlist, enc->item);
+}
+
+#ifndef HAVE_LIBEVENT2_OLD
+/* Like songlist_encode(), but returns the block of the item pinned instead of
+ * adding it to a buffer. The item is only encoded if its block isn't cached.
+ */
+static struct dmap_item *
+songlist_encode_pinned(struct songlist_encoder *enc, struct evbuffer *song, struct db_media_file_row *dbmfr, size_t *len)
+{
+  struct dmap_item *block;
+  uint64_t key;
+  uint32_t stamp;
+  uint32_t id;
+  int ret;
+
+  ret = songlist_encode_prepare(enc, dbmfr, &key);
+  if (ret < 0)
+    return NULL;
+
+  id = dbmfr_val(dbmfr, id)->intval;
+  stamp = dbmfr_val(dbmfr, time_modified)->intval;
+
+  block = cache_dmap_item_pin(id, key, stamp, len);
+  if (block)
+    return block;
+
+  ret = dmap_encode_file_metadata(enc->item, song, dbmfr, enc->meta, enc->nmeta, enc->sort_headers, enc->transcode);
+  if (ret == 0)
+    {
+      *len = evbuffer_get_length(enc->item);
+      block = cache_dmap_item_pin_add(id, key, stamp, enc->item_gen, enc->item);
+    }
+
+  evbuffer_drain(enc->item, evbuffer_get_length(enc->item));
+
+  return block;
+}
+
+static void
+songlist_stream_free(struct songlist_stream *st, int failed)
+{
+  struct evhttp_connection *evcon;
+  int i;
+
+  if (st->req)
+    {
+      evcon = evhttp_request_get_connection(st->req);
+      if (evcon)
+	evhttp_connection_set_closecb(evcon, NULL, NULL);
+    }
+
+  if (st->cr)
+    httpd_send_reply_end(st->cr, failed);
+
+  // The blocks before next have been sent and released
+  for (i = st->next; i < st->nitems; i++)
+    cache_dmap_item_unpin(st->items[i].block);
+
+  if (st->items)
+    free(st->items);
+  if (st->sctx)
+    daap_sort_context_free(st->sctx);
+  if (st->ev)
+    event_free(st->ev);
+  if (st->chunk)
+    evbuffer_free(st->chunk);
+
+  free(st);
+}
+
+/* Ends the stream after an error on our side. There is no terminating chunk, and
+ * the connection is closed, so the client can't take the truncated reply for a
+ * complete one.
+ */
+static void
+songlist_stream_abort(struct songlist_stream *st)
+{
+  struct evhttp_connection *evcon;
+
+  evcon = evhttp_request_get_connection(st->req);
+
+  songlist_stream_free(st, 1);
+
+  if (evcon)
+    evhttp_connection_free(evcon);
+}
+
+static void
+songlist_stream_fail_cb(struct evhttp_connection *evcon, void *arg)
+{
+  struct songlist_stream *st = arg;
+
+  DPRINTF(E_WARN, L_DAAP, "Connection failed; stopping song list stream after %zu of %zu bytes\n", st->streamed, st->len);
+
+  evhttp_connection_set_closecb(evcon, NULL, NULL);
+
+  event_del(st->ev);
+
+  songlist_stream_free(st, 1);
+}
+
+static void
+songlist_stream_resched_cb(struct evhttp_connection *evcon, void *arg)
+{
+  struct songlist_stream *st = arg;
+  struct timeval tv;
+  int ret;
+
+  evutil_timerclear(&tv);
+  ret = event_add(st->ev, &tv);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Could not re-add one-shot event for song list stream\n");
+
+      songlist_stream_abort(st);
+    }
+}
+
+/* Sends the next chunk of the song list, made from the pinned blocks */
+static void
+songlist_stream_cb(int fd, short event, void *arg)
+{
+  struct songlist_stream *st = arg;
+  struct songlist_item *item;
+  int ret;
+
+  while ((st->next < st->nitems) && (evbuffer_get_length(st->chunk) < DAAP_SONGLIST_CHUNK_SIZE))
+    {
+      item = &st->items[st->next];
+
+      ret = cache_dmap_item_pinned_get(item->block, st->chunk);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_DAAP, "Out of memory for song list stream, aborting after %zu of %zu bytes\n", st->streamed, st->len);
+
+	  songlist_stream_abort(st);
+	  return;
+	}
+
+      cache_dmap_item_unpin(item->block);
+
+      st->streamed += item->len;
+      st->next++;
+    }
+
+  // More to come
+  if (st->next < st->nitems)
+    {
+      ret = httpd_send_reply_chunk(st->cr, st->chunk, songlist_stream_resched_cb, st);
+      if (ret < 0)
+	songlist_stream_abort(st);
+
+      return;
+    }
+
+  if (st->sctx)
+    {
+      dmap_add_container(st->chunk, "mshl", evbuffer_get_length(st->sctx->headerlist)); /* 8 */
+      evbuffer_add_buffer(st->chunk, st->sctx->headerlist);
+    }
+
+  DPRINTF(E_DBG, L_DAAP, "Done streaming song list, %d songs\n", st->nitems);
+
+  ret = httpd_send_reply_chunk(st->cr, st->chunk, NULL, NULL);
+  if (ret < 0)
+    {
+      songlist_stream_abort(st);
+      return;
+    }
+
+  songlist_stream_free(st, 0);
+}
+
+static struct songlist_stream *
+songlist_stream_new(struct evhttp_request *req)
+{
+  struct songlist_stream *st;
+
+  st = calloc(1, sizeof(struct songlist_stream));
+  if (!st)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Out of memory for song list stream\n");
+      return NULL;
+    }
+
+  st->req = req;
+
+  st->chunk = evbuffer_new();
+  if (!st->chunk)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Out of memory for song list stream\n");
+
+      songlist_stream_free(st, 1);
+      return NULL;
+    }
+
+  return st;
+}
+
+/* Adds the item to the stream. Until the song list turns out to be large it is
+ * also added to songlist, which is then sent as a normal reply.
+ */
+static int
+songlist_stream_item_add(struct songlist_stream *st, struct songlist_encoder *enc, struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_row *dbmfr)
+{
+  struct songlist_item *items;
+  struct songlist_item *item;
+  int nitems_max;
+  int ret;
+
+  if (st->nitems == st->nitems_max)
+    {
+      nitems_max = st->nitems_max ? 2 * st->nitems_max : 1024;
+      items = realloc(st->items, nitems_max * sizeof(struct songlist_item));
+      if (!items)
+	return -1;
+
+      st->items = items;
+      st->nitems_max = nitems_max;
+    }
+
+  item = &st->items[st->nitems];
+
+  item->block = songlist_encode_pinned(enc, song, dbmfr, &item->len);
+  if (!item->block)
+    return -1;
+
+  st->nitems++;
+  st->len += item->len;
+
+  if (st->streaming)
+    return 0;
+
+  ret = cache_dmap_item_pinned_get(item->block, songlist);
+  if (ret < 0)
+    return -1;
+
+  if (evbuffer_get_length(songlist) > DAAP_SONGLIST_STREAM_THRESHOLD)
+    {
+      st->streaming = 1;
+      evbuffer_drain(songlist, evbuffer_get_length(songlist));
+    }
+
+  return 0;
+}
+
+static void
+songlist_stream_free_cb(void *arg)
+{
+  songlist_stream_free(arg, 1);
+}
+
+/* Sends the header, which must be in the first chunk, and kicks off the
+ * streaming. Called by the loop serving the request, also if the song list was
+ * made by a worker (see httpd_defer_finish).
+ */
+static void
+songlist_stream_start(struct evhttp_request *req, void *arg)
+{
+  struct songlist_stream *st = arg;
+  struct evhttp_connection *evcon;
+
+  st->ev = event_new(httpd_request_evbase(req), -1, EV_TIMEOUT, songlist_stream_cb, st);
+  if (!st->ev)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Out of memory for song list stream\n");
+      goto error;
+    }
+
+  st->cr = httpd_send_reply_start(req, HTTP_OK, "OK", 0);
+  if (!st->cr)
+    goto error;
+
+  evcon = evhttp_request_get_connection(req);
+  evhttp_connection_set_closecb(evcon, songlist_stream_fail_cb, st);
+
+  DPRINTF(E_DBG, L_DAAP, "Streaming song list, %d songs (%zu bytes)\n", st->nitems, st->len);
+
+  event_active(st->ev, 0, 0);
+
+  return;
+
+ error:
+  dmap_send_error(req, st->tag, "Out of memory");
+  songlist_stream_free(st, 1);
+}
+#endif /* !HAVE_LIBEVENT2_OLD */
+
 static int
 daap_reply_songlist_generic(struct evhttp_request *req, struct evbuffer *evbuf, int playlist, struct evkeyvalq *query, const char *ua)
 {
-  struct daap_session *s;
+  int session_id;
   struct query_params qp;
-  struct db_media_file_info dbmfi;
+  struct db_media_file_row dbmfr;
+  struct songlist_encoder enc;
+#ifndef HAVE_LIBEVENT2_OLD
+  struct songlist_stream *st;
+#endif
   struct evbuffer *song;
   struct evbuffer *songlist;
-  struct evkeyvalq *headers;
-  const struct dmap_field **meta;
   struct sort_ctx *sctx;
+  struct timespec start;
+  struct timespec end;
   const char *param;
-  const char *client_codecs;
-  char *last_codectype;
   char *tag;
   size_t len;
-  int nmeta;
-  int sort_headers;
+  int64_t usec;
   int nsongs;
-  int remote;
-  int transcode;
   int ret;
 
-  s = daap_session_find(req, query, evbuf);
-  if (!s && req)
+  session_id = daap_session_find(req, query, evbuf);
+  if ((session_id < 0) && req)
     return -1;
 
   DPRINTF(E_DBG, L_DAAP, "Fetching song list for playlist %d\n", playlist);
@@ -1308,6 +1813,8 @@ daap_reply_songlist_generic(struct evhttp_request *req, struct evbuffer *evbuf,
       goto out_song_free;
     }
 
+  songlist_encoder_init(&enc, req, ua);
+
   param = evhttp_find_header(query, "meta");
   if (!param)
     {
@@ -1319,28 +1826,23 @@ daap_reply_songlist_generic(struct evhttp_request *req, struct evbuffer *evbuf,
 
   if (param)
     {
-      nmeta = parse_meta(req, tag, param, &meta);
-      if (nmeta < 0)
+      enc.nmeta = parse_meta(req, tag, param, &enc.meta);
+      if (enc.nmeta < 0)
 	{
 	  DPRINTF(E_LOG, L_DAAP, "Failed to parse meta parameter in DAAP query\n");
 
 	  goto out_song_free;
 	}
     }
-  else
-    {
-      meta = NULL;
-      nmeta = 0;
-    }
 
   memset(&qp, 0, sizeof(struct query_params));
-  get_query_params(query, &sort_headers, &qp);
+  get_query_params(query, &enc.sort_headers, &qp);
 
   if (playlist == -1)
     user_agent_filter(ua, &qp);
 
   sctx = NULL;
-  if (sort_headers)
+  if (enc.sort_headers)
     {
       sctx = daap_sort_context_new();
       if (!sctx)
@@ -1360,6 +1862,26 @@ daap_reply_songlist_generic(struct evhttp_request *req, struct evbuffer *evbuf,
   else
     qp.type = Q_ITEMS;
 
+#ifndef HAVE_LIBEVENT2_OLD
+  // In case the reply turns out to be large
+  st = NULL;
+  if (req)
+    {
+      st = songlist_stream_new(req);
+      if (!st)
+	{
+	  dmap_send_error(req, tag, "Out of memory");
+
+	  if (enc.sort_headers)
+	    daap_sort_context_free(sctx);
+
+	  goto out_query_free;
+	}
+    }
+#endif
+
+  enc.item_gen = cache_dmap_item_gen();
+
   ret = db_query_start(&qp);
   if (ret < 0)
     {
@@ -1367,48 +1889,28 @@ daap_reply_songlist_generic(struct evhttp_request *req, struct evbuffer *evbuf,
 
       dmap_send_error(req, tag, "Could not start query");
 
-      if (sort_headers)
+      if (enc.sort_headers)
 	daap_sort_context_free(sctx);
 
-      goto out_query_free;
-    }
-
-  remote = is_remote(ua);
+#ifndef HAVE_LIBEVENT2_OLD
+      if (st)
+	songlist_stream_free(st, 1);
+#endif
 
-  client_codecs = NULL;
-  if (!remote && req)
-    {
-      headers = evhttp_request_get_input_headers(req);
-      client_codecs = evhttp_find_header(headers, "Accept-Codecs");
+      goto out_query_free;
     }
 
   nsongs = 0;
-  last_codectype = NULL;
-  while (((ret = db_query_fetch_file(&qp, &dbmfi)) == 0) && (dbmfi.id))
+  len = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (((ret = db_query_fetch_file_typed(&qp, &dbmfr)) == 0) && (dbmfr_val(&dbmfr, id)->intval))
     {
-      nsongs++;
-
-      if (!dbmfi.codectype)
-	{
-	  DPRINTF(E_LOG, L_DAAP, "Cannot transcode '%s', codec type is unknown\n", dbmfi.fname);
-
-	  transcode = 0;
-	}
-      else if (remote)
-	{
-	  transcode = 1;
-	}
-      else if (!last_codectype || (strcmp(last_codectype, dbmfi.codectype) != 0))
-	{
-	  transcode = transcode_needed(ua, client_codecs, dbmfi.codectype);
-
-	  if (last_codectype)
-	    free(last_codectype);
-
-	  last_codectype = strdup(dbmfi.codectype);
-	}
-
-      ret = dmap_encode_file_metadata(songlist, song, &dbmfi, meta, nmeta, sort_headers, transcode);
+#ifndef HAVE_LIBEVENT2_OLD
+      if (st)
+	ret = songlist_stream_item_add(st, &enc, songlist, song, &dbmfr);
+      else
+#endif
+	ret = songlist_encode(&enc, songlist, song, &dbmfr);
       if (ret < 0)
 	{
 	  DPRINTF(E_LOG, L_DAAP, "Failed to encode song metadata\n");
@@ -1417,9 +1919,11 @@ daap_reply_songlist_generic(struct evhttp_request *req, struct evbuffer *evbuf,
 	  break;
 	}
 
-      if (sort_headers)
+      nsongs++;
+
+      if (enc.sort_headers)
 	{
-	  ret = daap_sort_build(sctx, dbmfi.title_sort);
+	  ret = daap_sort_build(sctx, dbmfr_val(&dbmfr, title_sort)->str);
 	  if (ret < 0)
 	    {
 	      DPRINTF(E_LOG, L_DAAP, "Could not add sort header to DAAP song list reply\n");
@@ -1432,13 +1936,13 @@ daap_reply_songlist_generic(struct evhttp_request *req, struct evbuffer *evbuf,
       DPRINTF(E_SPAM, L_DAAP, "Done with song\n");
     }
 
-  DPRINTF(E_DBG, L_DAAP, "Done with song list, %d songs\n", nsongs);
+  clock_gettime(CLOCK_MONOTONIC, &end);
 
-  if (last_codectype)
-    free(last_codectype);
+  usec = (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_nsec - start.tv_nsec) / 1000;
 
-  if (nmeta > 0)
-    free(meta);
+  DPRINTF(E_DBG, L_DAAP, "Fetched and encoded %d songs in %" PRIi64 " usec (%" PRIi64 " usec/song)\n", nsongs, usec, (nsongs > 0) ? usec / nsongs : 0);
+
+  DPRINTF(E_DBG, L_DAAP, "Done with song list, %d songs\n", nsongs);
 
   evbuffer_free(song);
 
@@ -1457,15 +1961,27 @@ daap_reply_songlist_generic(struct evhttp_request *req, struct evbuffer *evbuf,
 
       db_query_end(&qp);
 
-      if (sort_headers)
+      songlist_encoder_deinit(&enc);
+
+      if (enc.sort_headers)
 	daap_sort_context_free(sctx);
 
+#ifndef HAVE_LIBEVENT2_OLD
+      if (st)
+	songlist_stream_free(st, 1);
+#endif
+
       goto out_list_free;
     }
 
   /* Add header to evbuf, add songlist to evbuf */
-  len = evbuffer_get_length(songlist);
-  if (sort_headers)
+#ifndef HAVE_LIBEVENT2_OLD
+  if (st && st->streaming)
+    len = st->len;
+  else
+#endif
+    len = evbuffer_get_length(songlist);
+  if (enc.sort_headers)
     {
       daap_sort_finalize(sctx);
       dmap_add_container(evbuf, tag, len + evbuffer_get_length(sctx->headerlist) + 61);
@@ -1480,6 +1996,38 @@ daap_reply_songlist_generic(struct evhttp_request *req, struct evbuffer *evbuf,
 
   db_query_end(&qp);
 
+#ifndef HAVE_LIBEVENT2_OLD
+  if (st && st->streaming)
+    {
+      evbuffer_free(songlist);
+      songlist_encoder_deinit(&enc);
+
+      st->sctx = sctx;
+      st->tag = tag;
+
+      ret = evbuffer_add_buffer(st->chunk, evbuf);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_DAAP, "Out of memory for song list stream\n");
+
+	  songlist_stream_free(st, 1);
+	  dmap_send_error(req, tag, "Out of memory");
+	  return -1;
+	}
+
+      // If we are a worker, the loop serving the request does the streaming
+      httpd_defer_finish(req, songlist_stream_start, st, songlist_stream_free_cb);
+
+      return 0;
+    }
+
+  // Small enough for a normal reply, which songlist has been built for
+  if (st)
+    songlist_stream_free(st, 0);
+#endif
+
+  songlist_encoder_deinit(&enc);
+
   ret = evbuffer_add_buffer(evbuf, songlist);
   evbuffer_free(songlist);
   if (ret < 0)
@@ -1488,13 +2036,13 @@ daap_reply_songlist_generic(struct evhttp_request *req, struct evbuffer *evbuf,
 
       dmap_send_error(req, tag, "Out of memory");
 
-      if (sort_headers)
+      if (enc.sort_headers)
 	daap_sort_context_free(sctx);
 
       return -1;
     }
 
-  if (sort_headers)
+  if (enc.sort_headers)
     {
       len = evbuffer_get_length(sctx->headerlist);
       dmap_add_container(evbuf, "mshl", len); /* 8 */
@@ -1515,8 +2063,7 @@ daap_reply_songlist_generic(struct evhttp_request *req, struct evbuffer *evbuf,
   return 0;
 
  out_query_free:
-  if (nmeta > 0)
-    free(meta);
+  songlist_encoder_deinit(&enc);
 
   if (qp.filter)
     free(qp.filter);
@@ -1558,7 +2105,7 @@ daap_reply_playlists(struct evhttp_request *req, struct evbuffer *evbuf, char **
 {
   struct query_params qp;
   struct db_playlist_info dbpli;
-  struct daap_session *s;
+  int session_id;
   struct evbuffer *playlistlist;
   struct evbuffer *playlist;
   cfg_t *lib;
@@ -1580,8 +2127,8 @@ daap_reply_playlists(struct evhttp_request *req, struct evbuffer *evbuf, char **
   int i;
   int ret;
 
-  s = daap_session_find(req, query, evbuf);
-  if (!s)
+  session_id = daap_session_find(req, query, evbuf);
+  if (session_id < 0)
     return -1;
 
   ret = safe_atoi32(uri[1], &database);
@@ -1844,7 +2391,7 @@ daap_reply_groups(struct evhttp_request *req, struct evbuffer *evbuf, char **uri
 {
   struct query_params qp;
   struct db_group_info dbgri;
-  struct daap_session *s;
+  int session_id;
   struct evbuffer *group;
   struct evbuffer *grouplist;
   const struct dmap_field_map *dfm;
@@ -1863,8 +2410,8 @@ daap_reply_groups(struct evhttp_request *req, struct evbuffer *evbuf, char **uri
   int i;
   int ret;
 
-  s = daap_session_find(req, query, evbuf);
-  if (!s && req)
+  session_id = daap_session_find(req, query, evbuf);
+  if ((session_id < 0) && req)
     return -1;
 
   memset(&qp, 0, sizeof(struct query_params));
@@ -2155,7 +2702,7 @@ static int
 daap_reply_browse(struct evhttp_request *req, struct evbuffer *evbuf, char **uri, struct evkeyvalq *query, const char *ua)
 {
   struct query_params qp;
-  struct daap_session *s;
+  int session_id;
   struct evbuffer *itemlist;
   struct sort_ctx *sctx;
   char *browse_item;
@@ -2166,8 +2713,8 @@ daap_reply_browse(struct evhttp_request *req, struct evbuffer *evbuf, char **uri
   int nitems;
   int ret;
 
-  s = daap_session_find(req, query, evbuf);
-  if (!s && req)
+  session_id = daap_session_find(req, query, evbuf);
+  if ((session_id < 0) && req)
     return -1;
 
   memset(&qp, 0, sizeof(struct query_params));
@@ -2361,7 +2908,7 @@ static int
 daap_reply_extra_data(struct evhttp_request *req, struct evbuffer *evbuf, char **uri, struct evkeyvalq *query, const char *ua)
 {
   char clen[32];
-  struct daap_session *s;
+  int session_id;
   struct evkeyvalq *headers;
   const char *param;
   char *ctype;
@@ -2371,8 +2918,8 @@ daap_reply_extra_data(struct evhttp_request *req, struct evbuffer *evbuf, char *
   int max_h;
   int ret;
 
-  s = daap_session_find(req, query, evbuf);
-  if (!s)
+  session_id = daap_session_find(req, query, evbuf);
+  if (session_id < 0)
     return -1;
 
   ret = safe_atoi32(uri[3], &id);
@@ -2641,11 +3188,13 @@ static struct uri_map daap_handlers[] =
     },
     {
       .regexp = "^/databases/[[:digit:]]+/browse/[^/]+$",
-      .handler = daap_reply_browse
+      .handler = daap_reply_browse,
+      .deferred = 1
     },
     {
       .regexp = "^/databases/[[:digit:]]+/items$",
-      .handler = daap_reply_dbsonglist
+      .handler = daap_reply_dbsonglist,
+      .deferred = 1
     },
     {
       .regexp = "^/databases/[[:digit:]]+/items/[[:digit:]]+[.][^/]+$",
@@ -2661,11 +3210,13 @@ static struct uri_map daap_handlers[] =
     },
     {
       .regexp = "^/databases/[[:digit:]]+/containers/[[:digit:]]+/items$",
-      .handler = daap_reply_plsonglist
+      .handler = daap_reply_plsonglist,
+      .deferred = 1
     },
     {
       .regexp = "^/databases/[[:digit:]]+/groups$",
-      .handler = daap_reply_groups
+      .handler = daap_reply_groups,
+      .deferred = 1
     },
     {
       .regexp = "^/databases/[[:digit:]]+/groups/[[:digit:]]+/extra_data/artwork$",
@@ -2684,6 +3235,49 @@ static struct uri_map daap_handlers[] =
   };
 
 
+/* Thread: httpd or worker pool */
+static void
+daap_handler_run(struct evhttp_request *req, int handler, struct evbuffer *evbuf, char **uri_parts, struct evkeyvalq *query, const char *ua, const char *full_uri)
+{
+  struct timespec start;
+  struct timespec end;
+  int msec;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  daap_handlers[handler].handler(req, evbuf, uri_parts, query, ua);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  msec = (end.tv_sec * 1000 + end.tv_nsec / 1000000) - (start.tv_sec * 1000 + start.tv_nsec / 1000000);
+
+  DPRINTF(E_DBG, L_DAAP, "DAAP request handled in %d milliseconds\n", msec);
+
+  if (msec > cache_daap_threshold())
+    cache_daap_add(full_uri, ua, msec);
+}
+
+/* Thread: worker pool */
+static void
+daap_job_run(struct evhttp_request *req, void *arg)
+{
+  struct daap_job *job = arg;
+
+  daap_handler_run(req, job->handler, job->evbuf, job->uri_parts, &job->query, job->ua, job->full_uri);
+}
+
+static void
+daap_job_free(void *arg)
+{
+  struct daap_job *job = arg;
+
+  evhttp_clear_headers(&job->query);
+  evbuffer_free(job->evbuf);
+  free(job->uri);
+  free(job->full_uri);
+  free(job);
+}
+
 void
 daap_request(struct evhttp_request *req)
 {
@@ -2694,13 +3288,11 @@ daap_request(struct evhttp_request *req)
   struct evbuffer *evbuf;
   struct evkeyvalq query;
   struct evkeyvalq *headers;
-  struct timespec start;
-  struct timespec end;
+  struct daap_job *job;
   const char *ua;
   cfg_t *lib;
   char *libname;
   char *passwd;
-  int msec;
   int handler;
   int ret;
   int i;
@@ -2863,20 +3455,33 @@ daap_request(struct evhttp_request *req)
     }
 
   // No cache, so prepare handler arguments and send to the handler
-  evhttp_parse_query(full_uri, &query);
-
-  clock_gettime(CLOCK_MONOTONIC, &start);
-
-  daap_handlers[handler].handler(req, evbuf, uri_parts, &query, ua);
-
-  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (daap_handlers[handler].deferred)
+    {
+      job = calloc(1, sizeof(struct daap_job));
+      if (job)
+	{
+	  job->handler = handler;
+	  job->full_uri = full_uri;
+	  job->uri = uri;
+	  memcpy(job->uri_parts, uri_parts, sizeof(uri_parts));
+	  job->ua = ua;
+	  job->evbuf = evbuf;
+	  evhttp_parse_query(full_uri, &job->query);
+
+	  ret = httpd_defer(req, daap_job_run, job, daap_job_free);
+	  if (ret < 0)
+	    {
+	      daap_job_run(req, job);
+	      daap_job_free(job);
+	    }
 
-  msec = (end.tv_sec * 1000 + end.tv_nsec / 1000000) - (start.tv_sec * 1000 + start.tv_nsec / 1000000);
+	  return;
+	}
+    }
 
-  DPRINTF(E_DBG, L_DAAP, "DAAP request handled in %d milliseconds\n", msec);
+  evhttp_parse_query(full_uri, &query);
 
-  if (msec > cache_daap_threshold())
-    cache_daap_add(full_uri, ua, msec);
+  daap_handler_run(req, handler, evbuf, uri_parts, &query, ua, full_uri);
 
   evhttp_clear_headers(&query);
   evbuffer_free(evbuf);
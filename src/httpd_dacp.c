@@ -31,6 +31,7 @@
 #include <regex.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #if defined(HAVE_SYS_EVENTFD_H) && defined(HAVE_EVENTFD)
 # define USE_EVENTFD
@@ -57,9 +58,7 @@
 extern struct event_base *evbase_httpd;
 
 /* From httpd_daap.c */
-struct daap_session;
-
-struct daap_session *
+int
 daap_session_find(struct evhttp_request *req, struct evkeyvalq *query, struct evbuffer *evbuf);
 
 
@@ -72,6 +71,9 @@ struct uri_map {
 struct dacp_update_request {
   struct evhttp_request *req;
 
+  // Event in the loop serving the request, activated when there is an update
+  struct event *ev;
+
   struct dacp_update_request *next;
 };
 
@@ -148,8 +150,11 @@ static int update_pipe[2];
 static struct event *updateev;
 static int current_rev;
 
-/* Play status update requests */
+/* Play status update requests, the list is protected by dacp_lck since the
+ * requests may be served by any of the httpd threads
+ */
 static struct dacp_update_request *update_requests;
+static pthread_mutex_t dacp_lck = PTHREAD_MUTEX_INITIALIZER;
 
 /* Seek timer */
 static struct event *seek_timer;
@@ -266,7 +271,7 @@ make_playstatusupdate(struct evbuffer *evbuf)
 
   dmap_add_int(psu, "mstt", 200);         /* 12 */
 
-  dmap_add_int(psu, "cmsr", current_rev); /* 12 */
+  dmap_add_int(psu, "cmsr", __atomic_load_n(&current_rev, __ATOMIC_RELAXED)); /* 12 */
 
   dmap_add_char(psu, "caps", status.status);  /*  9 */ /* play status, 2 = stopped, 3 = paused, 4 = playing */
   dmap_add_char(psu, "cash", status.shuffle); /*  9 */ /* shuffle, true/false */
@@ -312,14 +317,80 @@ make_playstatusupdate(struct evbuffer *evbuf)
 }
 
 static void
-playstatusupdate_cb(int fd, short what, void *arg)
+update_free(struct dacp_update_request *ur)
+{
+  if (ur->ev)
+    event_free(ur->ev);
+
+  free(ur);
+}
+
+static void
+update_remove(struct dacp_update_request *ur)
+{
+  struct dacp_update_request *p;
+
+  pthread_mutex_lock(&dacp_lck);
+
+  if (ur == update_requests)
+    update_requests = ur->next;
+  else
+    {
+      for (p = update_requests; p && (p->next != ur); p = p->next)
+	;
+
+      if (!p)
+	DPRINTF(E_LOG, L_DACP, "WARNING: struct dacp_update_request not found in list; BUG!\n");
+      else
+	p->next = ur->next;
+    }
+
+  pthread_mutex_unlock(&dacp_lck);
+}
+
+/* Thread: httpd (the loop serving the request) */
+static void
+update_send_cb(int fd, short what, void *arg)
 {
   struct dacp_update_request *ur;
-  struct evbuffer *evbuf;
-  struct evbuffer *update;
   struct evhttp_connection *evcon;
-  uint8_t *buf;
-  size_t len;
+  struct evbuffer *evbuf;
+  int ret;
+
+  ur = (struct dacp_update_request *)arg;
+
+  update_remove(ur);
+
+  evcon = evhttp_request_get_connection(ur->req);
+  if (evcon)
+    evhttp_connection_set_closecb(evcon, NULL, NULL);
+
+  evbuf = evbuffer_new();
+  if (!evbuf)
+    {
+      DPRINTF(E_LOG, L_DACP, "Could not allocate evbuffer for playstatusupdate reply\n");
+
+      httpd_send_error(ur->req, 500, "Internal Server Error");
+      goto out;
+    }
+
+  ret = make_playstatusupdate(evbuf);
+  if (ret < 0)
+    httpd_send_error(ur->req, 500, "Internal Server Error");
+  else
+    httpd_send_reply(ur->req, HTTP_OK, "OK", evbuf, 0);
+
+  evbuffer_free(evbuf);
+
+ out:
+  update_free(ur);
+}
+
+/* Thread: httpd */
+static void
+playstatusupdate_cb(int fd, short what, void *arg)
+{
+  struct dacp_update_request *ur;
   int ret;
 
 #ifdef USE_EVENTFD
@@ -338,58 +409,23 @@ playstatusupdate_cb(int fd, short what, void *arg)
   read(update_pipe[0], &dummy, sizeof(dummy));
 #endif
 
-  if (!update_requests)
-    goto readd;
+  // The replies are made by the loops serving the requests, since a connection
+  // must only be used from its own loop
+  pthread_mutex_lock(&dacp_lck);
 
-  evbuf = evbuffer_new();
-  if (!evbuf)
+  if (!update_requests)
     {
-      DPRINTF(E_LOG, L_DACP, "Could not allocate evbuffer for playstatusupdate reply\n");
-
+      pthread_mutex_unlock(&dacp_lck);
       goto readd;
     }
 
-  update = evbuffer_new();
-  if (!update)
-    {
-      DPRINTF(E_LOG, L_DACP, "Could not allocate evbuffer for playstatusupdate data\n");
-
-      goto out_free_evbuf;
-    }
-
-  ret = make_playstatusupdate(update);
-  if (ret < 0)
-    goto out_free_update;
-
-  len = evbuffer_get_length(update);
+  for (ur = update_requests; ur; ur = ur->next)
+    event_active(ur->ev, 0, 0);
 
-  for (ur = update_requests; update_requests; ur = update_requests)
-    {
-      update_requests = ur->next;
-
-      evcon = evhttp_request_get_connection(ur->req);
-      if (evcon)
-	evhttp_connection_set_closecb(evcon, NULL, NULL);
-
-      // Only copy buffer if we actually need to reuse it
-      if (ur->next)
-	{
-	  buf = evbuffer_pullup(update, -1);
-	  evbuffer_add(evbuf, buf, len);
-	  httpd_send_reply(ur->req, HTTP_OK, "OK", evbuf, 0);
-	}
-      else
-	httpd_send_reply(ur->req, HTTP_OK, "OK", update, 0);
-
-      free(ur);
-    }
+  __atomic_add_fetch(&current_rev, 1, __ATOMIC_RELAXED);
 
-  current_rev++;
+  pthread_mutex_unlock(&dacp_lck);
 
- out_free_update:
-  evbuffer_free(update);
- out_free_evbuf:
-  evbuffer_free(evbuf);
  readd:
   ret = event_add(updateev, NULL);
   if (ret < 0)
@@ -423,7 +459,6 @@ static void
 update_fail_cb(struct evhttp_connection *evcon, void *arg)
 {
   struct dacp_update_request *ur;
-  struct dacp_update_request *p;
   struct evhttp_connection *evc;
 
   ur = (struct dacp_update_request *)arg;
@@ -434,23 +469,8 @@ update_fail_cb(struct evhttp_connection *evcon, void *arg)
   if (evc)
     evhttp_connection_set_closecb(evc, NULL, NULL);
 
-  if (ur == update_requests)
-    update_requests = ur->next;
-  else
-    {
-      for (p = update_requests; p && (p->next != ur); p = p->next)
-	;
-
-      if (!p)
-	{
-	  DPRINTF(E_LOG, L_DACP, "WARNING: struct dacp_update_request not found in list; BUG!\n");
-	  return;
-	}
-
-      p->next = ur->next;
-    }
-
-  free(ur);
+  update_remove(ur);
+  update_free(ur);
 }
 
 
@@ -610,14 +630,17 @@ dacp_propset_volume(const char *value, struct evkeyvalq *query)
 static void
 seek_timer_cb(int fd, short what, void *arg)
 {
+  int target;
   int ret;
 
-  DPRINTF(E_DBG, L_DACP, "Seek timer expired, target %d ms\n", seek_target);
+  target = __atomic_load_n(&seek_target, __ATOMIC_RELAXED);
+
+  DPRINTF(E_DBG, L_DACP, "Seek timer expired, target %d ms\n", target);
 
-  ret = player_playback_seek(seek_target);
+  ret = player_playback_seek(target);
   if (ret < 0)
     {
-      DPRINTF(E_LOG, L_DACP, "Player failed to seek to %d ms\n", seek_target);
+      DPRINTF(E_LOG, L_DACP, "Player failed to seek to %d ms\n", target);
 
       return;
     }
@@ -631,9 +654,10 @@ static void
 dacp_propset_playingtime(const char *value, struct evkeyvalq *query)
 {
   struct timeval tv;
+  int target;
   int ret;
 
-  ret = safe_atoi32(value, &seek_target);
+  ret = safe_atoi32(value, &target);
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_DACP, "dacp.playingtime argument doesn't convert to integer: %s\n", value);
@@ -641,6 +665,9 @@ dacp_propset_playingtime(const char *value, struct evkeyvalq *query)
       return;
     }
 
+  // The timer runs in the main httpd loop, which may not be this one
+  __atomic_store_n(&seek_target, target, __ATOMIC_RELAXED);
+
   evutil_timerclear(&tv);
   tv.tv_usec = 200 * 1000;
   evtimer_add(seek_timer, &tv);
@@ -1140,11 +1167,11 @@ dacp_reply_cue_clear(struct evhttp_request *req, struct evbuffer *evbuf, char **
 static void
 dacp_reply_cue(struct evhttp_request *req, struct evbuffer *evbuf, char **uri, struct evkeyvalq *query)
 {
-  struct daap_session *s;
+  int session_id;
   const char *param;
 
-  s = daap_session_find(req, query, evbuf);
-  if (!s)
+  session_id = daap_session_find(req, query, evbuf);
+  if (session_id < 0)
     return;
 
   param = evhttp_find_header(query, "command");
@@ -1173,7 +1200,7 @@ static void
 dacp_reply_playspec(struct evhttp_request *req, struct evbuffer *evbuf, char **uri, struct evkeyvalq *query)
 {
   struct player_status status;
-  struct daap_session *s;
+  int session_id;
   const char *param;
   const char *shuffle;
   uint32_t plid;
@@ -1187,8 +1214,8 @@ dacp_reply_playspec(struct evhttp_request *req, struct evbuffer *evbuf, char **u
    * With our DAAP implementation, container-spec is the playlist ID and container-item-spec/item-spec is the song ID
    */
 
-  s = daap_session_find(req, query, evbuf);
-  if (!s)
+  session_id = daap_session_find(req, query, evbuf);
+  if (session_id < 0)
     return;
 
   /* Check for shuffle */
@@ -1307,10 +1334,10 @@ dacp_reply_playspec(struct evhttp_request *req, struct evbuffer *evbuf, char **u
 static void
 dacp_reply_pause(struct evhttp_request *req, struct evbuffer *evbuf, char **uri, struct evkeyvalq *query)
 {
-  struct daap_session *s;
+  int session_id;
 
-  s = daap_session_find(req, query, evbuf);
-  if (!s)
+  session_id = daap_session_find(req, query, evbuf);
+  if (session_id < 0)
     return;
 
   player_playback_pause();
@@ -1322,12 +1349,12 @@ dacp_reply_pause(struct evhttp_request *req, struct evbuffer *evbuf, char **uri,
 static void
 dacp_reply_playpause(struct evhttp_request *req, struct evbuffer *evbuf, char **uri, struct evkeyvalq *query)
 {
-  struct daap_session *s;
+  int session_id;
   struct player_status status;
   int ret;
 
-  s = daap_session_find(req, query, evbuf);
-  if (!s)
+  session_id = daap_session_find(req, query, evbuf);
+  if (session_id < 0)
     return;
 
 
@@ -1355,11 +1382,11 @@ dacp_reply_playpause(struct evhttp_request *req, struct evbuffer *evbuf, char **
 static void
 dacp_reply_nextitem(struct evhttp_request *req, struct evbuffer *evbuf, char **uri, struct evkeyvalq *query)
 {
-  struct daap_session *s;
+  int session_id;
   int ret;
 
-  s = daap_session_find(req, query, evbuf);
-  if (!s)
+  session_id = daap_session_find(req, query, evbuf);
+  if (session_id < 0)
     return;
 
   ret = player_playback_next();
@@ -1387,11 +1414,11 @@ dacp_reply_nextitem(struct evhttp_request *req, struct evbuffer *evbuf, char **u
 static void
 dacp_reply_previtem(struct evhttp_request *req, struct evbuffer *evbuf, char **uri, struct evkeyvalq *query)
 {
-  struct daap_session *s;
+  int session_id;
   int ret;
 
-  s = daap_session_find(req, query, evbuf);
-  if (!s)
+  session_id = daap_session_find(req, query, evbuf);
+  if (session_id < 0)
     return;
 
   ret = player_playback_prev();
@@ -1419,10 +1446,10 @@ dacp_reply_previtem(struct evhttp_request *req, struct evbuffer *evbuf, char **u
 static void
 dacp_reply_beginff(struct evhttp_request *req, struct evbuffer *evbuf, char **uri, struct evkeyvalq *query)
 {
-  struct daap_session *s;
+  int session_id;
 
-  s = daap_session_find(req, query, evbuf);
-  if (!s)
+  session_id = daap_session_find(req, query, evbuf);
+  if (session_id < 0)
     return;
 
   /* TODO */
@@ -1434,10 +1461,10 @@ dacp_reply_beginff(struct evhttp_request *req, struct evbuffer *evbuf, char **ur
 static void
 dacp_reply_beginrew(struct evhttp_request *req, struct evbuffer *evbuf, char **uri, struct evkeyvalq *query)
 {
-  struct daap_session *s;
+  int session_id;
 
-  s = daap_session_find(req, query, evbuf);
-  if (!s)
+  session_id = daap_session_find(req, query, evbuf);
+  if (session_id < 0)
     return;
 
   /* TODO */
@@ -1449,10 +1476,10 @@ dacp_reply_beginrew(struct evhttp_request *req, struct evbuffer *evbuf, char **u
 static void
 dacp_reply_playresume(struct evhttp_request *req, struct evbuffer *evbuf, char **uri, struct evkeyvalq *query)
 {
-  struct daap_session *s;
+  int session_id;
 
-  s = daap_session_find(req, query, evbuf);
-  if (!s)
+  session_id = daap_session_find(req, query, evbuf);
+  if (session_id < 0)
     return;
 
   /* TODO */
@@ -1556,7 +1583,7 @@ static void
 dacp_reply_playqueuecontents(struct evhttp_request *req, struct evbuffer *evbuf, char **uri,
     struct evkeyvalq *query)
 {
-  struct daap_session *s;
+  int session_id;
   struct evbuffer *songlist;
   struct evbuffer *playlists;
   struct player_status status;
@@ -1573,8 +1600,8 @@ dacp_reply_playqueuecontents(struct evhttp_request *req, struct evbuffer *evbuf,
 
   /* /ctrl-int/1/playqueue-contents?span=50&session-id=... */
 
-  s = daap_session_find(req, query, evbuf);
-  if (!s)
+  session_id = daap_session_find(req, query, evbuf);
+  if (session_id < 0)
     return;
 
   DPRINTF(E_DBG, L_DACP, "Fetching playqueue contents\n");
@@ -1975,7 +2002,7 @@ dacp_reply_playqueueedit_remove(struct evhttp_request *req, struct evbuffer *evb
 static void
 dacp_reply_playqueueedit(struct evhttp_request *req, struct evbuffer *evbuf, char **uri, struct evkeyvalq *query)
 {
-  struct daap_session *s;
+  int session_id;
   const char *param;
 
   /*  Variations of /ctrl-int/1/playqueue-edit and expected behaviour
@@ -2021,8 +2048,8 @@ dacp_reply_playqueueedit(struct evhttp_request *req, struct evbuffer *evbuf, cha
   -> remove song on position 1 from the playqueue
    */
 
-  s = daap_session_find(req, query, evbuf);
-  if (!s)
+  session_id = daap_session_find(req, query, evbuf);
+  if (session_id < 0)
     return;
 
   param = evhttp_find_header(query, "command");
@@ -2056,15 +2083,15 @@ dacp_reply_playqueueedit(struct evhttp_request *req, struct evbuffer *evbuf, cha
 static void
 dacp_reply_playstatusupdate(struct evhttp_request *req, struct evbuffer *evbuf, char **uri, struct evkeyvalq *query)
 {
-  struct daap_session *s;
+  int session_id;
   struct dacp_update_request *ur;
   struct evhttp_connection *evcon;
   const char *param;
   int reqd_rev;
   int ret;
 
-  s = daap_session_find(req, query, evbuf);
-  if (!s)
+  session_id = daap_session_find(req, query, evbuf);
+  if (session_id < 0)
     return;
 
   param = evhttp_find_header(query, "revision-number");
@@ -2108,8 +2135,20 @@ dacp_reply_playstatusupdate(struct evhttp_request *req, struct evbuffer *evbuf,
 
   ur->req = req;
 
+  ur->ev = event_new(httpd_request_evbase(req), -1, 0, update_send_cb, ur);
+  if (!ur->ev)
+    {
+      DPRINTF(E_LOG, L_DACP, "Could not create event for update request\n");
+
+      free(ur);
+      dmap_send_error(req, "cmst", "Out of memory");
+      return;
+    }
+
+  pthread_mutex_lock(&dacp_lck);
   ur->next = update_requests;
   update_requests = ur;
+  pthread_mutex_unlock(&dacp_lck);
 
   /* If the connection fails before we have an update to push out
    * to the client, we need to know.
@@ -2123,7 +2162,7 @@ static void
 dacp_reply_nowplayingartwork(struct evhttp_request *req, struct evbuffer *evbuf, char **uri, struct evkeyvalq *query)
 {
   char clen[32];
-  struct daap_session *s;
+  int session_id;
   struct evkeyvalq *headers;
   const char *param;
   char *ctype;
@@ -2133,8 +2172,8 @@ dacp_reply_nowplayingartwork(struct evhttp_request *req, struct evbuffer *evbuf,
   int max_h;
   int ret;
 
-  s = daap_session_find(req, query, evbuf);
-  if (!s)
+  session_id = daap_session_find(req, query, evbuf);
+  if (session_id < 0)
     return;
 
   param = evhttp_find_header(query, "mw");
@@ -2214,7 +2253,7 @@ static void
 dacp_reply_getproperty(struct evhttp_request *req, struct evbuffer *evbuf, char **uri, struct evkeyvalq *query)
 {
   struct player_status status;
-  struct daap_session *s;
+  int session_id;
   const struct dacp_prop_map *dpm;
   struct db_queue_item *queue_item = NULL;
   struct evbuffer *proplist;
@@ -2225,8 +2264,8 @@ dacp_reply_getproperty(struct evhttp_request *req, struct evbuffer *evbuf, char
   size_t len;
   int ret;
 
-  s = daap_session_find(req, query, evbuf);
-  if (!s)
+  session_id = daap_session_find(req, query, evbuf);
+  if (session_id < 0)
     return;
 
   param = evhttp_find_header(query, "properties");
@@ -2320,12 +2359,12 @@ dacp_reply_getproperty(struct evhttp_request *req, struct evbuffer *evbuf, char
 static void
 dacp_reply_setproperty(struct evhttp_request *req, struct evbuffer *evbuf, char **uri, struct evkeyvalq *query)
 {
-  struct daap_session *s;
+  int session_id;
   const struct dacp_prop_map *dpm;
   struct evkeyval *param;
 
-  s = daap_session_find(req, query, evbuf);
-  if (!s)
+  session_id = daap_session_find(req, query, evbuf);
+  if (session_id < 0)
     return;
 
   /* Known properties:
@@ -2389,12 +2428,12 @@ speaker_enum_cb(uint64_t id, const char *name, int relvol, int absvol, struct sp
 static void
 dacp_reply_getspeakers(struct evhttp_request *req, struct evbuffer *evbuf, char **uri, struct evkeyvalq *query)
 {
-  struct daap_session *s;
+  int session_id;
   struct evbuffer *spklist;
   size_t len;
 
-  s = daap_session_find(req, query, evbuf);
-  if (!s)
+  session_id = daap_session_find(req, query, evbuf);
+  if (session_id < 0)
     return;
 
   spklist = evbuffer_new();
@@ -2423,7 +2462,7 @@ dacp_reply_getspeakers(struct evhttp_request *req, struct evbuffer *evbuf, char
 static void
 dacp_reply_setspeakers(struct evhttp_request *req, struct evbuffer *evbuf, char **uri, struct evkeyvalq *query)
 {
-  struct daap_session *s;
+  int session_id;
   const char *param;
   const char *ptr;
   uint64_t *ids;
@@ -2431,8 +2470,8 @@ dacp_reply_setspeakers(struct evhttp_request *req, struct evbuffer *evbuf, char
   int i;
   int ret;
 
-  s = daap_session_find(req, query, evbuf);
-  if (!s)
+  session_id = daap_session_find(req, query, evbuf);
+  if (session_id < 0)
     return;
 
   param = evhttp_find_header(query, "speaker-id");
@@ -2822,7 +2861,7 @@ dacp_deinit(void)
 	  evhttp_connection_free(evcon);
 	}
 
-      free(ur);
+      update_free(ur);
     }
 
   event_free(updateev);
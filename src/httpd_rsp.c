@@ -64,6 +64,17 @@ struct uri_map {
   regex_t preg;
   char *regexp;
   void (*handler)(struct evhttp_request *req, char **uri, struct evkeyvalq *query);
+  // Handler may take long, so it runs in the worker pool (see httpd_defer)
+  int deferred;
+};
+
+// A request handed over to the worker pool
+struct rsp_job {
+  int handler;
+  char *full_uri;
+  char *uri;
+  char *uri_parts[5];
+  struct evkeyvalq query;
 };
 
 static const struct field_map pl_fields[] =
@@ -761,15 +772,18 @@ static struct uri_map rsp_handlers[] =
     },
     {
       .regexp = "^/rsp/db$",
-      .handler = rsp_reply_db
+      .handler = rsp_reply_db,
+      .deferred = 1
     },
     {
       .regexp = "^/rsp/db/[[:digit:]]+$",
-      .handler = rsp_reply_playlist
+      .handler = rsp_reply_playlist,
+      .deferred = 1
     },
     {
       .regexp = "^/rsp/db/[[:digit:]]+/[^/]+$",
-      .handler = rsp_reply_browse
+      .handler = rsp_reply_browse,
+      .deferred = 1
     },
     {
       .regexp = "^/rsp/stream/[[:digit:]]+$",
@@ -782,6 +796,26 @@ static struct uri_map rsp_handlers[] =
   };
 
 
+/* Thread: worker pool */
+static void
+rsp_job_run(struct evhttp_request *req, void *arg)
+{
+  struct rsp_job *job = arg;
+
+  rsp_handlers[job->handler].handler(req, job->uri_parts, &job->query);
+}
+
+static void
+rsp_job_free(void *arg)
+{
+  struct rsp_job *job = arg;
+
+  evhttp_clear_headers(&job->query);
+  free(job->uri);
+  free(job->full_uri);
+  free(job);
+}
+
 void
 rsp_request(struct evhttp_request *req)
 {
@@ -790,6 +824,7 @@ rsp_request(struct evhttp_request *req)
   char *ptr;
   char *uri_parts[5];
   struct evkeyvalq query;
+  struct rsp_job *job;
   cfg_t *lib;
   char *libname;
   char *passwd;
@@ -890,6 +925,28 @@ rsp_request(struct evhttp_request *req)
       return;
     }
 
+  if (rsp_handlers[handler].deferred)
+    {
+      job = calloc(1, sizeof(struct rsp_job));
+      if (job)
+	{
+	  job->handler = handler;
+	  job->full_uri = full_uri;
+	  job->uri = uri;
+	  memcpy(job->uri_parts, uri_parts, sizeof(uri_parts));
+	  evhttp_parse_query(full_uri, &job->query);
+
+	  ret = httpd_defer(req, rsp_job_run, job, rsp_job_free);
+	  if (ret < 0)
+	    {
+	      rsp_job_run(req, job);
+	      rsp_job_free(job);
+	    }
+
+	  return;
+	}
+    }
+
   evhttp_parse_query(full_uri, &query);
 
   rsp_handlers[handler].handler(req, uri_parts, &query);
@@ -25,12 +25,17 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
 
 #include <uninorm.h>
 #include <unistd.h>
 
 #include <event2/event.h>
 #include <event2/buffer.h>
+#include <event2/bufferevent.h>
 #include <event2/http.h>
 
 #include "logger.h"
@@ -51,13 +56,80 @@ extern struct event_base *evbase_httpd;
 #define STREAMING_RAWBUF_SIZE (STOB(AIRTUNES_V2_PACKET_SAMPLES))
 // Should prevent that we keep transcoding to dead connections
 #define STREAMING_CONNECTION_TIMEOUT 60
+// Max bytes of mp3 queued for a client, if it has more than this we drop the
+// audio for that client instead of queuing it (about 8 seconds at 128 kbit/s)
+#define STREAMING_QUEUE_MAX (128 * 1024)
+// Clients that have been dropping audio for this many seconds are disconnected
+#define STREAMING_STALL_MAX 30
+// Encoded audio waiting to be sent by an httpd thread
+#define STREAMING_LOOP_QUEUE 16
+
+struct streaming_loop;
 
 // Linked list of mp3 streaming requests
 struct streaming_session {
   struct evhttp_request *req;
+  struct streaming_loop *loop;
+
+  char *address;
+  ev_uint16_t port;
+
+  time_t start;
+  // Set when the client stops keeping up, reset when it catches up
+  time_t stalled;
+
+  size_t queued;
+  uint64_t bytes_sent;
+  uint64_t bytes_dropped;
+
   struct streaming_session *next;
 };
-static struct streaming_session *streaming_sessions;
+
+/* Encoded audio that is sent to all the clients. Each client's connection holds
+ * a reference to it instead of a copy, and the chunk is freed when the last of
+ * them has sent it.
+ */
+struct streaming_chunk {
+  int refcount;
+  uint8_t data[];
+};
+
+struct streaming_item {
+  struct streaming_chunk *chunk;
+  uint8_t *data;
+  size_t len;
+};
+
+/* A connection must only be used from the httpd thread that accepted it, so
+ * each thread that has mp3 clients gets its own list of sessions, and a queue
+ * where the encoder puts the audio for it. The lists and queues are protected
+ * by streaming_lck, but a session list is only changed by its own thread.
+ */
+struct streaming_loop {
+  struct event_base *evbase;
+  struct event *sendev;
+  struct evbuffer *sendbuf;
+
+  struct streaming_item queue[STREAMING_LOOP_QUEUE];
+  int head;
+  int len;
+
+  struct streaming_session *sessions;
+
+  struct streaming_loop *next;
+};
+static struct streaming_loop *streaming_loops;
+static pthread_mutex_t streaming_lck = PTHREAD_MUTEX_INITIALIZER;
+static int streaming_listeners;
+
+// Totals since startup, including clients that are gone
+struct streaming_stats {
+  uint64_t sessions;
+  uint64_t disconnected;
+  uint64_t bytes_sent;
+  uint64_t bytes_dropped;
+};
+static struct streaming_stats streaming_stats;
 
 static int streaming_initialized;
 
@@ -71,61 +143,261 @@ static uint8_t streaming_rawbuf[STREAMING_RAWBUF_SIZE];
 static struct encode_ctx *streaming_encode_ctx;
 static struct evbuffer *streaming_encoded_data;
 
-// Used for pushing events and data from the player
+// Used for pushing events and data from the player. The event is only added
+// while there are clients, streamingev_lck serializes adding and deleting it.
 static struct event *streamingev;
+static pthread_mutex_t streamingev_lck = PTHREAD_MUTEX_INITIALIZER;
 static struct player_status streaming_player_status;
 static int streaming_player_changed;
 static int streaming_pipe[2];
 
 static void
-streaming_fail_cb(struct evhttp_connection *evcon, void *arg)
+streaming_chunk_unref(const void *data, size_t datalen, void *extra)
 {
-  struct streaming_session *this;
-  struct streaming_session *session;
-  struct streaming_session *prev;
+  struct streaming_chunk *chunk = extra;
 
-  this = (struct streaming_session *)arg;
+  if (__atomic_sub_fetch(&chunk->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+    free(chunk);
+}
 
-  DPRINTF(E_WARN, L_STREAMING, "Connection failed; stopping mp3 streaming to client\n");
+/* Thread: httpd (any)
+ * The first client starts the event that reads from the player, so the httpd
+ * loop doesn't wake up every second when nobody is listening
+ */
+static void
+streaming_listener_add(void)
+{
+  pthread_mutex_lock(&streamingev_lck);
+
+  if (__atomic_add_fetch(&streaming_listeners, 1, __ATOMIC_RELAXED) == 1)
+    {
+      // The status may have changed while the event wasn't running
+      streaming_player_changed = 1;
+      event_add(streamingev, &streaming_silence_tv);
+    }
+
+  pthread_mutex_unlock(&streamingev_lck);
+}
+
+/* Thread: httpd (any), must not hold streaming_lck, since event_del() waits
+ * for streaming_send_cb() to finish
+ */
+static void
+streaming_listener_remove(void)
+{
+  pthread_mutex_lock(&streamingev_lck);
+
+  if (__atomic_sub_fetch(&streaming_listeners, 1, __ATOMIC_RELAXED) == 0)
+    {
+      DPRINTF(E_INFO, L_STREAMING, "No more clients, will stop streaming\n");
+      event_del(streamingev);
+    }
+
+  pthread_mutex_unlock(&streamingev_lck);
+}
+
+/* Thread: httpd (the loop serving the session) */
+static void
+streaming_session_remove(struct streaming_session *session)
+{
+  struct streaming_session *s;
+  struct streaming_session *prev;
+
+  pthread_mutex_lock(&streaming_lck);
 
   prev = NULL;
-  for (session = streaming_sessions; session; session = session->next)
+  for (s = session->loop->sessions; s; s = s->next)
     {
-      if (session->req == this->req)
+      if (s == session)
 	break;
 
-      prev = session;
+      prev = s;
     }
 
-  if (!session)
+  if (s)
+    {
+      if (!prev)
+	session->loop->sessions = session->next;
+      else
+	prev->next = session->next;
+    }
+
+  pthread_mutex_unlock(&streaming_lck);
+
+  if (!s)
     {
-      DPRINTF(E_LOG, L_STREAMING, "Bug! Got a failure callback for an unknown stream\n");
-      free(this);
+      DPRINTF(E_LOG, L_STREAMING, "Bug! Tried to remove an unknown stream\n");
       return;
     }
 
-  if (!prev)
-    streaming_sessions = session->next;
-  else
-    prev->next = session->next;
+  DPRINTF(E_INFO, L_STREAMING, "Stopped mp3 streaming to %s:%d after %d sec, sent %" PRIu64 " bytes, dropped %" PRIu64 " bytes\n",
+	  session->address, (int)session->port, (int)(time(NULL) - session->start), session->bytes_sent, session->bytes_dropped);
 
   free(session);
 
-  if (!streaming_sessions)
+  streaming_listener_remove();
+}
+
+static void
+streaming_fail_cb(struct evhttp_connection *evcon, void *arg)
+{
+  struct streaming_session *session;
+
+  session = (struct streaming_session *)arg;
+
+  DPRINTF(E_WARN, L_STREAMING, "Connection failed; stopping mp3 streaming to client\n");
+
+  streaming_session_remove(session);
+}
+
+// Queues len bytes of data for the client, unless it is not keeping up. Returns
+// -1 if the client has been disconnected, otherwise 0.
+static int
+streaming_session_send(struct streaming_session *session, uint8_t *data, size_t len, struct streaming_chunk *chunk, time_t now)
+{
+  struct evhttp_connection *evcon;
+  struct evbuffer *sendbuf;
+  size_t queued;
+
+  evcon = evhttp_request_get_connection(session->req);
+  if (!evcon)
+    return 0;
+
+  queued = evbuffer_get_length(bufferevent_get_output(evhttp_connection_get_bufferevent(evcon)));
+  __atomic_store_n(&session->queued, queued, __ATOMIC_RELAXED);
+  if (queued + len > STREAMING_QUEUE_MAX)
     {
-      DPRINTF(E_INFO, L_STREAMING, "No more clients, will stop streaming\n");
-      event_del(streamingev);
+      __atomic_add_fetch(&session->bytes_dropped, len, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&streaming_stats.bytes_dropped, len, __ATOMIC_RELAXED);
+
+      if (!session->stalled)
+	{
+	  DPRINTF(E_WARN, L_STREAMING, "Client is not keeping up with the mp3 stream, dropping audio\n");
+	  session->stalled = now;
+	}
+      else if (now - session->stalled > STREAMING_STALL_MAX)
+	{
+	  DPRINTF(E_LOG, L_STREAMING, "Client has not kept up with the mp3 stream for %d sec, disconnecting\n", STREAMING_STALL_MAX);
+
+	  __atomic_add_fetch(&streaming_stats.disconnected, 1, __ATOMIC_RELAXED);
+
+	  evhttp_connection_set_closecb(evcon, NULL, NULL);
+	  streaming_session_remove(session);
+	  evhttp_connection_free(evcon);
+	  return -1;
+	}
+
+      return 0;
+    }
+
+  session->stalled = 0;
+
+  sendbuf = session->loop->sendbuf;
+
+  if (chunk)
+    {
+      __atomic_add_fetch(&chunk->refcount, 1, __ATOMIC_RELAXED);
+      evbuffer_add_reference(sendbuf, data, len, streaming_chunk_unref, chunk);
     }
+  else
+    evbuffer_add_reference(sendbuf, data, len, NULL, NULL);
+
+  evhttp_send_reply_chunk(session->req, sendbuf);
+
+  // Normally the data has been moved to the connection, but make sure we don't
+  // hold on to it if not
+  evbuffer_drain(sendbuf, evbuffer_get_length(sendbuf));
+
+  __atomic_add_fetch(&session->bytes_sent, len, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&streaming_stats.bytes_sent, len, __ATOMIC_RELAXED);
+
+  return 0;
 }
 
+/* Thread: httpd (the loop serving the sessions) */
 static void
-streaming_send_cb(evutil_socket_t fd, short event, void *arg)
+streaming_loop_cb(evutil_socket_t fd, short event, void *arg)
 {
+  struct streaming_loop *loop;
+  struct streaming_item items[STREAMING_LOOP_QUEUE];
   struct streaming_session *session;
-  struct evbuffer *evbuf;
+  struct streaming_session *next;
+  time_t now;
+  int n;
+  int i;
+
+  loop = (struct streaming_loop *)arg;
+
+  pthread_mutex_lock(&streaming_lck);
+
+  for (n = 0; loop->len > 0; n++)
+    {
+      items[n] = loop->queue[loop->head];
+      loop->head = (loop->head + 1) % STREAMING_LOOP_QUEUE;
+      loop->len--;
+    }
+
+  pthread_mutex_unlock(&streaming_lck);
+
+  now = time(NULL);
+
+  // Only this thread changes the session list, so it can be read without lock
+  for (i = 0; i < n; i++)
+    {
+      for (session = loop->sessions; session; session = next)
+	{
+	  next = session->next;
+	  streaming_session_send(session, items[i].data, items[i].len, items[i].chunk, now);
+	}
+
+      if (items[i].chunk)
+	streaming_chunk_unref(items[i].data, items[i].len, items[i].chunk);
+    }
+}
+
+/* Thread: httpd (main loop) */
+static void
+streaming_distribute(uint8_t *data, size_t len, struct streaming_chunk *chunk)
+{
+  struct streaming_loop *loop;
+  struct streaming_item *item;
+
+  pthread_mutex_lock(&streaming_lck);
+
+  for (loop = streaming_loops; loop; loop = loop->next)
+    {
+      if (!loop->sessions)
+	continue;
+
+      // The thread is not keeping up at all, so it will have to do without
+      if (loop->len == STREAMING_LOOP_QUEUE)
+	{
+	  __atomic_add_fetch(&streaming_stats.bytes_dropped, len, __ATOMIC_RELAXED);
+	  continue;
+	}
+
+      item = &loop->queue[(loop->head + loop->len) % STREAMING_LOOP_QUEUE];
+      item->chunk = chunk;
+      item->data = data;
+      item->len = len;
+      loop->len++;
+
+      if (chunk)
+	__atomic_add_fetch(&chunk->refcount, 1, __ATOMIC_RELAXED);
+
+      event_active(loop->sendev, 0, 0);
+    }
+
+  pthread_mutex_unlock(&streaming_lck);
+}
+
+static void
+streaming_send_cb(evutil_socket_t fd, short event, void *arg)
+{
+  struct streaming_chunk *chunk;
   struct decoded_frame *decoded;
-  uint8_t *buf;
-  int len;
+  uint8_t *data;
+  size_t len;
   int ret;
 
   // Player wrote data to the pipe (EV_READ)
@@ -135,7 +407,7 @@ streaming_send_cb(evutil_socket_t fd, short event, void *arg)
       if (ret < 0)
 	return;
 
-      if (!streaming_sessions)
+      if (__atomic_load_n(&streaming_listeners, __ATOMIC_RELAXED) == 0)
 	return;
 
       decoded = transcode_raw2frame(streaming_rawbuf, STREAMING_RAWBUF_SIZE);
@@ -149,6 +421,24 @@ streaming_send_cb(evutil_socket_t fd, short event, void *arg)
       transcode_decoded_free(decoded);
       if (ret < 0)
 	return;
+
+      // The encoder may need more than a packet of audio to make a frame
+      len = evbuffer_get_length(streaming_encoded_data);
+      if (len == 0)
+	return;
+
+      // The encoded data is copied once, and then shared by all the clients
+      chunk = malloc(sizeof(struct streaming_chunk) + len);
+      if (!chunk)
+	{
+	  DPRINTF(E_LOG, L_STREAMING, "Out of memory for encoded mp3\n");
+	  evbuffer_drain(streaming_encoded_data, len);
+	  return;
+	}
+
+      evbuffer_remove(streaming_encoded_data, chunk->data, len);
+      chunk->refcount = 1;
+      data = chunk->data;
     }
   // Event timed out, let's see what the player is doing and send silence if it is paused
   else
@@ -159,31 +449,23 @@ streaming_send_cb(evutil_socket_t fd, short event, void *arg)
 	  player_get_status(&streaming_player_status);
 	}
 
-      if (!streaming_sessions)
+      if (__atomic_load_n(&streaming_listeners, __ATOMIC_RELAXED) == 0)
 	return;
 
       if (streaming_player_status.status != PLAY_PAUSED)
 	return;
 
-      evbuffer_add(streaming_encoded_data, streaming_silence_data, streaming_silence_size);
+      // The silence is permanent, so no need for a chunk
+      chunk = NULL;
+      data = streaming_silence_data;
+      len = streaming_silence_size;
     }
 
-  len = evbuffer_get_length(streaming_encoded_data);
+  // The httpd threads with clients will send the data
+  streaming_distribute(data, len, chunk);
 
-  // Send data
-  evbuf = evbuffer_new();
-  for (session = streaming_sessions; session; session = session->next)
-    {
-      if (session->next)
-	{
-	  buf = evbuffer_pullup(streaming_encoded_data, -1);
-	  evbuffer_add(evbuf, buf, len);
-	  evhttp_send_reply_chunk(session->req, evbuf);
-	}
-      else
-	evhttp_send_reply_chunk(session->req, streaming_encoded_data);
-    }
-  evbuffer_free(evbuf);
+  if (chunk)
+    streaming_chunk_unref(chunk->data, len, chunk);
 }
 
 // Thread: player (not fully thread safe, but hey...)
@@ -199,7 +481,7 @@ streaming_write(uint8_t *buf, uint64_t rtptime)
 {
   int ret;
 
-  if (!streaming_sessions)
+  if (__atomic_load_n(&streaming_listeners, __ATOMIC_RELAXED) == 0)
     return;
 
   ret = write(streaming_pipe[1], buf, STREAMING_RAWBUF_SIZE);
@@ -207,6 +489,41 @@ streaming_write(uint8_t *buf, uint64_t rtptime)
     DPRINTF(E_LOG, L_STREAMING, "Error writing to streaming pipe: %s\n", strerror(errno));
 }
 
+/* Thread: httpd, must hold streaming_lck */
+static struct streaming_loop *
+streaming_loop_get(struct event_base *evbase)
+{
+  struct streaming_loop *loop;
+
+  for (loop = streaming_loops; loop; loop = loop->next)
+    {
+      if (loop->evbase == evbase)
+	return loop;
+    }
+
+  loop = calloc(1, sizeof(struct streaming_loop));
+  if (!loop)
+    return NULL;
+
+  loop->evbase = evbase;
+  loop->sendbuf = evbuffer_new();
+  loop->sendev = event_new(evbase, -1, 0, streaming_loop_cb, loop);
+  if (!loop->sendbuf || !loop->sendev)
+    {
+      if (loop->sendbuf)
+	evbuffer_free(loop->sendbuf);
+      if (loop->sendev)
+	event_free(loop->sendev);
+      free(loop);
+      return NULL;
+    }
+
+  loop->next = streaming_loops;
+  streaming_loops = loop;
+
+  return loop;
+}
+
 int
 streaming_is_request(struct evhttp_request *req, char *uri)
 {
@@ -257,7 +574,7 @@ streaming_request(struct evhttp_request *req)
   // TODO ICY metaint
   evhttp_send_reply_start(req, HTTP_OK, "OK");
 
-  session = malloc(sizeof(struct streaming_session));
+  session = calloc(1, sizeof(struct streaming_session));
   if (!session)
     {
       DPRINTF(E_LOG, L_STREAMING, "Out of memory for streaming request\n");
@@ -266,12 +583,33 @@ streaming_request(struct evhttp_request *req)
       return -1;
     }
 
-  if (!streaming_sessions)
-    event_add(streamingev, &streaming_silence_tv);
-
   session->req = req;
-  session->next = streaming_sessions;
-  streaming_sessions = session;
+  session->address = address;
+  session->port = port;
+  session->start = time(NULL);
+
+  pthread_mutex_lock(&streaming_lck);
+
+  session->loop = streaming_loop_get(httpd_request_evbase(req));
+  if (session->loop)
+    {
+      session->next = session->loop->sessions;
+      session->loop->sessions = session;
+    }
+
+  pthread_mutex_unlock(&streaming_lck);
+
+  if (!session->loop)
+    {
+      DPRINTF(E_LOG, L_STREAMING, "Out of memory for streaming thread data\n");
+
+      free(session);
+      evhttp_send_error(req, HTTP_SERVUNAVAIL, "Internal Server Error");
+      return -1;
+    }
+
+  streaming_listener_add();
+  __atomic_add_fetch(&streaming_stats.sessions, 1, __ATOMIC_RELAXED);
 
   evhttp_connection_set_timeout(evcon, STREAMING_CONNECTION_TIMEOUT);
   evhttp_connection_set_closecb(evcon, streaming_fail_cb, session);
@@ -279,6 +617,52 @@ streaming_request(struct evhttp_request *req)
   return 0;
 }
 
+int
+streaming_stats_get(struct evbuffer *evbuf)
+{
+  struct streaming_loop *loop;
+  struct streaming_session *session;
+  time_t now;
+  int first;
+  int ret;
+
+  ret = evbuffer_add_printf(evbuf, "{\"listeners\":%d,\"sessions\":%" PRIu64 ",\"disconnected\":%" PRIu64 ","
+			    "\"bytes_sent\":%" PRIu64 ",\"bytes_dropped\":%" PRIu64 ",\"clients\":[",
+			    __atomic_load_n(&streaming_listeners, __ATOMIC_RELAXED),
+			    __atomic_load_n(&streaming_stats.sessions, __ATOMIC_RELAXED),
+			    __atomic_load_n(&streaming_stats.disconnected, __ATOMIC_RELAXED),
+			    __atomic_load_n(&streaming_stats.bytes_sent, __ATOMIC_RELAXED),
+			    __atomic_load_n(&streaming_stats.bytes_dropped, __ATOMIC_RELAXED));
+
+  now = time(NULL);
+  first = 1;
+
+  // The sessions may belong to other httpd threads, so only the fields they
+  // update atomically are read here
+  pthread_mutex_lock(&streaming_lck);
+
+  for (loop = streaming_loops; loop && (ret >= 0); loop = loop->next)
+    {
+      for (session = loop->sessions; session && (ret >= 0); session = session->next)
+	{
+	  ret = evbuffer_add_printf(evbuf, "%s{\"address\":\"%s\",\"port\":%d,\"seconds\":%d,\"queued\":%zu,"
+				    "\"bytes_sent\":%" PRIu64 ",\"bytes_dropped\":%" PRIu64 "}",
+				    first ? "" : ",", session->address, (int)session->port, (int)(now - session->start),
+				    __atomic_load_n(&session->queued, __ATOMIC_RELAXED),
+				    __atomic_load_n(&session->bytes_sent, __ATOMIC_RELAXED),
+				    __atomic_load_n(&session->bytes_dropped, __ATOMIC_RELAXED));
+	  first = 0;
+	}
+    }
+
+  pthread_mutex_unlock(&streaming_lck);
+
+  if (ret >= 0)
+    ret = evbuffer_add_printf(evbuf, "]}\n");
+
+  return (ret < 0) ? -1 : 0;
+}
+
 int
 streaming_init(void)
 {
@@ -399,25 +783,41 @@ streaming_init(void)
   return -1;
 }
 
+/* Thread: main, after the httpd threads have stopped */
 void
 streaming_deinit(void)
 {
+  struct streaming_loop *loop;
   struct streaming_session *session;
-  struct streaming_session *next;
+  struct streaming_item *item;
 
   if (!streaming_initialized)
     return;
 
-  session = streaming_sessions;
-  streaming_sessions = NULL; // Stops writing and sending
+  streaming_listeners = 0; // Stops writing
 
-  next = NULL;
-  while (session)
+  for (loop = streaming_loops; loop; loop = streaming_loops)
     {
-      evhttp_send_reply_end(session->req);
-      next = session->next;
-      free(session);
-      session = next;
+      streaming_loops = loop->next;
+
+      for (session = loop->sessions; session; session = loop->sessions)
+	{
+	  loop->sessions = session->next;
+	  evhttp_send_reply_end(session->req);
+	  free(session);
+	}
+
+      for (; loop->len > 0; loop->len--)
+	{
+	  item = &loop->queue[loop->head];
+	  if (item->chunk)
+	    streaming_chunk_unref(item->data, item->len, item->chunk);
+	  loop->head = (loop->head + 1) % STREAMING_LOOP_QUEUE;
+	}
+
+      event_free(loop->sendev);
+      evbuffer_free(loop->sendbuf);
+      free(loop);
     }
 
   event_free(streamingev);
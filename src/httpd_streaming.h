@@ -19,6 +19,10 @@ streaming_is_request(struct evhttp_request *req, char *uri);
 int
 streaming_request(struct evhttp_request *req);
 
+/* Adds listener and byte counts to evbuf as JSON */
+int
+streaming_stats_get(struct evbuffer *evbuf);
+
 int
 streaming_init(void);
 
@@ -48,6 +48,7 @@
 
 #include <getopt.h>
 #include <event2/event.h>
+#include <event2/thread.h>
 #include <libavutil/log.h>
 #include <libavformat/avformat.h>
 #include <libavfilter/avfilter.h>
@@ -585,6 +586,13 @@ main(int argc, char **argv)
       return EXIT_FAILURE;
     }
 
+  /* Count libevent allocations, the player uses it to check that playback
+   * doesn't allocate in steady state */
+  mem_count_init();
+
+  /* Output write threads may activate events on the player event base */
+  evthread_use_pthreads();
+
   /* Set up libevent logging callback */
   event_set_log_callback(logger_libevent);
 
@@ -37,6 +37,8 @@
 #include <unistr.h>
 #include <uniconv.h>
 
+#include <event2/event.h>
+
 #include "logger.h"
 #include "misc.h"
 
@@ -918,3 +920,46 @@ timespec_cmp(struct timespec time1, struct timespec time2)
   else
     return 0;
 }
+
+
+#ifdef EVENT_SET_MEM_FUNCTIONS_IMPLEMENTED
+static __thread uint64_t mem_count;
+
+static void *
+mem_count_malloc(size_t size)
+{
+  mem_count++;
+
+  return malloc(size);
+}
+
+static void *
+mem_count_realloc(void *ptr, size_t size)
+{
+  mem_count++;
+
+  return realloc(ptr, size);
+}
+#endif
+
+/* Must be called before anything else uses libevent */
+void
+mem_count_init(void)
+{
+#ifdef EVENT_SET_MEM_FUNCTIONS_IMPLEMENTED
+  event_set_mem_functions(mem_count_malloc, mem_count_realloc, free);
+#endif
+}
+
+/* Returns the number of allocations libevent has made in the calling thread,
+ * or 0 if libevent was built without support for replacing its allocator
+ */
+uint64_t
+mem_count_get(void)
+{
+#ifdef EVENT_SET_MEM_FUNCTIONS_IMPLEMENTED
+  return mem_count;
+#else
+  return 0;
+#endif
+}
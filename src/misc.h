@@ -92,4 +92,11 @@ timespec_add(struct timespec time1, struct timespec time2);
 int
 timespec_cmp(struct timespec time1, struct timespec time2);
 
+/* Allocation counter for libevent (evbuffers etc.), per thread */
+void
+mem_count_init(void);
+
+uint64_t
+mem_count_get(void);
+
 #endif /* !__MISC_H__ */
@@ -27,10 +27,18 @@
 #include <errno.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <pthread.h>
+
+#include <event2/buffer.h>
 
 #include "logger.h"
+#include "player.h"
 #include "outputs.h"
 
+// Packets a write thread can have queued before new ones are dropped, this is
+// about a quarter of a second
+#define OUTPUT_QUEUE_LEN 32
+
 extern struct output_definition output_raop;
 extern struct output_definition output_streaming;
 extern struct output_definition output_dummy;
@@ -63,16 +71,512 @@ static struct output_definition *outputs[] = {
     NULL
 };
 
+/* PCM packet handed to the write threads. Packets are shared by all the
+ * threads, and return to the pool when the last reference is released.
+ */
+struct output_packet
+{
+  int refcount;
+  uint64_t rtptime;
+  struct timespec queued;
+  uint8_t samples[STOB(AIRTUNES_V2_PACKET_SAMPLES)];
+
+  // Playback position when the packet was queued, see outputs_playback_pos()
+  int pos_err;
+  uint64_t pos;
+  struct timespec pos_ts;
+
+  struct output_packet *next;
+};
+
+/* Write thread of an output type with write_thread set. outputs.c holds
+ * backend_lck when it calls the other callbacks of the backend from the player
+ * thread. The thread calls write() without it, the backend takes it only while
+ * it uses its session state, see outputs_backend_lock().
+ */
+struct output_writer
+{
+  pthread_t tid;
+  int running;
+  int exit;
+
+  pthread_mutex_t backend_lck;
+
+  pthread_mutex_t lck;
+  pthread_cond_t cond;
+  struct output_packet *queue[OUTPUT_QUEUE_LEN];
+  int head;
+  int len;
+
+  // Protected by lck, logged and reset when playback stops
+  uint64_t written;
+  uint64_t dropped;
+  uint64_t latency[8];
+};
+
+// Upper bounds (ms) of the write latency histogram buckets, the last bucket of
+// output_writer.latency counts everything above
+static const int output_latency_ms[] = { 1, 2, 5, 10, 20, 50, 100 };
+
+static struct output_writer writers[sizeof(outputs) / sizeof(outputs[0])];
+
+// The packets are preallocated and shared. Each write thread holds at most the
+// queued packets and the one it is writing, and the player the one it is
+// queueing, so the pool has room for all the threads being full at once. That
+// way a slow output only drops its own packets, the others still get theirs.
+#define OUTPUT_PACKET_POOL_LEN ((sizeof(outputs) / sizeof(outputs[0]) - 1) * (OUTPUT_QUEUE_LEN + 1) + 1)
+static struct output_packet packet_pool[OUTPUT_PACKET_POOL_LEN];
+static struct output_packet *packet_free;
+static pthread_mutex_t packet_lck = PTHREAD_MUTEX_INITIALIZER;
+
+// The packet a write thread is writing
+static __thread struct output_packet *writer_packet;
+
+/* Clock measurements of a device. The offset is how far the device is behind
+ * the player clock, and the drift is the slope of a least squares fit of the
+ * offsets since playback started. Offsets are kept as if no corrections had
+ * been made, so that a correction doesn't show up as drift.
+ */
+struct output_clock
+{
+  uint64_t id;
+  char *name;
+  enum output_types type;
+
+  uint64_t count;
+  struct timespec base;
+  int64_t base_offset_ns;
+  double sum_t;
+  double sum_o;
+  double sum_tt;
+  double sum_to;
+
+  int64_t offset_ns;
+  int64_t offset_min_ns;
+  int64_t offset_max_ns;
+
+  int corrections;
+  int64_t corrected_samples;
+
+  struct output_clock *next;
+};
+
+static struct output_clock *clocks;
+static pthread_mutex_t clock_lck = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* ------------------------------ Write threads ----------------------------- */
+
+static void
+packet_pool_init(void)
+{
+  int i;
+
+  packet_free = NULL;
+  for (i = 0; i < sizeof(packet_pool) / sizeof(packet_pool[0]); i++)
+    {
+      packet_pool[i].next = packet_free;
+      packet_free = &packet_pool[i];
+    }
+}
+
+/* Thread: player */
+static struct output_packet *
+packet_new(uint8_t *buf, uint64_t rtptime)
+{
+  struct output_packet *pkt;
+
+  pthread_mutex_lock(&packet_lck);
+  pkt = packet_free;
+  if (pkt)
+    packet_free = pkt->next;
+  pthread_mutex_unlock(&packet_lck);
+
+  if (!pkt)
+    return NULL;
+
+  pkt->refcount = 1;
+  pkt->rtptime = rtptime;
+  pkt->next = NULL;
+  clock_gettime(CLOCK_MONOTONIC, &pkt->queued);
+  memcpy(pkt->samples, buf, sizeof(pkt->samples));
+
+  // The player position is only safe to read in the player thread
+  pkt->pos_err = player_get_current_pos(&pkt->pos, &pkt->pos_ts, 0);
+
+  return pkt;
+}
+
+static void
+packet_unref(struct output_packet *pkt)
+{
+  if (__atomic_sub_fetch(&pkt->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+
+  pthread_mutex_lock(&packet_lck);
+  pkt->next = packet_free;
+  packet_free = pkt;
+  pthread_mutex_unlock(&packet_lck);
+}
+
+/* Thread: player */
+static void
+writer_queue(struct output_writer *w, struct output_packet *pkt)
+{
+  pthread_mutex_lock(&w->lck);
+
+  if (!pkt || (w->len == OUTPUT_QUEUE_LEN))
+    {
+      w->dropped++;
+      pthread_mutex_unlock(&w->lck);
+      return;
+    }
+
+  __atomic_add_fetch(&pkt->refcount, 1, __ATOMIC_RELAXED);
+
+  w->queue[(w->head + w->len) % OUTPUT_QUEUE_LEN] = pkt;
+  w->len++;
+
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->lck);
+}
+
+/* Thread: player, drops whatever is queued (on stop and flush) */
+static void
+writer_flush(struct output_writer *w)
+{
+  pthread_mutex_lock(&w->lck);
+
+  for (; w->len > 0; w->len--)
+    {
+      packet_unref(w->queue[w->head]);
+      w->head = (w->head + 1) % OUTPUT_QUEUE_LEN;
+    }
+
+  pthread_mutex_unlock(&w->lck);
+}
+
+static void
+writer_stats_log(struct output_writer *w, const char *name)
+{
+  char hist[256];
+  int len;
+  int i;
+
+  pthread_mutex_lock(&w->lck);
+
+  if (w->written + w->dropped > 0)
+    {
+      len = 0;
+      for (i = 0; i < sizeof(w->latency) / sizeof(w->latency[0]); i++)
+	{
+	  if (i < sizeof(output_latency_ms) / sizeof(output_latency_ms[0]))
+	    len += snprintf(hist + len, sizeof(hist) - len, " <%dms: %" PRIu64, output_latency_ms[i], w->latency[i]);
+	  else
+	    len += snprintf(hist + len, sizeof(hist) - len, " more: %" PRIu64, w->latency[i]);
+
+	  if (len >= sizeof(hist))
+	    break;
+	}
+
+      DPRINTF(E_DBG, L_PLAYER, "Output %s wrote %" PRIu64 " packets, dropped %" PRIu64 ", latency%s\n",
+	      name, w->written, w->dropped, hist);
+    }
+
+  w->written = 0;
+  w->dropped = 0;
+  memset(w->latency, 0, sizeof(w->latency));
+
+  pthread_mutex_unlock(&w->lck);
+}
+
+/* Thread: output writer */
+static void *
+writer_run(void *arg)
+{
+  struct output_writer *w = arg;
+  struct output_packet *pkt;
+  struct timespec now;
+  int type;
+  int ms;
+  int i;
+
+  type = w - writers;
+
+  pthread_mutex_lock(&w->lck);
+
+  while (!w->exit)
+    {
+      if (w->len == 0)
+	{
+	  pthread_cond_wait(&w->cond, &w->lck);
+	  continue;
+	}
+
+      pkt = w->queue[w->head];
+      w->head = (w->head + 1) % OUTPUT_QUEUE_LEN;
+      w->len--;
+
+      pthread_mutex_unlock(&w->lck);
+
+      writer_packet = pkt;
+      outputs[type]->write(pkt->samples, pkt->rtptime);
+      writer_packet = NULL;
+
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      ms = (now.tv_sec - pkt->queued.tv_sec) * 1000 + (now.tv_nsec - pkt->queued.tv_nsec) / 1000000;
+
+      packet_unref(pkt);
+
+      for (i = 0; i < sizeof(output_latency_ms) / sizeof(output_latency_ms[0]); i++)
+	if (ms < output_latency_ms[i])
+	  break;
+
+      pthread_mutex_lock(&w->lck);
+
+      w->written++;
+      w->latency[i]++;
+    }
+
+  pthread_mutex_unlock(&w->lck);
+
+  pthread_exit(NULL);
+}
+
+static void
+writer_start(int type)
+{
+  struct output_writer *w = &writers[type];
+  char name[16];
+  int ret;
+
+  pthread_mutex_init(&w->lck, NULL);
+  pthread_cond_init(&w->cond, NULL);
+
+  ret = pthread_create(&w->tid, NULL, writer_run, w);
+  if (ret != 0)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Could not spawn write thread for output %s, will write from the player thread: %s\n",
+	      outputs[type]->name, strerror(ret));
+
+      pthread_cond_destroy(&w->cond);
+      pthread_mutex_destroy(&w->lck);
+      return;
+    }
+
+  snprintf(name, sizeof(name), "out_%s", outputs[type]->name);
+#if defined(HAVE_PTHREAD_SETNAME_NP)
+  pthread_setname_np(w->tid, name);
+#elif defined(HAVE_PTHREAD_SET_NAME_NP)
+  pthread_set_name_np(w->tid, name);
+#endif
+
+  w->running = 1;
+}
+
+static void
+writer_stop(int type)
+{
+  struct output_writer *w = &writers[type];
+
+  if (!w->running)
+    return;
+
+  pthread_mutex_lock(&w->lck);
+  w->exit = 1;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->lck);
+
+  pthread_join(w->tid, NULL);
+
+  writer_flush(w);
+
+  pthread_cond_destroy(&w->cond);
+  pthread_mutex_destroy(&w->lck);
+
+  w->running = 0;
+}
+
+
+/* --------------------------------- Clocks --------------------------------- */
+
+// Must be called with clock_lck held
+static struct output_clock *
+clock_find(uint64_t id)
+{
+  struct output_clock *oc;
+
+  for (oc = clocks; oc; oc = oc->next)
+    {
+      if (oc->id == id)
+	return oc;
+    }
+
+  return NULL;
+}
+
+// Must be called with clock_lck held
+static void
+clock_reset(struct output_clock *oc)
+{
+  oc->count = 0;
+  oc->sum_t = 0;
+  oc->sum_o = 0;
+  oc->sum_tt = 0;
+  oc->sum_to = 0;
+  oc->offset_ns = 0;
+  oc->offset_min_ns = 0;
+  oc->offset_max_ns = 0;
+  oc->corrections = 0;
+  oc->corrected_samples = 0;
+}
+
+// Must be called with clock_lck held, returns the drift in ppm
+static double
+clock_drift(struct output_clock *oc)
+{
+  double d;
+
+  if (oc->count < 2)
+    return 0;
+
+  d = oc->count * oc->sum_tt - oc->sum_t * oc->sum_t;
+  if (d == 0)
+    return 0;
+
+  // Offsets are in usec and time in sec, so the slope is in ppm
+  return (oc->count * oc->sum_to - oc->sum_t * oc->sum_o) / d;
+}
+
+/* Thread: player */
+static void
+clock_register(struct output_device *device)
+{
+  struct output_clock *oc;
+
+  pthread_mutex_lock(&clock_lck);
+
+  oc = clock_find(device->id);
+  if (!oc)
+    {
+      oc = calloc(1, sizeof(struct output_clock));
+      if (!oc)
+	{
+	  DPRINTF(E_LOG, L_PLAYER, "Out of memory for output clock\n");
+	  goto out;
+	}
+
+      oc->id = device->id;
+      oc->next = clocks;
+      clocks = oc;
+    }
+
+  if (!oc->name || (strcmp(oc->name, device->name) != 0))
+    {
+      free(oc->name);
+      oc->name = strdup(device->name);
+    }
+
+  oc->type = device->type;
+
+  clock_reset(oc);
+
+ out:
+  pthread_mutex_unlock(&clock_lck);
+}
+
+/* Thread: player */
+static void
+clock_reset_all(void)
+{
+  struct output_clock *oc;
+
+  pthread_mutex_lock(&clock_lck);
+
+  for (oc = clocks; oc; oc = oc->next)
+    clock_reset(oc);
+
+  pthread_mutex_unlock(&clock_lck);
+}
+
+static void
+clock_free_all(void)
+{
+  struct output_clock *oc;
+
+  pthread_mutex_lock(&clock_lck);
+
+  while (clocks)
+    {
+      oc = clocks;
+      clocks = oc->next;
+
+      free(oc->name);
+      free(oc);
+    }
+
+  pthread_mutex_unlock(&clock_lck);
+}
+
+
+/* ---------------------------------- API ----------------------------------- */
+
+void
+outputs_backend_lock(enum output_types type)
+{
+  if (writers[type].running)
+    pthread_mutex_lock(&writers[type].backend_lck);
+}
+
+void
+outputs_backend_unlock(enum output_types type)
+{
+  if (writers[type].running)
+    pthread_mutex_unlock(&writers[type].backend_lck);
+}
+
+int
+outputs_playback_pos(uint64_t *pos, struct timespec *ts)
+{
+  struct output_packet *pkt;
+  uint64_t delta;
+
+  pkt = writer_packet;
+  if (!pkt)
+    return player_get_current_pos(pos, ts, 0);
+
+  if (pkt->pos_err < 0)
+    return -1;
+
+  // Same as player_get_current_pos(), from the position passed with the packet
+  clock_gettime(CLOCK_MONOTONIC, ts);
+
+  delta = (ts->tv_sec - pkt->pos_ts.tv_sec) * 1000000 + (ts->tv_nsec - pkt->pos_ts.tv_nsec) / 1000;
+  delta = (delta * 44100) / 1000000;
+
+  *pos = pkt->pos + delta;
+
+  return 0;
+}
+
 int
 outputs_device_start(struct output_device *device, output_status_cb cb, uint64_t rtptime)
 {
+  int ret;
+
   if (outputs[device->type]->disabled)
     return -1;
 
-  if (outputs[device->type]->device_start)
-    return outputs[device->type]->device_start(device, cb, rtptime);
-  else
+  if (!outputs[device->type]->device_start)
     return -1;
+
+  clock_register(device);
+
+  outputs_backend_lock(device->type);
+  ret = outputs[device->type]->device_start(device, cb, rtptime);
+  outputs_backend_unlock(device->type);
+
+  return ret;
 }
 
 void
@@ -81,20 +585,30 @@ outputs_device_stop(struct output_session *session)
   if (outputs[session->type]->disabled)
     return;
 
-  if (outputs[session->type]->device_stop)
-    outputs[session->type]->device_stop(session);
+  if (!outputs[session->type]->device_stop)
+    return;
+
+  outputs_backend_lock(session->type);
+  outputs[session->type]->device_stop(session);
+  outputs_backend_unlock(session->type);
 }
 
 int
 outputs_device_probe(struct output_device *device, output_status_cb cb)
 {
+  int ret;
+
   if (outputs[device->type]->disabled)
     return -1;
 
-  if (outputs[device->type]->device_probe)
-    return outputs[device->type]->device_probe(device, cb);
-  else
+  if (!outputs[device->type]->device_probe)
     return -1;
+
+  outputs_backend_lock(device->type);
+  ret = outputs[device->type]->device_probe(device, cb);
+  outputs_backend_unlock(device->type);
+
+  return ret;
 }
 
 void
@@ -104,7 +618,11 @@ outputs_device_free(struct output_device *device)
     DPRINTF(E_LOG, L_PLAYER, "BUG! Freeing device from a disabled output?\n");
 
   if (outputs[device->type]->device_free_extra)
-    outputs[device->type]->device_free_extra(device);
+    {
+      outputs_backend_lock(device->type);
+      outputs[device->type]->device_free_extra(device);
+      outputs_backend_unlock(device->type);
+    }
 
   if (device->name)
     free(device->name);
@@ -124,13 +642,19 @@ outputs_device_free(struct output_device *device)
 int
 outputs_device_volume_set(struct output_device *device, output_status_cb cb)
 {
+  int ret;
+
   if (outputs[device->type]->disabled)
     return -1;
 
-  if (outputs[device->type]->device_volume_set)
-    return outputs[device->type]->device_volume_set(device, cb);
-  else
+  if (!outputs[device->type]->device_volume_set)
     return -1;
+
+  outputs_backend_lock(device->type);
+  ret = outputs[device->type]->device_volume_set(device, cb);
+  outputs_backend_unlock(device->type);
+
+  return ret;
 }
 
 void
@@ -138,13 +662,19 @@ outputs_playback_start(uint64_t next_pkt, struct timespec *ts)
 {
   int i;
 
+  clock_reset_all();
+
   for (i = 0; outputs[i]; i++)
     {
       if (outputs[i]->disabled)
 	continue;
 
-      if (outputs[i]->playback_start)
-	outputs[i]->playback_start(next_pkt, ts);
+      if (!outputs[i]->playback_start)
+	continue;
+
+      outputs_backend_lock(i);
+      outputs[i]->playback_start(next_pkt, ts);
+      outputs_backend_unlock(i);
     }
 }
 
@@ -158,13 +688,52 @@ outputs_playback_stop(void)
       if (outputs[i]->disabled)
 	continue;
 
-      if (outputs[i]->playback_stop)
-	outputs[i]->playback_stop();
+      if (writers[i].running)
+	{
+	  writer_flush(&writers[i]);
+	  writer_stats_log(&writers[i], outputs[i]->name);
+	}
+
+      if (!outputs[i]->playback_stop)
+	continue;
+
+      outputs_backend_lock(i);
+      outputs[i]->playback_stop();
+      outputs_backend_unlock(i);
     }
 }
 
 void
 outputs_write(uint8_t *buf, uint64_t rtptime)
+{
+  struct output_packet *pkt;
+  int i;
+
+  pkt = NULL;
+  for (i = 0; outputs[i]; i++)
+    {
+      if (outputs[i]->disabled || !outputs[i]->write)
+	continue;
+
+      if (!writers[i].running)
+	{
+	  outputs[i]->write(buf, rtptime);
+	  continue;
+	}
+
+      // The pool can't run out, but if it did writer_queue() counts a drop
+      if (!pkt)
+	pkt = packet_new(buf, rtptime);
+
+      writer_queue(&writers[i], pkt);
+    }
+
+  if (pkt)
+    packet_unref(pkt);
+}
+
+void
+outputs_write_commit(void)
 {
   int i;
 
@@ -173,8 +742,8 @@ outputs_write(uint8_t *buf, uint64_t rtptime)
       if (outputs[i]->disabled)
 	continue;
 
-      if (outputs[i]->write)
-	outputs[i]->write(buf, rtptime);
+      if (outputs[i]->write_commit && !writers[i].running)
+	outputs[i]->write_commit();
     }
 }
 
@@ -190,8 +759,15 @@ outputs_flush(output_status_cb cb, uint64_t rtptime)
       if (outputs[i]->disabled)
 	continue;
 
-      if (outputs[i]->flush)
-	ret += outputs[i]->flush(cb, rtptime);
+      if (writers[i].running)
+	writer_flush(&writers[i]);
+
+      if (!outputs[i]->flush)
+	continue;
+
+      outputs_backend_lock(i);
+      ret += outputs[i]->flush(cb, rtptime);
+      outputs_backend_unlock(i);
     }
 
   return ret;
@@ -203,8 +779,12 @@ outputs_status_cb(struct output_session *session, output_status_cb cb)
   if (outputs[session->type]->disabled)
     return;
 
-  if (outputs[session->type]->status_cb)
-    outputs[session->type]->status_cb(session, cb);
+  if (!outputs[session->type]->status_cb)
+    return;
+
+  outputs_backend_lock(session->type);
+  outputs[session->type]->status_cb(session, cb);
+  outputs_backend_unlock(session->type);
 }
 
 struct output_metadata *
@@ -325,19 +905,135 @@ outputs_name(enum output_types type)
   return outputs[type]->name;
 }
 
+/* Thread: any, typically a backend's write thread or the player */
+void
+outputs_clock_offset(uint64_t id, int64_t offset_ns, struct timespec *ts)
+{
+  struct output_clock *oc;
+  double t;
+  double o;
+
+  pthread_mutex_lock(&clock_lck);
+
+  oc = clock_find(id);
+  if (!oc)
+    goto out;
+
+  // Undo the corrections that have been made
+  offset_ns += oc->corrected_samples * 1000000000LL / 44100;
+
+  if (oc->count == 0)
+    {
+      oc->base = *ts;
+      oc->base_offset_ns = offset_ns;
+      oc->offset_min_ns = offset_ns;
+      oc->offset_max_ns = offset_ns;
+    }
+
+  t = (ts->tv_sec - oc->base.tv_sec) + (ts->tv_nsec - oc->base.tv_nsec) / 1000000000.0;
+  o = (offset_ns - oc->base_offset_ns) / 1000.0;
+
+  oc->count++;
+  oc->sum_t += t;
+  oc->sum_o += o;
+  oc->sum_tt += t * t;
+  oc->sum_to += t * o;
+
+  oc->offset_ns = offset_ns;
+  if (offset_ns < oc->offset_min_ns)
+    oc->offset_min_ns = offset_ns;
+  if (offset_ns > oc->offset_max_ns)
+    oc->offset_max_ns = offset_ns;
+
+ out:
+  pthread_mutex_unlock(&clock_lck);
+}
+
+/* Thread: any */
+void
+outputs_clock_corrected(uint64_t id, int samples)
+{
+  struct output_clock *oc;
+
+  pthread_mutex_lock(&clock_lck);
+
+  oc = clock_find(id);
+  if (oc)
+    {
+      oc->corrections++;
+      oc->corrected_samples += samples;
+    }
+
+  pthread_mutex_unlock(&clock_lck);
+}
+
+/* Thread: any */
+int
+outputs_clock_stats(struct evbuffer *evbuf)
+{
+  struct output_clock *oc;
+  const char *c;
+  int ret;
+
+  pthread_mutex_lock(&clock_lck);
+
+  ret = evbuffer_add_printf(evbuf, "{\"clocks\":[");
+
+  for (oc = clocks; oc && (ret >= 0); oc = oc->next)
+    {
+      evbuffer_add_printf(evbuf, "%s{\"id\":\"%" PRIx64 "\",\"name\":\"", (oc == clocks) ? "" : ",", oc->id);
+
+      for (c = oc->name; c && *c; c++)
+	{
+	  if ((*c == '"') || (*c == '\\'))
+	    evbuffer_add_printf(evbuf, "\\%c", *c);
+	  else if ((unsigned char)*c < 0x20)
+	    evbuffer_add_printf(evbuf, "\\u%04x", *c);
+	  else
+	    evbuffer_add(evbuf, c, 1);
+	}
+
+      ret = evbuffer_add_printf(evbuf, "\",\"type\":\"%s\",\"measurements\":%" PRIu64 ","
+				"\"offset_us\":%" PRId64 ",\"offset_min_us\":%" PRId64 ",\"offset_max_us\":%" PRId64 ","
+				"\"drift_ppm\":%.3f,\"corrections\":%d,\"corrected_samples\":%" PRId64 "}",
+				outputs[oc->type]->name, oc->count,
+				oc->offset_ns / 1000, oc->offset_min_ns / 1000, oc->offset_max_ns / 1000,
+				clock_drift(oc), oc->corrections, oc->corrected_samples);
+    }
+
+  if (ret >= 0)
+    ret = evbuffer_add_printf(evbuf, "]}\n");
+
+  pthread_mutex_unlock(&clock_lck);
+
+  return (ret < 0) ? -1 : 0;
+}
+
 int
 outputs_init(void)
 {
+  pthread_mutexattr_t mattr;
   int no_output;
   int ret;
   int i;
 
+  packet_pool_init();
+
+  // Recursive, since a backend callback can lead to the player calling back
+  // into the backend
+  pthread_mutexattr_init(&mattr);
+  pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_RECURSIVE);
+
   no_output = 1;
   for (i = 0; outputs[i]; i++)
     {
+      memset(&writers[i], 0, sizeof(struct output_writer));
+      pthread_mutex_init(&writers[i].backend_lck, &mattr);
+
       if (outputs[i]->type != i)
 	{
 	  DPRINTF(E_FATAL, L_PLAYER, "BUG! Output definitions are misaligned with output enum\n");
+	  pthread_mutexattr_destroy(&mattr);
 	  return -1;
 	}
 
@@ -346,11 +1042,19 @@ outputs_init(void)
 
       ret = outputs[i]->init();
       if (ret < 0)
-	outputs[i]->disabled = 1;
-      else
-	no_output = 0;
+	{
+	  outputs[i]->disabled = 1;
+	  continue;
+	}
+
+      no_output = 0;
+
+      if (outputs[i]->write_thread && outputs[i]->write)
+	writer_start(i);
     }
 
+  pthread_mutexattr_destroy(&mattr);
+
   if (no_output)
     return -1;
 
@@ -364,11 +1068,14 @@ outputs_deinit(void)
 
   for (i = 0; outputs[i]; i++)
     {
-      if (outputs[i]->disabled)
-	continue;
+      writer_stop(i);
 
-      if (outputs[i]->deinit)
+      if (!outputs[i]->disabled && outputs[i]->deinit)
         outputs[i]->deinit();
+
+      pthread_mutex_destroy(&writers[i].backend_lck);
     }
+
+  clock_free_all();
 }
 
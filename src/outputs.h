@@ -4,6 +4,8 @@
 
 #include <time.h>
 
+struct evbuffer;
+
 /* Outputs is a generic interface between the player and a media output method,
  * like for instance AirPlay (raop) or ALSA. The purpose of the interface is to
  * make it easier to add new outputs without messing too much with the player or
@@ -97,8 +99,11 @@ struct output_device
   // Type of output (string)
   const char *type_name;
 
+  // Not a bit field, since output write threads read it with the backend
+  // lock held while the player changes the other flags
+  int selected;
+
   // Misc device flags 
-  unsigned selected:1;
   unsigned advertised:1;
   unsigned has_password:1;
   unsigned has_video:1;
@@ -155,6 +160,14 @@ struct output_definition
   // Set to 1 if the output initialization failed
   int disabled;
 
+  // Set to 1 to have write() called from a thread of its own instead of the
+  // player thread, so a backend that may block doesn't hold up the other
+  // outputs. outputs.c calls the other callbacks with outputs_backend_lock()
+  // held. write() is called without it, and must take it while it uses state
+  // the other callbacks change, but not across I/O that may block. The backend
+  // must also take it in its own deferred events.
+  int write_thread;
+
   // Initialization function called during startup
   // Output must call device_cb when an output device becomes available/unavailable
   int (*init)(void);
@@ -184,6 +197,9 @@ struct output_definition
   // Write stream data to the output devices
   void (*write)(uint8_t *buf, uint64_t rtptime);
 
+  // Send data that write() has queued, called once per playback tick
+  void (*write_commit)(void);
+
   // Flush all sessions, the return must be number of sessions pending the flush
   int (*flush)(output_status_cb cb, uint64_t rtptime);
 
@@ -197,6 +213,19 @@ struct output_definition
   void (*metadata_prune)(uint64_t rtptime);
 };
 
+/* Gets the playback position like player_get_current_pos(), also from an
+ * output write thread, where it is based on the position the player had when
+ * the packet being written was queued.
+ */
+int
+outputs_playback_pos(uint64_t *pos, struct timespec *ts);
+
+void
+outputs_backend_lock(enum output_types type);
+
+void
+outputs_backend_unlock(enum output_types type);
+
 int
 outputs_device_start(struct output_device *device, output_status_cb cb, uint64_t rtptime);
 
@@ -221,6 +250,9 @@ outputs_playback_stop(void);
 void
 outputs_write(uint8_t *buf, uint64_t rtptime);
 
+void
+outputs_write_commit(void);
+
 int
 outputs_flush(output_status_cb cb, uint64_t rtptime);
 
@@ -248,6 +280,20 @@ outputs_priority(struct output_device *device);
 const char *
 outputs_name(enum output_types type);
 
+/* Clock service. Backends report how far a device is behind the player clock
+ * at time ts (CLOCK_MONOTONIC), and the corrections they make in samples
+ * (positive when samples were skipped to catch up). Measurements are reset when
+ * playback starts, and outputs_clock_stats() adds them to evbuf as JSON.
+ */
+void
+outputs_clock_offset(uint64_t id, int64_t offset_ns, struct timespec *ts);
+
+void
+outputs_clock_corrected(uint64_t id, int samples);
+
+int
+outputs_clock_stats(struct evbuffer *evbuf);
+
 int
 outputs_init(void);
 
@@ -37,6 +37,10 @@
 #include "player.h"
 #include "outputs.h"
 
+#ifndef MIN
+# define MIN(a, b) ((a < b) ? a : b)
+#endif
+
 #define PACKET_SIZE STOB(AIRTUNES_V2_PACKET_SAMPLES)
 // The maximum number of samples that the output is allowed to get behind (or
 // ahead) of the player position, before compensation is attempted
@@ -67,13 +71,6 @@ enum alsa_state
   ALSA_STATE_STREAMING = ALSA_F_STARTED | 0x01,
 };
 
-enum alsa_sync_state
-{
-  ALSA_SYNC_OK,
-  ALSA_SYNC_AHEAD,
-  ALSA_SYNC_BEHIND,
-};
-
 struct alsa_session
 {
   enum alsa_state state;
@@ -86,6 +83,10 @@ struct alsa_session
   int32_t last_latency;
   int sync_counter;
 
+  // Samples still to be skipped (positive) or repeated (negative) to make up
+  // for the latency measured by sync_check()
+  int32_t correction;
+
   // An array that will hold the packets we prebuffer. The length of the array
   // is prebuf_len (measured in rtp_packets)
   uint8_t *prebuf;
@@ -100,6 +101,7 @@ struct alsa_session
 
   /* Do not dereference - only passed to the status cb */
   struct output_device *device;
+  uint64_t device_id;
   struct output_session *output_session;
   output_status_cb status_cb;
 
@@ -199,6 +201,7 @@ alsa_session_make(struct output_device *device, output_status_cb cb)
   as->output_session = os;
   as->state = ALSA_STATE_STOPPED;
   as->device = device;
+  as->device_id = device->id;
   as->status_cb = cb;
   as->volume = device->volume;
   as->devname = card_name;
@@ -220,6 +223,9 @@ defer_cb(int fd, short what, void *arg)
   struct alsa_session *as = arg;
   enum output_device_state state;
 
+  // alsa_write() runs in the output write thread
+  outputs_backend_lock(OUTPUT_TYPE_ALSA);
+
   switch (as->state)
     {
       case ALSA_STATE_FAILED:
@@ -244,6 +250,8 @@ defer_cb(int fd, short what, void *arg)
 
   if (!(as->state & ALSA_F_STARTED))
     alsa_session_cleanup(as);
+
+  outputs_backend_unlock(OUTPUT_TYPE_ALSA);
 }
 
 // Note: alsa_states also nukes the session if it is not ALSA_F_STARTED
@@ -496,6 +504,16 @@ device_open(struct alsa_session *as)
       goto out_fail;
     }
 
+  // alsa_write() holds the backend lock while writing, so it must not block.
+  // It only writes what there is room for anyway.
+  ret = snd_pcm_nonblock(hdl, 1);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_LAUDIO, "Could not set non-blocking mode: %s\n", snd_strerror(ret));
+
+      goto out_fail;
+    }
+
   snd_pcm_hw_params_free(hw_params);
   hw_params = NULL;
 
@@ -560,6 +578,9 @@ playback_start(struct alsa_session *as, uint64_t pos, uint64_t start_pos)
   // Clear prebuffer in case start somehow got called twice without a stop in between
   prebuf_free(as);
 
+  as->sync_counter = 0;
+  as->correction = 0;
+
   // Adjust the starting position with the configured value
   start_pos -= offset;
 
@@ -658,21 +679,67 @@ buffer_write(struct alsa_session *as, uint8_t *buf, snd_pcm_sframes_t *avail, in
   return 0;
 }
 
-// Checks if ALSA's playback position is ahead or behind the player's
-enum alsa_sync_state
+// Skips or repeats up to a packet worth of samples, as set by sync_check().
+// Must only be called when the prebuffer is empty and there is room in ALSA for
+// two packets. Returns 0 on success, negative on error.
+static int
+correction_write(struct alsa_session *as, uint8_t *buf, snd_pcm_sframes_t *avail)
+{
+  snd_pcm_sframes_t nsamp;
+  snd_pcm_sframes_t ret;
+  int32_t n;
+
+  if (as->correction > 0)
+    {
+      // Behind, so drop the first n samples of the packet
+      n = MIN(as->correction, AIRTUNES_V2_PACKET_SAMPLES);
+      buf += STOB(n);
+      nsamp = AIRTUNES_V2_PACKET_SAMPLES - n;
+    }
+  else
+    {
+      // Ahead, so play the first n samples of the packet twice
+      ret = snd_pcm_writei(hdl, buf, MIN(-as->correction, AIRTUNES_V2_PACKET_SAMPLES));
+      if (ret < 0)
+	return ret;
+
+      *avail -= ret;
+      n = -ret;
+      nsamp = AIRTUNES_V2_PACKET_SAMPLES;
+    }
+
+  as->correction -= n;
+  outputs_clock_corrected(as->device_id, n);
+
+  if (nsamp == 0)
+    return 0;
+
+  ret = snd_pcm_writei(hdl, buf, nsamp);
+  if (ret < 0)
+    return ret;
+
+  if (ret != nsamp)
+    DPRINTF(E_WARN, L_LAUDIO, "ALSA partial write detected\n");
+
+  *avail -= ret;
+
+  return 0;
+}
+
+// Checks if ALSA's playback position is ahead or behind the player's, reports
+// it to the clock service and sets the correction to make if it is consistently
+// off
+static void
 sync_check(struct alsa_session *as, uint64_t rtptime, snd_pcm_sframes_t delay, int prebuf_empty)
 {
-  enum alsa_sync_state sync;
   struct timespec now;
   uint64_t cur_pos;
   uint64_t pb_pos;
   int32_t latency;
   int npackets;
 
-  sync = ALSA_SYNC_OK;
-
-  if (player_get_current_pos(&cur_pos, &now, 0) != 0)
-    return sync;
+  if (outputs_playback_pos(&cur_pos, &now) != 0)
+    return;
 
   if (!prebuf_empty)
     npackets = (as->prebuf_head - (as->prebuf_tail + 1) + as->prebuf_len) % as->prebuf_len + 1;
@@ -682,11 +749,12 @@ sync_check(struct alsa_session *as, uint64_t rtptime, snd_pcm_sframes_t delay, i
   pb_pos = rtptime - delay - AIRTUNES_V2_PACKET_SAMPLES * npackets;
   latency = cur_pos - (pb_pos - offset);
 
+  outputs_clock_offset(as->device_id, (int64_t)latency * 1000000000LL / 44100, &now);
+
   // If the latency is low or very different from our last measurement, we reset the sync_counter
   if (abs(latency) < ALSA_MAX_LATENCY || abs(as->last_latency - latency) > ALSA_MAX_LATENCY_VARIANCE)
     {
       as->sync_counter = 0;
-      sync = ALSA_SYNC_OK;
     }
   // If we have measured a consistent latency for 10 seconds, then we take action
   else if (as->sync_counter >= 10 * 126)
@@ -694,18 +762,13 @@ sync_check(struct alsa_session *as, uint64_t rtptime, snd_pcm_sframes_t delay, i
       DPRINTF(E_INFO, L_LAUDIO, "Taking action to compensate for ALSA latency of %d samples\n", latency);
 
       as->sync_counter = 0;
-      if (latency > 0)
-	sync = ALSA_SYNC_BEHIND;
-      else
-	sync = ALSA_SYNC_AHEAD;
+      as->correction = latency;
     }
 
   as->last_latency = latency;
 
   if (latency)
-    DPRINTF(E_SPAM, L_LAUDIO, "Sync %d cur_pos %" PRIu64 ", pb_pos %" PRIu64 " (diff %d, delay %li), pos %" PRIu64 "\n", sync, cur_pos, pb_pos, latency, delay, as->pos);
-
-  return sync;
+    DPRINTF(E_SPAM, L_LAUDIO, "Sync cur_pos %" PRIu64 ", pb_pos %" PRIu64 " (diff %d, delay %li), pos %" PRIu64 "\n", cur_pos, pb_pos, latency, delay, as->pos);
 }
 
 static void
@@ -714,7 +777,6 @@ playback_write(struct alsa_session *as, uint8_t *buf, uint64_t rtptime)
   snd_pcm_sframes_t ret;
   snd_pcm_sframes_t avail;
   snd_pcm_sframes_t delay;
-  enum alsa_sync_state sync;
   int prebuffering;
   int prebuf_empty;
 
@@ -734,18 +796,15 @@ playback_write(struct alsa_session *as, uint8_t *buf, uint64_t rtptime)
     goto alsa_error;
 
   // Every second we do a sync check
-  sync = ALSA_SYNC_OK;
   as->sync_counter++;
   if (as->sync_counter % 126 == 0)
-    sync = sync_check(as, rtptime, delay, prebuf_empty);
-
-  // Skip write -> reduce the delay
-  if (sync == ALSA_SYNC_BEHIND)
-    return;
+    sync_check(as, rtptime, delay, prebuf_empty);
 
-  ret = buffer_write(as, buf, &avail, prebuffering, prebuf_empty);
-  // Double write -> increase the delay
-  if (sync == ALSA_SYNC_AHEAD && (ret == 0))
+  // The correction is made a packet at a time, and only when writing directly
+  // to ALSA, since the prebuffer holds whole packets
+  if (as->correction && prebuf_empty && (avail >= 2 * AIRTUNES_V2_PACKET_SAMPLES))
+    ret = correction_write(as, buf, &avail);
+  else
     ret = buffer_write(as, buf, &avail, prebuffering, prebuf_empty);
   if (ret < 0)
     goto alsa_error;
@@ -753,6 +812,12 @@ playback_write(struct alsa_session *as, uint8_t *buf, uint64_t rtptime)
   return;
 
  alsa_error:
+  if (ret == -EAGAIN)
+    {
+      DPRINTF(E_WARN, L_LAUDIO, "ALSA buffer full, packet dropped\n");
+      return;
+    }
+
   if (ret == -EPIPE)
     {
       DPRINTF(E_WARN, L_LAUDIO, "ALSA buffer underrun\n");
@@ -783,7 +848,7 @@ playback_pos_get(uint64_t *pos, uint64_t next_pkt)
   struct timespec now;
   int ret;
 
-  ret = player_get_current_pos(&cur_pos, &now, 0);
+  ret = outputs_playback_pos(&cur_pos, &now);
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_LAUDIO, "Could not get playback position, setting to next_pkt - 2 seconds\n");
@@ -936,6 +1001,9 @@ alsa_write(uint8_t *buf, uint64_t rtptime)
   struct alsa_session *as;
   uint64_t pos;
 
+  // Called in the output write thread
+  outputs_backend_lock(OUTPUT_TYPE_ALSA);
+
   for (as = sessions; as; as = as->next)
     {
       if (as->state == ALSA_STATE_STARTED)
@@ -949,6 +1017,8 @@ alsa_write(uint8_t *buf, uint64_t rtptime)
 
       playback_write(as, buf, rtptime);
     }
+
+  outputs_backend_unlock(OUTPUT_TYPE_ALSA);
 }
 
 static int
@@ -1047,6 +1117,7 @@ struct output_definition output_alsa =
   .type = OUTPUT_TYPE_ALSA,
   .priority = 3,
   .disabled = 0,
+  .write_thread = 1,
   .init = alsa_init,
   .deinit = alsa_deinit,
   .device_start = alsa_device_start,
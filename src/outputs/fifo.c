@@ -57,10 +57,38 @@ struct fifo_buffer
 {
   struct fifo_packet *head;
   struct fifo_packet *tail;
+
+  /* Packets that have been written are kept for reuse, so that fifo_write
+     doesn't have to allocate a new one every time */
+  struct fifo_packet *unused;
 };
 static struct fifo_buffer buffer;
 
 
+static struct fifo_packet *
+packet_get(void)
+{
+  struct fifo_packet *packet;
+
+  packet = buffer.unused;
+  if (!packet)
+    return calloc(1, sizeof(struct fifo_packet));
+
+  buffer.unused = packet->next;
+
+  packet->next = NULL;
+  packet->prev = NULL;
+
+  return packet;
+}
+
+static void
+packet_put(struct fifo_packet *packet)
+{
+  packet->next = buffer.unused;
+  buffer.unused = packet;
+}
+
 static void
 free_buffer()
 {
@@ -72,13 +100,25 @@ free_buffer()
     {
       tmp = packet;
       packet = packet->next;
-      free(tmp);
+      packet_put(tmp);
     }
 
   buffer.tail = NULL;
   buffer.head = NULL;
 }
 
+static void
+free_unused()
+{
+  struct fifo_packet *packet;
+
+  while ((packet = buffer.unused))
+    {
+      buffer.unused = packet->next;
+      free(packet);
+    }
+}
+
 struct fifo_session
 {
   enum output_device_state state;
@@ -241,6 +281,7 @@ fifo_session_free(struct fifo_session *fifo_session)
   free(fifo_session->output_session);
   free(fifo_session);
   free_buffer();
+  free_unused();
   fifo_session = NULL;
 }
 
@@ -311,11 +352,16 @@ defer_cb(int fd, short what, void *arg)
 {
   struct fifo_session *ds = arg;
 
+  // fifo_write() runs in the output write thread
+  outputs_backend_lock(OUTPUT_TYPE_FIFO);
+
   if (ds->defer_cb)
     ds->defer_cb(ds->device, ds->output_session, ds->state);
 
   if (ds->state == OUTPUT_STATE_STOPPED)
     fifo_session_cleanup(ds);
+
+  outputs_backend_unlock(OUTPUT_TYPE_FIFO);
 }
 
 static void
@@ -446,8 +492,9 @@ fifo_flush(output_status_cb cb, uint64_t rtptime)
   return 1;
 }
 
+// Must be called with the backend lock held
 static void
-fifo_write(uint8_t *buf, uint64_t rtptime)
+fifo_write_packet(uint8_t *buf, uint64_t rtptime)
 {
   struct fifo_session *fifo_session = sessions;
   size_t length = STOB(AIRTUNES_V2_PACKET_SAMPLES);
@@ -460,7 +507,13 @@ fifo_write(uint8_t *buf, uint64_t rtptime)
   if (!fifo_session || !fifo_session->device->selected)
     return;
 
-  packet = (struct fifo_packet *) calloc(1, sizeof(struct fifo_packet));
+  packet = packet_get();
+  if (!packet)
+    {
+      DPRINTF(E_LOG, L_FIFO, "Out of memory for fifo packet\n");
+      return;
+    }
+
   memcpy(packet->samples, buf, sizeof(packet->samples));
   packet->rtptime = rtptime;
   if (buffer.head)
@@ -472,7 +525,7 @@ fifo_write(uint8_t *buf, uint64_t rtptime)
   if (!buffer.tail)
     buffer.tail = packet;
 
-  ret = player_get_current_pos(&cur_pos, &now, 0);
+  ret = outputs_playback_pos(&cur_pos, &now);
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_FIFO, "Could not get playback position\n");
@@ -486,7 +539,11 @@ fifo_write(uint8_t *buf, uint64_t rtptime)
 	{
 	  packet = buffer.tail;
 	  buffer.tail = buffer.tail->next;
-	  free(packet);
+	  if (buffer.tail)
+	    buffer.tail->prev = NULL;
+	  else
+	    buffer.head = NULL;
+	  packet_put(packet);
 	  return;
 	}
 
@@ -508,6 +565,16 @@ fifo_write(uint8_t *buf, uint64_t rtptime)
     }
 }
 
+static void
+fifo_write(uint8_t *buf, uint64_t rtptime)
+{
+  // Called in the output write thread. The fifo is non-blocking, so the lock
+  // can be held while writing to it.
+  outputs_backend_lock(OUTPUT_TYPE_FIFO);
+  fifo_write_packet(buf, rtptime);
+  outputs_backend_unlock(OUTPUT_TYPE_FIFO);
+}
+
 static void
 fifo_set_status_cb(struct output_session *session, output_status_cb cb)
 {
@@ -569,6 +636,7 @@ struct output_definition output_fifo =
   .type = OUTPUT_TYPE_FIFO,
   .priority = 98,
   .disabled = 0,
+  .write_thread = 1,
   .init = fifo_init,
   .deinit = fifo_deinit,
   .device_start = fifo_device_start,
@@ -187,6 +187,8 @@ send_status(void *arg, int *ptr)
   output_status_cb status_cb;
   enum output_device_state state;
 
+  outputs_backend_lock(OUTPUT_TYPE_PULSE);
+
   switch (ps->state)
     {
       case PA_STREAM_FAILED:
@@ -212,6 +214,8 @@ send_status(void *arg, int *ptr)
   if (status_cb)
     status_cb(ps->device, ps->output_session, state);
 
+  outputs_backend_unlock(OUTPUT_TYPE_PULSE);
+
   return COMMAND_PENDING; // Don't want the command module to clean up ps
 }
 
@@ -220,9 +224,14 @@ session_shutdown(void *arg, int *ptr)
 {
   struct pulse_session *ps = arg;
 
+  // pulse_write() runs in the output write thread and walks the session list
+  outputs_backend_lock(OUTPUT_TYPE_PULSE);
+
   send_status(ps, ptr);
   pulse_session_cleanup(ps);
 
+  outputs_backend_unlock(OUTPUT_TYPE_PULSE);
+
   return COMMAND_PENDING; // Don't want the command module to clean up ps
 }
 
@@ -754,8 +763,15 @@ pulse_write(uint8_t *buf, uint64_t rtptime)
   size_t length;
   int ret;
 
+  // Called in the output write thread. pa_stream_write() doesn't block, so the
+  // lock can be held while writing.
+  outputs_backend_lock(OUTPUT_TYPE_PULSE);
+
   if (!sessions)
-    return;
+    {
+      outputs_backend_unlock(OUTPUT_TYPE_PULSE);
+      return;
+    }
 
   length = STOB(AIRTUNES_V2_PACKET_SAMPLES);
 
@@ -782,6 +798,8 @@ pulse_write(uint8_t *buf, uint64_t rtptime)
     }
 
   pa_threaded_mainloop_unlock(pulse.mainloop);
+
+  outputs_backend_unlock(OUTPUT_TYPE_PULSE);
 }
 
 static void
@@ -967,6 +985,7 @@ struct output_definition output_pulse =
   .type = OUTPUT_TYPE_PULSE,
   .priority = 3,
   .disabled = 0,
+  .write_thread = 1,
   .init = pulse_init,
   .deinit = pulse_deinit,
   .device_start = pulse_device_start,
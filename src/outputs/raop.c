@@ -58,6 +58,10 @@
 #include <net/if.h>
 #include <netinet/in.h>
 
+#ifdef __linux__
+# include <linux/errqueue.h>
+#endif
+
 #include <event2/event.h>
 #include <event2/buffer.h>
 #include <gcrypt.h>
@@ -80,9 +84,12 @@
 #define AIRTUNES_V2_HDR_LEN        12
 #define ALAC_HDR_LEN               3
 #define AIRTUNES_V2_PKT_LEN        (AIRTUNES_V2_HDR_LEN + ALAC_HDR_LEN + STOB(AIRTUNES_V2_PACKET_SAMPLES))
-#define AIRTUNES_V2_PKT_TAIL_LEN   (AIRTUNES_V2_PKT_LEN - AIRTUNES_V2_HDR_LEN - ((AIRTUNES_V2_PKT_LEN / 16) * 16))
-#define AIRTUNES_V2_PKT_TAIL_OFF   (AIRTUNES_V2_PKT_LEN - AIRTUNES_V2_PKT_TAIL_LEN)
-#define RETRANSMIT_BUFFER_SIZE     1000
+// Default and max number of packets kept for retransmission, must be powers of two
+#define RETRANSMIT_BUFFER_SIZE     1024
+#define RETRANSMIT_BUFFER_MAX      8192
+
+// Max number of packets (counting one per session) queued for sending in a tick
+#define SEND_BATCH_MAX             512
 
 #define RAOP_MD_DELAY_STARTUP      15360
 #define RAOP_MD_DELAY_SWITCH       (RAOP_MD_DELAY_STARTUP * 2)
@@ -90,6 +97,16 @@
 /* This is an arbitrary value which just needs to be kept in sync with the config */
 #define RAOP_CONFIG_MAX_VOLUME     11
 
+/* The queued audio of all sessions is sent with one sendmmsg() per address
+ * family on a shared unconnected socket. Errors for the packets, like the ICMP
+ * port unreachable from a speaker that went away, are then only reported
+ * through the socket's error queue, so this needs IP_RECVERR. Without it the
+ * packets are sent on the connected session sockets.
+ */
+#if defined(HAVE_SENDMMSG) && defined(IP_RECVERR) && defined(IPV6_RECVERR)
+# define RAOP_SEND_SHARED 1
+#endif
+
 union sockaddr_all
 {
   struct sockaddr_in sin;
@@ -103,10 +120,56 @@ struct raop_v2_packet
   uint8_t clear[AIRTUNES_V2_PKT_LEN];
   uint8_t encrypted[AIRTUNES_V2_PKT_LEN];
 
+  /* Compressed ALAC version of the packet for sessions with alac_compressed,
+   * only made if such a session is streaming. If alac_len is 0 they get the
+   * uncompressed packet above.
+   */
+  uint8_t alac_clear[AIRTUNES_V2_PKT_LEN];
+  uint8_t alac_encrypted[AIRTUNES_V2_PKT_LEN];
+  int alac_len;
+
+  /* The encrypted versions are only made when a session that needs them gets
+   * the packet, see raop_v2_packet_data()
+   */
+  unsigned has_encrypted:1;
+  unsigned has_alac_encrypted:1;
+
   uint16_t seqnum;
+};
+
+struct raop_v2_batch_entry
+{
+  struct raop_session *rs;
+  struct raop_v2_packet *pkt;
 
-  struct raop_v2_packet *prev;
-  struct raop_v2_packet *next;
+  // What the session gets of pkt, set by raop_v2_batch_send()
+  uint8_t *data;
+  int len;
+};
+
+struct raop_alac_stats
+{
+  uint64_t packets;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t usec;
+};
+
+struct raop_v2_packet_stats
+{
+  uint64_t packets;
+  uint64_t usec;
+  uint64_t encrypted;
+  uint64_t encrypt_usec;
+};
+
+struct raop_v2_send_stats
+{
+  uint64_t ticks;
+  uint64_t packets;
+  uint64_t syscalls;
+  uint64_t usec;
+  uint64_t usec_max;
 };
 
 enum raop_devtype {
@@ -163,11 +226,16 @@ struct raop_session
   unsigned auth_quirk_itunes:1;
   unsigned wants_metadata:1;
   unsigned keep_alive:1;
+  unsigned alac_compressed:1;
 
   struct event *deferredev;
 
   int reqs_in_flight;
   int cseq;
+
+  /* Retransmit requests, counted in packets */
+  unsigned int resends_served;
+  unsigned int resends_missed;
   char *session;
   char session_url[128];
 
@@ -294,10 +362,32 @@ static int sync_counter;
 static uint32_t ssrc_id;
 static uint16_t stream_seq;
 
-/* Retransmit packet buffer */
+/* Retransmit packet buffer, a ring of pktbuf_size (power of two) packets
+ * indexed by seqnum. The newest packet is the one with seqnum stream_seq and
+ * pktbuf_count is the number of valid packets going back from there.
+ */
+static struct raop_v2_packet *pktbuf;
 static int pktbuf_size;
-static struct raop_v2_packet *pktbuf_head;
-static struct raop_v2_packet *pktbuf_tail;
+static int pktbuf_count;
+
+/* Audio packets queued by raop_v2_write() for all sessions, sent together by
+ * raop_v2_write_commit() at the end of the playback tick. Entries of sessions
+ * that go away in the meantime have rs set to NULL.
+ */
+static struct raop_v2_batch_entry send_batch[SEND_BATCH_MAX];
+static int send_batch_len;
+static int send_batch_npkts;
+static struct raop_v2_send_stats send_stats;
+static struct raop_v2_packet_stats packet_stats;
+
+#ifdef RAOP_SEND_SHARED
+/* Unconnected sockets for sending the queued packets, -1 if not available */
+static int send_4fd;
+static int send_6fd;
+#endif
+
+/* ALAC compression */
+static struct raop_alac_stats alac_stats;
 
 /* Metadata */
 static struct raop_metadata *metadata_head;
@@ -392,6 +482,324 @@ alac_encode(uint8_t *raw, uint8_t *buf, int buflen)
     }
 }
 
+/* ALAC compression. The receiver decodes with the parameters we announce in
+ * the fmtp of the SDP: 352 samples per frame, 16 bit, rice history mult 40,
+ * initial history 10 and rice limit 14. Frames are compressed with a fixed
+ * first or second order predictor, which the decoder's adaptive FIR refines
+ * as it goes, and adaptive Rice coding of the residuals.
+ */
+#define ALAC_RICE_HISTORY_MULT     40
+#define ALAC_RICE_INITIAL_HISTORY  10
+#define ALAC_RICE_LIMIT            14
+#define ALAC_LPC_QUANT             9
+/* Bits per residual of a channel pair, one more than the sample size */
+#define ALAC_RESIDUAL_BITS         17
+
+struct alac_bitbuf
+{
+  uint8_t *p;
+  int bpos;
+  int bits;
+  int maxbits;
+};
+
+/* Writes up to 32 bits, big endian. If the buffer is full nothing more is
+ * written, but bits keeps counting so the caller can tell.
+ */
+static inline void
+alac_put_bits(struct alac_bitbuf *bb, uint32_t val, int blen)
+{
+  int n;
+
+  bb->bits += blen;
+  if (bb->bits > bb->maxbits)
+    return;
+
+  while (blen > 0)
+    {
+      n = (blen > 8) ? 8 : blen;
+      blen -= n;
+
+      alac_write_bits(&bb->p, (val >> blen) & ((1 << n) - 1), n, &bb->bpos);
+    }
+}
+
+static inline int
+alac_log2(uint32_t val)
+{
+  int n;
+
+  for (n = 0; val > 1; n++)
+    val >>= 1;
+
+  return n;
+}
+
+static inline int32_t
+alac_sign_extend(int32_t val, int bits)
+{
+  return (int32_t)((uint32_t)val << (32 - bits)) >> (32 - bits);
+}
+
+static inline int
+alac_sign(int32_t val)
+{
+  return (val > 0) - (val < 0);
+}
+
+/* Rice code with escape, like the decoder's decode_scalar() expects */
+static void
+alac_put_scalar(struct alac_bitbuf *bb, uint32_t x, int k, int escape_bits)
+{
+  uint32_t divisor;
+  uint32_t q;
+  uint32_t r;
+
+  if (k > ALAC_RICE_LIMIT)
+    k = ALAC_RICE_LIMIT;
+
+  divisor = (1 << k) - 1;
+  q = x / divisor;
+  r = x % divisor;
+
+  if (q > 8)
+    {
+      alac_put_bits(bb, 0x1ff, 9);
+      alac_put_bits(bb, x, escape_bits);
+      return;
+    }
+
+  alac_put_bits(bb, (1 << q) - 1, q);
+  alac_put_bits(bb, 0, 1);
+
+  if (k == 1)
+    return;
+
+  if (r > 0)
+    alac_put_bits(bb, r + 1, k);
+  else
+    alac_put_bits(bb, 0, k - 1);
+}
+
+/* Adaptive Rice coding of the residuals of a channel, with runs of zeros coded
+ * as blocks when the history gets low
+ */
+static void
+alac_put_residuals(struct alac_bitbuf *bb, const int32_t *res, int n)
+{
+  uint32_t history;
+  uint32_t block;
+  uint32_t x;
+  int sign_modifier;
+  int k;
+  int i;
+
+  history = ALAC_RICE_INITIAL_HISTORY;
+  sign_modifier = 0;
+
+  for (i = 0; i < n; )
+    {
+      k = alac_log2((history >> 9) + 3);
+
+      x = (res[i] < 0) ? (uint32_t)(-2 * res[i] - 1) : (uint32_t)(2 * res[i]);
+      i++;
+
+      alac_put_scalar(bb, x - sign_modifier, k, ALAC_RESIDUAL_BITS);
+
+      if (x > 0xffff)
+	history = 0xffff;
+      else
+	history += x * ALAC_RICE_HISTORY_MULT - ((history * ALAC_RICE_HISTORY_MULT) >> 9);
+
+      sign_modifier = 0;
+
+      if ((history < 128) && (i < n))
+	{
+	  k = 7 - alac_log2(history) + ((history + 16) >> 6);
+
+	  for (block = 0; (i < n) && (res[i] == 0); i++)
+	    block++;
+
+	  alac_put_scalar(bb, block, k, 16);
+
+	  // The block ends with a non-zero sample (or the frame), so the decoder
+	  // knows the next one is at least 1
+	  sign_modifier = (block <= 0xffff);
+	  history = 0;
+	}
+    }
+}
+
+/* Makes the residuals the decoder's adaptive FIR filter will turn back into
+ * the samples. The filter adapts the coefficients after each sample, so we do
+ * exactly the same, with the same integer arithmetic.
+ */
+static void
+alac_predict(const int32_t *x, int32_t *res, int n, int16_t *coefs, int order)
+{
+  const int32_t *pred;
+  int64_t sum;
+  int32_t val;
+  int32_t err;
+  int32_t d;
+  int sign;
+  int i;
+  int j;
+
+  res[0] = x[0];
+
+  for (i = 1; (i <= order) && (i < n); i++)
+    res[i] = alac_sign_extend(x[i] - x[i - 1], ALAC_RESIDUAL_BITS);
+
+  for (; i < n; i++)
+    {
+      d = x[i - order - 1];
+      pred = x + i - order;
+
+      for (j = 0, sum = 0; j < order; j++)
+	sum += (int64_t)(pred[j] - d) * coefs[j];
+
+      // The decoder sums in 32 bit
+      val = (int32_t)(uint32_t)sum;
+      val = (int32_t)(((int64_t)val + (1 << (ALAC_LPC_QUANT - 1))) >> ALAC_LPC_QUANT);
+
+      err = alac_sign_extend((int32_t)((uint32_t)x[i] - (uint32_t)d - (uint32_t)val), ALAC_RESIDUAL_BITS);
+      res[i] = err;
+
+      sign = alac_sign(err);
+      for (j = 0; (j < order) && (err * sign > 0); j++)
+	{
+	  val = d - pred[j];
+	  coefs[j] -= alac_sign(val) * sign;
+	  val *= alac_sign(val) * sign;
+	  err -= (val >> ALAC_LPC_QUANT) * (j + 1);
+	}
+    }
+}
+
+/* Picks the first or second order predictor, whichever leaves the smaller
+ * differences, and sets its coefficients (oldest sample first)
+ */
+static int
+alac_predictor_get(const int32_t *x, int n, int16_t *coefs)
+{
+  int64_t sum1;
+  int64_t sum2;
+  int i;
+
+  for (i = 2, sum1 = 0, sum2 = 0; i < n; i++)
+    {
+      sum1 += abs(x[i] - x[i - 1]);
+      sum2 += abs(x[i] - 2 * x[i - 1] + x[i - 2]);
+    }
+
+  if (sum1 <= sum2)
+    {
+      coefs[0] = 1 << ALAC_LPC_QUANT;
+      return 1;
+    }
+
+  coefs[0] = -(1 << ALAC_LPC_QUANT);
+  coefs[1] = 2 << ALAC_LPC_QUANT;
+  return 2;
+}
+
+/* Raw data must be little endian. Returns the length of the compressed frame
+ * written to buf, or 0 if it doesn't fit in buflen, in which case the packet
+ * should be sent uncompressed.
+ */
+static int
+alac_compress(uint8_t *raw, uint8_t *buf, int buflen)
+{
+  struct timespec start;
+  struct timespec end;
+  struct alac_bitbuf bb;
+  int32_t samples[2][AIRTUNES_V2_PACKET_SAMPLES];
+  int32_t res[AIRTUNES_V2_PACKET_SAMPLES];
+  int16_t coefs[2][2];
+  int order[2];
+  int len;
+  int ch;
+  int i;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (i = 0; i < AIRTUNES_V2_PACKET_SAMPLES; i++, raw += 4)
+    {
+      samples[0][i] = (int16_t)(raw[0] | (raw[1] << 8));
+      samples[1][i] = (int16_t)(raw[2] | (raw[3] << 8));
+    }
+
+  bb.p = buf;
+  bb.bpos = 0;
+  bb.bits = 0;
+  bb.maxbits = buflen * 8;
+
+  alac_put_bits(&bb, 1, 3);  /* channel=1, stereo */
+  alac_put_bits(&bb, 0, 4);  /* unknown */
+  alac_put_bits(&bb, 0, 12); /* unknown */
+  alac_put_bits(&bb, 0, 1);  /* hassize */
+  alac_put_bits(&bb, 0, 2);  /* unused */
+  alac_put_bits(&bb, 0, 1);  /* is-not-compressed */
+
+  alac_put_bits(&bb, 0, 8);  /* interlacing shift */
+  alac_put_bits(&bb, 0, 8);  /* interlacing left weight, 0 = none */
+
+  for (ch = 0; ch < 2; ch++)
+    {
+      order[ch] = alac_predictor_get(samples[ch], AIRTUNES_V2_PACKET_SAMPLES, coefs[ch]);
+
+      alac_put_bits(&bb, 0, 4);              /* prediction type */
+      alac_put_bits(&bb, ALAC_LPC_QUANT, 4); /* prediction quantization */
+      alac_put_bits(&bb, 4, 3);              /* rice history mult, times 1/4 of the fmtp value */
+      alac_put_bits(&bb, order[ch], 5);
+
+      /* Most recent sample first */
+      for (i = order[ch] - 1; i >= 0; i--)
+	alac_put_bits(&bb, (uint16_t)coefs[ch][i], 16);
+    }
+
+  for (ch = 0; ch < 2; ch++)
+    {
+      alac_predict(samples[ch], res, AIRTUNES_V2_PACKET_SAMPLES, coefs[ch], order[ch]);
+      alac_put_residuals(&bb, res, AIRTUNES_V2_PACKET_SAMPLES);
+    }
+
+  alac_put_bits(&bb, 7, 3);  /* end of frame */
+
+  if (bb.bits > bb.maxbits)
+    len = 0;
+  else
+    len = (bb.bits + 7) / 8;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  alac_stats.packets++;
+  alac_stats.bytes_in += ALAC_HDR_LEN + STOB(AIRTUNES_V2_PACKET_SAMPLES);
+  alac_stats.bytes_out += (len > 0) ? len : ALAC_HDR_LEN + STOB(AIRTUNES_V2_PACKET_SAMPLES);
+  alac_stats.usec += (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_nsec - start.tv_nsec) / 1000;
+
+  return len;
+}
+
+static void
+alac_compress_stats_log(void)
+{
+  double sec;
+
+  if (alac_stats.packets == 0)
+    return;
+
+  // Duration of the compressed audio
+  sec = (double)alac_stats.packets * AIRTUNES_V2_PACKET_SAMPLES / 44100;
+
+  DPRINTF(E_DBG, L_RAOP, "ALAC compressed %" PRIu64 " packets, avg %.1f usec/packet, %.1f%% of uncompressed size, saving %.f kbit/s per device\n",
+	  alac_stats.packets, (double)alac_stats.usec / alac_stats.packets, 100.0 * alac_stats.bytes_out / alac_stats.bytes_in,
+	  (double)(alac_stats.bytes_in - alac_stats.bytes_out) * 8 / sec / 1000);
+
+  memset(&alac_stats, 0, sizeof(struct raop_alac_stats));
+}
+
 /* AirTunes v2 time synchronization helpers */
 static inline void
 timespec_to_ntp(struct timespec *ts, struct ntp_stamp *ns)
@@ -1734,12 +2142,22 @@ raop_session_free(struct raop_session *rs)
   rs = NULL;
 }
 
+static void
+raop_v2_batch_purge(struct raop_session *rs)
+{
+  int i;
+
+  for (i = 0; i < send_batch_len; i++)
+    {
+      if (send_batch[i].rs == rs)
+	send_batch[i].rs = NULL;
+    }
+}
+
 static void
 raop_session_cleanup(struct raop_session *rs)
 {
   struct raop_session *s;
-  struct raop_v2_packet *pkt;
-  struct raop_v2_packet *next_pkt;
 
   if (rs == sessions)
     sessions = sessions->next;
@@ -1754,22 +2172,21 @@ raop_session_cleanup(struct raop_session *rs)
 	s->next = rs->next;
     }
 
+  raop_v2_batch_purge(rs);
+
+  if (rs->resends_served || rs->resends_missed)
+    DPRINTF(E_INFO, L_RAOP, "Retransmissions for '%s': %u packets resent, %u requested packets not in buffer\n",
+	    rs->devname, rs->resends_served, rs->resends_missed);
+
   raop_session_free(rs);
 
   /* No more active sessions, free retransmit buffer */
   if (!sessions)
     {
-      pkt = pktbuf_head;
-      while (pkt)
-	{
-	  next_pkt = pkt->next;
-	  free(pkt);
-	  pkt = next_pkt;
-	}
+      free(pktbuf);
 
-      pktbuf_head = NULL;
-      pktbuf_tail = NULL;
-      pktbuf_size = 0;
+      pktbuf = NULL;
+      pktbuf_count = 0;
     }
 }
 
@@ -1819,6 +2236,7 @@ raop_session_make(struct output_device *rd, int family, output_status_cb cb)
   struct output_session *os;
   struct raop_session *rs;
   struct raop_extra *re;
+  cfg_t *airplay;
   char *address;
   char *intf;
   unsigned short port;
@@ -1879,6 +2297,10 @@ raop_session_make(struct output_device *rd, int family, output_status_cb cb)
   rs->password = rd->password;
   rs->wants_metadata = re->wants_metadata;
 
+  airplay = cfg_gettsec(cfg, "airplay", rd->name);
+  if (airplay)
+    rs->alac_compressed = cfg_getbool(airplay, "alac_compression");
+
   switch (re->devtype)
     {
       case RAOP_DEV_APEX1_80211G:
@@ -2581,6 +3003,47 @@ raop_flush(output_status_cb cb, uint64_t rtptime)
 
 
 /* AirTunes v2 time synchronization */
+/* Reports the offset of the device's clock to the clock service. The device's
+ * clock has an epoch of its own, so only the drift of the offset is of use.
+ */
+static void
+raop_v2_timing_report(union sockaddr_all *sa, uint8_t *req, struct ntp_stamp *recv_stamp)
+{
+  struct raop_session *rs;
+  struct ntp_stamp dev_stamp;
+  struct timespec ts;
+  int64_t offset_ns;
+
+  for (rs = sessions; rs; rs = rs->next)
+    {
+      if (!(rs->state & RAOP_STATE_F_CONNECTED) || (rs->sa.ss.ss_family != sa->ss.ss_family))
+	continue;
+
+      if ((sa->ss.ss_family == AF_INET)
+	  && (memcmp(&rs->sa.sin.sin_addr, &sa->sin.sin_addr, sizeof(struct in_addr)) == 0))
+	break;
+
+      if ((sa->ss.ss_family == AF_INET6)
+	  && (memcmp(&rs->sa.sin6.sin6_addr, &sa->sin6.sin6_addr, sizeof(struct in6_addr)) == 0))
+	break;
+    }
+
+  if (!rs)
+    return;
+
+  memcpy(&dev_stamp.sec, req + 24, 4);
+  memcpy(&dev_stamp.frac, req + 28, 4);
+  dev_stamp.sec = be32toh(dev_stamp.sec);
+  dev_stamp.frac = be32toh(dev_stamp.frac);
+
+  offset_ns = ((int64_t)recv_stamp->sec - (int64_t)dev_stamp.sec) * 1000000000LL;
+  offset_ns += (((int64_t)recv_stamp->frac - (int64_t)dev_stamp.frac) * 1000000000LL) >> 32;
+
+  ntp_to_timespec(recv_stamp, &ts);
+
+  outputs_clock_offset(rs->device->id, offset_ns, &ts);
+}
+
 static void
 raop_v2_timing_cb(int fd, short what, void *arg)
 {
@@ -2626,6 +3089,8 @@ raop_v2_timing_cb(int fd, short what, void *arg)
       goto readd;
     }
 
+  raop_v2_timing_report(&sa, req, &recv_stamp);
+
   memset(res, 0, sizeof(res));
 
   /* Header */
@@ -3159,140 +3624,229 @@ raop_v2_control_start(int v6enabled)
 
 /* AirTunes v2 streaming */
 static struct raop_v2_packet *
-raop_v2_new_packet(void)
+raop_v2_packet_get(uint16_t seqnum)
 {
   struct raop_v2_packet *pkt;
+  uint16_t distance;
 
-  if (pktbuf_size >= RETRANSMIT_BUFFER_SIZE)
-    {
-      pktbuf_size--;
-
-      pkt = pktbuf_tail;
+  if (!pktbuf)
+    return NULL;
 
-      pktbuf_tail = pktbuf_tail->prev;
-      pktbuf_tail->next = NULL;
-    }
-  else
-    {
-      pkt = (struct raop_v2_packet *)malloc(sizeof(struct raop_v2_packet));
-      if (!pkt)
-	{
-	  DPRINTF(E_LOG, L_RAOP, "Out of memory for RAOP packet\n");
+  distance = stream_seq - seqnum;
+  if (distance >= pktbuf_count)
+    return NULL;
 
-	  return NULL;
-	}
-    }
+  pkt = &pktbuf[seqnum & (pktbuf_size - 1)];
+  if (pkt->seqnum != seqnum)
+    return NULL;
 
   return pkt;
 }
 
-static struct raop_v2_packet *
-raop_v2_make_packet(uint8_t *rawbuf, uint64_t rtptime)
+/* Encrypts the payload of the clear packet of length len into encrypted. The
+ * header and the tail that doesn't fill a block are copied as is.
+ */
+static int
+raop_v2_packet_encrypt(uint8_t *clear, uint8_t *encrypted, int len)
 {
   char ebuf[64];
-  struct raop_v2_packet *pkt;
+  struct timespec start;
+  struct timespec end;
   gpg_error_t gc_err;
-  uint32_t rtptime32;
-  uint16_t seq;
-
-  pkt = raop_v2_new_packet();
-  if (!pkt)
-    return NULL;
-
-  memset(pkt, 0, sizeof(struct raop_v2_packet));
-
-  alac_encode(rawbuf, pkt->clear + AIRTUNES_V2_HDR_LEN, STOB(AIRTUNES_V2_PACKET_SAMPLES));
-
-  stream_seq++;
-
-  pkt->seqnum = stream_seq;
-
-  seq = htobe16(pkt->seqnum);
-  rtptime32 = htobe32(RAOP_RTPTIME(rtptime));
-
-  pkt->clear[0] = 0x80;
-  pkt->clear[1] = (sync_counter == 0) ? 0xe0 : 0x60;
+  int enclen;
 
-  memcpy(pkt->clear + 2, &seq, 2);
-  memcpy(pkt->clear + 4, &rtptime32, 4);
+  clock_gettime(CLOCK_MONOTONIC, &start);
 
-  /* RTP SSRC ID
-   * Note: should htobe32() that value, but it's just a
-   * random/unique ID so it's no big deal
-   */
-  memcpy(pkt->clear + 8, &ssrc_id, 4);
+  enclen = ((len - AIRTUNES_V2_HDR_LEN) / 16) * 16;
 
   /* Copy AirTunes v2 header to encrypted packet */
-  memcpy(pkt->encrypted, pkt->clear, AIRTUNES_V2_HDR_LEN);
+  memcpy(encrypted, clear, AIRTUNES_V2_HDR_LEN);
 
   /* Copy the tail of the audio packet that is left unencrypted */
-  memcpy(pkt->encrypted + AIRTUNES_V2_PKT_TAIL_OFF,
-	 pkt->clear + AIRTUNES_V2_PKT_TAIL_OFF,
-	 AIRTUNES_V2_PKT_TAIL_LEN);
+  memcpy(encrypted + AIRTUNES_V2_HDR_LEN + enclen,
+	 clear + AIRTUNES_V2_HDR_LEN + enclen,
+	 len - AIRTUNES_V2_HDR_LEN - enclen);
 
-  /* Reset cipher */
-  gc_err = gcry_cipher_reset(raop_aes_ctx);
+  /* Set IV, which is all the reset we need between packets in CBC mode. The
+   * encryption itself is done by gcrypt with AES-NI if the CPU has it.
+   */
+  gc_err = gcry_cipher_setiv(raop_aes_ctx, raop_aes_iv, sizeof(raop_aes_iv));
   if (gc_err != GPG_ERR_NO_ERROR)
     {
       gpg_strerror_r(gc_err, ebuf, sizeof(ebuf));
-      DPRINTF(E_LOG, L_RAOP, "Could not reset AES cipher: %s\n", ebuf);
+      DPRINTF(E_LOG, L_RAOP, "Could not set AES IV: %s\n", ebuf);
 
-      free(pkt);
-      return NULL;
-    }
-
-  /* Set IV */
-  gc_err = gcry_cipher_setiv(raop_aes_ctx, raop_aes_iv, sizeof(raop_aes_iv));
-  if (gc_err != GPG_ERR_NO_ERROR)
-    {
-      gpg_strerror_r(gc_err, ebuf, sizeof(ebuf));
-      DPRINTF(E_LOG, L_RAOP, "Could not set AES IV: %s\n", ebuf);
-
-      free(pkt);
-      return NULL;
+      return -1;
     }
 
   /* Encrypt in blocks of 16 bytes */
   gc_err = gcry_cipher_encrypt(raop_aes_ctx,
-			       pkt->encrypted + AIRTUNES_V2_HDR_LEN, ((AIRTUNES_V2_PKT_LEN - AIRTUNES_V2_HDR_LEN) / 16) * 16,
-			       pkt->clear + AIRTUNES_V2_HDR_LEN, ((AIRTUNES_V2_PKT_LEN - AIRTUNES_V2_HDR_LEN) / 16) * 16);
+			       encrypted + AIRTUNES_V2_HDR_LEN, enclen,
+			       clear + AIRTUNES_V2_HDR_LEN, enclen);
   if (gc_err != GPG_ERR_NO_ERROR)
     {
       gpg_strerror_r(gc_err, ebuf, sizeof(ebuf));
       DPRINTF(E_LOG, L_RAOP, "Could not encrypt payload: %s\n", ebuf);
 
-      free(pkt);
-      return NULL;
+      return -1;
     }
 
-  pkt->prev = NULL;
-  pkt->next = pktbuf_head;
+  clock_gettime(CLOCK_MONOTONIC, &end);
 
-  if (pktbuf_head)
-    pktbuf_head->prev = pkt;
+  packet_stats.encrypted++;
+  packet_stats.encrypt_usec += (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_nsec - start.tv_nsec) / 1000;
 
-  if (!pktbuf_tail)
-    pktbuf_tail = pkt;
+  return 0;
+}
 
-  pktbuf_head = pkt;
+static struct raop_v2_packet *
+raop_v2_make_packet(uint8_t *rawbuf, uint64_t rtptime)
+{
+  struct raop_v2_packet *pkt;
+  struct raop_session *rs;
+  struct timespec start;
+  struct timespec end;
+  uint32_t rtptime32;
+  uint16_t seq;
+  int len;
 
-  pktbuf_size++;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (!pktbuf)
+    {
+      pktbuf = calloc(pktbuf_size, sizeof(struct raop_v2_packet));
+      if (!pktbuf)
+	{
+	  DPRINTF(E_LOG, L_RAOP, "Out of memory for RAOP retransmit buffer\n");
+
+	  return NULL;
+	}
+
+      pktbuf_count = 0;
+    }
+
+  /* Overwrites the oldest packet. The new packet only becomes valid for
+   * raop_v2_packet_get() once stream_seq is incremented below.
+   */
+  pkt = &pktbuf[(uint16_t)(stream_seq + 1) & (pktbuf_size - 1)];
+
+  memset(pkt, 0, sizeof(struct raop_v2_packet));
+
+  pkt->seqnum = stream_seq + 1;
+
+  alac_encode(rawbuf, pkt->clear + AIRTUNES_V2_HDR_LEN, STOB(AIRTUNES_V2_PACKET_SAMPLES));
+
+  seq = htobe16(pkt->seqnum);
+  rtptime32 = htobe32(RAOP_RTPTIME(rtptime));
+
+  pkt->clear[0] = 0x80;
+  pkt->clear[1] = (sync_counter == 0) ? 0xe0 : 0x60;
+
+  memcpy(pkt->clear + 2, &seq, 2);
+  memcpy(pkt->clear + 4, &rtptime32, 4);
+
+  /* RTP SSRC ID
+   * Note: should htobe32() that value, but it's just a
+   * random/unique ID so it's no big deal
+   */
+  memcpy(pkt->clear + 8, &ssrc_id, 4);
+
+  /* Compress once for all the sessions that want it */
+  for (rs = sessions; rs; rs = rs->next)
+    {
+      if ((rs->state == RAOP_STATE_STREAMING) && rs->alac_compressed)
+	break;
+    }
+
+  // If the frame doesn't compress, e.g. with noise, alac_len is left at 0 and
+  // the sessions get the uncompressed packet
+  if (rs)
+    {
+      len = alac_compress(rawbuf, pkt->alac_clear + AIRTUNES_V2_HDR_LEN, AIRTUNES_V2_PKT_LEN - AIRTUNES_V2_HDR_LEN);
+      if (len > 0)
+	{
+	  memcpy(pkt->alac_clear, pkt->clear, AIRTUNES_V2_HDR_LEN);
+
+	  pkt->alac_len = AIRTUNES_V2_HDR_LEN + len;
+	}
+    }
+
+  stream_seq++;
+
+  if (pktbuf_count < pktbuf_size)
+    pktbuf_count++;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  packet_stats.packets++;
+  packet_stats.usec += (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_nsec - start.tv_nsec) / 1000;
 
   return pkt;
 }
 
+/* Returns the version of the packet that the session wants, encrypting it
+ * first if this is the first session that needs it encrypted. Returns NULL if
+ * encryption fails.
+ */
+static uint8_t *
+raop_v2_packet_data(struct raop_session *rs, struct raop_v2_packet *pkt, int *len)
+{
+  int ret;
+
+  if (rs->alac_compressed && (pkt->alac_len > 0))
+    {
+      *len = pkt->alac_len;
+
+      if (!rs->encrypt)
+	return pkt->alac_clear;
+
+      if (!pkt->has_alac_encrypted)
+	{
+	  ret = raop_v2_packet_encrypt(pkt->alac_clear, pkt->alac_encrypted, pkt->alac_len);
+	  if (ret < 0)
+	    return NULL;
+
+	  pkt->has_alac_encrypted = 1;
+	}
+
+      return pkt->alac_encrypted;
+    }
+
+  *len = AIRTUNES_V2_PKT_LEN;
+
+  if (!rs->encrypt)
+    return pkt->clear;
+
+  if (!pkt->has_encrypted)
+    {
+      ret = raop_v2_packet_encrypt(pkt->clear, pkt->encrypted, AIRTUNES_V2_PKT_LEN);
+      if (ret < 0)
+	return NULL;
+
+      pkt->has_encrypted = 1;
+    }
+
+  return pkt->encrypted;
+}
+
 static int
 raop_v2_send_packet(struct raop_session *rs, struct raop_v2_packet *pkt)
 {
   uint8_t *data;
+  int len;
   int ret;
 
   if (!rs)
     return -1;
 
-  data = (rs->encrypt) ? pkt->encrypted : pkt->clear;
+  data = raop_v2_packet_data(rs, pkt, &len);
+  if (!data)
+    {
+      DPRINTF(E_LOG, L_RAOP, "Could not encrypt packet %u for '%s'\n", pkt->seqnum, rs->devname);
+      return -1;
+    }
 
-  ret = send(rs->server_fd, data, AIRTUNES_V2_PKT_LEN, 0);
+  ret = send(rs->server_fd, data, len, 0);
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_RAOP, "Send error for '%s': %s\n", rs->devname, strerror(errno));
@@ -3300,7 +3854,7 @@ raop_v2_send_packet(struct raop_session *rs, struct raop_v2_packet *pkt)
       raop_session_failure(rs);
       return -1;
     }
-  else if (ret != AIRTUNES_V2_PKT_LEN)
+  else if (ret != len)
     {
       DPRINTF(E_WARN, L_RAOP, "Partial send (%d) for '%s'\n", ret, rs->devname);
       return -1;
@@ -3313,12 +3867,315 @@ raop_v2_send_packet(struct raop_session *rs, struct raop_v2_packet *pkt)
 static void
 raop_playback_stop(void);
 
+#ifdef RAOP_SEND_SHARED
+static struct raop_session *
+raop_v2_session_find_by_addr(union sockaddr_all *sa)
+{
+  struct raop_session *rs;
+
+  for (rs = sessions; rs; rs = rs->next)
+    {
+      if (rs->sa.ss.ss_family != sa->ss.ss_family)
+	continue;
+
+      if ((sa->ss.ss_family == AF_INET)
+	  && (sa->sin.sin_addr.s_addr == rs->sa.sin.sin_addr.s_addr)
+	  && (sa->sin.sin_port == rs->sa.sin.sin_port))
+	return rs;
+
+      if ((sa->ss.ss_family == AF_INET6)
+	  && IN6_ARE_ADDR_EQUAL(&sa->sin6.sin6_addr, &rs->sa.sin6.sin6_addr)
+	  && (sa->sin6.sin6_port == rs->sa.sin6.sin6_port))
+	return rs;
+    }
+
+  return NULL;
+}
+
+/* Fails the sessions of the speakers that the kernel has queued a send error
+ * for, which is how we find out that a speaker went away. Reading the queue
+ * also clears the socket's pending error, which sendmmsg() would return.
+ */
+static void
+raop_v2_send_errors_check(int fd)
+{
+  union sockaddr_all sa;
+  struct sock_extended_err *ee;
+  struct cmsghdr *cmsg;
+  struct msghdr msg;
+  struct raop_session *rs;
+  char cbuf[256];
+  int err;
+  int ret;
+
+  while (1)
+    {
+      memset(&sa, 0, sizeof(union sockaddr_all));
+      memset(&msg, 0, sizeof(struct msghdr));
+      msg.msg_name = &sa;
+      msg.msg_namelen = sizeof(sa.ss);
+      msg.msg_control = cbuf;
+      msg.msg_controllen = sizeof(cbuf);
+
+      // msg_name is set to the address the failed packet was sent to
+      ret = recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+      if (ret < 0)
+	{
+	  if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+	    DPRINTF(E_LOG, L_RAOP, "Could not read send errors: %s\n", strerror(errno));
+
+	  return;
+	}
+
+      err = 0;
+      for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+	  if (((cmsg->cmsg_level == IPPROTO_IP) && (cmsg->cmsg_type == IP_RECVERR))
+	      || ((cmsg->cmsg_level == IPPROTO_IPV6) && (cmsg->cmsg_type == IPV6_RECVERR)))
+	    {
+	      ee = (struct sock_extended_err *)CMSG_DATA(cmsg);
+	      err = ee->ee_errno;
+	    }
+	}
+
+      // A connected socket doesn't fail on "message too long" either
+      if ((err == 0) || (err == EMSGSIZE))
+	continue;
+
+      rs = raop_v2_session_find_by_addr(&sa);
+      if (!rs)
+	continue;
+
+      DPRINTF(E_LOG, L_RAOP, "Send error for '%s': %s\n", rs->devname, strerror(err));
+
+      raop_session_failure(rs);
+    }
+}
+
+/* Sends the queued packets of all sessions of the given address family with
+ * sendmmsg() on the shared socket. The packets that were sent are taken off the
+ * batch, anything left is sent by raop_v2_batch_send_sessions().
+ */
+static void
+raop_v2_batch_send_shared(int family, int fd)
+{
+  static struct mmsghdr msgs[SEND_BATCH_MAX];
+  static struct iovec iov[SEND_BATCH_MAX];
+  static int idx[SEND_BATCH_MAX];
+  struct raop_session *rs;
+  int sent;
+  int n;
+  int i;
+  int ret;
+
+  if (fd < 0)
+    return;
+
+  raop_v2_send_errors_check(fd);
+
+  n = 0;
+  for (i = 0; i < send_batch_len; i++)
+    {
+      rs = send_batch[i].rs;
+      if (!rs || (rs->sa.ss.ss_family != family))
+	continue;
+
+      iov[n].iov_base = send_batch[i].data;
+      iov[n].iov_len = send_batch[i].len;
+
+      // The port of rs->sa was set to the server port by raop_v2_stream_open()
+      memset(&msgs[n], 0, sizeof(struct mmsghdr));
+      msgs[n].msg_hdr.msg_name = &rs->sa;
+      msgs[n].msg_hdr.msg_namelen = (family == AF_INET6) ? sizeof(rs->sa.sin6) : sizeof(rs->sa.sin);
+      msgs[n].msg_hdr.msg_iov = &iov[n];
+      msgs[n].msg_hdr.msg_iovlen = 1;
+
+      idx[n] = i;
+      n++;
+    }
+
+  // No session is freed in here, so the addresses in msgs stay valid
+  sent = 0;
+  while (sent < n)
+    {
+      ret = sendmmsg(fd, msgs + sent, n - sent, 0);
+      send_stats.syscalls++;
+      if (ret <= 0)
+	{
+	  DPRINTF(E_WARN, L_RAOP, "Batched send stopped after %d of %d packets (%s), sending the rest on the session sockets\n",
+		  sent, n, (ret < 0) ? strerror(errno) : "none sent");
+	  break;
+	}
+
+      sent += ret;
+    }
+
+  for (i = 0; i < sent; i++)
+    send_batch[idx[i]].rs = NULL;
+
+  send_stats.packets += sent;
+}
+#endif
+
+/* Sends the packets left in the batch on the connected session sockets, with
+ * one sendmmsg() per session if we have it. A send error fails the session.
+ */
+static void
+raop_v2_batch_send_sessions(void)
+{
+  static int idx[SEND_BATCH_MAX];
+#ifdef HAVE_SENDMMSG
+  static struct mmsghdr msgs[SEND_BATCH_MAX];
+  static struct iovec iov[SEND_BATCH_MAX];
+  int ret;
+#endif
+  struct raop_session *rs;
+  int sent;
+  int n;
+  int i;
+  int j;
+
+  for (i = 0; i < send_batch_len; i++)
+    {
+      rs = send_batch[i].rs;
+      if (!rs)
+	continue;
+
+      // Take this session's packets off the batch, in order
+      n = 0;
+      for (j = i; j < send_batch_len; j++)
+	{
+	  if (send_batch[j].rs != rs)
+	    continue;
+
+	  idx[n] = j;
+	  send_batch[j].rs = NULL;
+	  n++;
+	}
+
+      send_stats.packets += n;
+
+      sent = 0;
+#ifdef HAVE_SENDMMSG
+      for (j = 0; j < n; j++)
+	{
+	  iov[j].iov_base = send_batch[idx[j]].data;
+	  iov[j].iov_len = send_batch[idx[j]].len;
+
+	  memset(&msgs[j], 0, sizeof(struct mmsghdr));
+	  msgs[j].msg_hdr.msg_iov = &iov[j];
+	  msgs[j].msg_hdr.msg_iovlen = 1;
+	}
+
+      while (sent < n)
+	{
+	  ret = sendmmsg(rs->server_fd, msgs + sent, n - sent, 0);
+	  send_stats.syscalls++;
+	  if (ret < 0)
+	    {
+	      DPRINTF(E_LOG, L_RAOP, "Send error for '%s': %s\n", rs->devname, strerror(errno));
+
+	      raop_session_failure(rs);
+	      rs = NULL;
+	      break;
+	    }
+	  else if (ret == 0)
+	    {
+	      DPRINTF(E_WARN, L_RAOP, "Batched send for '%s' stopped after %d of %d packets, sending the rest one by one\n", rs->devname, sent, n);
+	      break;
+	    }
+
+	  sent += ret;
+	}
+#endif
+
+      // Note that rs is freed if this fails with a send error
+      for (j = sent; rs && (j < n); j++)
+	{
+	  send_stats.syscalls++;
+
+	  if (raop_v2_send_packet(rs, send_batch[idx[j]].pkt) < 0)
+	    break;
+	}
+    }
+}
+
+static void
+raop_v2_batch_send(void)
+{
+  struct raop_v2_batch_entry *entry;
+  int i;
+
+  // Get the data for each packet first, so no session is failed while the
+  // messages are being built
+  for (i = 0; i < send_batch_len; i++)
+    {
+      entry = &send_batch[i];
+      if (!entry->rs)
+	continue;
+
+      entry->data = raop_v2_packet_data(entry->rs, entry->pkt, &entry->len);
+      if (entry->data)
+	continue;
+
+      DPRINTF(E_LOG, L_RAOP, "Could not encrypt packet %u for '%s'\n", entry->pkt->seqnum, entry->rs->devname);
+
+      // Also takes the session's other packets off the batch
+      raop_session_failure(entry->rs);
+    }
+
+#ifdef RAOP_SEND_SHARED
+  raop_v2_batch_send_shared(AF_INET, send_4fd);
+  raop_v2_batch_send_shared(AF_INET6, send_6fd);
+#endif
+
+  raop_v2_batch_send_sessions();
+}
+
+static void
+raop_v2_write_commit(void)
+{
+  struct timespec start;
+  struct timespec end;
+  uint64_t usec;
+
+  if (send_batch_len == 0)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  raop_v2_batch_send();
+
+  send_batch_len = 0;
+  send_batch_npkts = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  usec = (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_nsec - start.tv_nsec) / 1000;
+
+  send_stats.ticks++;
+  send_stats.usec += usec;
+  if (usec > send_stats.usec_max)
+    send_stats.usec_max = usec;
+
+  DPRINTF(E_SPAM, L_RAOP, "Sent audio for this tick in %" PRIu64 " usec\n", usec);
+}
+
 static void
 raop_v2_write(uint8_t *buf, uint64_t rtptime)
 {
   struct raop_v2_packet *pkt;
   struct raop_session *rs;
   struct raop_session *next;
+  int n;
+
+  // Send what we have queued if this packet won't fit, or if making it would
+  // overwrite a queued packet in the retransmit buffer
+  for (n = 0, rs = sessions; rs; rs = rs->next)
+    n++;
+
+  if ((send_batch_len + n > SEND_BATCH_MAX) || (send_batch_npkts >= pktbuf_size))
+    raop_v2_write_commit();
 
   pkt = raop_v2_make_packet(buf, rtptime);
   if (!pkt)
@@ -3345,71 +4202,127 @@ raop_v2_write(uint8_t *buf, uint64_t rtptime)
       if (rs->state != RAOP_STATE_STREAMING)
 	continue;
 
-      raop_v2_send_packet(rs, pkt);
+      if (send_batch_len < SEND_BATCH_MAX)
+	{
+	  send_batch[send_batch_len].rs = rs;
+	  send_batch[send_batch_len].pkt = pkt;
+	  send_batch_len++;
+	}
+      else
+	raop_v2_send_packet(rs, pkt);
     }
 
+  send_batch_npkts++;
+
   return;
 }
 
 static void
-raop_v2_resend_range(struct raop_session *rs, uint16_t seqnum, uint16_t len)
+raop_v2_send_stats_log(void)
 {
-  struct raop_v2_packet *pktbuf;
-  int ret;
-  uint16_t distance;
+  if (send_stats.ticks > 0)
+    DPRINTF(E_DBG, L_RAOP, "Sent %" PRIu64 " audio packets with %" PRIu64 " syscalls in %" PRIu64 " ticks, avg %" PRIu64 " usec/tick, max %" PRIu64 " usec\n",
+	    send_stats.packets, send_stats.syscalls, send_stats.ticks, send_stats.usec / send_stats.ticks, send_stats.usec_max);
 
-  /* Check that seqnum is in the retransmit buffer */
-  if ((seqnum > pktbuf_head->seqnum) || (seqnum < pktbuf_tail->seqnum))
-    {
-      DPRINTF(E_WARN, L_RAOP, "Device '%s' asking for seqnum %u; not in buffer (h %u t %u)\n", rs->devname, seqnum, pktbuf_head->seqnum, pktbuf_tail->seqnum);
-      return;
-    }
+  memset(&send_stats, 0, sizeof(struct raop_v2_send_stats));
 
-  if (seqnum > pktbuf_head->seqnum)
-    {
-      distance = seqnum - pktbuf_tail->seqnum;
+  if (packet_stats.packets == 0)
+    return;
 
-      if (distance > (RETRANSMIT_BUFFER_SIZE / 2))
-	pktbuf = pktbuf_head;
-      else
-	pktbuf = pktbuf_tail;
-    }
-  else
-    {
-      distance = pktbuf_head->seqnum - seqnum;
+  DPRINTF(E_DBG, L_RAOP, "Made %" PRIu64 " packets, avg %.1f usec/packet; encrypted %" PRIu64 " packets, avg %.1f usec/packet\n",
+	  packet_stats.packets, (double)packet_stats.usec / packet_stats.packets,
+	  packet_stats.encrypted, (packet_stats.encrypted > 0) ? (double)packet_stats.encrypt_usec / packet_stats.encrypted : 0);
 
-      if (distance > (RETRANSMIT_BUFFER_SIZE / 2))
-	pktbuf = pktbuf_tail;
-      else
-	pktbuf = pktbuf_head;
-    }
+  memset(&packet_stats, 0, sizeof(struct raop_v2_packet_stats));
+}
 
-  if (pktbuf == pktbuf_head)
+#ifdef RAOP_SEND_SHARED
+static int
+raop_v2_send_socket(int family)
+{
+  int on;
+  int fd;
+  int ret;
+
+  fd = socket(family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
     {
-      while (pktbuf && seqnum != pktbuf->seqnum)
-	pktbuf = pktbuf->next;
+      DPRINTF(E_WARN, L_RAOP, "Could not create %s socket for batched sending: %s\n", (family == AF_INET6) ? "IPv6" : "IPv4", strerror(errno));
+      return -1;
     }
+
+  // Without the error queue we wouldn't notice speakers going away
+  on = 1;
+  if (family == AF_INET6)
+    ret = setsockopt(fd, IPPROTO_IPV6, IPV6_RECVERR, &on, sizeof(on));
   else
+    ret = setsockopt(fd, IPPROTO_IP, IP_RECVERR, &on, sizeof(on));
+  if (ret < 0)
     {
-      while (pktbuf && seqnum != pktbuf->seqnum)
-	pktbuf = pktbuf->prev;
+      DPRINTF(E_WARN, L_RAOP, "Could not enable send errors on %s socket for batched sending: %s\n", (family == AF_INET6) ? "IPv6" : "IPv4", strerror(errno));
+
+      close(fd);
+      return -1;
     }
 
-  while (len && pktbuf)
+  return fd;
+}
+
+static void
+raop_v2_send_start(int v6enabled)
+{
+  send_4fd = raop_v2_send_socket(AF_INET);
+  send_6fd = (v6enabled) ? raop_v2_send_socket(AF_INET6) : -1;
+}
+
+static void
+raop_v2_send_stop(void)
+{
+  if (send_4fd >= 0)
+    close(send_4fd);
+  if (send_6fd >= 0)
+    close(send_6fd);
+
+  send_4fd = -1;
+  send_6fd = -1;
+}
+#endif
+
+static void
+raop_v2_resend_range(struct raop_session *rs, uint16_t seqnum, uint16_t len)
+{
+  struct raop_v2_packet *pkt;
+  uint16_t missed;
+  int ret;
+
+  missed = 0;
+  for (; len > 0; seqnum++, len--)
     {
-      ret = raop_v2_send_packet(rs, pktbuf);
+      pkt = raop_v2_packet_get(seqnum);
+      if (!pkt)
+	{
+	  missed++;
+	  continue;
+	}
+
+      // Note that rs may have been freed if this fails
+      ret = raop_v2_send_packet(rs, pkt);
       if (ret < 0)
 	{
 	  DPRINTF(E_LOG, L_RAOP, "Error retransmit packet, aborting retransmission\n");
 	  return;
 	}
 
-      pktbuf = pktbuf->prev;
-      len--;
+      rs->resends_served++;
     }
 
-  if (len != 0)
-    DPRINTF(E_LOG, L_RAOP, "WARNING: len non-zero at end of retransmission\n");
+  if (missed > 0)
+    {
+      DPRINTF(E_WARN, L_RAOP, "Device '%s' asking for %u packets not in buffer (newest seqnum %u, %d packets buffered)\n",
+	      rs->devname, missed, stream_seq, pktbuf_count);
+
+      rs->resends_missed += missed;
+    }
 }
 
 static int
@@ -4301,6 +5214,9 @@ raop_playback_stop(void)
 
   evtimer_del(keep_alive_timer);
 
+  raop_v2_send_stats_log();
+  alac_compress_stats_log();
+
   for (rs = sessions; rs; rs = rs->next)
     {
       ret = raop_send_req_teardown(rs, raop_cb_shutdown_teardown);
@@ -4342,9 +5258,25 @@ raop_init(void)
 
   sessions = NULL;
 
-  pktbuf_size = 0;
-  pktbuf_head = NULL;
-  pktbuf_tail = NULL;
+  pktbuf = NULL;
+  pktbuf_count = 0;
+
+  send_batch_len = 0;
+  send_batch_npkts = 0;
+  memset(&send_stats, 0, sizeof(struct raop_v2_send_stats));
+  memset(&packet_stats, 0, sizeof(struct raop_v2_packet_stats));
+
+  memset(&alac_stats, 0, sizeof(struct raop_alac_stats));
+
+  /* Retransmit buffer size, rounded up to a power of two */
+  ret = cfg_getint(cfg_getsec(cfg, "airplay_shared"), "retransmit_buffer_size");
+  if (ret <= 0)
+    ret = RETRANSMIT_BUFFER_SIZE;
+  else if (ret > RETRANSMIT_BUFFER_MAX)
+    ret = RETRANSMIT_BUFFER_MAX;
+
+  for (pktbuf_size = 1; pktbuf_size < ret; pktbuf_size <<= 1)
+    ; /* EMPTY */
 
   metadata_head = NULL;
   metadata_tail = NULL;
@@ -4436,6 +5368,10 @@ raop_init(void)
   if (v6enabled)
     v6enabled = !((timing_6svc.fd < 0) || (control_6svc.fd < 0));
 
+#ifdef RAOP_SEND_SHARED
+  raop_v2_send_start(v6enabled);
+#endif
+
   if (v6enabled)
     family = AF_UNSPEC;
   else
@@ -4453,6 +5389,9 @@ raop_init(void)
   return 0;
 
  out_stop_control:
+#ifdef RAOP_SEND_SHARED
+  raop_v2_send_stop();
+#endif
   raop_v2_control_stop();
  out_stop_timing:
   raop_v2_timing_stop();
@@ -4481,6 +5420,9 @@ raop_deinit(void)
       raop_session_free(rs);
     }
 
+#ifdef RAOP_SEND_SHARED
+  raop_v2_send_stop();
+#endif
   raop_v2_control_stop();
   raop_v2_timing_stop();
 
@@ -4509,6 +5451,7 @@ struct output_definition output_raop =
   .playback_start = raop_playback_start,
   .playback_stop = raop_playback_stop,
   .write = raop_v2_write,
+  .write_commit = raop_v2_write_commit,
   .flush = raop_flush,
   .status_cb = raop_set_status_cb,
   .metadata_prepare = raop_metadata_prepare,
@@ -84,6 +84,23 @@
 // Used to keep the player from getting ahead of a rate limited source (see below)
 #define PLAYER_TICKS_MAX_OVERRUN 2
 
+// How far ahead of playback the decoder thread reads, the PCM ring is this size
+// rounded up to a power of two
+#define DECODER_AHEAD_SECS 4
+// Bytes the decoder reads in one go
+#define DECODER_READ_LEN STOB(4 * AIRTUNES_V2_PACKET_SAMPLES)
+// Live sources like pipes return silence if they have no data, so reading those
+// far ahead would just add latency
+#define DECODER_READ_LEN_LIVE STOB(AIRTUNES_V2_PACKET_SAMPLES)
+#define DECODER_AHEAD_LIVE STOB(2 * AIRTUNES_V2_PACKET_SAMPLES)
+// When a source is started, wait until the decoder has read this much
+#define DECODER_PRIME_LEN STOB(2 * AIRTUNES_V2_PACKET_SAMPLES)
+
+// State of the prefetched next source, see source_prefetch()
+#define PREFETCH_PENDING 0
+#define PREFETCH_READY   1
+#define PREFETCH_FAILED -1
+
 struct player_source
 {
   /* Id of the file/item in the files database */
@@ -123,9 +140,113 @@ struct player_source
   struct transcode_ctx *xcode;
   int setup_done;
 
+  /* ICY metadata read by the decoder thread when it changed, handed over to
+     the player with an atomic exchange (see metadata_check_icy) */
+  struct http_icy_metadata *icy;
+
+  /* Artwork url from the last ICY metadata, only used by the player thread */
+  char *icy_artwork_url;
+
+  /* Set when the next queue item has been looked up for prefetching, so it is
+     only done once per source (reset when playback is (re)started) */
+  int prefetched;
+
   struct player_source *play_next;
 };
 
+/* Single producer (decoder thread), single consumer (player thread) ring for
+ * decoded PCM. The producer only writes wpos and the consumer only writes rpos,
+ * so no locking is needed. The positions wrap around, fill is wpos - rpos.
+ */
+struct pcm_ring
+{
+  uint8_t *buf;
+  size_t size;
+  size_t wpos;
+  size_t rpos;
+};
+
+struct pcm_ring_stats
+{
+  uint64_t reads;
+  uint64_t fill_sum;
+  size_t fill_min;
+  uint64_t underruns;
+  uint64_t underrun_bytes;
+};
+
+/* Allocations made through libevent by the player thread during playback
+ * ticks, see mem_count_get()
+ */
+struct tick_alloc_stats
+{
+  uint64_t ticks;
+  uint64_t ticks_alloc;
+  uint64_t allocs;
+};
+
+/* Copy of the player status that other threads can read without a round trip
+ * to the player thread. While playing, the position is worked out by the
+ * reader from the playback position pos at time pos_stamp.
+ */
+struct status_snapshot
+{
+  struct player_status status;
+  // Id of the now playing item in the files db, 0 if none
+  uint32_t now_playing;
+
+  int extrapolate;
+  uint64_t pos;
+  uint64_t stream_start;
+  struct timespec pos_stamp;
+};
+
+// Status queries, updated atomically by the readers
+struct status_query_stats
+{
+  uint64_t queries;
+  uint64_t retries;
+  uint64_t nsec_total;
+  uint64_t nsec_max;
+};
+
+struct decoder
+{
+  pthread_t tid;
+  pthread_mutex_t lck;
+  pthread_cond_t cond;
+
+  // Decoded audio on its way to the ring. Only touched by the decoder thread,
+  // or by the player while the decoder is halted.
+  struct evbuffer *evbuf;
+
+  // Protected by lck. The decoder thread reads from ps with the lock released
+  // while busy is set, so the player must wait for busy to clear after
+  // setting ps to NULL (see decoder_halt).
+  struct player_source *ps;
+  size_t ahead;
+  size_t read_len;
+  int busy;
+  int exit;
+
+  // Set by the decoder when ps reached eof (read_ret 0) or failed (read_ret
+  // -1), after the last data was written to the ring
+  int eof;
+  int read_ret;
+
+  // Protected by lck. The next source, set by the player ahead of the end of
+  // ps (see source_prefetch). The decoder opens it, and when ps reaches eof it
+  // continues with next without waiting for the player.
+  struct player_source *next;
+  int next_state;
+
+  // Set by the decoder when it continued with the prefetched source, which is
+  // then ps. The data in the ring from switch_pos on belongs to it, the
+  // player takes it over when it gets there (see source_switch).
+  int switched;
+  size_t switch_pos;
+};
+
 struct volume_param {
   int volume;
   uint64_t spk_id;
@@ -165,10 +286,8 @@ union player_arg
   void *noarg;
   struct spk_enum *spk_enum;
   struct output_device *device;
-  struct player_status *status;
   struct player_source *ps;
   struct player_metadata *pmd;
-  uint32_t *id_ptr;
   struct speaker_set_param speaker_set_param;
   enum repeat_mode mode;
   uint32_t id;
@@ -192,6 +311,14 @@ static enum repeat_mode repeat;
 static char shuffle;
 static char consume;
 
+/* Gapless prefetch, seconds before the end of an item the next one is opened,
+ * and the queue state when it was looked up
+ */
+static int prefetch_secs;
+static int prefetch_queue_version;
+static enum repeat_mode prefetch_repeat;
+static char prefetch_shuffle;
+
 /* Playback timer */
 #if defined(__linux__)
 static int pb_timer_fd;
@@ -233,19 +360,165 @@ static struct player_source *cur_streaming;
 static uint32_t cur_plid;
 static uint32_t cur_plversion;
 
-static struct evbuffer *audio_buf;
+/* Decoded audio, filled by the decoder thread. The playback tick only reads
+ * from the preallocated ring, so in steady state it doesn't allocate.
+ */
+static struct pcm_ring pcm_ring;
+static struct pcm_ring_stats pcm_ring_stats;
+static struct decoder decoder;
 static uint8_t rawbuf[STOB(AIRTUNES_V2_PACKET_SAMPLES)];
+static struct tick_alloc_stats tick_alloc_stats;
+
+/* Status snapshot, only written by the player thread. The sequence counter is
+ * odd while the snapshot is being written, and a reader that sees it odd or
+ * changed while it copied tries again (a seqlock).
+ */
+static struct status_snapshot status_snapshot;
+static unsigned int status_seq;
+static struct status_query_stats status_query_stats;
 
 
 /* Play history */
 static struct player_history *history;
 
 
+/* Publishes the status for player_get_status() and player_now_playing(). Must
+ * be called when anything in the status has changed, except the position while
+ * playing, which the readers work out themselves.
+ */
+static void
+status_publish(void)
+{
+  struct status_snapshot snap;
+  struct player_source *ps;
+  uint64_t pos;
+
+  memset(&snap, 0, sizeof(struct status_snapshot));
+
+  snap.status.shuffle = shuffle;
+  snap.status.consume = consume;
+  snap.status.repeat = repeat;
+  snap.status.volume = master_volume;
+  snap.status.plid = cur_plid;
+
+  ps = cur_playing ? cur_playing : cur_streaming;
+  if (ps)
+    snap.now_playing = ps->id;
+
+  switch (player_state)
+    {
+      case PLAY_STOPPED:
+	snap.status.status = PLAY_STOPPED;
+	break;
+
+      case PLAY_PAUSED:
+	if (!cur_streaming)
+	  {
+	    snap.status.status = PLAY_PAUSED;
+	    break;
+	  }
+
+	ps = cur_streaming;
+	pos = last_rtptime + AIRTUNES_V2_PACKET_SAMPLES - ps->stream_start;
+
+	snap.status.status = PLAY_PAUSED;
+	snap.status.pos_ms = (pos * 1000) / 44100;
+	snap.status.len_ms = ps->len_ms;
+	snap.status.id = ps->id;
+	snap.status.item_id = ps->item_id;
+	break;
+
+      case PLAY_PLAYING:
+	if (!cur_playing)
+	  {
+	    if (!cur_streaming)
+	      {
+		snap.status.status = PLAY_PAUSED;
+		break;
+	      }
+
+	    // Buffering, and avoid a visible 2-second jump backward for the client
+	    ps = cur_streaming;
+	    pos = ps->output_start - ps->stream_start;
+
+	    snap.status.status = PLAY_PAUSED;
+	    snap.status.pos_ms = (pos * 1000) / 44100;
+	  }
+	else
+	  {
+	    ps = cur_playing;
+
+	    snap.status.status = PLAY_PLAYING;
+	    snap.extrapolate = 1;
+	    snap.pos = pb_pos;
+	    snap.stream_start = ps->stream_start;
+	    snap.pos_stamp = pb_pos_stamp;
+	  }
+
+	snap.status.len_ms = ps->len_ms;
+	snap.status.id = ps->id;
+	snap.status.item_id = ps->item_id;
+	break;
+    }
+
+  __atomic_store_n(&status_seq, status_seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  memcpy(&status_snapshot, &snap, sizeof(struct status_snapshot));
+
+  __atomic_store_n(&status_seq, status_seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Thread: any */
+static void
+status_read(struct status_snapshot *snap)
+{
+  struct timespec start;
+  struct timespec end;
+  unsigned int seq;
+  uint64_t retries;
+  uint64_t nsec;
+  uint64_t max;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  retries = 0;
+  for (;;)
+    {
+      seq = __atomic_load_n(&status_seq, __ATOMIC_ACQUIRE);
+      if (!(seq & 1))
+	{
+	  memcpy(snap, &status_snapshot, sizeof(struct status_snapshot));
+	  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	  if (seq == __atomic_load_n(&status_seq, __ATOMIC_RELAXED))
+	    break;
+	}
+
+      retries++;
+    }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  nsec = (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+
+  __atomic_add_fetch(&status_query_stats.queries, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&status_query_stats.nsec_total, nsec, __ATOMIC_RELAXED);
+  if (retries)
+    __atomic_add_fetch(&status_query_stats.retries, retries, __ATOMIC_RELAXED);
+
+  max = __atomic_load_n(&status_query_stats.nsec_max, __ATOMIC_RELAXED);
+  while ((nsec > max) && !__atomic_compare_exchange_n(&status_query_stats.nsec_max, &max, nsec, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
 static void
 status_update(enum play_status status)
 {
   player_state = status;
 
+  status_publish();
+
   listener_notify(LISTENER_PLAYER);
 }
 
@@ -290,6 +563,9 @@ volume_master_update(int newvol)
       if (device->selected)
 	device->relvol = vol_to_rel(device->volume);
     }
+
+  // The volume is part of the published status, see status_publish()
+  status_publish();
 }
 
 static void
@@ -314,7 +590,10 @@ volume_master_find(void)
 static void
 speaker_select_output(struct output_device *device)
 {
+  // Output write threads read it, see outputs_backend_lock()
+  outputs_backend_lock(device->type);
   device->selected = 1;
+  outputs_backend_unlock(device->type);
 
   if (device->volume > master_volume)
     {
@@ -330,7 +609,9 @@ speaker_select_output(struct output_device *device)
 static void
 speaker_deselect_output(struct output_device *device)
 {
+  outputs_backend_lock(device->type);
   device->selected = 0;
+  outputs_backend_unlock(device->type);
 
   if (device->volume == master_volume)
     volume_master_find();
@@ -431,6 +712,9 @@ pb_timer_stop(void)
 static void
 playback_abort(void);
 
+static void
+source_free(struct player_source *ps);
+
 static void
 player_metadata_send(struct player_metadata *pmd);
 
@@ -520,18 +804,22 @@ metadata_trigger(int startup)
   worker_execute(metadata_prepare_cb, &pmd, sizeof(struct player_metadata), 0);
 }
 
-/* Checks if there is new HTTP ICY metadata, and if so sends updates to clients */
+/* Checks if the decoder has read new HTTP ICY metadata, and if so sends updates
+ * to clients
+ */
 void
 metadata_check_icy(void)
 {
   struct http_icy_metadata *metadata;
-  int changed;
 
-  metadata = transcode_metadata(cur_streaming->xcode, &changed);
+  metadata = __atomic_exchange_n(&cur_streaming->icy, NULL, __ATOMIC_ACQ_REL);
   if (!metadata)
     return;
 
-  if (!changed || !metadata->title)
+  free(cur_streaming->icy_artwork_url);
+  cur_streaming->icy_artwork_url = metadata->artwork_url ? strdup(metadata->artwork_url) : NULL;
+
+  if (!metadata->title)
     goto no_update;
 
   if (metadata->title[0] == '\0')
@@ -709,8 +997,40 @@ stream_play(struct player_source *ps)
 }
 
 /*
- * Read up to "len" data from the given player source and returns
- * the actual amount of data read.
+ * Reads the ICY metadata of ps, which must be done here since the decoder owns
+ * the input context. If it changed, it is left in ps->icy for the player.
+ *
+ * Thread: decoder
+ */
+static void
+stream_read_icy(struct player_source *ps)
+{
+  struct http_icy_metadata *metadata;
+  int changed;
+
+  metadata = transcode_metadata(ps->xcode, &changed);
+  if (!metadata)
+    return;
+
+  if (!changed)
+    {
+      http_icy_metadata_free(metadata, 0);
+      return;
+    }
+
+  metadata->id = ps->item_id;
+
+  // Replaces metadata the player hasn't picked up yet
+  metadata = __atomic_exchange_n(&ps->icy, metadata, __ATOMIC_ACQ_REL);
+  if (metadata)
+    http_icy_metadata_free(metadata, 0);
+}
+
+/*
+ * Read up to "len" data from the given player source into decoder.evbuf and
+ * returns the actual amount of data read.
+ *
+ * Thread: decoder
  */
 static int
 stream_read(struct player_source *ps, int len)
@@ -734,24 +1054,23 @@ stream_read(struct player_source *ps, int len)
   switch (ps->data_kind)
     {
       case DATA_KIND_HTTP:
-	ret = transcode(audio_buf, len, ps->xcode, &icy_timer);
-
+	ret = transcode(decoder.evbuf, len, ps->xcode, &icy_timer);
 	if (icy_timer)
-	  metadata_check_icy();
+	  stream_read_icy(ps);
 	break;
 
       case DATA_KIND_FILE:
-	ret = transcode(audio_buf, len, ps->xcode, &icy_timer);
+	ret = transcode(decoder.evbuf, len, ps->xcode, &icy_timer);
 	break;
 
 #ifdef HAVE_SPOTIFY_H
       case DATA_KIND_SPOTIFY:
-	ret = spotify_audio_get(audio_buf, len);
+	ret = spotify_audio_get(decoder.evbuf, len);
 	break;
 #endif
 
       case DATA_KIND_PIPE:
-	ret = pipe_audio_get(audio_buf, len);
+	ret = pipe_audio_get(decoder.evbuf, len);
 	break;
 
       default:
@@ -903,6 +1222,362 @@ stream_stop(struct player_source *ps)
 }
 
 
+/* ---------------------------- PCM ring buffer ---------------------------- */
+
+static int
+pcm_ring_init(size_t size)
+{
+  memset(&pcm_ring, 0, sizeof(struct pcm_ring));
+
+  for (pcm_ring.size = 1; pcm_ring.size < size; pcm_ring.size <<= 1)
+    ; /* EMPTY */
+
+  pcm_ring.buf = malloc(pcm_ring.size);
+  if (!pcm_ring.buf)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Out of memory for PCM ring buffer\n");
+      return -1;
+    }
+
+  return 0;
+}
+
+static void
+pcm_ring_deinit(void)
+{
+  free(pcm_ring.buf);
+
+  memset(&pcm_ring, 0, sizeof(struct pcm_ring));
+}
+
+static inline size_t
+pcm_ring_fill(void)
+{
+  return __atomic_load_n(&pcm_ring.wpos, __ATOMIC_ACQUIRE) - __atomic_load_n(&pcm_ring.rpos, __ATOMIC_ACQUIRE);
+}
+
+/* Thread: decoder */
+static size_t
+pcm_ring_write(struct evbuffer *evbuf)
+{
+  size_t rpos;
+  size_t wpos;
+  size_t off;
+  size_t len;
+  size_t n;
+
+  wpos = pcm_ring.wpos;
+  rpos = __atomic_load_n(&pcm_ring.rpos, __ATOMIC_ACQUIRE);
+
+  len = MIN(evbuffer_get_length(evbuf), pcm_ring.size - (wpos - rpos));
+
+  off = wpos & (pcm_ring.size - 1);
+  n = MIN(len, pcm_ring.size - off);
+
+  evbuffer_remove(evbuf, pcm_ring.buf + off, n);
+  if (n < len)
+    evbuffer_remove(evbuf, pcm_ring.buf, len - n);
+
+  __atomic_store_n(&pcm_ring.wpos, wpos + len, __ATOMIC_RELEASE);
+
+  return len;
+}
+
+/* Thread: player */
+static size_t
+pcm_ring_read(uint8_t *buf, size_t len)
+{
+  size_t rpos;
+  size_t wpos;
+  size_t off;
+  size_t n;
+
+  rpos = pcm_ring.rpos;
+  wpos = __atomic_load_n(&pcm_ring.wpos, __ATOMIC_ACQUIRE);
+
+  len = MIN(len, wpos - rpos);
+
+  off = rpos & (pcm_ring.size - 1);
+  n = MIN(len, pcm_ring.size - off);
+
+  memcpy(buf, pcm_ring.buf + off, n);
+  if (n < len)
+    memcpy(buf + n, pcm_ring.buf, len - n);
+
+  __atomic_store_n(&pcm_ring.rpos, rpos + len, __ATOMIC_RELEASE);
+
+  return len;
+}
+
+/* Thread: player (only when the decoder is halted) */
+static void
+pcm_ring_flush(void)
+{
+  __atomic_store_n(&pcm_ring.rpos, __atomic_load_n(&pcm_ring.wpos, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
+
+static void
+pcm_ring_stats_log(void)
+{
+  if (pcm_ring_stats.reads > 0)
+    DPRINTF(E_DBG, L_PLAYER, "PCM ring fill avg %" PRIu64 " ms, min %" PRIu64 " ms; %" PRIu64 " underruns (%" PRIu64 " ms of silence)\n",
+	    BTOS(pcm_ring_stats.fill_sum / pcm_ring_stats.reads) * 1000 / 44100, (uint64_t)BTOS(pcm_ring_stats.fill_min) * 1000 / 44100,
+	    pcm_ring_stats.underruns, BTOS(pcm_ring_stats.underrun_bytes) * 1000 / 44100);
+
+  memset(&pcm_ring_stats, 0, sizeof(struct pcm_ring_stats));
+  pcm_ring_stats.fill_min = pcm_ring.size;
+}
+
+static void
+tick_alloc_stats_log(void)
+{
+  if (tick_alloc_stats.ticks > 0)
+    DPRINTF(E_DBG, L_PLAYER, "Playback ticks: %" PRIu64 ", of which %" PRIu64 " allocated memory (%" PRIu64 " allocations)\n",
+	    tick_alloc_stats.ticks, tick_alloc_stats.ticks_alloc, tick_alloc_stats.allocs);
+
+  memset(&tick_alloc_stats, 0, sizeof(struct tick_alloc_stats));
+}
+
+
+/* ----------------------------- Decoder thread ----------------------------- */
+
+/* Must be called with the decoder lock held */
+static void
+decoder_source_set(struct player_source *ps)
+{
+  decoder.ps = ps;
+
+  if (ps->data_kind == DATA_KIND_PIPE)
+    {
+      decoder.ahead = DECODER_AHEAD_LIVE;
+      decoder.read_len = DECODER_READ_LEN_LIVE;
+    }
+  else
+    {
+      decoder.ahead = pcm_ring.size;
+      decoder.read_len = DECODER_READ_LEN;
+    }
+}
+
+/* Thread: decoder */
+static void *
+decoder_run(void *arg)
+{
+  struct player_source *ps;
+  struct timespec ts;
+  int ret;
+
+  pthread_mutex_lock(&decoder.lck);
+
+  while (!decoder.exit)
+    {
+      // Opening the prefetched source goes first, it must be ready before the
+      // current one runs out
+      if (decoder.next && (decoder.next_state == PREFETCH_PENDING))
+	{
+	  ps = decoder.next;
+	  decoder.busy = 1;
+
+	  pthread_mutex_unlock(&decoder.lck);
+
+	  DPRINTF(E_DBG, L_PLAYER, "Prefetching '%s' (id=%d, item-id=%d)\n", ps->path, ps->id, ps->item_id);
+
+	  ret = stream_setup(ps);
+
+	  pthread_mutex_lock(&decoder.lck);
+
+	  decoder.busy = 0;
+	  decoder.next_state = (ret < 0) ? PREFETCH_FAILED : PREFETCH_READY;
+
+	  pthread_cond_broadcast(&decoder.cond);
+	  continue;
+	}
+
+      if (!decoder.ps || decoder.eof)
+	{
+	  pthread_cond_wait(&decoder.cond, &decoder.lck);
+	  continue;
+	}
+
+      // The player doesn't signal when it reads from the ring, so poll
+      if (pcm_ring_fill() + decoder.read_len > decoder.ahead)
+	{
+	  clock_gettime(CLOCK_REALTIME, &ts);
+	  ts = timespec_add(ts, packet_time);
+	  pthread_cond_timedwait(&decoder.cond, &decoder.lck, &ts);
+	  continue;
+	}
+
+      ps = decoder.ps;
+      decoder.busy = 1;
+
+      pthread_mutex_unlock(&decoder.lck);
+
+      ret = 1;
+      if (evbuffer_get_length(decoder.evbuf) == 0)
+	ret = stream_read(ps, decoder.read_len);
+
+      if (ret > 0)
+	pcm_ring_write(decoder.evbuf);
+
+      pthread_mutex_lock(&decoder.lck);
+
+      decoder.busy = 0;
+
+      if ((ret == 0) && decoder.ps && decoder.next && (decoder.next_state == PREFETCH_READY))
+	{
+	  decoder_source_set(decoder.next);
+	  decoder.next = NULL;
+
+	  decoder.switch_pos = pcm_ring.wpos;
+	  __atomic_store_n(&decoder.switched, 1, __ATOMIC_RELEASE);
+	}
+      else if (ret <= 0)
+	{
+	  decoder.read_ret = (ret < 0) ? -1 : 0;
+	  __atomic_store_n(&decoder.eof, 1, __ATOMIC_RELEASE);
+	}
+
+      pthread_cond_broadcast(&decoder.cond);
+    }
+
+  pthread_mutex_unlock(&decoder.lck);
+
+  pthread_exit(NULL);
+}
+
+/*
+ * Starts decoding the given source into the PCM ring, and waits until the
+ * decoder has read the first data
+ */
+static void
+decoder_start(struct player_source *ps)
+{
+  ps->prefetched = 0;
+
+  pthread_mutex_lock(&decoder.lck);
+
+  decoder_source_set(ps);
+  decoder.eof = 0;
+  decoder.read_ret = 0;
+
+  pthread_cond_broadcast(&decoder.cond);
+
+  while (!decoder.eof && (pcm_ring_fill() < DECODER_PRIME_LEN))
+    pthread_cond_wait(&decoder.cond, &decoder.lck);
+
+  pthread_mutex_unlock(&decoder.lck);
+}
+
+/*
+ * Stops decoding, and when it returns the decoder thread is no longer using
+ * the source, so it is safe to seek, pause or stop it. Anything the decoder
+ * read ahead is discarded, and so is a prefetched source the player hasn't
+ * taken over yet.
+ */
+static void
+decoder_halt(void)
+{
+  struct player_source *orphan;
+  struct player_source *next;
+
+  pthread_mutex_lock(&decoder.lck);
+
+  orphan = decoder.switched ? decoder.ps : NULL;
+  next = decoder.next;
+
+  decoder.ps = NULL;
+  decoder.next = NULL;
+  while (decoder.busy)
+    pthread_cond_wait(&decoder.cond, &decoder.lck);
+
+  decoder.eof = 0;
+  decoder.switched = 0;
+
+  pthread_mutex_unlock(&decoder.lck);
+
+  pcm_ring_flush();
+  evbuffer_drain(decoder.evbuf, evbuffer_get_length(decoder.evbuf));
+
+  if (orphan)
+    {
+      stream_stop(orphan);
+      source_free(orphan);
+    }
+
+  if (next)
+    {
+      if (next->setup_done)
+	stream_stop(next);
+      source_free(next);
+    }
+}
+
+static int
+decoder_init(void)
+{
+  int ret;
+
+  memset(&decoder, 0, sizeof(struct decoder));
+
+  ret = pcm_ring_init(STOB(DECODER_AHEAD_SECS * 44100));
+  if (ret < 0)
+    return -1;
+
+  pcm_ring_stats_log();
+
+  decoder.evbuf = evbuffer_new();
+  if (!decoder.evbuf)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Could not allocate evbuffer for decoder\n");
+
+      pcm_ring_deinit();
+      return -1;
+    }
+
+  pthread_mutex_init(&decoder.lck, NULL);
+  pthread_cond_init(&decoder.cond, NULL);
+
+  ret = pthread_create(&decoder.tid, NULL, decoder_run, NULL);
+  if (ret != 0)
+    {
+      DPRINTF(E_FATAL, L_PLAYER, "Could not spawn decoder thread: %s\n", strerror(ret));
+
+      pthread_cond_destroy(&decoder.cond);
+      pthread_mutex_destroy(&decoder.lck);
+      evbuffer_free(decoder.evbuf);
+      pcm_ring_deinit();
+      return -1;
+    }
+
+#if defined(HAVE_PTHREAD_SETNAME_NP)
+  pthread_setname_np(decoder.tid, "decoder");
+#elif defined(HAVE_PTHREAD_SET_NAME_NP)
+  pthread_set_name_np(decoder.tid, "decoder");
+#endif
+
+  return 0;
+}
+
+static void
+decoder_deinit(void)
+{
+  pthread_mutex_lock(&decoder.lck);
+  decoder.exit = 1;
+  decoder.ps = NULL;
+  pthread_cond_broadcast(&decoder.cond);
+  pthread_mutex_unlock(&decoder.lck);
+
+  pthread_join(decoder.tid, NULL);
+
+  pthread_cond_destroy(&decoder.cond);
+  pthread_mutex_destroy(&decoder.lck);
+
+  evbuffer_free(decoder.evbuf);
+  pcm_ring_deinit();
+}
+
+
 static struct player_source *
 source_now_playing()
 {
@@ -944,6 +1619,11 @@ source_free(struct player_source *ps)
   if (ps->path)
     free(ps->path);
 
+  if (ps->icy)
+    http_icy_metadata_free(ps->icy, 0);
+
+  free(ps->icy_artwork_url);
+
   free(ps);
 }
 
@@ -958,6 +1638,11 @@ source_stop()
   struct player_source *ps_playing;
   struct player_source *ps_temp;
 
+  decoder_halt();
+
+  pcm_ring_stats_log();
+  tick_alloc_stats_log();
+
   if (cur_streaming)
     stream_stop(cur_streaming);
 
@@ -997,6 +1682,8 @@ source_pause(uint64_t pos)
   if (!ps_playing)
     return -1;
 
+  decoder_halt();
+
   if (cur_streaming)
     {
       if (ps_playing != cur_streaming)
@@ -1067,6 +1754,8 @@ source_seek(int seek_ms)
 {
   int ret;
 
+  decoder_halt();
+
   ret = stream_seek(cur_streaming, seek_ms);
   if (ret < 0)
     return -1;
@@ -1087,10 +1776,14 @@ source_play()
   int ret;
 
   ret = stream_play(cur_streaming);
+  if (ret < 0)
+    return ret;
 
   ticks_skip = 0;
   memset(rawbuf, 0, sizeof(rawbuf));
 
+  decoder_start(cur_streaming);
+
   return ret;
 }
 
@@ -1151,6 +1844,8 @@ source_open(struct player_source *ps, uint64_t start_pos, int seek_ms)
 static int
 source_close(uint64_t end_pos)
 {
+  decoder_halt();
+
   stream_stop(cur_streaming);
 
   cur_streaming->end = end_pos;
@@ -1334,79 +2029,286 @@ source_prev()
   return ps;
 }
 
+/*
+ * Returns the item id of the queue item source_next() would return, without its
+ * side effects. Returns 0 if there is none, or if it isn't known yet because
+ * source_next() will reshuffle the queue first.
+ */
+static uint32_t
+source_next_id(void)
+{
+  struct db_queue_item *queue_item;
+  uint32_t item_id;
+
+  if (repeat == REPEAT_SONG)
+    return cur_streaming->item_id;
+
+  queue_item = db_queue_fetch_next(cur_streaming->item_id, shuffle);
+  if (!queue_item && repeat == REPEAT_ALL && !shuffle)
+    queue_item = db_queue_fetch_bypos(0, shuffle);
+
+  if (!queue_item)
+    return 0;
+
+  item_id = queue_item->id;
+  free_queue_item(queue_item, 0);
+
+  return item_id;
+}
+
+/*
+ * When the decoder is within prefetch_secs of the end of the current streaming
+ * source, looks up the next queue item and hands it to the decoder. The decoder
+ * opens it and continues with it when the current source reaches eof, so the
+ * item change doesn't have to wait for the open in the playback tick.
+ *
+ * Only files and http streams are prefetched, spotify and pipes have a single
+ * global playback context and can't be opened while another item is playing.
+ *
+ * @param pos rtp-time up to which the current source has been read
+ */
+static void
+source_prefetch(uint64_t pos)
+{
+  struct player_source *ps;
+  struct db_queue_item *queue_item;
+  uint32_t item_id;
+  uint64_t decoded_ms;
+  int eof;
+
+  if ((prefetch_secs <= 0) || !cur_streaming || cur_streaming->prefetched || (cur_streaming->len_ms == 0))
+    return;
+
+  // Position in the source up to which the decoder has read
+  pos += BTOS(pcm_ring_fill());
+  if (pos < cur_streaming->stream_start)
+    return;
+
+  decoded_ms = (pos - cur_streaming->stream_start) * 1000 / 44100;
+  if (decoded_ms + prefetch_secs * 1000 < cur_streaming->len_ms)
+    return;
+
+  cur_streaming->prefetched = 1;
+
+  pthread_mutex_lock(&decoder.lck);
+  eof = decoder.eof || (decoder.ps != cur_streaming);
+  pthread_mutex_unlock(&decoder.lck);
+
+  // Too late, the item will be opened the usual way
+  if (eof)
+    return;
+
+  // Not source_next(), the queue must not be reshuffled until we get there
+  item_id = source_next_id();
+  if (item_id == 0)
+    return;
+
+  queue_item = db_queue_fetch_byitemid(item_id);
+  if (!queue_item)
+    return;
+
+  ps = source_new(queue_item);
+  free_queue_item(queue_item, 0);
+  if (!ps)
+    return;
+
+  if ((ps->data_kind != DATA_KIND_FILE) && (ps->data_kind != DATA_KIND_HTTP))
+    {
+      source_free(ps);
+      return;
+    }
+
+  prefetch_queue_version = db_queue_get_version();
+  prefetch_repeat = repeat;
+  prefetch_shuffle = shuffle;
+
+  pthread_mutex_lock(&decoder.lck);
+
+  eof = decoder.eof || (decoder.ps != cur_streaming);
+  if (!eof)
+    {
+      decoder.next = ps;
+      decoder.next_state = PREFETCH_PENDING;
+
+      pthread_cond_broadcast(&decoder.cond);
+    }
+
+  pthread_mutex_unlock(&decoder.lck);
+
+  if (eof)
+    source_free(ps);
+}
+
+/*
+ * Takes over the prefetched source the decoder continued with as the new
+ * streaming source, the current streaming source is closed with its end-time
+ * set to the given position.
+ *
+ * If the queue, repeat or shuffle changed since the prefetch and the prefetched
+ * item is no longer the next one, the decoder is halted and the prefetched
+ * source discarded.
+ *
+ * @return 0 on success, -1 if the prefetched source was discarded
+ */
+static int
+source_switch(uint64_t end_pos)
+{
+  struct player_source *ps;
+
+  pthread_mutex_lock(&decoder.lck);
+  ps = decoder.ps;
+  pthread_mutex_unlock(&decoder.lck);
+
+  if ((repeat != prefetch_repeat) || (shuffle != prefetch_shuffle) || (db_queue_get_version() != prefetch_queue_version))
+    {
+      if (source_next_id() != ps->item_id)
+	{
+	  DPRINTF(E_DBG, L_PLAYER, "Queue changed, discarding prefetched '%s' (id=%d, item-id=%d)\n", ps->path, ps->id, ps->item_id);
+
+	  decoder_halt();
+	  return -1;
+	}
+    }
+
+  pthread_mutex_lock(&decoder.lck);
+  decoder.switched = 0;
+  pthread_mutex_unlock(&decoder.lck);
+
+  stream_stop(cur_streaming);
+
+  cur_streaming->end = end_pos;
+  cur_streaming->play_next = ps;
+
+  cur_streaming = ps;
+
+  cur_streaming->stream_start = end_pos + 1;
+  cur_streaming->output_start = cur_streaming->stream_start;
+  cur_streaming->end = 0;
+
+  return 0;
+}
+
 static int
 source_read(uint8_t *buf, int len, uint64_t rtptime)
 {
   int ret;
   int nbytes;
-  char *silence_buf;
+  int eof;
+  int switched;
+  size_t want;
+  size_t fill;
   struct player_source *ps;
 
   if (!cur_streaming)
     return 0;
 
+  metadata_check_icy();
+
+  fill = pcm_ring_fill();
+
+  pcm_ring_stats.reads++;
+  pcm_ring_stats.fill_sum += fill;
+  if (fill < pcm_ring_stats.fill_min)
+    pcm_ring_stats.fill_min = fill;
+
   nbytes = 0;
   while (nbytes < len)
     {
-      if (evbuffer_get_length(audio_buf) == 0)
+      if (cur_streaming)
 	{
-	  if (cur_streaming)
+	  // Check eof before reading, so we know there is nothing more to read
+	  // if the ring comes up short. If the decoder continued with the
+	  // prefetched source, read no further than the end of this one.
+	  eof = __atomic_load_n(&decoder.eof, __ATOMIC_ACQUIRE);
+	  switched = __atomic_load_n(&decoder.switched, __ATOMIC_ACQUIRE);
+
+	  want = len - nbytes;
+	  if (switched)
+	    want = MIN(want, decoder.switch_pos - pcm_ring.rpos);
+
+	  nbytes += pcm_ring_read(buf + nbytes, want);
+
+	  if (switched && (pcm_ring.rpos == decoder.switch_pos))
 	    {
-	      ret = stream_read(cur_streaming, len - nbytes);
+	      ret = source_switch(rtptime + BTOS(nbytes) - 1);
+	      if (ret == 0)
+		{
+		  DPRINTF(E_DBG, L_PLAYER, "New file (prefetched)\n");
+
+		  metadata_trigger(0);
+		  continue;
+		}
+
+	      // Not the next item anymore, open the right one below
+	      ret = 0;
 	    }
-	  else if (cur_playing)
+	  else if (nbytes == len)
+	    break;
+	  else if (!eof || switched)
 	    {
-	      // Reached end of playlist (cur_playing is NULL) send silence and source_check will abort playback if the last item was played
-	      DPRINTF(E_SPAM, L_PLAYER, "End of playlist reached, stream silence until playback of last item ends\n");
-	      silence_buf = (char *)calloc((len - nbytes), sizeof(char));
-	      evbuffer_add(audio_buf, silence_buf, (len - nbytes));
-	      free(silence_buf);
-	      ret = len - nbytes;
+	      // Decoder is behind, play silence and move the stream start so
+	      // that the position of the item is still right
+	      DPRINTF(E_SPAM, L_PLAYER, "PCM ring underrun, %d bytes short\n", len - nbytes);
+
+	      pcm_ring_stats.underruns++;
+	      pcm_ring_stats.underrun_bytes += len - nbytes;
+
+	      cur_streaming->stream_start += BTOS(len - nbytes);
+
+	      memset(buf + nbytes, 0, len - nbytes);
+	      nbytes = len;
+	      break;
 	    }
 	  else
-	    {
-	      // If cur_streaming and cur_playing are NULL, source_read for all queue items failed. Playback will be aborted in the calling function
-	      return -1;
-	    }
+	    ret = decoder.read_ret;
+	}
+      else if (cur_playing)
+	{
+	  // Reached end of playlist (cur_playing is NULL) send silence and source_check will abort playback if the last item was played
+	  DPRINTF(E_SPAM, L_PLAYER, "End of playlist reached, stream silence until playback of last item ends\n");
+	  memset(buf + nbytes, 0, len - nbytes);
+	  nbytes = len;
+	  break;
+	}
+      else
+	{
+	  // If cur_streaming and cur_playing are NULL, source_read for all queue items failed. Playback will be aborted in the calling function
+	  return -1;
+	}
 
-	  if (ret <= 0)
-	    {
-	      /* EOF or error */
-	      source_close(rtptime + BTOS(nbytes) - 1);
+      /* EOF or error */
+      source_close(rtptime + BTOS(nbytes) - 1);
 
-	      DPRINTF(E_DBG, L_PLAYER, "New file\n");
+      DPRINTF(E_DBG, L_PLAYER, "New file\n");
 
-	      ps = source_next();
+      ps = source_next();
 
-	      if (ret < 0)
-		{
-		  DPRINTF(E_LOG, L_PLAYER, "Error reading source %d\n", cur_streaming->id);
-		  db_queue_delete_byitemid(cur_streaming->item_id);
-		}
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_PLAYER, "Error reading source %d\n", cur_streaming->id);
+	  db_queue_delete_byitemid(cur_streaming->item_id);
+	}
 
-	      if (ps)
-		{
-		  ret = source_open(ps, cur_streaming->end + 1, 0);
-		  if (ret < 0)
-		    return -1;
+      if (ps)
+	{
+	  ret = source_open(ps, cur_streaming->end + 1, 0);
+	  if (ret < 0)
+	    return -1;
 
-		  ret = source_play();
-		  if (ret < 0)
-		    return -1;
+	  ret = source_play();
+	  if (ret < 0)
+	    return -1;
 
-		  metadata_trigger(0);
-		}
-	      else
-		{
-		  cur_streaming = NULL;
-		}
-	      continue;
-	    }
+	  metadata_trigger(0);
+	}
+      else
+	{
+	  cur_streaming = NULL;
 	}
-
-      nbytes += evbuffer_remove(audio_buf, buf + nbytes, len - nbytes);
     }
 
+  source_prefetch(rtptime + BTOS(nbytes));
+
   return nbytes;
 }
 
@@ -1445,10 +2347,13 @@ player_playback_cb(int fd, short what, void *arg)
 {
   struct timespec next_tick;
   uint64_t overrun;
+  uint64_t allocs;
   int ret;
   int skip;
   int skip_first;
 
+  allocs = mem_count_get();
+
   // Check if we missed any timer expirations
   overrun = 0;
 #if defined(__linux__)
@@ -1518,10 +2423,25 @@ player_playback_cb(int fd, short what, void *arg)
     }
   while ((timespec_cmp(packet_timer_last, next_tick) < 0) && (player_state == PLAY_PLAYING));
 
+  // Outputs may have queued what was written during this tick
+  outputs_write_commit();
+
+  allocs = mem_count_get() - allocs;
+
+  tick_alloc_stats.ticks++;
+  if (allocs > 0)
+    {
+      tick_alloc_stats.ticks_alloc++;
+      tick_alloc_stats.allocs += allocs;
+    }
+
   /* Make sure playback is still running */
   if (player_state == PLAY_STOPPED)
     return;
 
+  // Items may have changed and the playback position has been committed
+  status_publish();
+
   pb_timer_last = next_tick;
 }
 
@@ -2042,8 +2962,6 @@ playback_abort(void)
 
   source_stop();
 
-  evbuffer_drain(audio_buf, evbuffer_get_length(audio_buf));
-
   if (!clear_queue_on_stop_disabled)
     db_queue_clear();
 
@@ -2053,117 +2971,6 @@ playback_abort(void)
 }
 
 /* Actual commands, executed in the player thread */
-static enum command_state
-get_status(void *arg, int *retval)
-{
-  union player_arg *cmdarg = arg;
-  struct timespec ts;
-  struct player_source *ps;
-  struct player_status *status;
-  uint64_t pos;
-  int ret;
-
-  status = cmdarg->status;
-
-  memset(status, 0, sizeof(struct player_status));
-
-  status->shuffle = shuffle;
-  status->consume = consume;
-  status->repeat = repeat;
-
-  status->volume = master_volume;
-
-  status->plid = cur_plid;
-
-  switch (player_state)
-    {
-      case PLAY_STOPPED:
-	DPRINTF(E_DBG, L_PLAYER, "Player status: stopped\n");
-
-	status->status = PLAY_STOPPED;
-	break;
-
-      case PLAY_PAUSED:
-	DPRINTF(E_DBG, L_PLAYER, "Player status: paused\n");
-
-	status->status = PLAY_PAUSED;
-	status->id = cur_streaming->id;
-	status->item_id = cur_streaming->item_id;
-
-	pos = last_rtptime + AIRTUNES_V2_PACKET_SAMPLES - cur_streaming->stream_start;
-	status->pos_ms = (pos * 1000) / 44100;
-	status->len_ms = cur_streaming->len_ms;
-
-	break;
-
-      case PLAY_PLAYING:
-	if (!cur_playing)
-	  {
-	    DPRINTF(E_DBG, L_PLAYER, "Player status: playing (buffering)\n");
-
-	    status->status = PLAY_PAUSED;
-	    ps = cur_streaming;
-
-	    /* Avoid a visible 2-second jump backward for the client */
-	    pos = ps->output_start - ps->stream_start;
-	  }
-	else
-	  {
-	    DPRINTF(E_DBG, L_PLAYER, "Player status: playing\n");
-
-	    status->status = PLAY_PLAYING;
-	    ps = cur_playing;
-
-	    ret = player_get_current_pos(&pos, &ts, 0);
-	    if (ret < 0)
-	      {
-		DPRINTF(E_LOG, L_PLAYER, "Could not get current stream position for playstatus\n");
-
-		pos = 0;
-	      }
-
-	    if (pos < ps->stream_start)
-	      pos = 0;
-	    else
-	      pos -= ps->stream_start;
-	  }
-
-	status->pos_ms = (pos * 1000) / 44100;
-	status->len_ms = ps->len_ms;
-
-	status->id = ps->id;
-	status->item_id = ps->item_id;
-
-	break;
-    }
-
-  *retval = 0;
-  return COMMAND_END;
-}
-
-static enum command_state
-now_playing(void *arg, int *retval)
-{
-  union player_arg *cmdarg = arg;
-  uint32_t *id;
-  struct player_source *ps_playing;
-
-  id = cmdarg->id_ptr;
-
-  ps_playing = source_now_playing();
-
-  if (ps_playing)
-    *id = ps_playing->id;
-  else
-    {
-      *retval = -1;
-      return COMMAND_END;
-    }
-
-  *retval = 0;
-  return COMMAND_END;
-}
-
 static enum command_state
 artwork_url_get(void *arg, int *retval)
 {
@@ -2189,7 +2996,9 @@ artwork_url_get(void *arg, int *retval)
       return COMMAND_END;
     }
 
-  cmdarg->icy.artwork_url = transcode_metadata_artwork_url(ps->xcode);
+  // Not read from ps->xcode, the decoder thread may be using it
+  if (ps->icy_artwork_url)
+    cmdarg->icy.artwork_url = strdup(ps->icy_artwork_url);
 
   *retval = 0;
   return COMMAND_END;
@@ -2216,8 +3025,6 @@ playback_stop(void *arg, int *retval)
 
   source_stop();
 
-  evbuffer_drain(audio_buf, evbuffer_get_length(audio_buf));
-
   status_update(PLAY_STOPPED);
 
   metadata_purge();
@@ -2657,8 +3464,6 @@ playback_pause(void *arg, int *retval)
 
   source_pause(pos);
 
-  evbuffer_drain(audio_buf, evbuffer_get_length(audio_buf));
-
   metadata_purge();
 
   /* We're async if we need to flush devices */
@@ -2837,6 +3642,7 @@ speaker_set(void *arg, int *retval)
 	}
     }
 
+  status_publish();
   listener_notify(LISTENER_SPEAKER);
 
   if (*retval > 0)
@@ -2876,6 +3682,7 @@ volume_set(void *arg, int *retval)
 	*retval += outputs_device_volume_set(device, device_command_cb);
     }
 
+  status_publish();
   listener_notify(LISTENER_VOLUME);
 
   if (*retval > 0)
@@ -2920,6 +3727,7 @@ volume_setrel_speaker(void *arg, int *retval)
       break;
     }
 
+  status_publish();
   listener_notify(LISTENER_VOLUME);
 
   if (*retval > 0)
@@ -2970,6 +3778,7 @@ volume_setabs_speaker(void *arg, int *retval)
 	}
     }
 
+  status_publish();
   listener_notify(LISTENER_VOLUME);
 
   if (*retval > 0)
@@ -3003,6 +3812,7 @@ repeat_set(void *arg, int *retval)
 	return COMMAND_END;
     }
 
+  status_publish();
   listener_notify(LISTENER_OPTIONS);
 
   *retval = 0;
@@ -3034,6 +3844,7 @@ shuffle_set(void *arg, int *retval)
 	return COMMAND_END;
     }
 
+  status_publish();
   listener_notify(LISTENER_OPTIONS);
 
   *retval = 0;
@@ -3047,6 +3858,7 @@ consume_set(void *arg, int *retval)
 
   consume = cmdarg->intval;
 
+  status_publish();
   listener_notify(LISTENER_OPTIONS);
 
   *retval = 0;
@@ -3062,6 +3874,7 @@ playerqueue_clear_history(void *arg, int *retval)
 
   cur_plversion++; // TODO [db_queue] need to update db queue version
 
+  status_publish();
   listener_notify(LISTENER_PLAYLIST);
 
   *retval = 0;
@@ -3074,6 +3887,8 @@ playerqueue_plid(void *arg, int *retval)
   union player_arg *cmdarg = arg;
   cur_plid = cmdarg->id;
 
+  status_publish();
+
   *retval = 0;
   return COMMAND_END;
 }
@@ -3083,13 +3898,32 @@ playerqueue_plid(void *arg, int *retval)
 int
 player_get_status(struct player_status *status)
 {
-  union player_arg cmdarg;
-  int ret;
+  struct status_snapshot snap;
+  struct timespec ts;
+  uint64_t pos;
+  uint64_t delta;
 
-  cmdarg.status = status;
+  status_read(&snap);
 
-  ret = commands_exec_sync(cmdbase, get_status, NULL, &cmdarg);
-  return ret;
+  memcpy(status, &snap.status, sizeof(struct player_status));
+
+  if (!snap.extrapolate)
+    return 0;
+
+  // Same as player_get_current_pos(), but from the snapshot
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  delta = (ts.tv_sec - snap.pos_stamp.tv_sec) * 1000000 + (ts.tv_nsec - snap.pos_stamp.tv_nsec) / 1000;
+  pos = snap.pos + (delta * 44100) / 1000000;
+
+  if (pos < snap.stream_start)
+    pos = 0;
+  else
+    pos -= snap.stream_start;
+
+  status->pos_ms = (pos * 1000) / 44100;
+
+  return 0;
 }
 
 /*
@@ -3101,13 +3935,35 @@ player_get_status(struct player_status *status)
 int
 player_now_playing(uint32_t *id)
 {
-  union player_arg cmdarg;
+  struct status_snapshot snap;
+
+  status_read(&snap);
+
+  if (!snap.now_playing)
+    return -1;
+
+  *id = snap.now_playing;
+
+  return 0;
+}
+
+int
+player_stats_get(struct evbuffer *evbuf)
+{
+  uint64_t queries;
+  uint64_t nsec_total;
   int ret;
 
-  cmdarg.id_ptr = id;
+  queries = __atomic_load_n(&status_query_stats.queries, __ATOMIC_RELAXED);
+  nsec_total = __atomic_load_n(&status_query_stats.nsec_total, __ATOMIC_RELAXED);
 
-  ret = commands_exec_sync(cmdbase, now_playing, NULL, &cmdarg);
-  return ret;
+  ret = evbuffer_add_printf(evbuf, "{\"status_queries\":%" PRIu64 ",\"status_retries\":%" PRIu64 ","
+			    "\"status_nsec_avg\":%" PRIu64 ",\"status_nsec_max\":%" PRIu64 "}\n",
+			    queries, __atomic_load_n(&status_query_stats.retries, __ATOMIC_RELAXED),
+			    (queries > 0) ? nsec_total / queries : 0,
+			    __atomic_load_n(&status_query_stats.nsec_max, __ATOMIC_RELAXED));
+
+  return (ret < 0) ? -1 : 0;
 }
 
 char *
@@ -3434,6 +4290,7 @@ player_init(void)
   player_exit = 0;
 
   speaker_autoselect = cfg_getbool(cfg_getsec(cfg, "general"), "speaker_autoselect");
+  prefetch_secs = cfg_getint(cfg_getsec(cfg, "general"), "prefetch_secs");
   clear_queue_on_stop_disabled = cfg_getbool(cfg_getsec(cfg, "mpd"), "clear_queue_on_stop_disable");
 
   dev_list = NULL;
@@ -3452,6 +4309,8 @@ player_init(void)
   shuffle = 0;
   consume = 0;
 
+  status_publish();
+
   history = (struct player_history *)calloc(1, sizeof(struct player_history));
 
   /*
@@ -3496,13 +4355,9 @@ player_init(void)
   gcry_randomize(&rnd, sizeof(rnd), GCRY_STRONG_RANDOM);
   last_rtptime = ((uint64_t)1 << 32) | rnd;
 
-  audio_buf = evbuffer_new();
-  if (!audio_buf)
-    {
-      DPRINTF(E_LOG, L_PLAYER, "Could not allocate evbuffer for audio buffer\n");
-
-      goto audio_fail;
-    }
+  ret = decoder_init();
+  if (ret < 0)
+    goto decoder_fail;
 
   evbase_player = event_base_new();
   if (!evbase_player)
@@ -3555,8 +4410,8 @@ player_init(void)
  evnew_fail:
   event_base_free(evbase_player);
  evbase_fail:
-  evbuffer_free(audio_buf);
- audio_fail:
+  decoder_deinit();
+ decoder_fail:
 #if defined(__linux__)
   close(pb_timer_fd);
 #else
@@ -3592,7 +4447,7 @@ player_deinit(void)
   timer_delete(pb_timer);
 #endif
 
-  evbuffer_free(audio_buf);
+  decoder_deinit();
 
   outputs_deinit();
 
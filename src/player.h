@@ -6,6 +6,8 @@
 
 #include "db.h"
 
+struct evbuffer;
+
 /* AirTunes v2 packet interval in ns */
 /* (352 samples/packet * 1e9 ns/s) / 44100 samples/s = 7981859 ns/packet */
 # define AIRTUNES_V2_STREAM_PERIOD 7981859
@@ -85,6 +87,10 @@ player_get_status(struct player_status *status);
 int
 player_now_playing(uint32_t *id);
 
+/* Adds statistics on status queries to evbuf as JSON */
+int
+player_stats_get(struct evbuffer *evbuf);
+
 char *
 player_get_icy_artwork_url(uint32_t id);
 
@@ -0,0 +1,745 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * On-disk cache of transcoded files. When a file is streamed with transcoding,
+ * the output is also written to a file in the cache directory, named by the
+ * file id, its modification time and the transcode profile. If the stream runs
+ * to the end the file is added to the cache, and the next time the file is
+ * requested it is streamed from the cache like a raw file, i.e. without
+ * decoding, with a known Content-Length and with cheap seeking.
+ *
+ * The streams only hand the data over, it is written to disk by a writer thread
+ * of the cache, so a slow disk (or an eviction) doesn't hold up the httpd
+ * loops.
+ *
+ * The cache is limited in size. We keep a running total of the size of the
+ * cached files, and when an added file takes it over the limit, the least
+ * recently used files (by modification time, which is updated on every hit)
+ * are removed until the cache fits.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "logger.h"
+#include "conffile.h"
+#include "transcode_cache.h"
+
+#define TRANSCODE_CACHE_TMP_SUFFIX ".tmp"
+#define TRANSCODE_CACHE_IOVEC 16
+// If more than this is waiting to be written the disk can't keep up, and the
+// fill is given up
+#define TRANSCODE_CACHE_PENDING_MAX (8 * 1024 * 1024)
+
+struct transcode_cache_fill {
+  int fd;
+  int id;
+  off_t size;
+  char path[PATH_MAX];
+  char tmp_path[PATH_MAX];
+
+  // Only used by the writer thread
+  struct evbuffer *writing;
+
+  // Protected by lck
+  pthread_mutex_t lck;
+  struct evbuffer *pending;
+  int scheduled;
+  int ended;
+  int complete;
+  int failed;
+
+  // Protected by writer_lck
+  struct transcode_cache_fill *next;
+};
+
+struct cache_entry {
+  char name[NAME_MAX + 1];
+  off_t size;
+  time_t mtime;
+};
+
+static char *cache_dir;
+static off_t cache_max;
+
+// Protects cache_total and serializes eviction
+static pthread_mutex_t cache_lck = PTHREAD_MUTEX_INITIALIZER;
+static off_t cache_total;
+
+// The writer thread and its queue of fills that have something to write
+static pthread_t tid_writer;
+static pthread_mutex_t writer_lck = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static struct transcode_cache_fill *writer_head;
+static struct transcode_cache_fill *writer_tail;
+static int writer_running;
+static int writer_exit;
+
+
+static int
+cache_path_make(char *path, size_t len, struct media_file_info *mfi, enum transcode_profile profile, const char *suffix)
+{
+  int ret;
+
+  ret = snprintf(path, len, "%s/%u-%" PRIu32 "-%d%s", cache_dir, mfi->id, mfi->time_modified, (int)profile, suffix);
+  if ((ret < 0) || (ret >= len))
+    {
+      DPRINTF(E_LOG, L_XCODE, "Transcode cache path exceeds PATH_MAX\n");
+      return -1;
+    }
+
+  return 0;
+}
+
+static int
+is_tmp(const char *name)
+{
+  size_t len;
+  size_t slen;
+
+  len = strlen(name);
+  slen = strlen(TRANSCODE_CACHE_TMP_SUFFIX);
+
+  return (len > slen) && (strcmp(name + len - slen, TRANSCODE_CACHE_TMP_SUFFIX) == 0);
+}
+
+static int
+entry_cmp(const void *a, const void *b)
+{
+  const struct cache_entry *ea = a;
+  const struct cache_entry *eb = b;
+
+  if (ea->mtime < eb->mtime)
+    return -1;
+  if (ea->mtime > eb->mtime)
+    return 1;
+
+  return 0;
+}
+
+/* Scans the cache directory and removes the least recently used files until
+ * the cache is within cache_max, and sets cache_total. Leftover temporary files
+ * are removed if remove_tmp is set, otherwise they are left to their fills.
+ */
+static void
+cache_evict(int remove_tmp)
+{
+  struct cache_entry *entries;
+  struct cache_entry *tmp;
+  struct dirent *de;
+  struct stat sb;
+  char path[PATH_MAX];
+  DIR *dirp;
+  off_t total;
+  int nentries;
+  int size;
+  int removed;
+  int i;
+  int ret;
+
+  pthread_mutex_lock(&cache_lck);
+
+  // Shut down
+  if (!cache_dir)
+    {
+      pthread_mutex_unlock(&cache_lck);
+      return;
+    }
+
+  dirp = opendir(cache_dir);
+  if (!dirp)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Could not open transcode cache directory %s: %s\n", cache_dir, strerror(errno));
+
+      pthread_mutex_unlock(&cache_lck);
+      return;
+    }
+
+  entries = NULL;
+  nentries = 0;
+  size = 0;
+  total = 0;
+  while ((de = readdir(dirp)))
+    {
+      if (de->d_name[0] == '.')
+	continue;
+
+      ret = snprintf(path, sizeof(path), "%s/%s", cache_dir, de->d_name);
+      if ((ret < 0) || (ret >= sizeof(path)))
+	continue;
+
+      if ((lstat(path, &sb) < 0) || !S_ISREG(sb.st_mode))
+	continue;
+
+      if (is_tmp(de->d_name))
+	{
+	  if (remove_tmp)
+	    {
+	      DPRINTF(E_DBG, L_XCODE, "Removing stale transcode cache file %s\n", de->d_name);
+	      unlink(path);
+	    }
+
+	  continue;
+	}
+
+      if (nentries == size)
+	{
+	  size = size ? size * 2 : 64;
+	  tmp = realloc(entries, size * sizeof(struct cache_entry));
+	  if (!tmp)
+	    {
+	      DPRINTF(E_LOG, L_XCODE, "Out of memory for transcode cache entries\n");
+	      goto out;
+	    }
+	  entries = tmp;
+	}
+
+      snprintf(entries[nentries].name, sizeof(entries[nentries].name), "%s", de->d_name);
+      entries[nentries].size = sb.st_size;
+      entries[nentries].mtime = sb.st_mtime;
+      nentries++;
+
+      total += sb.st_size;
+    }
+
+  if (total <= cache_max)
+    goto out;
+
+  qsort(entries, nentries, sizeof(struct cache_entry), entry_cmp);
+
+  removed = 0;
+  for (i = 0; (i < nentries) && (total > cache_max); i++)
+    {
+      snprintf(path, sizeof(path), "%s/%s", cache_dir, entries[i].name);
+
+      ret = unlink(path);
+      if (ret < 0)
+	{
+	  DPRINTF(E_WARN, L_XCODE, "Could not remove transcode cache file %s: %s\n", path, strerror(errno));
+	  continue;
+	}
+
+      total -= entries[i].size;
+      removed++;
+    }
+
+  DPRINTF(E_DBG, L_XCODE, "Evicted %d files from the transcode cache, now %" PRIi64 " MB\n", removed, (int64_t)total / (1024 * 1024));
+
+ out:
+  cache_total = total;
+
+  closedir(dirp);
+  free(entries);
+
+  pthread_mutex_unlock(&cache_lck);
+}
+
+/* Thread: writer
+ * Adds a file to the running total, only rescanning the directory to evict when
+ * the cache has grown too large
+ */
+static void
+cache_add(off_t size)
+{
+  int evict;
+
+  pthread_mutex_lock(&cache_lck);
+  cache_total += size;
+  evict = (cache_total > cache_max);
+  pthread_mutex_unlock(&cache_lck);
+
+  if (evict)
+    cache_evict(0);
+}
+
+static void
+fill_free(struct transcode_cache_fill *fill)
+{
+  if (fill->pending)
+    evbuffer_free(fill->pending);
+  if (fill->writing)
+    evbuffer_free(fill->writing);
+
+  pthread_mutex_destroy(&fill->lck);
+  free(fill);
+}
+
+/* Thread: writer */
+static void
+fill_finish(struct transcode_cache_fill *fill)
+{
+  int complete;
+  int ret;
+
+  complete = fill->complete && !fill->failed;
+
+  ret = close(fill->fd);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Could not write transcode cache file %s: %s\n", fill->tmp_path, strerror(errno));
+      complete = 0;
+    }
+
+  if (complete)
+    {
+      ret = rename(fill->tmp_path, fill->path);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_XCODE, "Could not rename %s: %s\n", fill->tmp_path, strerror(errno));
+	  complete = 0;
+	}
+    }
+
+  if (complete)
+    {
+      DPRINTF(E_DBG, L_XCODE, "Added transcoding of file id %d to the transcode cache (%" PRIi64 " bytes)\n", fill->id, (int64_t)fill->size);
+
+      cache_add(fill->size);
+    }
+  else
+    unlink(fill->tmp_path);
+
+  fill_free(fill);
+}
+
+/* Thread: writer
+ * Writes what the stream has handed over until there is no more. A fill is
+ * only queued once at a time, so the writes are in order.
+ */
+static void
+fill_run(void *arg)
+{
+  struct transcode_cache_fill *fill = arg;
+  int ended;
+  int ret;
+
+  for (;;)
+    {
+      pthread_mutex_lock(&fill->lck);
+
+      evbuffer_add_buffer(fill->writing, fill->pending);
+      if (evbuffer_get_length(fill->writing) == 0)
+	{
+	  fill->scheduled = 0;
+	  ended = fill->ended;
+	  pthread_mutex_unlock(&fill->lck);
+
+	  if (ended)
+	    fill_finish(fill);
+	  return;
+	}
+
+      pthread_mutex_unlock(&fill->lck);
+
+      while (evbuffer_get_length(fill->writing) > 0)
+	{
+	  ret = evbuffer_write(fill->writing, fill->fd);
+	  if ((ret < 0) && (errno == EINTR))
+	    continue;
+
+	  if (ret <= 0)
+	    {
+	      DPRINTF(E_LOG, L_XCODE, "Could not write to transcode cache file %s: %s\n", fill->tmp_path, (ret < 0) ? strerror(errno) : "short write");
+	      break;
+	    }
+
+	  fill->size += ret;
+	}
+
+      if (evbuffer_get_length(fill->writing) == 0 && (fill->size <= cache_max))
+	continue;
+
+      if (fill->size > cache_max)
+	DPRINTF(E_DBG, L_XCODE, "Transcoding of file id %d outgrew the transcode cache\n", fill->id);
+
+      // The stream finds out on its next write, what it hands over until then
+      // is dropped here
+      evbuffer_drain(fill->writing, evbuffer_get_length(fill->writing));
+
+      pthread_mutex_lock(&fill->lck);
+      fill->failed = 1;
+      evbuffer_drain(fill->pending, evbuffer_get_length(fill->pending));
+      pthread_mutex_unlock(&fill->lck);
+    }
+}
+
+/* Thread: httpd (any) */
+static void
+fill_schedule(struct transcode_cache_fill *fill)
+{
+  int ended;
+
+  pthread_mutex_lock(&writer_lck);
+
+  // After shutdown the fill is dropped, when its stream has ended it
+  if (!writer_running)
+    {
+      pthread_mutex_unlock(&writer_lck);
+
+      pthread_mutex_lock(&fill->lck);
+      fill->failed = 1;
+      fill->scheduled = 0;
+      ended = fill->ended;
+      pthread_mutex_unlock(&fill->lck);
+
+      if (ended)
+	{
+	  close(fill->fd);
+	  unlink(fill->tmp_path);
+	  fill_free(fill);
+	}
+      return;
+    }
+
+  fill->next = NULL;
+  if (writer_tail)
+    writer_tail->next = fill;
+  else
+    writer_head = fill;
+  writer_tail = fill;
+
+  pthread_cond_signal(&writer_cond);
+  pthread_mutex_unlock(&writer_lck);
+}
+
+/* Thread: writer */
+static void *
+writer(void *arg)
+{
+  struct transcode_cache_fill *fill;
+
+  for (;;)
+    {
+      pthread_mutex_lock(&writer_lck);
+
+      while (!writer_head && !writer_exit)
+	pthread_cond_wait(&writer_cond, &writer_lck);
+
+      // When exiting we still write what is queued
+      fill = writer_head;
+      if (!fill)
+	{
+	  writer_running = 0;
+	  pthread_mutex_unlock(&writer_lck);
+	  break;
+	}
+
+      writer_head = fill->next;
+      if (!writer_head)
+	writer_tail = NULL;
+
+      pthread_mutex_unlock(&writer_lck);
+
+      fill_run(fill);
+    }
+
+  pthread_exit(NULL);
+}
+
+
+/* ---------------------------------- API ----------------------------------- */
+
+/* Thread: httpd (any) */
+int
+transcode_cache_open(struct media_file_info *mfi, enum transcode_profile profile, off_t *size)
+{
+  char path[PATH_MAX];
+  struct stat sb;
+  int fd;
+  int ret;
+
+  if (!cache_dir)
+    return -1;
+
+  ret = cache_path_make(path, sizeof(path), mfi, profile, "");
+  if (ret < 0)
+    return -1;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  ret = fstat(fd, &sb);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Could not stat transcode cache file %s: %s\n", path, strerror(errno));
+
+      close(fd);
+      return -1;
+    }
+
+  // Keeps it from being evicted for a while
+  futimens(fd, NULL);
+
+  *size = sb.st_size;
+
+  return fd;
+}
+
+/* Thread: httpd (any) */
+struct transcode_cache_fill *
+transcode_cache_fill_start(struct media_file_info *mfi, enum transcode_profile profile, off_t est_size)
+{
+  struct transcode_cache_fill *fill;
+  int ret;
+
+  if (!cache_dir)
+    return NULL;
+
+  if (est_size > cache_max)
+    {
+      DPRINTF(E_DBG, L_XCODE, "Transcoding of %s too large for the transcode cache\n", mfi->path);
+      return NULL;
+    }
+
+  fill = calloc(1, sizeof(struct transcode_cache_fill));
+  if (!fill)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Out of memory for transcode cache fill\n");
+      return NULL;
+    }
+
+  pthread_mutex_init(&fill->lck, NULL);
+
+  fill->pending = evbuffer_new();
+  fill->writing = evbuffer_new();
+  if (!fill->pending || !fill->writing)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Out of memory for transcode cache fill\n");
+      goto out_free;
+    }
+
+  ret = cache_path_make(fill->path, sizeof(fill->path), mfi, profile, "");
+  if (ret < 0)
+    goto out_free;
+
+  ret = cache_path_make(fill->tmp_path, sizeof(fill->tmp_path), mfi, profile, TRANSCODE_CACHE_TMP_SUFFIX);
+  if (ret < 0)
+    goto out_free;
+
+  // If the file exists another stream is already caching it
+  fill->fd = open(fill->tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fill->fd < 0)
+    {
+      if (errno != EEXIST)
+	DPRINTF(E_LOG, L_XCODE, "Could not create transcode cache file %s: %s\n", fill->tmp_path, strerror(errno));
+
+      goto out_free;
+    }
+
+  fill->id = mfi->id;
+
+  DPRINTF(E_DBG, L_XCODE, "Caching transcoding of file id %d\n", fill->id);
+
+  return fill;
+
+ out_free:
+  fill_free(fill);
+  return NULL;
+}
+
+/* Thread: httpd (any) */
+int
+transcode_cache_fill_write(struct transcode_cache_fill *fill, struct evbuffer *evbuf)
+{
+  struct evbuffer_iovec vec[TRANSCODE_CACHE_IOVEC];
+  int schedule;
+  int n;
+  int i;
+  int ret;
+
+  n = evbuffer_peek(evbuf, -1, NULL, NULL, 0);
+  if (n <= 0)
+    return 0;
+
+  // More chains than vec can hold is unusual, so just make it contiguous
+  if ((n > TRANSCODE_CACHE_IOVEC) && !evbuffer_pullup(evbuf, -1))
+    {
+      DPRINTF(E_LOG, L_XCODE, "Out of memory for transcode cache write\n");
+
+      transcode_cache_fill_end(fill, 0);
+      return -1;
+    }
+
+  n = evbuffer_peek(evbuf, -1, NULL, vec, TRANSCODE_CACHE_IOVEC);
+
+  pthread_mutex_lock(&fill->lck);
+
+  ret = fill->failed ? -1 : 0;
+
+  if ((ret == 0) && (evbuffer_get_length(fill->pending) + evbuffer_get_length(evbuf) > TRANSCODE_CACHE_PENDING_MAX))
+    {
+      DPRINTF(E_LOG, L_XCODE, "Transcode cache writes of file id %d are falling behind, giving up\n", fill->id);
+      ret = -1;
+    }
+
+  for (i = 0; (ret == 0) && (i < n); i++)
+    {
+      ret = evbuffer_add(fill->pending, vec[i].iov_base, vec[i].iov_len);
+      if (ret < 0)
+	DPRINTF(E_LOG, L_XCODE, "Out of memory for transcode cache write\n");
+    }
+
+  schedule = (ret == 0) && !fill->scheduled;
+  if (schedule)
+    fill->scheduled = 1;
+
+  pthread_mutex_unlock(&fill->lck);
+
+  if (ret < 0)
+    {
+      transcode_cache_fill_end(fill, 0);
+      return -1;
+    }
+
+  if (schedule)
+    fill_schedule(fill);
+
+  return 0;
+}
+
+/* Thread: httpd (any)
+ * The fill is finished and freed by the writer thread once it has written what
+ * is pending
+ */
+void
+transcode_cache_fill_end(struct transcode_cache_fill *fill, int complete)
+{
+  int schedule;
+
+  pthread_mutex_lock(&fill->lck);
+
+  fill->ended = 1;
+  fill->complete = complete;
+
+  schedule = !fill->scheduled;
+  if (schedule)
+    fill->scheduled = 1;
+
+  pthread_mutex_unlock(&fill->lck);
+
+  if (schedule)
+    fill_schedule(fill);
+}
+
+/* Thread: main */
+int
+transcode_cache_init(void)
+{
+  cfg_t *lib;
+  char *dir;
+  int size;
+  int ret;
+
+  cache_dir = NULL;
+  cache_total = 0;
+
+  lib = cfg_getsec(cfg, "general");
+
+  size = cfg_getint(lib, "transcode_cache_size");
+  if (size <= 0)
+    {
+      DPRINTF(E_INFO, L_XCODE, "Transcode cache disabled\n");
+      return 0;
+    }
+
+  dir = cfg_getstr(lib, "transcode_cache_dir");
+  if (!dir || (strlen(dir) == 0))
+    {
+      DPRINTF(E_LOG, L_XCODE, "No transcode cache directory set, transcode cache disabled\n");
+      return 0;
+    }
+
+  ret = mkdir(dir, 0755);
+  if ((ret < 0) && (errno != EEXIST))
+    {
+      DPRINTF(E_LOG, L_XCODE, "Could not create transcode cache directory %s: %s\n", dir, strerror(errno));
+      return -1;
+    }
+
+  cache_dir = strdup(dir);
+  if (!cache_dir)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Out of memory for transcode cache directory\n");
+      return -1;
+    }
+
+  cache_max = (off_t)size * 1024 * 1024;
+
+  // Clean up after an unclean shutdown, and apply a reduced cache size
+  cache_evict(1);
+
+  writer_exit = 0;
+  writer_running = 1;
+
+  ret = pthread_create(&tid_writer, NULL, writer, NULL);
+  if (ret != 0)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Could not spawn transcode cache writer thread: %s\n", strerror(ret));
+
+      writer_running = 0;
+      free(cache_dir);
+      cache_dir = NULL;
+      return -1;
+    }
+
+#if defined(HAVE_PTHREAD_SETNAME_NP)
+  pthread_setname_np(tid_writer, "xcode_cache");
+#elif defined(HAVE_PTHREAD_SET_NAME_NP)
+  pthread_set_name_np(tid_writer, "xcode_cache");
+#endif
+
+  DPRINTF(E_INFO, L_XCODE, "Caching transcoded files in %s, max %d MB\n", cache_dir, size);
+
+  return 0;
+}
+
+/* Thread: main */
+void
+transcode_cache_deinit(void)
+{
+  if (!cache_dir)
+    return;
+
+  // Writes what is queued, fills ended after this are dropped
+  pthread_mutex_lock(&writer_lck);
+  writer_exit = 1;
+  pthread_cond_signal(&writer_cond);
+  pthread_mutex_unlock(&writer_lck);
+
+  pthread_join(tid_writer, NULL);
+
+  pthread_mutex_lock(&cache_lck);
+  free(cache_dir);
+  cache_dir = NULL;
+  pthread_mutex_unlock(&cache_lck);
+}
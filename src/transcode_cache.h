@@ -0,0 +1,46 @@
+
+#ifndef __TRANSCODE_CACHE_H__
+#define __TRANSCODE_CACHE_H__
+
+#include <sys/types.h>
+#include <event2/buffer.h>
+
+#include "db.h"
+#include "transcode.h"
+
+struct transcode_cache_fill;
+
+/* Opens the cached transcoding of the file with the given profile, if we have
+ * it. Returns a fd for reading (and sets size) or -1 if not cached.
+ */
+int
+transcode_cache_open(struct media_file_info *mfi, enum transcode_profile profile, off_t *size);
+
+/* Starts caching a transcoding of the file, est_size being the size estimated
+ * by the transcoder. Returns NULL if the cache is disabled, the file is already
+ * being cached by another stream or it would not fit.
+ */
+struct transcode_cache_fill *
+transcode_cache_fill_start(struct media_file_info *mfi, enum transcode_profile profile, off_t est_size);
+
+/* Hands the contents of evbuf to the writer thread for writing to the cache,
+ * without draining it. On error the fill is aborted and freed, and -1 is
+ * returned.
+ */
+int
+transcode_cache_fill_write(struct transcode_cache_fill *fill, struct evbuffer *evbuf);
+
+/* Ends the fill, which must not be used after this. When the writer thread has
+ * written what is pending the transcoding is added to the cache if complete,
+ * otherwise it is discarded.
+ */
+void
+transcode_cache_fill_end(struct transcode_cache_fill *fill, int complete);
+
+int
+transcode_cache_init(void);
+
+void
+transcode_cache_deinit(void);
+
+#endif /* !__TRANSCODE_CACHE_H__ */
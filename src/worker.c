@@ -38,9 +38,12 @@
 
 #include "db.h"
 #include "logger.h"
+#include "conffile.h"
 #include "worker.h"
 #include "commands.h"
 
+#define WORKER_POOL_MAX 16
+
 
 struct worker_arg
 {
@@ -50,6 +53,31 @@ struct worker_arg
   struct event *timer;
 };
 
+struct worker_task
+{
+  void (*cb)(void *);
+  void *cb_arg;
+  struct worker_task *next;
+};
+
+struct worker_pool
+{
+  pthread_t tids[WORKER_POOL_MAX];
+  int nthreads;
+  int exit;
+
+  // Threads that have set up their db connection, and of those the ones that
+  // succeeded and serve the queue
+  int nready;
+  int nlive;
+
+  pthread_mutex_t lck;
+  pthread_cond_t cond;
+
+  struct worker_task *head;
+  struct worker_task *tail;
+};
+
 
 /* --- Globals --- */
 // worker thread
@@ -60,6 +88,9 @@ struct event_base *evbase_worker;
 static int g_initialized;
 static struct commands_base *cmdbase;
 
+// Pool of threads for tasks that may take long
+static struct worker_pool pool;
+
 
 /* ---------------------------- CALLBACK EXECUTION ------------------------- */
 /*                                Thread: worker                             */
@@ -131,6 +162,123 @@ worker(void *arg)
 }
 
 
+/* --------------------------------- POOL --------------------------------- */
+/*                            Thread: worker pool                           */
+
+static void *
+pool_worker(void *arg)
+{
+  struct worker_task *task;
+  int ret;
+
+  ret = db_perthread_init();
+
+  pthread_mutex_lock(&pool.lck);
+  pool.nready++;
+  if (ret == 0)
+    pool.nlive++;
+  pthread_cond_broadcast(&pool.cond);
+  pthread_mutex_unlock(&pool.lck);
+
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_MAIN, "Error: DB init failed (worker pool thread)\n");
+      pthread_exit(NULL);
+    }
+
+  for (;;)
+    {
+      pthread_mutex_lock(&pool.lck);
+
+      while (!pool.head && !pool.exit)
+	pthread_cond_wait(&pool.cond, &pool.lck);
+
+      // When exiting we still run what is queued, so the tasks can clean up
+      task = pool.head;
+      if (!task)
+	{
+	  pthread_mutex_unlock(&pool.lck);
+	  break;
+	}
+
+      pool.head = task->next;
+      if (!pool.head)
+	pool.tail = NULL;
+
+      pthread_mutex_unlock(&pool.lck);
+
+      task->cb(task->cb_arg);
+      free(task);
+    }
+
+  db_perthread_deinit();
+
+  pthread_exit(NULL);
+}
+
+static void
+pool_init(int nthreads)
+{
+  int ret;
+  int i;
+
+  pthread_mutex_init(&pool.lck, NULL);
+  pthread_cond_init(&pool.cond, NULL);
+
+  if (nthreads > WORKER_POOL_MAX)
+    nthreads = WORKER_POOL_MAX;
+
+  for (i = 0; i < nthreads; i++)
+    {
+      ret = pthread_create(&pool.tids[i], NULL, pool_worker, NULL);
+      if (ret != 0)
+	{
+	  DPRINTF(E_LOG, L_MAIN, "Could not spawn worker pool thread: %s\n", strerror(ret));
+	  break;
+	}
+
+#if defined(HAVE_PTHREAD_SETNAME_NP)
+      pthread_setname_np(pool.tids[i], "worker_pool");
+#elif defined(HAVE_PTHREAD_SET_NAME_NP)
+      pthread_set_name_np(pool.tids[i], "worker_pool");
+#endif
+    }
+
+  pool.nthreads = i;
+
+  // Wait for the threads to set up, so no task is queued without a thread to
+  // run it
+  pthread_mutex_lock(&pool.lck);
+  while (pool.nready < pool.nthreads)
+    pthread_cond_wait(&pool.cond, &pool.lck);
+  pthread_mutex_unlock(&pool.lck);
+
+  if (pool.nlive < pool.nthreads)
+    DPRINTF(E_LOG, L_MAIN, "Only %d of %d worker pool threads could be started\n", pool.nlive, pool.nthreads);
+}
+
+static void
+pool_deinit(void)
+{
+  int i;
+
+  pthread_mutex_lock(&pool.lck);
+  pool.exit = 1;
+  pthread_cond_broadcast(&pool.cond);
+  pthread_mutex_unlock(&pool.lck);
+
+  for (i = 0; i < pool.nthreads; i++)
+    pthread_join(pool.tids[i], NULL);
+
+  pool.nthreads = 0;
+  pool.nready = 0;
+  pool.nlive = 0;
+
+  pthread_cond_destroy(&pool.cond);
+  pthread_mutex_destroy(&pool.lck);
+}
+
+
 /* ---------------------------- Our worker API  --------------------------- */
 
 /* Thread: player */
@@ -166,6 +314,47 @@ worker_execute(void (*cb)(void *), void *cb_arg, size_t arg_size, int delay)
   commands_exec_async(cmdbase, execute, cmdarg);
 }
 
+/* Thread: any */
+int
+worker_pool_execute(void (*cb)(void *), void *cb_arg)
+{
+  struct worker_task *task;
+
+  // Without threads the caller runs the task itself
+  if (pool.nlive == 0)
+    return -1;
+
+  task = calloc(1, sizeof(struct worker_task));
+  if (!task)
+    {
+      DPRINTF(E_LOG, L_MAIN, "Could not allocate worker_task\n");
+      return -1;
+    }
+
+  task->cb = cb;
+  task->cb_arg = cb_arg;
+
+  pthread_mutex_lock(&pool.lck);
+
+  if (pool.exit)
+    {
+      pthread_mutex_unlock(&pool.lck);
+      free(task);
+      return -1;
+    }
+
+  if (pool.tail)
+    pool.tail->next = task;
+  else
+    pool.head = task;
+  pool.tail = task;
+
+  pthread_cond_signal(&pool.cond);
+  pthread_mutex_unlock(&pool.lck);
+
+  return 0;
+}
+
 int
 worker_init(void)
 {
@@ -194,6 +383,9 @@ worker_init(void)
   pthread_set_name_np(tid_worker, "worker");
 #endif
 
+  // Not fatal if this fails, the tasks will then run where they were made
+  pool_init(cfg_getint(cfg_getsec(cfg, "general"), "httpd_workers"));
+
   return 0;
   
  thread_fail:
@@ -210,6 +402,8 @@ worker_deinit(void)
 {
   int ret;
 
+  pool_deinit();
+
   g_initialized = 0;
   commands_base_destroy(cmdbase);
 
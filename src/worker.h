@@ -19,6 +19,18 @@
 void
 worker_execute(void (*cb)(void *), void *cb_arg, size_t arg_size, int delay);
 
+/* The worker pool is a number of threads (general/httpd_workers) made for
+ * tasks that may take long, like building a large reply to a library request.
+ * The tasks are run in parallel from a shared queue. Unlike worker_execute()
+ * the argument is not copied, the callback must free it if required.
+ *
+ * @param cb the function to call from a worker pool thread
+ * @param cb_arg argument for callback
+ * @return 0 if the task was queued, -1 if not (e.g. there is no pool)
+ */
+int
+worker_pool_execute(void (*cb)(void *), void *cb_arg);
+
 int
 worker_init(void);
 